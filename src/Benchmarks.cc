@@ -0,0 +1,873 @@
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <functional>
+#include <phosg/Arguments.hh>
+#include <phosg/Filesystem.hh>
+#include <phosg/JSON.hh>
+#include <phosg/Random.hh>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+#include <string>
+#include <vector>
+
+#include "Channel.hh"
+#include "Compression.hh"
+#include "Episode3/BattleRecord.hh"
+#include "Episode3/BattleSimulator.hh"
+#include "Episode3/Server.hh"
+#include "IPFrameInfo.hh"
+#include "ItemCreator.hh"
+#include "ItemParameterTable.hh"
+#include "Loggers.hh"
+#include "Map.hh"
+#include "PSOEncryption.hh"
+#include "Quest.hh"
+#include "Revision.hh"
+#include "ServerState.hh"
+#include "Text.hh"
+
+using namespace std;
+
+// This is the entry point for newserv-bench, which measures the performance of
+// newserv's core subsystems in isolation and writes the results as JSON, so
+// they can be compared between commits. Like newserv itself, it should be run
+// from the directory containing the system/ directory.
+
+class BenchmarkContext {
+public:
+  struct Result {
+    string name;
+    size_t iterations;
+    uint64_t total_usecs;
+    size_t bytes_per_iteration;
+  };
+  struct Counter {
+    string name;
+    uint64_t count;
+    uint64_t total_nsecs;
+  };
+
+  BenchmarkContext(phosg::Arguments& args)
+      : args(args),
+        min_usecs(args.get<uint64_t>("min-time", 500) * 1000),
+        config_filename(args.get<string>("config", false)) {
+    if (this->config_filename.empty()) {
+      this->config_filename = "system/config.json";
+    }
+  }
+
+  // Calls fn repeatedly, doubling the number of calls until they take at least
+  // min_usecs in total. fn should return a value derived from its work; the
+  // values are accumulated so the compiler can't skip the work.
+  // bytes_per_iteration is only used to compute throughput, and may be zero.
+  template <typename FnT>
+  void measure(const string& name, size_t bytes_per_iteration, FnT&& fn) {
+    uint64_t checksum = fn(); // Warm up caches and lazily-populated tables
+    size_t iterations = 1;
+    uint64_t usecs;
+    for (;;) {
+      uint64_t start = phosg::now();
+      for (size_t z = 0; z < iterations; z++) {
+        checksum += fn();
+      }
+      usecs = phosg::now() - start;
+      if (usecs >= this->min_usecs) {
+        break;
+      }
+      iterations *= 2;
+    }
+
+    auto& res = this->results.emplace_back(Result{name, iterations, usecs, bytes_per_iteration});
+    double nsecs_per_iteration = (res.total_usecs * 1000.0) / res.iterations;
+    if (res.bytes_per_iteration) {
+      fprintf(stderr, "%-50s %14.1f ns/iter %10.2f MB/sec (%016" PRIX64 ")\n",
+          name.c_str(), nsecs_per_iteration, this->bytes_per_second(res) / (1024.0 * 1024.0), checksum);
+    } else {
+      fprintf(stderr, "%-50s %14.1f ns/iter                (%016" PRIX64 ")\n",
+          name.c_str(), nsecs_per_iteration, checksum);
+    }
+  }
+
+  // Records a breakdown measured by the code under test itself (for example,
+  // the Episode 3 engine's performance counters), rather than by measure()
+  void add_counter(const string& name, uint64_t count, uint64_t total_nsecs) {
+    fprintf(stderr, "%-50s %14.1f ns/call %10" PRIu64 " calls\n",
+        name.c_str(), count ? (static_cast<double>(total_nsecs) / count) : 0.0, count);
+    this->counters.emplace_back(Counter{name, count, total_nsecs});
+  }
+
+  void skip(const string& name, const string& reason) {
+    fprintf(stderr, "%-50s skipped: %s\n", name.c_str(), reason.c_str());
+    this->skipped.emplace_back(name, reason);
+  }
+
+  // These load only the parts of the server state that the benchmarks use, in
+  // the same order as ServerState::load_all.
+  shared_ptr<ServerState> item_state() {
+    if (!this->item_state_loaded) {
+      auto s = this->state();
+      s->load_config_early();
+      s->load_patch_indexes(false);
+      s->load_text_index(false);
+      s->load_item_definitions(false);
+      s->load_item_name_indexes(false);
+      s->load_drop_tables(false);
+      this->item_state_loaded = true;
+      this->quiet_logs();
+    }
+    return this->state();
+  }
+  shared_ptr<ServerState> quest_state() {
+    if (!this->quest_state_loaded) {
+      auto s = this->state();
+      s->load_config_early();
+      s->load_quest_index(false);
+      this->quest_state_loaded = true;
+      this->quiet_logs();
+    }
+    return this->state();
+  }
+  shared_ptr<ServerState> ep3_state() {
+    if (!this->ep3_state_loaded) {
+      auto s = this->state();
+      s->load_config_early();
+      s->load_ep3_cards(false);
+      s->load_ep3_maps(false);
+      s->load_ep3_trap_cards();
+      this->ep3_state_loaded = true;
+      this->quiet_logs();
+    }
+    return this->state();
+  }
+
+  phosg::JSON json() const {
+    auto results_json = phosg::JSON::list();
+    for (const auto& res : this->results) {
+      auto res_json = phosg::JSON::dict({
+          {"Name", res.name},
+          {"Iterations", res.iterations},
+          {"TotalUsecs", res.total_usecs},
+          {"NsecsPerIteration", (res.total_usecs * 1000.0) / res.iterations},
+      });
+      if (res.bytes_per_iteration) {
+        res_json.emplace("BytesPerIteration", res.bytes_per_iteration);
+        res_json.emplace("BytesPerSecond", this->bytes_per_second(res));
+      }
+      results_json.emplace_back(std::move(res_json));
+    }
+    auto counters_json = phosg::JSON::list();
+    for (const auto& counter : this->counters) {
+      counters_json.emplace_back(phosg::JSON::dict({
+          {"Name", counter.name},
+          {"Count", counter.count},
+          {"TotalNsecs", counter.total_nsecs},
+          {"NsecsPerCall", counter.count ? (static_cast<double>(counter.total_nsecs) / counter.count) : 0.0},
+      }));
+    }
+    auto skipped_json = phosg::JSON::list();
+    for (const auto& [name, reason] : this->skipped) {
+      skipped_json.emplace_back(phosg::JSON::dict({{"Name", name}, {"Reason", reason}}));
+    }
+    return phosg::JSON::dict({
+        {"Revision", GIT_REVISION_HASH},
+        {"BuildTimestamp", BUILD_TIMESTAMP},
+        {"MinTimeUsecs", this->min_usecs},
+        {"Results", std::move(results_json)},
+        {"Counters", std::move(counters_json)},
+        {"Skipped", std::move(skipped_json)},
+    });
+  }
+
+  phosg::Arguments& args;
+
+private:
+  uint64_t min_usecs;
+  string config_filename;
+  shared_ptr<ServerState> loaded_state;
+  bool item_state_loaded = false;
+  bool quest_state_loaded = false;
+  bool ep3_state_loaded = false;
+  vector<Result> results;
+  vector<Counter> counters;
+  vector<pair<string, string>> skipped;
+
+  shared_ptr<ServerState> state() {
+    if (!this->loaded_state) {
+      this->loaded_state = make_shared<ServerState>(this->config_filename);
+    }
+    return this->loaded_state;
+  }
+
+  void quiet_logs() {
+    // load_config_early applies the log levels from the config file; item
+    // creation logs every step at the info level, which would dominate the
+    // measurements
+    lobby_log.min_level = phosg::LogLevel::WARNING;
+    static_game_data_log.min_level = phosg::LogLevel::WARNING;
+  }
+
+  static double bytes_per_second(const Result& res) {
+    return res.total_usecs
+        ? ((static_cast<double>(res.bytes_per_iteration) * res.iterations * 1000000.0) / res.total_usecs)
+        : 0.0;
+  }
+};
+
+struct Benchmark;
+vector<const Benchmark*> all_benchmarks;
+
+struct Benchmark {
+  const char* name;
+  function<void(BenchmarkContext& ctx)> run;
+
+  Benchmark(const char* name, function<void(BenchmarkContext& ctx)> run)
+      : name(name),
+        run(run) {
+    all_benchmarks.emplace_back(this);
+  }
+};
+
+static uint64_t checksum_string(const string& data) {
+  return data.empty() ? 0 : (data.size() ^ static_cast<uint8_t>(data[data.size() / 2]));
+}
+
+Benchmark b_encryption(
+    "encryption", +[](BenchmarkContext& ctx) -> void {
+      for (size_t size : {0x10, 0x100, 0x1000}) {
+        string data(size, '\0');
+        phosg::random_data(data.data(), data.size());
+
+        PSOV2Encryption v2(0x12345678);
+        ctx.measure(phosg::string_printf("encryption/v2/%zu", size), size, [&]() -> uint64_t {
+          v2.encrypt(data.data(), data.size());
+          return data[0];
+        });
+        PSOV3Encryption v3(0x12345678);
+        ctx.measure(phosg::string_printf("encryption/v3/%zu", size), size, [&]() -> uint64_t {
+          v3.encrypt(data.data(), data.size());
+          return data[0];
+        });
+
+        // There is one BB key file for each subtype (and some custom keys for
+        // the standard subtype), so this covers all BB encryption variants
+        for (const string& filename : phosg::list_directory_sorted("system/blueburst/keys")) {
+          if (!phosg::ends_with(filename, ".nsk")) {
+            continue;
+          }
+          auto key = phosg::load_object_file<PSOBBEncryption::KeyFile>("system/blueburst/keys/" + filename);
+          string seed(0x30, '\0');
+          phosg::random_data(seed.data(), seed.size());
+          PSOBBEncryption bb(key, seed.data(), seed.size());
+          string key_name = filename.substr(0, filename.size() - 4);
+          ctx.measure(phosg::string_printf("encryption/bb-%s-encrypt/%zu", key_name.c_str(), size), size, [&]() -> uint64_t {
+            bb.encrypt(data.data(), data.size());
+            return data[0];
+          });
+          ctx.measure(phosg::string_printf("encryption/bb-%s-decrypt/%zu", key_name.c_str(), size), size, [&]() -> uint64_t {
+            bb.decrypt(data.data(), data.size());
+            return data[0];
+          });
+        }
+      }
+    });
+
+Benchmark b_compression(
+    "compression", +[](BenchmarkContext& ctx) -> void {
+      // Item parameter tables are typical of the files newserv compresses and
+      // decompresses at load time and when sending files to clients
+      string data = prs_decompress(phosg::load_file("system/item-tables/ItemPMT-gc-v3.prs"));
+
+      string prs_data = prs_compress(data);
+      ctx.measure("compression/prs-compress", data.size(), [&]() -> uint64_t {
+        return checksum_string(prs_compress(data));
+      });
+      ctx.measure("compression/prs-decompress", data.size(), [&]() -> uint64_t {
+        return checksum_string(prs_decompress(prs_data));
+      });
+      ctx.measure("compression/prs-decompress-size", data.size(), [&]() -> uint64_t {
+        return prs_decompress_size(prs_data);
+      });
+
+      string bc0_data = bc0_compress(data);
+      ctx.measure("compression/bc0-compress", data.size(), [&]() -> uint64_t {
+        return checksum_string(bc0_compress(data));
+      });
+      ctx.measure("compression/bc0-decompress", data.size(), [&]() -> uint64_t {
+        return checksum_string(bc0_decompress(bc0_data));
+      });
+    });
+
+struct ChannelBenchmarkState {
+  shared_ptr<struct event_base> base;
+  size_t commands_received = 0;
+  size_t bytes_received = 0;
+  size_t commands_expected = 0;
+  bool failed = false;
+};
+
+Benchmark b_channel(
+    "channel", +[](BenchmarkContext& ctx) -> void {
+      static constexpr size_t COMMANDS_PER_ITERATION = 100;
+
+      auto on_command_received = +[](Channel& ch, uint16_t, uint32_t, string& data) -> void {
+        auto* st = reinterpret_cast<ChannelBenchmarkState*>(ch.context_obj);
+        st->commands_received++;
+        st->bytes_received += data.size();
+        if (st->commands_received == st->commands_expected) {
+          event_base_loopbreak(st->base.get());
+        }
+      };
+      auto on_error = +[](Channel& ch, short events) -> void {
+        if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF)) {
+          auto* st = reinterpret_cast<ChannelBenchmarkState*>(ch.context_obj);
+          st->failed = true;
+          event_base_loopbreak(st->base.get());
+        }
+      };
+
+      vector<pair<Version, const char*>> versions = {{Version::GC_V3, "gc"}, {Version::BB_V4, "bb"}};
+      auto bb_key = phosg::load_object_file<PSOBBEncryption::KeyFile>("system/blueburst/keys/default.nsk");
+      for (const auto& [version, version_name] : versions) {
+        for (size_t size : {0x20, 0x400}) {
+          ChannelBenchmarkState st;
+          st.base.reset(event_base_new(), event_base_free);
+
+          int fds[2];
+          if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+            throw runtime_error("cannot create socket pair");
+          }
+          Channel sender(bufferevent_socket_new(st.base.get(), fds[0], BEV_OPT_CLOSE_ON_FREE), 0,
+              version, 1, on_command_received, on_error, &st, "sender");
+          Channel receiver(bufferevent_socket_new(st.base.get(), fds[1], BEV_OPT_CLOSE_ON_FREE), 0,
+              version, 1, on_command_received, on_error, &st, "receiver");
+          if (version == Version::BB_V4) {
+            string seed(0x30, '\0');
+            phosg::random_data(seed.data(), seed.size());
+            sender.crypt_out = make_shared<PSOBBEncryption>(bb_key, seed.data(), seed.size());
+            receiver.crypt_in = make_shared<PSOBBEncryption>(bb_key, seed.data(), seed.size());
+          } else {
+            sender.crypt_out = make_shared<PSOV3Encryption>(0x12345678);
+            receiver.crypt_in = make_shared<PSOV3Encryption>(0x12345678);
+          }
+
+          string data(size, '\0');
+          phosg::random_data(data.data(), data.size());
+          ctx.measure(
+              phosg::string_printf("channel/%s-send-recv/%zu", version_name, size),
+              data.size() * COMMANDS_PER_ITERATION,
+              [&]() -> uint64_t {
+                st.commands_expected += COMMANDS_PER_ITERATION;
+                for (size_t z = 0; z < COMMANDS_PER_ITERATION; z++) {
+                  sender.send(0x60, 0x00, data, true);
+                }
+                event_base_dispatch(st.base.get());
+                if (st.failed) {
+                  throw runtime_error("socket pair was disconnected");
+                }
+                return st.bytes_received;
+              });
+        }
+      }
+    });
+
+Benchmark b_item_creator(
+    "item-creator", +[](BenchmarkContext& ctx) -> void {
+      auto s = ctx.item_state();
+      for (uint8_t difficulty = 0; difficulty < 4; difficulty++) {
+        ItemCreator creator(
+            s->common_item_set_v3_v4,
+            s->rare_item_sets.at("rare-table-v4"),
+            s->armor_random_set,
+            s->tool_random_set,
+            s->weapon_random_sets.at(difficulty),
+            s->tekker_adjustment_set,
+            s->item_parameter_table(Version::BB_V4),
+            s->item_stack_limits(Version::BB_V4),
+            Episode::EP1,
+            GameMode::NORMAL,
+            difficulty,
+            0,
+            make_shared<PSOV2Encryption>(0x12345678));
+
+        // Each iteration simulates clearing one room on each floor in Episode 1
+        static constexpr size_t ENEMIES_PER_FLOOR = 0x40;
+        static constexpr size_t BOXES_PER_FLOOR = 0x10;
+        ctx.measure(phosg::string_printf("item-creator/monster-drops/%c", abbreviation_for_difficulty(difficulty)), 0, [&]() -> uint64_t {
+          uint64_t ret = 0;
+          for (uint8_t area = 1; area < 0x0F; area++) {
+            for (size_t z = 0; z < ENEMIES_PER_FLOOR; z++) {
+              ret += creator.on_monster_item_drop(z % 0x58, area).item.data1d[0];
+            }
+          }
+          return ret;
+        });
+        ctx.measure(phosg::string_printf("item-creator/box-drops/%c", abbreviation_for_difficulty(difficulty)), 0, [&]() -> uint64_t {
+          uint64_t ret = 0;
+          for (uint8_t area = 1; area < 0x0F; area++) {
+            for (size_t z = 0; z < BOXES_PER_FLOOR; z++) {
+              ret += creator.on_box_item_drop(area).item.data1d[0];
+            }
+          }
+          return ret;
+        });
+        ctx.measure(phosg::string_printf("item-creator/shop-contents/%c", abbreviation_for_difficulty(difficulty)), 0, [&]() -> uint64_t {
+          return creator.generate_armor_shop_contents(100).size() +
+              creator.generate_tool_shop_contents(100).size() +
+              creator.generate_weapon_shop_contents(100).size();
+        });
+      }
+    });
+
+Benchmark b_item_parameter_table(
+    "item-parameter-table", +[](BenchmarkContext& ctx) -> void {
+      auto s = ctx.item_state();
+
+      // Use a realistic mix of items, as generated by the drop tables
+      ItemCreator creator(
+          s->common_item_set_v3_v4,
+          s->rare_item_sets.at("rare-table-v4"),
+          s->armor_random_set,
+          s->tool_random_set,
+          s->weapon_random_sets.at(3),
+          s->tekker_adjustment_set,
+          s->item_parameter_table(Version::BB_V4),
+          s->item_stack_limits(Version::BB_V4),
+          Episode::EP1,
+          GameMode::NORMAL,
+          3,
+          0,
+          make_shared<PSOV2Encryption>(0x12345678));
+      vector<ItemData> items;
+      while (items.size() < 1000) {
+        for (uint8_t area = 1; area < 0x0F; area++) {
+          auto res = creator.on_box_item_drop(area);
+          if (!res.item.empty() && (res.item.data1[0] != 0x04)) {
+            items.emplace_back(res.item);
+          }
+        }
+      }
+
+      for (Version v : {Version::DC_V2, Version::GC_V3, Version::BB_V4}) {
+        auto pmt = s->item_parameter_table(v);
+        // Items that don't exist on older versions are skipped
+        vector<ItemData> version_items;
+        for (const auto& item : items) {
+          try {
+            pmt->get_item_id(item);
+            version_items.emplace_back(item);
+          } catch (const exception&) {
+          }
+        }
+        ctx.measure(phosg::string_printf("item-parameter-table/%s/item-ids", phosg::name_for_enum(v)), 0, [&]() -> uint64_t {
+          uint64_t ret = 0;
+          for (const auto& item : version_items) {
+            ret += pmt->get_item_id(item);
+          }
+          return ret;
+        });
+        ctx.measure(phosg::string_printf("item-parameter-table/%s/is-rare", phosg::name_for_enum(v)), 0, [&]() -> uint64_t {
+          uint64_t ret = 0;
+          for (const auto& item : version_items) {
+            ret += pmt->is_item_rare(item);
+          }
+          return ret;
+        });
+        ctx.measure(phosg::string_printf("item-parameter-table/%s/adjusted-stars", phosg::name_for_enum(v)), 0, [&]() -> uint64_t {
+          uint64_t ret = 0;
+          for (const auto& item : version_items) {
+            ret += pmt->get_item_adjusted_stars(item);
+          }
+          return ret;
+        });
+        ctx.measure(phosg::string_printf("item-parameter-table/%s/prices", phosg::name_for_enum(v)), 0, [&]() -> uint64_t {
+          uint64_t ret = 0;
+          for (const auto& item : version_items) {
+            try {
+              ret += pmt->price_for_item(item);
+            } catch (const exception&) {
+            }
+          }
+          return ret;
+        });
+      }
+    });
+
+Benchmark b_quest_index(
+    "quest-index", +[](BenchmarkContext& ctx) -> void {
+      auto s = ctx.quest_state();
+      ctx.measure("quest-index/load", 0, [&]() -> uint64_t {
+        QuestIndex index("system/quests", s->quest_category_index, false);
+        return index.quests_by_number.size();
+      });
+    });
+
+Benchmark b_map(
+    "map", +[](BenchmarkContext& ctx) -> void {
+      auto s = ctx.quest_state();
+
+      // Use the map files from the loaded quests, which cover all the kinds of
+      // sections that a map file can contain
+      vector<shared_ptr<const string>> dat_contents;
+      size_t dat_bytes = 0;
+      struct SuperMapSource {
+        Episode episode;
+        array<shared_ptr<const MapFile>, NUM_VERSIONS> map_files;
+      };
+      vector<SuperMapSource> supermap_sources;
+      for (const auto& q_it : s->default_quest_index->quests_by_number) {
+        auto& src = supermap_sources.emplace_back(SuperMapSource{q_it.second->episode, {}});
+        for (const auto& vq_it : q_it.second->versions) {
+          const auto& vq = vq_it.second;
+          if (!vq->map_file || vq->map_file->has_random_sections()) {
+            continue;
+          }
+          if (!src.map_files[static_cast<size_t>(vq->version)]) {
+            src.map_files[static_cast<size_t>(vq->version)] = vq->map_file;
+            auto& data = dat_contents.emplace_back(make_shared<string>(prs_decompress(*vq->dat_contents)));
+            dat_bytes += data->size();
+          }
+        }
+        if (all_of(src.map_files.begin(), src.map_files.end(), [](const auto& m) { return !m; })) {
+          supermap_sources.pop_back();
+        }
+      }
+      if (supermap_sources.empty()) {
+        ctx.skip("map", "no quests with map files are present");
+        return;
+      }
+
+      ctx.measure("map/map-file-construction", dat_bytes, [&]() -> uint64_t {
+        uint64_t ret = 0;
+        for (const auto& data : dat_contents) {
+          ret += MapFile(data).source_hash();
+        }
+        return ret;
+      });
+      ctx.measure("map/supermap-construction", 0, [&]() -> uint64_t {
+        uint64_t ret = 0;
+        for (const auto& src : supermap_sources) {
+          ret += SuperMap(src.episode, src.map_files).all_enemies().size();
+        }
+        return ret;
+      });
+    });
+
+Benchmark b_text(
+    "text", +[](BenchmarkContext& ctx) -> void {
+      // A mix of typical chat messages, item names, and quest text, in English
+      // and Japanese
+      string utf8;
+      while (utf8.size() < 0x4000) {
+        utf8 += "Looking for: Sealed J-Sword, Lame d'Argent. Have: 20 PDs\n";
+        utf8 += "ハンターズギルドからの依頼です。\n";
+        utf8 += "Welcome to the Hunter's Guild. Please choose a quest.\n";
+        utf8 += "ラグオルの森へ向かえ！\n";
+      }
+      string ascii;
+      while (ascii.size() < 0x4000) {
+        ascii += "Welcome to the Hunter's Guild. Please choose a quest.\n";
+      }
+
+      string sjis = tt_utf8_to_sega_sjis(utf8);
+      ctx.measure("text/utf8-to-sjis", utf8.size(), [&]() -> uint64_t {
+        return checksum_string(tt_utf8_to_sega_sjis(utf8));
+      });
+      ctx.measure("text/sjis-to-utf8", sjis.size(), [&]() -> uint64_t {
+        return checksum_string(tt_sega_sjis_to_utf8(sjis));
+      });
+      string utf16 = tt_utf8_to_utf16(utf8);
+      ctx.measure("text/utf8-to-utf16", utf8.size(), [&]() -> uint64_t {
+        return checksum_string(tt_utf8_to_utf16(utf8));
+      });
+      ctx.measure("text/utf16-to-utf8", utf16.size(), [&]() -> uint64_t {
+        return checksum_string(tt_utf16_to_utf8(utf16));
+      });
+      ctx.measure("text/ascii-utf8-to-utf16", ascii.size(), [&]() -> uint64_t {
+        return checksum_string(tt_utf8_to_utf16(ascii));
+      });
+      ctx.measure("text/ascii-utf8-to-sjis", ascii.size(), [&]() -> uint64_t {
+        return checksum_string(tt_utf8_to_sega_sjis(ascii));
+      });
+      ctx.measure("text/ascii-utf8-to-8859", ascii.size(), [&]() -> uint64_t {
+        return checksum_string(tt_utf8_to_8859(ascii));
+      });
+    });
+
+Benchmark b_text_colors(
+    "text-colors", +[](BenchmarkContext& ctx) -> void {
+      // Typical chat messages, player names, and info board text, which are
+      // mostly short and mostly plain ASCII, plus a long message like those
+      // sent by the server (e.g. $info output)
+      vector<string> corpus = {
+          "hi",
+          "hello everyone!",
+          "anyone want to do a ruins run?",
+          "brb",
+          "lol",
+          "ty",
+          "$C6Need a healer for Ultimate Ep1",
+          "I found a $C2Red Ring$C7!!",
+          "where are you? I'm on floor 2 near the dragon room",
+          "Looking for: Sealed J-Sword, Lame d'Argent, Yasminkov 9000M, Psycho Wand. Have: 20 PDs",
+          "%s is not a color code but 100% is a percent sign #1",
+          "Alice",
+          "\tEBob",
+          "\tC6Dave",
+          "$C5Raid$C7Leader",
+          "ok let's go",
+          "gg",
+          "$C3Info board:#$C7Trading PDs for Photon Spheres#Ask me in lobby 3",
+      };
+      string long_message;
+      for (size_t z = 0; z < 8; z++) {
+        long_message += phosg::string_printf("$C6Line %zu:$C7 some status text that is mostly plain ASCII\n", z);
+      }
+      corpus.emplace_back(std::move(long_message));
+      size_t corpus_bytes = 0;
+      for (const auto& str : corpus) {
+        corpus_bytes += str.size();
+      }
+
+      auto measure_fn = [&](const char* name, string (*fn)(const string&)) -> void {
+        ctx.measure(phosg::string_printf("text-colors/%s", name), corpus_bytes, [&]() -> uint64_t {
+          uint64_t ret = 0;
+          for (const auto& str : corpus) {
+            ret += fn(str).size();
+          }
+          return ret;
+        });
+      };
+      measure_fn("add-color", +[](const string& str) -> string { return add_color(str); });
+      measure_fn("add-color-inplace", +[](const string& str) -> string {
+        string ret = str;
+        add_color_inplace(ret);
+        return ret;
+      });
+      measure_fn("remove-color", +[](const string& str) -> string { return remove_color(str); });
+      measure_fn("strip-color", +[](const string& str) -> string { return strip_color(str); });
+      measure_fn("escape-player-name", +[](const string& str) -> string { return escape_player_name(str); });
+    });
+
+Benchmark b_ip_checksums(
+    "ip-checksums", +[](BenchmarkContext& ctx) -> void {
+      // Common frame sizes: minimal IPv4 header, IPv4+TCP headers, minimal
+      // Ethernet payload (and an odd size), minimum reassembly buffer, typical
+      // TCP payload and Ethernet MTU, and a jumbo frame. Correctness is checked
+      // by the ip-checksums-test action.
+      for (size_t size : {20, 40, 64, 63, 576, 1460, 1500, 9000}) {
+        string data(size, '\0');
+        phosg::random_data(data.data(), data.size());
+        ctx.measure(phosg::string_printf("ip-checksums/sum/%zu", size), size, [&]() -> uint64_t {
+          return FrameInfo::ones_complement_sum(data.data(), data.size());
+        });
+      }
+
+      string header(20, '\0');
+      phosg::random_data(header.data(), header.size());
+      uint16_t checksum = ~FrameInfo::ones_complement_sum(header.data(), header.size());
+      ctx.measure("ip-checksums/incremental-update", 0, [&]() -> uint64_t {
+        be_uint32_t* field = reinterpret_cast<be_uint32_t*>(header.data() + 4);
+        uint32_t old_value = *field;
+        uint32_t new_value = old_value + 1;
+        *field = new_value;
+        checksum = FrameInfo::updated_checksum32(checksum, old_value, new_value);
+        return checksum;
+      });
+    });
+
+Benchmark b_ep3_card_lookups(
+    "ep3-card-lookups", +[](BenchmarkContext& ctx) -> void {
+      auto card_index = ctx.ep3_state()->ep3_card_index;
+      vector<uint16_t> ids;
+      for (uint32_t id : card_index->all_ids()) {
+        if (id < 0x10000) {
+          ids.emplace_back(id);
+        }
+      }
+
+      // The battle engine uses find_definition; definition_for_id is the hash
+      // table lookup it replaced
+      ctx.measure("ep3-card-lookups/hash-table", 0, [&]() -> uint64_t {
+        uint64_t ret = 0;
+        for (uint16_t id : ids) {
+          ret += card_index->definition_for_id(id)->def.hp.stat;
+        }
+        return ret;
+      });
+      ctx.measure("ep3-card-lookups/array", 0, [&]() -> uint64_t {
+        uint64_t ret = 0;
+        for (uint16_t id : ids) {
+          ret += card_index->find_definition(id)->def.hp.stat;
+        }
+        return ret;
+      });
+    });
+
+Benchmark b_ep3_engine(
+    "ep3-engine", +[](BenchmarkContext& ctx) -> void {
+      auto s = ctx.ep3_state();
+
+      // Battles between COM decks on the first few 1v1 maps, with fixed seeds,
+      // so the results are comparable between runs. Each iteration runs the
+      // same battles from the beginning.
+      static constexpr size_t NUM_SIMULATED_BATTLES = 8;
+      vector<shared_ptr<const Episode3::MapDefinition>> maps;
+      for (uint32_t map_number : s->ep3_map_index->all_numbers()) {
+        auto map = s->ep3_map_index->for_number(map_number)->initial_version->map;
+        if (Episode3::BattleSimulator::map_supports_1v1(*map)) {
+          maps.emplace_back(map);
+          if (maps.size() >= NUM_SIMULATED_BATTLES) {
+            break;
+          }
+        }
+      }
+      size_t num_decks = s->ep3_com_deck_index->num_decks();
+      if (maps.empty() || (num_decks == 0)) {
+        ctx.skip("ep3-engine/simulated-battles", "no 1v1 maps or COM decks are available");
+      } else {
+        ctx.measure("ep3-engine/simulated-battles", 0, [&]() -> uint64_t {
+          uint64_t ret = 0;
+          for (size_t z = 0; z < NUM_SIMULATED_BATTLES; z++) {
+            array<shared_ptr<const Episode3::COMDeckDefinition>, 2> decks = {
+                s->ep3_com_deck_index->deck_for_index((2 * z) % num_decks),
+                s->ep3_com_deck_index->deck_for_index((2 * z + 1) % num_decks)};
+            Episode3::BattleSimulator sim(s->ep3_card_index, s->ep3_map_index, maps[z % maps.size()], decks, 0x45503300 + z);
+            auto res = sim.run();
+            ret += res.num_commands_sent;
+          }
+          return ret;
+        });
+
+        // Run the same battles once more with the performance counters
+        // enabled, to show where the time is spent. This is done separately so
+        // the counters don't affect the measurement above.
+        Episode3::Server::PerformanceCounters counters;
+        for (size_t z = 0; z < NUM_SIMULATED_BATTLES; z++) {
+          array<shared_ptr<const Episode3::COMDeckDefinition>, 2> decks = {
+              s->ep3_com_deck_index->deck_for_index((2 * z) % num_decks),
+              s->ep3_com_deck_index->deck_for_index((2 * z + 1) % num_decks)};
+          Episode3::BattleSimulator sim(s->ep3_card_index, s->ep3_map_index, maps[z % maps.size()], decks, 0x45503300 + z);
+          auto battle_counters = make_shared<Episode3::Server::PerformanceCounters>();
+          sim.get_server()->performance_counters = battle_counters;
+          sim.run();
+          counters.add(*battle_counters);
+        }
+        for (size_t z = 0; z < counters.phases.size(); z++) {
+          auto phase = static_cast<Episode3::Server::PerformanceCounters::Phase>(z);
+          const auto& counter = counters.phases[z];
+          ctx.add_counter(
+              phosg::string_printf("ep3-engine/phase/%s", Episode3::Server::PerformanceCounters::name_for_phase(phase)),
+              counter.count, counter.total_nsecs);
+        }
+        for (size_t z = 0; z < counters.handlers.size(); z++) {
+          const auto& counter = counters.handlers[z];
+          if (counter.count) {
+            const char* name = Episode3::Server::name_for_subcommand_handler(z);
+            ctx.add_counter(
+                name ? phosg::string_printf("ep3-engine/handler/%s", name) : phosg::string_printf("ep3-engine/handler/CAx%02zX", z),
+                counter.count, counter.total_nsecs);
+          }
+        }
+      }
+
+      // Battle records can also be given on the command line, since they
+      // contain real players' actions instead of the simulator's policy
+      string directory = ctx.args.get<string>("ep3-records", false);
+      if (directory.empty()) {
+        return;
+      }
+      vector<shared_ptr<Episode3::BattleRecord>> records;
+      vector<vector<string>> record_commands;
+      for (const auto& filename : phosg::list_directory_sorted(directory)) {
+        if (filename.ends_with(".mzrd")) {
+          auto& rec = records.emplace_back(make_shared<Episode3::BattleRecord>(phosg::load_file(directory + "/" + filename)));
+          record_commands.emplace_back(rec->get_all_server_data_commands());
+        }
+      }
+      if (records.empty()) {
+        ctx.skip("ep3-engine/replay-battle-records", "no battle records found in " + directory);
+        return;
+      }
+
+      ctx.measure("ep3-engine/replay-battle-records", 0, [&]() -> uint64_t {
+        uint64_t ret = 0;
+        for (size_t z = 0; z < records.size(); z++) {
+          const auto& rec = records[z];
+          auto options = Episode3::Server::options_for_record_replay(
+              rec, s->ep3_card_index, s->ep3_map_index, s->ep3_trap_card_ids);
+          auto server = make_shared<Episode3::Server>(nullptr, std::move(options));
+          server->init();
+          for (const auto& command : record_commands[z]) {
+            server->on_server_data_input(nullptr, command);
+          }
+          ret += record_commands[z].size();
+        }
+        return ret;
+      });
+    });
+
+static void print_usage() {
+  fprintf(stderr, "\
+Usage: newserv-bench [OPTIONS...] [BENCHMARK-NAME...]\n\
+\n\
+Runs benchmarks for newserv's core subsystems and writes the results as JSON.\n\
+Like newserv itself, this should be run from the directory that contains the\n\
+system/ directory. If any benchmark names are given, only those benchmarks are\n\
+run; otherwise, all of them are run. The available benchmarks are:\n\
+");
+  for (const auto* b : all_benchmarks) {
+    fprintf(stderr, "  %s\n", b->name);
+  }
+  fprintf(stderr, "\n\
+Options:\n\
+  --output=FILENAME: Write the results to this file instead of to stdout.\n\
+  --min-time=MSECS: Run each measurement for at least this long (default 500).\n\
+  --config=FILENAME: Use this config file (default system/config.json).\n\
+  --ep3-records=DIRECTORY: Also replay the battle records (.mzrd files) in\n\
+      this directory in the ep3-engine benchmark.\n\
+");
+}
+
+int main(int argc, char** argv) {
+  phosg::Arguments args(&argv[1], argc - 1);
+  if (args.get<bool>("help")) {
+    print_usage();
+    return 0;
+  }
+
+  vector<const Benchmark*> benchmarks;
+  for (size_t z = 0;; z++) {
+    const string& name = args.get<string>(z, false);
+    if (name.empty()) {
+      break;
+    }
+    auto it = find_if(all_benchmarks.begin(), all_benchmarks.end(), [&](const Benchmark* b) { return name == b->name; });
+    if (it == all_benchmarks.end()) {
+      phosg::log_error("Unknown benchmark: %s", name.c_str());
+      return 1;
+    }
+    benchmarks.emplace_back(*it);
+  }
+  if (benchmarks.empty()) {
+    benchmarks = all_benchmarks;
+  }
+
+  BenchmarkContext ctx(args);
+  for (const auto* b : benchmarks) {
+    b->run(ctx);
+  }
+
+  string json_data = ctx.json().serialize(phosg::JSON::SerializeOption::FORMAT);
+  string output_filename = args.get<string>("output", false);
+  if (output_filename.empty()) {
+    phosg::fwritex(stdout, json_data + "\n");
+  } else {
+    phosg::save_file(output_filename, json_data + "\n");
+  }
+  return 0;
+}
@@ -85,6 +85,11 @@ void Channel::replace_with(
   this->on_command_received = on_command_received;
   this->on_error = on_error;
   this->context_obj = context_obj;
+  // The capture follows the connection, so the other channel shouldn't record
+  // a disconnect
+  this->capture = std::move(other.capture);
+  this->capture_channel_id = other.capture_channel_id;
+  this->capture_peer_is_server = other.capture_peer_is_server;
   other.disconnect(); // Clears crypts, addrs, etc.
 }
 
@@ -102,7 +107,7 @@ void Channel::set_bufferevent(struct bufferevent* bev, uint64_t virtual_network_
     }
 
     bufferevent_setcb(this->bev.get(), &Channel::dispatch_on_input, nullptr, &Channel::dispatch_on_error, this);
-    bufferevent_enable(this->bev.get(), EV_READ | EV_WRITE);
+    bufferevent_enable(this->bev.get(), this->input_paused ? EV_WRITE : (EV_READ | EV_WRITE));
 
   } else {
     memset(&this->local_addr, 0, sizeof(this->local_addr));
@@ -110,7 +115,23 @@ void Channel::set_bufferevent(struct bufferevent* bev, uint64_t virtual_network_
   }
 }
 
+void Channel::start_capture(shared_ptr<SessionCaptureWriter> capture, const string& description, bool peer_is_server) {
+  this->capture = capture;
+  this->capture_peer_is_server = peer_is_server;
+  if (this->capture) {
+    this->capture_channel_id = this->capture->allocate_channel_id();
+    this->capture->record_connect(this->capture_channel_id, this->version, description);
+  }
+}
+
 void Channel::disconnect() {
+  if (this->capture) {
+    if (this->bev.get()) {
+      this->capture->record_disconnect(this->capture_channel_id, this->version);
+    }
+    this->capture.reset();
+  }
+
   if (this->bev.get()) {
     // If the output buffer is not empty, move the bufferevent into the draining
     // pool instead of disconnecting it, to make sure all the data gets sent.
@@ -151,6 +172,65 @@ void Channel::disconnect() {
   this->crypt_out.reset();
 }
 
+void Channel::set_input_paused(bool paused) {
+  if (this->input_paused == paused) {
+    return;
+  }
+  this->input_paused = paused;
+  if (this->bev.get()) {
+    if (paused) {
+      bufferevent_disable(this->bev.get(), EV_READ);
+    } else {
+      bufferevent_enable(this->bev.get(), EV_READ);
+      Channel::dispatch_on_input(this->bev.get(), this);
+    }
+  }
+}
+
+pair<size_t, size_t> Channel::command_sizes_for_send(Version version, bool encrypted, size_t data_size) {
+  switch (version) {
+    case Version::DC_NTE:
+    case Version::DC_11_2000:
+    case Version::DC_V1:
+    case Version::DC_V2:
+    case Version::GC_NTE:
+    case Version::GC_V3:
+    case Version::GC_EP3_NTE:
+    case Version::GC_EP3:
+    case Version::XB_V3: {
+      size_t size = sizeof(PSOCommandHeaderDCV3) + data_size;
+      if (encrypted && (version != Version::DC_NTE) && (version != Version::DC_11_2000) && (version != Version::DC_V1)) {
+        size = (size + 3) & ~3;
+      }
+      return make_pair(size, size);
+    }
+    case Version::PC_PATCH:
+    case Version::BB_PATCH:
+    case Version::PC_NTE:
+    case Version::PC_V2: {
+      size_t size = sizeof(PSOCommandHeaderPC) + data_size;
+      if (encrypted) {
+        size = (size + 3) & ~3;
+      }
+      return make_pair(size, size);
+    }
+    case Version::BB_V4: {
+      // BB has an annoying behavior here: command lengths must be multiples of
+      // 4, but the actual data length must be a multiple of 8. If the size
+      // field is not divisible by 8, 4 extra bytes are sent anyway. This
+      // behavior only applies when encryption is enabled - any commands sent
+      // before encryption is enabled have no size restrictions (except they
+      // must include a full header and must fit in the client's receive
+      // buffer), and no implicit extra bytes are sent.
+      size_t size = sizeof(PSOCommandHeaderBB) + data_size;
+      size_t logical_size = (size + 3) & ~3;
+      return make_pair(logical_size, encrypted ? ((size + 7) & ~7) : size);
+    }
+    default:
+      throw logic_error("unimplemented game version in send_command");
+  }
+}
+
 Channel::Message Channel::recv() {
   struct evbuffer* buf = bufferevent_get_input(this->bev.get());
 
@@ -206,6 +286,20 @@ Channel::Message Channel::recv() {
   }
   command_data.resize(command_logical_size - header_size);
 
+  if (this->capture) {
+    this->capture->record_command(
+        this->capture_channel_id,
+        false,
+        !this->capture_peer_is_server,
+        this->version,
+        header.command(this->version),
+        header.flag(this->version),
+        header_data.data(),
+        header_data.size(),
+        command_data.data(),
+        command_data.size());
+  }
+
   if (command_data_log.should_log(phosg::LogLevel::INFO) && (this->terminal_recv_color != phosg::TerminalFormat::END)) {
     if (use_terminal_colors && this->terminal_recv_color != phosg::TerminalFormat::NORMAL) {
       print_color_escape(stderr, this->terminal_recv_color, phosg::TerminalFormat::BOLD, phosg::TerminalFormat::END);
@@ -258,9 +352,8 @@ void Channel::send(uint16_t cmd, uint32_t flag, const std::vector<std::pair<cons
     size += b.second;
   }
 
+  auto [logical_size, send_data_size] = this->command_sizes_for_send(this->version, this->crypt_out.get(), size);
   string send_data;
-  size_t logical_size;
-  size_t send_data_size = 0;
   switch (this->version) {
     case Version::DC_NTE:
     case Version::DC_11_2000:
@@ -272,18 +365,9 @@ void Channel::send(uint16_t cmd, uint32_t flag, const std::vector<std::pair<cons
     case Version::GC_EP3:
     case Version::XB_V3: {
       PSOCommandHeaderDCV3 header;
-      if (this->crypt_out.get() &&
-          (this->version != Version::DC_NTE) &&
-          (this->version != Version::DC_11_2000) &&
-          (this->version != Version::DC_V1)) {
-        send_data_size = (sizeof(header) + size + 3) & ~3;
-      } else {
-        send_data_size = (sizeof(header) + size);
-      }
-      logical_size = send_data_size;
       header.command = cmd;
       header.flag = flag;
-      header.size = send_data_size;
+      header.size = logical_size;
       send_data.append(reinterpret_cast<const char*>(&header), sizeof(header));
       break;
     }
@@ -292,33 +376,14 @@ void Channel::send(uint16_t cmd, uint32_t flag, const std::vector<std::pair<cons
     case Version::PC_NTE:
     case Version::PC_V2: {
       PSOCommandHeaderPC header;
-      if (this->crypt_out.get()) {
-        send_data_size = (sizeof(header) + size + 3) & ~3;
-      } else {
-        send_data_size = (sizeof(header) + size);
-      }
-      logical_size = send_data_size;
-      header.size = send_data_size;
+      header.size = logical_size;
       header.command = cmd;
       header.flag = flag;
       send_data.append(reinterpret_cast<const char*>(&header), sizeof(header));
       break;
     }
     case Version::BB_V4: {
-      // BB has an annoying behavior here: command lengths must be multiples of
-      // 4, but the actual data length must be a multiple of 8. If the size
-      // field is not divisible by 8, 4 extra bytes are sent anyway. This
-      // behavior only applies when encryption is enabled - any commands sent
-      // before encryption is enabled have no size restrictions (except they
-      // must include a full header and must fit in the client's receive
-      // buffer), and no implicit extra bytes are sent.
       PSOCommandHeaderBB header;
-      if (this->crypt_out.get()) {
-        send_data_size = (sizeof(header) + size + 7) & ~7;
-      } else {
-        send_data_size = (sizeof(header) + size);
-      }
-      logical_size = (sizeof(header) + size + 3) & ~3;
       header.size = logical_size;
       header.command = cmd;
       header.flag = flag;
@@ -342,6 +407,11 @@ void Channel::send(uint16_t cmd, uint32_t flag, const std::vector<std::pair<cons
   }
   send_data.resize(send_data_size, '\0');
 
+  if (this->capture) {
+    this->capture->record_command(
+        this->capture_channel_id, true, this->capture_peer_is_server, this->version, cmd, flag, send_data.data(), logical_size);
+  }
+
   if (!silent && (command_data_log.should_log(phosg::LogLevel::INFO)) && (this->terminal_send_color != phosg::TerminalFormat::END)) {
     if (use_terminal_colors && this->terminal_send_color != phosg::TerminalFormat::NORMAL) {
       print_color_escape(stderr, phosg::TerminalFormat::FG_YELLOW, phosg::TerminalFormat::BOLD, phosg::TerminalFormat::END);
@@ -390,11 +460,99 @@ void Channel::send(const string& data, bool silent) {
   return this->send(data.data(), data.size(), silent);
 }
 
+bool Channel::forward_passthrough_command() {
+  Channel* target = this->passthrough_target;
+  if (!target || !this->is_passthrough_command || !target->connected() || (target->version != this->version)) {
+    return false;
+  }
+  // Commands have to go through recv() if they're going to be logged
+  if (command_data_log.should_log(phosg::LogLevel::INFO) && (this->terminal_recv_color != phosg::TerminalFormat::END)) {
+    return false;
+  }
+
+  struct evbuffer* in_buf = bufferevent_get_input(this->bev.get());
+  size_t header_size = (this->version == Version::BB_V4) ? 8 : 4;
+  PSOCommandHeader header;
+  if (evbuffer_copyout(in_buf, &header, header_size) < static_cast<ssize_t>(header_size)) {
+    return false;
+  }
+  if (this->crypt_in.get()) {
+    this->crypt_in->decrypt(&header, header_size, false);
+  }
+
+  // This logic must match recv(); see the comments there
+  size_t command_logical_size = header.size(this->version);
+  size_t command_physical_size = (this->crypt_in.get() && (this->version == Version::BB_V4))
+      ? ((command_logical_size + 7) & ~7)
+      : command_logical_size;
+  if ((command_logical_size < header_size) || (evbuffer_get_length(in_buf) < command_physical_size)) {
+    return false;
+  }
+  // recv() rounds the data size up to a multiple of 4 when decrypting, and
+  // send() may use a different size than the original command; in these cases
+  // we can't just forward the bytes
+  if (this->crypt_in.get() && ((command_physical_size - header_size) & 3)) {
+    return false;
+  }
+  auto send_sizes = this->command_sizes_for_send(target->version, target->crypt_out.get(), command_logical_size - header_size);
+  if ((send_sizes.first != command_logical_size) || (send_sizes.second != command_physical_size) || (command_physical_size > 0x7C00)) {
+    return false;
+  }
+
+  uint16_t command = header.command(this->version);
+  uint32_t flag = header.flag(this->version);
+  if (!this->is_passthrough_command(*this, command, flag)) {
+    return false;
+  }
+
+  struct evbuffer* out_buf = bufferevent_get_output(target->bev.get());
+  struct evbuffer_iovec iov;
+  if (evbuffer_reserve_space(out_buf, command_physical_size, &iov, 1) != 1) {
+    return false;
+  }
+  uint8_t* data = reinterpret_cast<uint8_t*>(iov.iov_base);
+  if (evbuffer_remove(in_buf, data, command_physical_size) < static_cast<ssize_t>(command_physical_size)) {
+    throw logic_error("enough bytes available, but could not remove them");
+  }
+  if (this->crypt_in.get()) {
+    this->crypt_in->decrypt(data, header_size);
+    this->crypt_in->decrypt(data + header_size, command_physical_size - header_size);
+  }
+  if (this->on_passthrough_command) {
+    this->on_passthrough_command(*this, command, flag, data + header_size, command_logical_size - header_size);
+  }
+  if (this->capture) {
+    this->capture->record_command(
+        this->capture_channel_id, false, !this->capture_peer_is_server, this->version, command, flag, data, command_logical_size);
+  }
+  if (target->capture) {
+    target->capture->record_command(
+        target->capture_channel_id, true, target->capture_peer_is_server, target->version, command, flag, data, command_logical_size);
+  }
+  if (target->crypt_out.get()) {
+    target->crypt_out->encrypt(data, command_physical_size);
+  }
+  iov.iov_len = command_physical_size;
+  evbuffer_commit_space(out_buf, &iov, 1);
+  return true;
+}
+
 void Channel::dispatch_on_input(struct bufferevent*, void* ctx) {
   Channel* ch = reinterpret_cast<Channel*>(ctx);
   // The client can be disconnected during on_command_received, so we have to
-  // make sure ch->bev is valid every time before calling recv()
-  while (ch->bev.get()) {
+  // make sure ch->bev is valid every time before calling recv(). It can also
+  // pause input, in which case we stop processing commands until it's resumed.
+  while (ch->bev.get() && !ch->input_paused) {
+    try {
+      if (ch->forward_passthrough_command()) {
+        continue;
+      }
+    } catch (const exception& e) {
+      channel_exceptions_log.warning("Error forwarding command on channel: %s", e.what());
+      ch->on_error(*ch, BEV_EVENT_ERROR);
+      break;
+    }
+
     Message msg;
     try {
       msg = ch->recv();
@@ -7,6 +7,7 @@
 
 #include "PSOEncryption.hh"
 #include "PSOProtocol.hh"
+#include "SessionCapture.hh"
 #include "Version.hh"
 
 struct Channel {
@@ -37,6 +38,32 @@ struct Channel {
   on_error_t on_error;
   void* context_obj;
 
+  // If passthrough_target and is_passthrough_command are set, then commands
+  // for which is_passthrough_command returns true are not passed to
+  // on_command_received. Instead, they're copied directly from this channel's
+  // input buffer into passthrough_target's output buffer, decrypted and
+  // re-encrypted in place. on_passthrough_command (if set) is called with the
+  // decrypted data before it's re-encrypted. This only happens if the result
+  // would be the same as receiving the command and sending it with the same
+  // command, flag, and data; otherwise, on_command_received is called as
+  // usual. is_passthrough_command is called before the command's data is
+  // decrypted.
+  typedef bool (*is_passthrough_command_t)(Channel&, uint16_t, uint32_t);
+  typedef void (*on_passthrough_command_t)(Channel&, uint16_t, uint32_t, const void*, size_t);
+  Channel* passthrough_target = nullptr;
+  is_passthrough_command_t is_passthrough_command = nullptr;
+  on_passthrough_command_t on_passthrough_command = nullptr;
+
+  // If capture is set, all commands sent and received on this channel are
+  // written to it (see SessionCapture.hh). This is cleared when the channel is
+  // disconnected.
+  std::shared_ptr<SessionCaptureWriter> capture;
+  uint64_t capture_channel_id = 0;
+  // True if the other end of this channel is a server (for the proxy's
+  // connections to remote servers), so commands sent on this channel are the
+  // ones that come from the client
+  bool capture_peer_is_server = false;
+
   // Creates an unconnected channel
   Channel(
       Version version,
@@ -73,11 +100,25 @@ struct Channel {
 
   void set_bufferevent(struct bufferevent* bev, uint64_t virtual_network_id);
 
+  // Starts writing this channel's commands to the given capture. The
+  // description is written in the capture's connect record.
+  void start_capture(
+      std::shared_ptr<SessionCaptureWriter> capture, const std::string& description, bool peer_is_server = false);
+
   inline bool connected() const {
     return this->bev.get() != nullptr;
   }
   void disconnect();
 
+  // While input is paused, no data is read from the connection and
+  // on_command_received is not called. When input is unpaused, any commands
+  // that were already received are processed immediately, so this must not be
+  // called from within on_command_received.
+  void set_input_paused(bool paused);
+  inline bool is_input_paused() const {
+    return this->input_paused;
+  }
+
   // Receives a message. Throws std::out_of_range if no messages are available.
   Message recv();
 
@@ -98,6 +139,15 @@ struct Channel {
   void send(const std::string& data, bool silent = false);
 
 private:
+  bool input_paused = false;
+
+  // Returns the size that will be written in the command header and the
+  // number of bytes that will actually be sent for a command with the given
+  // data size (not including the header)
+  static std::pair<size_t, size_t> command_sizes_for_send(Version version, bool encrypted, size_t data_size);
+  // Returns true if a command was forwarded to passthrough_target
+  bool forward_passthrough_command();
+
   static void dispatch_on_input(struct bufferevent*, void* ctx);
   static void dispatch_on_error(struct bufferevent*, short events, void* ctx);
 };
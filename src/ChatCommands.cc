@@ -2236,6 +2236,31 @@ ChatCommandDefinition cc_secid(
       }
     });
 
+ChatCommandDefinition cc_seekrec(
+    {"$seekrec"},
+    +[](const ServerArgs& a) -> void {
+      if (!is_ep3(a.c->version())) {
+        throw precondition_failed("$C4This command can\nonly be used on\nEpisode 3");
+      }
+
+      auto l = a.c->require_lobby();
+      if (!l->is_game() || !l->battle_player) {
+        throw precondition_failed("$C4This command can\nonly be used while\nplaying a recording");
+      }
+      uint64_t seconds;
+      try {
+        seconds = stoull(a.text, nullptr, 0);
+      } catch (const invalid_argument&) {
+        throw precondition_failed("$C4Invalid time");
+      }
+      try {
+        l->battle_player->seek(seconds * 1000000);
+      } catch (const exception& e) {
+        throw precondition_failed(phosg::string_printf("$C4Cannot seek:\n%s", e.what()));
+      }
+    },
+    unavailable_on_proxy_server);
+
 ChatCommandDefinition cc_setassist(
     {"$setassist"},
     +[](const ServerArgs& a) -> void {
@@ -194,26 +194,18 @@ Client::Client(
       should_send_to_proxy_server(false),
       bb_connection_phase(0xFF),
       ping_start_time(0),
+      command_rate_bucket(server->get_state()->rate_limiter->make_command_bucket()),
       sub_version(-1),
       floor(0),
       lobby_client_id(0),
       lobby_arrow_color(0),
       preferred_lobby_id(-1),
-      save_game_data_event(
-          event_new(
-              bufferevent_get_base(bev), -1, EV_TIMEOUT | EV_PERSIST,
-              &Client::dispatch_save_game_data, this),
-          event_free),
-      send_ping_event(
-          event_new(
-              bufferevent_get_base(bev), -1, EV_TIMEOUT,
-              &Client::dispatch_send_ping, this),
-          event_free),
-      idle_timeout_event(
-          event_new(
-              bufferevent_get_base(bev), -1, EV_TIMEOUT,
-              &Client::dispatch_idle_timeout, this),
-          event_free),
+      save_game_data_timer(server->get_state()->timer_wheel, [this]() -> void {
+        this->save_game_data();
+        this->reschedule_save_game_data_event();
+      }),
+      send_ping_timer(server->get_state()->timer_wheel, [this]() -> void { this->send_ping(); }),
+      idle_timeout_timer(server->get_state()->timer_wheel, [this]() -> void { this->idle_timeout(); }),
       card_battle_table_number(-1),
       card_battle_table_seat_number(0),
       card_battle_table_seat_state(0),
@@ -282,17 +274,14 @@ void Client::update_channel_name() {
 
 void Client::reschedule_save_game_data_event() {
   if (this->version() == Version::BB_V4) {
-    struct timeval tv = phosg::usecs_to_timeval(60000000); // 1 minute
-    event_add(this->save_game_data_event.get(), &tv);
+    this->save_game_data_timer.schedule(60000000); // 1 minute
   }
 }
 
 void Client::reschedule_ping_and_timeout_events() {
   auto s = this->require_server_state();
-  struct timeval ping_tv = phosg::usecs_to_timeval(s->client_ping_interval_usecs);
-  event_add(this->send_ping_event.get(), &ping_tv);
-  struct timeval idle_tv = phosg::usecs_to_timeval(s->client_idle_timeout_usecs);
-  event_add(this->idle_timeout_event.get(), &idle_tv);
+  this->send_ping_timer.schedule(s->client_ping_interval_usecs);
+  this->idle_timeout_timer.schedule(s->client_idle_timeout_usecs);
 }
 
 void Client::convert_account_to_temporary_if_nte() {
@@ -434,10 +423,6 @@ bool Client::can_use_chat_commands() const {
   return this->require_server_state()->enable_chat_commands;
 }
 
-void Client::dispatch_save_game_data(evutil_socket_t, short, void* ctx) {
-  reinterpret_cast<Client*>(ctx)->save_game_data();
-}
-
 void Client::save_game_data() {
   if (this->version() != Version::BB_V4) {
     throw logic_error("save_game_data called for non-BB client");
@@ -447,10 +432,6 @@ void Client::save_game_data() {
   }
 }
 
-void Client::dispatch_send_ping(evutil_socket_t, short, void* ctx) {
-  reinterpret_cast<Client*>(ctx)->send_ping();
-}
-
 void Client::send_ping() {
   if (!is_patch(this->version())) {
     this->log.info("Sending ping command");
@@ -464,10 +445,6 @@ void Client::send_ping() {
   }
 }
 
-void Client::dispatch_idle_timeout(evutil_socket_t, short, void* ctx) {
-  reinterpret_cast<Client*>(ctx)->idle_timeout();
-}
-
 void Client::idle_timeout() {
   this->log.info("Idle timeout expired");
   auto s = this->server.lock();
@@ -480,8 +457,8 @@ void Client::idle_timeout() {
 }
 
 void Client::suspend_timeouts() {
-  event_del(this->send_ping_event.get());
-  event_del(this->idle_timeout_event.get());
+  this->send_ping_timer.cancel();
+  this->idle_timeout_timer.cancel();
   this->log.info("Timeouts suspended");
 }
 
@@ -17,8 +17,10 @@
 #include "PatchFileIndex.hh"
 #include "Quest.hh"
 #include "QuestScript.hh"
+#include "RateLimiter.hh"
 #include "TeamIndex.hh"
 #include "Text.hh"
+#include "TimerWheel.hh"
 
 extern const uint64_t CLIENT_CONFIG_MAGIC;
 
@@ -201,6 +203,7 @@ public:
   parray<le_uint32_t, 3> xb_9E_unknown_a1a;
   uint8_t bb_connection_phase;
   uint64_t ping_start_time;
+  TokenBucket command_rate_bucket;
 
   // Lobby/positioning
   Config config;
@@ -214,9 +217,9 @@ public:
   uint8_t lobby_arrow_color;
   int64_t preferred_lobby_id; // <0 = no preference
 
-  std::unique_ptr<struct event, void (*)(struct event*)> save_game_data_event;
-  std::unique_ptr<struct event, void (*)(struct event*)> send_ping_event;
-  std::unique_ptr<struct event, void (*)(struct event*)> idle_timeout_event;
+  TimerWheel::Timer save_game_data_timer;
+  TimerWheel::Timer send_ping_timer;
+  TimerWheel::Timer idle_timeout_timer;
   int16_t card_battle_table_number;
   uint16_t card_battle_table_seat_number;
   uint16_t card_battle_table_seat_state;
@@ -325,11 +328,8 @@ public:
 
   bool can_use_chat_commands() const;
 
-  static void dispatch_save_game_data(evutil_socket_t, short, void* ctx);
   void save_game_data();
-  static void dispatch_send_ping(evutil_socket_t, short, void* ctx);
   void send_ping();
-  static void dispatch_idle_timeout(evutil_socket_t, short, void* ctx);
   void idle_timeout();
 
   void suspend_timeouts();
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <phosg/Encoding.hh>
 #include <phosg/Network.hh>
 #include <phosg/Strings.hh>
@@ -25,7 +26,27 @@ DNSServer::DNSServer(
     : base(base),
       local_connect_address(local_connect_address),
       external_connect_address(external_connect_address),
-      banned_ipv4_ranges(banned_ipv4_ranges) {}
+      local_answer_suffix(DNSServer::make_answer_suffix(local_connect_address)),
+      external_answer_suffix(DNSServer::make_answer_suffix(external_connect_address)),
+      banned_ipv4_ranges(banned_ipv4_ranges),
+      batch(make_unique<Batch>()) {
+  // The buffer pointers never change, so the iovecs and message headers only
+  // need to be set up once
+  for (size_t z = 0; z < BATCH_SIZE; z++) {
+    this->batch->query_iovs[z].iov_base = this->batch->queries[z].data();
+    this->batch->query_iovs[z].iov_len = this->batch->queries[z].size();
+    this->batch->response_iovs[z].iov_base = this->batch->responses[z].data();
+    this->batch->response_iovs[z].iov_len = 0;
+#ifdef __linux__
+    memset(&this->batch->query_msgs[z], 0, sizeof(this->batch->query_msgs[z]));
+    this->batch->query_msgs[z].msg_hdr.msg_iov = &this->batch->query_iovs[z];
+    this->batch->query_msgs[z].msg_hdr.msg_iovlen = 1;
+    memset(&this->batch->response_msgs[z], 0, sizeof(this->batch->response_msgs[z]));
+    this->batch->response_msgs[z].msg_hdr.msg_iov = &this->batch->response_iovs[z];
+    this->batch->response_msgs[z].msg_hdr.msg_iovlen = 1;
+#endif
+  }
+}
 
 DNSServer::~DNSServer() {
   for (const auto& it : this->fd_to_receive_event) {
@@ -58,22 +79,54 @@ void DNSServer::dispatch_on_receive_message(evutil_socket_t fd,
   reinterpret_cast<DNSServer*>(ctx)->on_receive_message(fd, events);
 }
 
+DNSServer::AnswerSuffix DNSServer::make_answer_suffix(uint32_t resolved_address) {
+  // Type A, class IN, then an answer pointing to the name in the question
+  // (offset 0x0C) with type A, class IN, TTL 60, and a 4-byte address
+  static const uint8_t prefix[0x10] = {
+      0x00, 0x01, 0x00, 0x01, 0xC0, 0x0C, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3C, 0x00, 0x04};
+  AnswerSuffix ret;
+  memcpy(ret.data(), prefix, sizeof(prefix));
+  ret[0x10] = resolved_address >> 24;
+  ret[0x11] = resolved_address >> 16;
+  ret[0x12] = resolved_address >> 8;
+  ret[0x13] = resolved_address;
+  return ret;
+}
+
+size_t DNSServer::write_response(void* vout, const void* vquery, size_t query_size, const AnswerSuffix& answer_suffix) {
+  // Flags = standard response with recursion available, 1 question, 1 answer
+  static const uint8_t header[10] = {0x81, 0x80, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00};
+
+  if (query_size < 0x0C) {
+    return 0;
+  }
+  const uint8_t* query = reinterpret_cast<const uint8_t*>(vquery);
+  size_t max_name_len = min<size_t>(query_size, MAX_QUERY_SIZE) - 0x0C;
+  size_t name_len = strnlen(reinterpret_cast<const char*>(&query[0x0C]), max_name_len);
+  if (name_len >= max_name_len) {
+    return 0;
+  }
+  name_len++;
+
+  uint8_t* out = reinterpret_cast<uint8_t*>(vout);
+  memcpy(out, query, 2); // Transaction ID
+  memcpy(out + 2, header, sizeof(header));
+  memcpy(out + 0x0C, &query[0x0C], name_len);
+  memcpy(out + 0x0C + name_len, answer_suffix.data(), answer_suffix.size());
+  return 0x0C + name_len + answer_suffix.size();
+}
+
 string DNSServer::response_for_query(const void* vdata, size_t size, uint32_t resolved_address) {
   if (size < 0x0C) {
     throw invalid_argument("query too small");
   }
-
-  const char* data = reinterpret_cast<const char*>(vdata);
-  size_t name_len = strlen(&data[12]) + 1;
-
-  phosg::be_uint32_t be_resolved_address = resolved_address;
-
-  string response;
-  response.append(data, 2);
-  response.append("\x81\x80\x00\x01\x00\x01\x00\x00\x00\x00", 10);
-  response.append(&data[12], name_len);
-  response.append("\x00\x01\x00\x01\xC0\x0C\x00\x01\x00\x01\x00\x00\x00\x3C\x00\x04", 16);
-  response.append(reinterpret_cast<const char*>(&be_resolved_address), 4);
+  string response(MAX_RESPONSE_SIZE, '\0');
+  size_t response_size = DNSServer::write_response(
+      response.data(), vdata, size, DNSServer::make_answer_suffix(resolved_address));
+  if (response_size == 0) {
+    throw invalid_argument("query name is not terminated");
+  }
+  response.resize(response_size);
   return response;
 }
 
@@ -82,40 +135,113 @@ string DNSServer::response_for_query(
   return DNSServer::response_for_query(query.data(), query.size(), resolved_address);
 }
 
+string DNSServer::query_for_name(uint16_t id, const string& name) {
+  phosg::StringWriter w;
+  w.put_u16b(id);
+  w.put_u16b(0x0100); // Standard query, recursion desired
+  w.put_u16b(1); // 1 question
+  w.put_u16b(0);
+  w.put_u16b(0);
+  w.put_u16b(0);
+  for (const auto& label : phosg::split(name, '.')) {
+    if (label.empty() || label.size() > 0x3F) {
+      throw invalid_argument("invalid name");
+    }
+    w.put_u8(label.size());
+    w.write(label);
+  }
+  w.put_u8(0);
+  w.put_u16b(1); // Type A
+  w.put_u16b(1); // Class IN
+  return std::move(w.str());
+}
+
+size_t DNSServer::prepare_response(size_t index, size_t query_size) {
+  const auto& remote = this->batch->remote_addrs[index];
+  if (remote.ss_family != AF_INET || this->banned_ipv4_ranges->check(remote)) {
+    return 0;
+  }
+  const sockaddr_in* remote_sin = reinterpret_cast<const sockaddr_in*>(&remote);
+  uint32_t remote_address = ntohl(remote_sin->sin_addr.s_addr);
+  const auto& answer_suffix = is_local_address(remote_address)
+      ? this->local_answer_suffix
+      : this->external_answer_suffix;
+  size_t response_size = this->write_response(
+      this->batch->responses[index].data(), this->batch->queries[index].data(), query_size, answer_suffix);
+  if (response_size == 0) {
+    dns_server_log.warning("input query too small or malformed");
+  }
+  return response_size;
+}
+
 void DNSServer::on_receive_message(int fd, short) {
+  auto& b = *this->batch;
   for (;;) {
-    struct sockaddr_storage remote;
-    socklen_t remote_size = sizeof(sockaddr_in);
-    memset(&remote, 0, remote_size);
+#ifdef __linux__
+    // Receive as many queries as are available (up to BATCH_SIZE) and send all
+    // the responses at once, so a burst of queries costs two system calls per
+    // batch instead of two per query
+    for (size_t z = 0; z < BATCH_SIZE; z++) {
+      b.query_msgs[z].msg_hdr.msg_name = &b.remote_addrs[z];
+      b.query_msgs[z].msg_hdr.msg_namelen = sizeof(b.remote_addrs[z]);
+      b.query_msgs[z].msg_hdr.msg_flags = 0;
+    }
+    int num_received = recvmmsg(fd, b.query_msgs.data(), BATCH_SIZE, MSG_DONTWAIT, nullptr);
+    if (num_received < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        dns_server_log.error("input error %d", errno);
+        throw runtime_error("cannot read from udp socket");
+      }
+      break;
+    } else if (num_received == 0) {
+      break;
+    }
 
-    string input(2048, 0);
-    ssize_t bytes = recvfrom(fd, const_cast<char*>(input.data()), input.size(),
-        0, reinterpret_cast<sockaddr*>(&remote), &remote_size);
+    size_t num_responses = 0;
+    for (size_t z = 0; z < static_cast<size_t>(num_received); z++) {
+      size_t response_size = this->prepare_response(z, b.query_msgs[z].msg_len);
+      if (response_size) {
+        auto& msg = b.response_msgs[num_responses++];
+        msg.msg_hdr.msg_name = &b.remote_addrs[z];
+        msg.msg_hdr.msg_namelen = b.query_msgs[z].msg_hdr.msg_namelen;
+        msg.msg_hdr.msg_iov = &b.response_iovs[z];
+        b.response_iovs[z].iov_len = response_size;
+      }
+    }
 
+    // If the socket's send buffer is full, the remaining responses are
+    // dropped; the clients will retry
+    for (size_t num_sent = 0; num_sent < num_responses;) {
+      int ret = sendmmsg(fd, &b.response_msgs[num_sent], num_responses - num_sent, MSG_DONTWAIT);
+      if (ret <= 0) {
+        break;
+      }
+      num_sent += ret;
+    }
+
+    if (static_cast<size_t>(num_received) < BATCH_SIZE) {
+      break;
+    }
+
+#else
+    socklen_t remote_size = sizeof(b.remote_addrs[0]);
+    ssize_t bytes = recvfrom(fd, b.queries[0].data(), b.queries[0].size(), 0,
+        reinterpret_cast<sockaddr*>(&b.remote_addrs[0]), &remote_size);
     if (bytes < 0) {
       if (errno != EAGAIN) {
         dns_server_log.error("input error %d", errno);
         throw runtime_error("cannot read from udp socket");
       }
       break;
-
     } else if (bytes == 0) {
       break;
+    }
 
-    } else if (bytes < 0x0C) {
-      dns_server_log.warning("input query too small");
-      phosg::print_data(stderr, input.data(), bytes);
-
-    } else if (!this->banned_ipv4_ranges->check(remote)) {
-      input.resize(bytes);
-      const sockaddr_in* remote_sin = reinterpret_cast<const sockaddr_in*>(&remote);
-      uint32_t remote_address = ntohl(remote_sin->sin_addr.s_addr);
-      uint32_t connect_address = is_local_address(remote_address)
-          ? this->local_connect_address
-          : this->external_connect_address;
-      string response = this->response_for_query(input, connect_address);
-      sendto(fd, response.data(), response.size(), 0,
-          reinterpret_cast<const sockaddr*>(&remote), remote_size);
+    size_t response_size = this->prepare_response(0, bytes);
+    if (response_size) {
+      sendto(fd, b.responses[0].data(), response_size, 0,
+          reinterpret_cast<const sockaddr*>(&b.remote_addrs[0]), remote_size);
     }
+#endif
   }
 }
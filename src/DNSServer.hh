@@ -1,7 +1,11 @@
 #pragma once
 
 #include <event2/event.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
+#include <array>
 #include <memory>
 #include <set>
 #include <string>
@@ -31,14 +35,50 @@ public:
 
   static std::string response_for_query(const void* vdata, size_t size, uint32_t resolved_address);
   static std::string response_for_query(const std::string& query, uint32_t resolved_address);
+  // Returns an A query for the given name (used by the dns-load-test action)
+  static std::string query_for_name(uint16_t id, const std::string& name);
 
 private:
+  // Everything in a response after the question; this is the same for all
+  // responses that resolve to the same address
+  using AnswerSuffix = std::array<uint8_t, 0x14>;
+  static AnswerSuffix make_answer_suffix(uint32_t resolved_address);
+  // Writes the response for a query to out, which must have room for
+  // MAX_RESPONSE_SIZE bytes, and returns its size. Returns 0 if the query is
+  // malformed.
+  static size_t write_response(void* out, const void* query, size_t query_size, const AnswerSuffix& answer_suffix);
+
+  // Queries larger than this are truncated when received, but the question is
+  // always within this limit since names can't be longer than 255 bytes
+  static constexpr size_t MAX_QUERY_SIZE = 0x200;
+  static constexpr size_t MAX_RESPONSE_SIZE = MAX_QUERY_SIZE + sizeof(AnswerSuffix);
+  // Number of queries received (and responses sent) per system call
+  static constexpr size_t BATCH_SIZE = 32;
+
   std::shared_ptr<struct event_base> base;
   std::unordered_map<int, std::unique_ptr<struct event, void (*)(struct event*)>> fd_to_receive_event;
   uint32_t local_connect_address;
   uint32_t external_connect_address;
+  AnswerSuffix local_answer_suffix;
+  AnswerSuffix external_answer_suffix;
   std::shared_ptr<const IPV4RangeSet> banned_ipv4_ranges;
 
+  struct Batch {
+    std::array<struct sockaddr_storage, BATCH_SIZE> remote_addrs;
+    std::array<std::array<uint8_t, MAX_QUERY_SIZE>, BATCH_SIZE> queries;
+    std::array<std::array<uint8_t, MAX_RESPONSE_SIZE>, BATCH_SIZE> responses;
+    std::array<struct iovec, BATCH_SIZE> query_iovs;
+    std::array<struct iovec, BATCH_SIZE> response_iovs;
+#ifdef __linux__
+    std::array<struct mmsghdr, BATCH_SIZE> query_msgs;
+    std::array<struct mmsghdr, BATCH_SIZE> response_msgs;
+#endif
+  };
+  std::unique_ptr<Batch> batch;
+
   static void dispatch_on_receive_message(evutil_socket_t fd, short events, void* ctx);
   void on_receive_message(int fd, short event);
+  // Returns the size of the response written to batch->responses[index], or 0
+  // if no response should be sent
+  size_t prepare_response(size_t index, size_t query_size);
 };
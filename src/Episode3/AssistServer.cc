@@ -141,6 +141,12 @@ shared_ptr<Server> AssistServer::server() {
   return s;
 }
 
+shared_ptr<AssistServer> AssistServer::clone(shared_ptr<Server> server) const {
+  auto ret = make_shared<AssistServer>(*this);
+  ret->w_server = server;
+  return ret;
+}
+
 shared_ptr<const Server> AssistServer::server() const {
   auto s = this->w_server.lock();
   if (!s) {
@@ -153,7 +159,7 @@ uint16_t AssistServer::card_id_for_card_ref(uint16_t card_ref) const {
   return this->server()->card_id_for_card_ref(card_ref);
 }
 
-shared_ptr<const CardIndex::CardEntry> AssistServer::definition_for_card_id(
+const CardIndex::CardEntry* AssistServer::definition_for_card_id(
     uint16_t card_id) const {
   return this->server()->definition_for_card_id(card_id);
 }
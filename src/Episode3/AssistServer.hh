@@ -19,11 +19,14 @@ AssistEffect assist_effect_number_for_card_id(uint16_t card_id, bool is_nte);
 class AssistServer {
 public:
   explicit AssistServer(std::shared_ptr<Server> server);
+  // The copy still shares its per-player state objects with this object;
+  // Server::clone replaces them.
+  std::shared_ptr<AssistServer> clone(std::shared_ptr<Server> server) const;
   std::shared_ptr<Server> server();
   std::shared_ptr<const Server> server() const;
 
   uint16_t card_id_for_card_ref(uint16_t card_ref) const;
-  std::shared_ptr<const CardIndex::CardEntry> definition_for_card_id(uint16_t card_id) const;
+  const CardIndex::CardEntry* definition_for_card_id(uint16_t card_id) const;
 
   uint32_t compute_num_assist_effects_for_client(uint16_t client_id);
   uint32_t compute_num_assist_effects_for_team(uint32_t team_id);
@@ -39,11 +42,11 @@ private:
 
 public:
   parray<AssistEffect, 4> assist_effects;
-  bcarray<std::shared_ptr<const CardIndex::CardEntry>, 4> assist_card_defs;
+  bcarray<const CardIndex::CardEntry*, 4> assist_card_defs;
   uint32_t num_assist_cards_set;
   parray<uint8_t, 4> client_ids_with_assists;
   parray<AssistEffect, 4> active_assist_effects;
-  bcarray<std::shared_ptr<const CardIndex::CardEntry>, 4> active_assist_card_defs;
+  bcarray<const CardIndex::CardEntry*, 4> active_assist_card_defs;
   uint32_t num_active_assists;
   bcarray<std::shared_ptr<HandAndEquipState>, 4> hand_and_equip_states;
   bcarray<std::shared_ptr<parray<CardShortStatus, 0x10>>, 4> card_short_statuses;
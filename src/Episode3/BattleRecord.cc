@@ -1,8 +1,13 @@
 #include "BattleRecord.hh"
 
+#include <stdio.h>
+
+#include <algorithm>
+#include <phosg/Filesystem.hh>
 #include <phosg/Time.hh>
 
 #include "../CommandFormats.hh"
+#include "../Loggers.hh"
 #include "../SendCommands.hh"
 
 using namespace std;
@@ -41,6 +46,9 @@ BattleRecord::Event::Event(phosg::StringReader& r) {
     case Event::Type::SERVER_DATA_COMMAND:
       this->data = r.read(r.get_u16l());
       break;
+    case Event::Type::KEYFRAME:
+      this->data = r.read(r.get_u32l());
+      break;
     default:
       throw logic_error("unknown event type");
   }
@@ -75,6 +83,10 @@ void BattleRecord::Event::serialize(phosg::StringWriter& w) const {
       w.put_u16l(this->data.size());
       w.write(this->data);
       break;
+    case Event::Type::KEYFRAME:
+      w.put_u32l(this->data.size());
+      w.write(this->data);
+      break;
     default:
       throw logic_error("unknown event type");
   }
@@ -121,6 +133,10 @@ void BattleRecord::Event::print(FILE* stream) const {
       fprintf(stream, "SERVER_DATA_COMMAND\n");
       phosg::print_data(stream, this->data, 0, nullptr, phosg::PrintDataFlags::PRINT_ASCII | phosg::PrintDataFlags::DISABLE_COLOR | phosg::PrintDataFlags::OFFSET_16_BITS);
       break;
+    case Type::KEYFRAME:
+      fprintf(stream, "KEYFRAME\n");
+      phosg::print_data(stream, this->data, 0, nullptr, phosg::PrintDataFlags::PRINT_ASCII | phosg::PrintDataFlags::DISABLE_COLOR | phosg::PrintDataFlags::OFFSET_16_BITS);
+      break;
     default:
       throw runtime_error("unknown event type in battle record");
   }
@@ -145,6 +161,14 @@ BattleRecord::BattleRecord(const string& data)
     has_random_stream = false;
   } else if (signature == this->SIGNATURE_V2) {
     has_random_stream = true;
+  } else if (signature == this->SIGNATURE_V3) {
+    r.go(0);
+    const auto& header = r.get<FileHeader>();
+    this->battle_start_timestamp = header.battle_start_timestamp;
+    this->battle_end_timestamp = header.battle_end_timestamp;
+    this->behavior_flags = header.behavior_flags;
+    this->parse_chunks(r);
+    return;
   } else {
     throw runtime_error("incorrect battle record signature");
   }
@@ -156,22 +180,223 @@ BattleRecord::BattleRecord(const string& data)
     this->random_stream = r.read(r.get_u32l());
   }
   while (!r.eof()) {
-    this->events.emplace_back(r);
+    const auto& ev = this->events.emplace_back(r);
+    if (ev.type == Event::Type::KEYFRAME) {
+      this->keyframe_event_indexes.emplace_back(this->events.size() - 1);
+    }
+  }
+}
+
+void BattleRecord::parse_chunks(phosg::StringReader& r) {
+  // The index isn't needed here since we read the entire file anyway; we just
+  // read all the chunks in order. If the file is incomplete, the last chunk
+  // may be truncated; in that case we stop before it.
+  while (r.remaining() >= sizeof(ChunkHeader)) {
+    const auto& chunk_header = r.get<ChunkHeader>();
+    if (r.remaining() < chunk_header.size) {
+      break;
+    }
+    auto chunk_type = static_cast<ChunkType>(chunk_header.type.load());
+    if (chunk_type == ChunkType::INDEX) {
+      break;
+    }
+    string chunk_data = r.read(chunk_header.size);
+    if (chunk_type == ChunkType::EVENTS) {
+      phosg::StringReader chunk_r(chunk_data);
+      while (!chunk_r.eof()) {
+        const auto& ev = this->events.emplace_back(chunk_r);
+        if (ev.type == Event::Type::KEYFRAME) {
+          this->keyframe_event_indexes.emplace_back(this->events.size() - 1);
+        }
+      }
+    } else if (chunk_type == ChunkType::RANDOM_DATA) {
+      this->random_stream += chunk_data;
+    }
+  }
+}
+
+BattleRecord::FileHeader BattleRecord::file_header() const {
+  FileHeader header;
+  header.signature = this->SIGNATURE_V3;
+  header.battle_start_timestamp = this->battle_start_timestamp;
+  header.battle_end_timestamp = this->battle_end_timestamp;
+  header.behavior_flags = this->behavior_flags;
+  return header;
+}
+
+void BattleRecord::write_chunk(
+    string& out,
+    uint64_t base_offset,
+    ChunkType type,
+    const string& data,
+    IndexEntry entry,
+    vector<IndexEntry>& index) {
+  entry.offset = base_offset + out.size();
+  entry.type = static_cast<uint32_t>(type);
+  index.emplace_back(entry);
+
+  ChunkHeader header;
+  header.type = static_cast<uint32_t>(type);
+  header.size = data.size();
+  out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+  out += data;
+}
+
+string BattleRecord::serialize_events_chunks(
+    uint64_t base_offset, size_t start_index, size_t end_index, vector<IndexEntry>& index) const {
+  string ret;
+  phosg::StringWriter chunk_w;
+  IndexEntry entry;
+  entry.count = 0;
+  for (size_t z = start_index; z < end_index; z++) {
+    const auto& ev = this->events[z];
+    if ((entry.count > 0) &&
+        ((ev.type == Event::Type::KEYFRAME) || (entry.count >= this->MAX_EVENTS_PER_CHUNK))) {
+      write_chunk(ret, base_offset, ChunkType::EVENTS, chunk_w.str(), entry, index);
+      chunk_w.str().clear();
+      entry.count = 0;
+    }
+    if (entry.count == 0) {
+      entry.flags = (ev.type == Event::Type::KEYFRAME) ? IndexEntry::Flag::STARTS_WITH_KEYFRAME : 0;
+      entry.first_timestamp = ev.timestamp;
+      entry.first_index = z;
+    }
+    ev.serialize(chunk_w);
+    entry.count++;
   }
+  if (entry.count > 0) {
+    write_chunk(ret, base_offset, ChunkType::EVENTS, chunk_w.str(), entry, index);
+  }
+  return ret;
 }
 
 string BattleRecord::serialize() const {
-  phosg::StringWriter w;
-  w.put_u64l(this->SIGNATURE_V2);
-  w.put_u64l(this->battle_start_timestamp);
-  w.put_u64l(this->battle_end_timestamp);
-  w.put_u32l(this->behavior_flags);
-  w.put_u32l(this->random_stream.size());
-  w.write(this->random_stream);
-  for (const auto& ev : this->events) {
-    ev.serialize(w);
+  auto header = this->file_header();
+  string ret(reinterpret_cast<const char*>(&header), sizeof(header));
+
+  vector<IndexEntry> index;
+  if (!this->random_stream.empty()) {
+    IndexEntry entry;
+    entry.flags = 0;
+    entry.first_timestamp = 0;
+    entry.first_index = 0;
+    entry.count = this->random_stream.size();
+    write_chunk(ret, 0, ChunkType::RANDOM_DATA, this->random_stream, entry, index);
   }
-  return std::move(w.str());
+  ret += this->serialize_events_chunks(ret.size(), 0, this->events.size(), index);
+
+  FileTrailer trailer;
+  trailer.index_offset = ret.size();
+  trailer.signature = this->TRAILER_SIGNATURE_V3;
+  ChunkHeader index_header;
+  index_header.type = static_cast<uint32_t>(ChunkType::INDEX);
+  index_header.size = index.size() * sizeof(IndexEntry);
+  ret.append(reinterpret_cast<const char*>(&index_header), sizeof(index_header));
+  ret.append(reinterpret_cast<const char*>(index.data()), index.size() * sizeof(IndexEntry));
+  ret.append(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+  return ret;
+}
+
+void BattleRecord::stream_to_file(const string& filename) {
+  if (!this->is_writable) {
+    throw logic_error("cannot stream read-only battle record");
+  }
+  if (this->stream_file || !this->stream_filename.empty()) {
+    throw logic_error("battle record is already being streamed");
+  }
+  this->stream_filename = filename;
+  if (this->battle_start_timestamp != 0) {
+    this->start_stream();
+  }
+}
+
+void BattleRecord::write_stream(const string& data) {
+  phosg::fwritex(this->stream_file.get(), data);
+  this->stream_offset += data.size();
+}
+
+void BattleRecord::start_stream() {
+  try {
+    this->stream_file = phosg::fopen_shared(this->stream_filename, "wb");
+    this->stream_offset = 0;
+    this->stream_next_event_index = 0;
+    this->stream_random_offset = 0;
+    this->stream_index.clear();
+    auto header = this->file_header();
+    this->write_stream(string(reinterpret_cast<const char*>(&header), sizeof(header)));
+  } catch (const exception& e) {
+    this->abort_stream(e);
+    return;
+  }
+  this->flush_stream();
+}
+
+void BattleRecord::abort_stream(const exception& e) {
+  // Failing to write the file should not affect the battle; the record is
+  // still kept in memory and can be saved with $saverec later
+  lobby_log.warning("Cannot stream battle record to %s: %s", this->stream_filename.c_str(), e.what());
+  this->stream_file.reset();
+  this->stream_index.clear();
+}
+
+void BattleRecord::flush_stream() {
+  if (!this->stream_file) {
+    return;
+  }
+
+  string data;
+  if (this->stream_random_offset < this->random_stream.size()) {
+    IndexEntry entry;
+    entry.flags = 0;
+    entry.first_timestamp = 0;
+    entry.first_index = this->stream_random_offset;
+    entry.count = this->random_stream.size() - this->stream_random_offset;
+    write_chunk(data, this->stream_offset, ChunkType::RANDOM_DATA,
+        this->random_stream.substr(this->stream_random_offset), entry, this->stream_index);
+    this->stream_random_offset = this->random_stream.size();
+  }
+  data += this->serialize_events_chunks(
+      this->stream_offset + data.size(), this->stream_next_event_index, this->events.size(), this->stream_index);
+  this->stream_next_event_index = this->events.size();
+
+  if (!data.empty()) {
+    try {
+      this->write_stream(data);
+      fflush(this->stream_file.get());
+    } catch (const exception& e) {
+      this->abort_stream(e);
+    }
+  }
+}
+
+void BattleRecord::finish_stream() {
+  if (!this->stream_file) {
+    return;
+  }
+  this->flush_stream();
+
+  FileTrailer trailer;
+  trailer.index_offset = this->stream_offset;
+  trailer.signature = this->TRAILER_SIGNATURE_V3;
+  ChunkHeader index_header;
+  index_header.type = static_cast<uint32_t>(ChunkType::INDEX);
+  index_header.size = this->stream_index.size() * sizeof(IndexEntry);
+  string data(reinterpret_cast<const char*>(&index_header), sizeof(index_header));
+  data.append(reinterpret_cast<const char*>(this->stream_index.data()), this->stream_index.size() * sizeof(IndexEntry));
+  data.append(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+  try {
+    this->write_stream(data);
+
+    // Rewrite the header, since the end timestamp is now known
+    auto header = this->file_header();
+    fseeko(this->stream_file.get(), 0, SEEK_SET);
+    phosg::fwritex(this->stream_file.get(), &header, sizeof(header));
+  } catch (const exception& e) {
+    this->abort_stream(e);
+    return;
+  }
+  this->stream_file.reset();
+  this->stream_index.clear();
 }
 
 bool BattleRecord::writable() const {
@@ -189,6 +414,17 @@ const BattleRecord::Event* BattleRecord::get_first_event() const {
   return &this->events.front();
 }
 
+size_t BattleRecord::find_keyframe_event_index(uint64_t timestamp) const {
+  // Find the first keyframe after the timestamp; the one before it (if any) is
+  // the one we want
+  auto it = upper_bound(
+      this->keyframe_event_indexes.begin(), this->keyframe_event_indexes.end(), timestamp,
+      [&](uint64_t ts, size_t event_index) -> bool {
+        return ts < this->events[event_index].timestamp;
+      });
+  return (it == this->keyframe_event_indexes.begin()) ? this->events.size() : *(it - 1);
+}
+
 void BattleRecord::add_player(
     const PlayerLobbyDataDCGC& lobby_data,
     const PlayerInventory& inventory,
@@ -228,6 +464,9 @@ void BattleRecord::add_command(Event::Type type, const void* data, size_t size)
   ev.type = type;
   ev.timestamp = phosg::now();
   ev.data.assign(reinterpret_cast<const char*>(data), size);
+  if (this->stream_file && ((this->events.size() - this->stream_next_event_index) >= this->MAX_EVENTS_PER_CHUNK)) {
+    this->flush_stream();
+  }
 }
 
 void BattleRecord::add_command(Event::Type type, string&& data) {
@@ -238,6 +477,9 @@ void BattleRecord::add_command(Event::Type type, string&& data) {
   ev.type = type;
   ev.timestamp = phosg::now();
   ev.data = std::move(data);
+  if (this->stream_file && ((this->events.size() - this->stream_next_event_index) >= this->MAX_EVENTS_PER_CHUNK)) {
+    this->flush_stream();
+  }
 }
 
 void BattleRecord::add_chat_message(
@@ -256,6 +498,20 @@ void BattleRecord::add_random_data(const void* data, size_t size) {
   this->random_stream.append(reinterpret_cast<const char*>(data), size);
 }
 
+void BattleRecord::add_keyframe(string&& data) {
+  if (!this->is_writable) {
+    throw logic_error("cannot write to battle record");
+  }
+  // Write everything before the keyframe first, so the keyframe will begin a
+  // new chunk in the stream
+  this->flush_stream();
+  Event& ev = this->events.emplace_back();
+  ev.type = Event::Type::KEYFRAME;
+  ev.timestamp = phosg::now();
+  ev.data = std::move(data);
+  this->keyframe_event_indexes.emplace_back(this->events.size() - 1);
+}
+
 vector<string> BattleRecord::get_all_server_data_commands() const {
   vector<string> ret;
   for (const auto& event : this->events) {
@@ -354,10 +610,16 @@ void BattleRecord::set_battle_start_timestamp() {
 
   // Clear any existing random data (there shouldn't be any)
   this->random_stream.clear();
+  this->keyframe_event_indexes.clear();
+
+  if (!this->stream_filename.empty()) {
+    this->start_stream();
+  }
 }
 
 void BattleRecord::set_battle_end_timestamp() {
   this->battle_end_timestamp = phosg::now();
+  this->finish_stream();
 }
 
 void BattleRecord::print(FILE* stream) const {
@@ -433,34 +695,7 @@ void BattleRecordPlayer::schedule_events() {
     } else {
       if (this->event_it->timestamp <= relative_ts) {
         // Play the next event
-        auto& ev = *this->event_it;
-        switch (ev.type) {
-          case BattleRecord::Event::Type::PLAYER_JOIN:
-            // Technically we can support this, but it should never happen
-            throw runtime_error("player join event during battle replay");
-          case BattleRecord::Event::Type::PLAYER_LEAVE:
-            send_player_leave_notification(l, ev.leaving_client_id);
-            break;
-          case BattleRecord::Event::Type::SET_INITIAL_PLAYERS:
-            // This should have been handled before the lobby was even created
-            break;
-          case BattleRecord::Event::Type::BATTLE_COMMAND:
-            send_command(l, (ev.data.size() >= 0x400) ? 0x6C : 0xC9, 0x00, ev.data);
-            break;
-          case BattleRecord::Event::Type::GAME_COMMAND:
-            send_command(l, (ev.data.size() >= 0x400) ? 0x6C : 0x60, 0x00, ev.data);
-            break;
-          case BattleRecord::Event::Type::EP3_GAME_COMMAND:
-            send_command(l, 0xC9, 0x00, ev.data);
-            break;
-          case BattleRecord::Event::Type::CHAT_MESSAGE:
-            send_prepared_chat_message(l, ev.guild_card_number, ev.data);
-            break;
-          case BattleRecord::Event::Type::SERVER_DATA_COMMAND:
-            // These are not replayed, since the battle record also contains
-            // the results of these commands.
-            break;
-        }
+        this->play_event(l, *this->event_it);
         this->event_it++;
 
       } else {
@@ -474,4 +709,267 @@ void BattleRecordPlayer::schedule_events() {
   }
 }
 
+void BattleRecordPlayer::play_event(shared_ptr<Lobby> l, const BattleRecord::Event& ev) {
+  switch (ev.type) {
+    case BattleRecord::Event::Type::PLAYER_JOIN:
+      // Technically we can support this, but it should never happen
+      throw runtime_error("player join event during battle replay");
+    case BattleRecord::Event::Type::PLAYER_LEAVE:
+      send_player_leave_notification(l, ev.leaving_client_id);
+      break;
+    case BattleRecord::Event::Type::SET_INITIAL_PLAYERS:
+      // This should have been handled before the lobby was even created
+      break;
+    case BattleRecord::Event::Type::BATTLE_COMMAND:
+      send_command(l, (ev.data.size() >= 0x400) ? 0x6C : 0xC9, 0x00, ev.data);
+      break;
+    case BattleRecord::Event::Type::GAME_COMMAND:
+      send_command(l, (ev.data.size() >= 0x400) ? 0x6C : 0x60, 0x00, ev.data);
+      break;
+    case BattleRecord::Event::Type::EP3_GAME_COMMAND:
+      send_command(l, 0xC9, 0x00, ev.data);
+      break;
+    case BattleRecord::Event::Type::CHAT_MESSAGE:
+      send_prepared_chat_message(l, ev.guild_card_number, ev.data);
+      break;
+    case BattleRecord::Event::Type::SERVER_DATA_COMMAND:
+      // These are not replayed, since the battle record also contains
+      // the results of these commands.
+      break;
+    case BattleRecord::Event::Type::KEYFRAME:
+      // These are only used when seeking; during normal playback, the battle
+      // commands before the keyframe already put the clients in this state.
+      break;
+  }
+}
+
+static vector<string> split_battle_state_commands(const string& data) {
+  vector<string> ret;
+  phosg::StringReader r(data);
+  while (!r.eof()) {
+    const auto& header = r.get<G_CardBattleCommandHeader>(false);
+    size_t size = header.size * 4;
+    if (size == 0) {
+      throw runtime_error("invalid command size in battle record keyframe");
+    }
+    ret.emplace_back(r.read(size));
+  }
+  return ret;
+}
+
+void BattleRecordPlayer::seek(uint64_t relative_usecs) {
+  auto l = this->lobby.lock();
+  if (!l) {
+    throw runtime_error("battle record player has no lobby");
+  }
+  if (this->play_start_timestamp == 0) {
+    throw runtime_error("battle record playback has not started");
+  }
+
+  uint64_t target_ts = this->record->battle_start_timestamp + relative_usecs;
+  if (this->record->battle_end_timestamp && (target_ts > this->record->battle_end_timestamp)) {
+    target_ts = this->record->battle_end_timestamp;
+  }
+
+  // If the target is after the current position and there's no keyframe in
+  // between, we can just fast-forward; otherwise, start from the keyframe
+  size_t current_index = this->event_it - this->record->events.begin();
+  bool is_forward = (current_index == 0) || (target_ts >= this->record->events[current_index - 1].timestamp);
+  size_t keyframe_index = this->record->find_keyframe_event_index(target_ts);
+  bool has_keyframe = (keyframe_index < this->record->events.size());
+  size_t index;
+  if (has_keyframe && (!is_forward || (keyframe_index >= current_index))) {
+    for (const string& cmd : split_battle_state_commands(this->record->events[keyframe_index].data)) {
+      send_command(l, 0xC9, 0x00, cmd);
+    }
+    index = keyframe_index + 1;
+  } else if (is_forward) {
+    index = current_index;
+  } else {
+    throw runtime_error("battle record does not contain a keyframe before the target time");
+  }
+
+  // Play all events between the keyframe and the target time immediately,
+  // except chat messages (which would be confusing out of context)
+  for (; (index < this->record->events.size()) && (this->record->events[index].timestamp <= target_ts); index++) {
+    const auto& ev = this->record->events[index];
+    if (ev.type != BattleRecord::Event::Type::CHAT_MESSAGE) {
+      this->play_event(l, ev);
+    }
+  }
+  this->event_it = this->record->events.begin() + index;
+
+  // Adjust the start time so that playback continues from the target time
+  this->play_start_timestamp = phosg::now() - (target_ts - this->record->battle_start_timestamp);
+  event_del(this->next_command_ev.get());
+  this->schedule_events();
+}
+
+BattleRecordReader::BattleRecordReader(const string& filename)
+    : f(phosg::fopen_shared(filename, "rb")),
+      has_trailer(false) {
+  auto header_data = this->read(0, sizeof(BattleRecord::FileHeader));
+  this->header = *reinterpret_cast<const BattleRecord::FileHeader*>(header_data.data());
+  if (this->header.signature != BattleRecord::SIGNATURE_V3) {
+    throw runtime_error("battle record is not in the indexed format");
+  }
+
+  fseeko(this->f.get(), 0, SEEK_END);
+  uint64_t file_size = ftello(this->f.get());
+
+  if (file_size >= sizeof(BattleRecord::FileHeader) + sizeof(BattleRecord::ChunkHeader) + sizeof(BattleRecord::FileTrailer)) {
+    auto trailer_data = this->read(file_size - sizeof(BattleRecord::FileTrailer), sizeof(BattleRecord::FileTrailer));
+    const auto& trailer = *reinterpret_cast<const BattleRecord::FileTrailer*>(trailer_data.data());
+    if (trailer.signature == BattleRecord::TRAILER_SIGNATURE_V3) {
+      auto index_header_data = this->read(trailer.index_offset, sizeof(BattleRecord::ChunkHeader));
+      const auto& index_header = *reinterpret_cast<const BattleRecord::ChunkHeader*>(index_header_data.data());
+      if (index_header.type != static_cast<uint32_t>(BattleRecord::ChunkType::INDEX)) {
+        throw runtime_error("battle record trailer does not point to index");
+      }
+      auto index_data = this->read(trailer.index_offset + sizeof(BattleRecord::ChunkHeader), index_header.size);
+      phosg::StringReader r(index_data);
+      while (!r.eof()) {
+        this->index.emplace_back(r.get<BattleRecord::IndexEntry>());
+      }
+      this->has_trailer = true;
+      this->index_keyframe_chunks();
+      return;
+    }
+  }
+
+  // There's no index, so the file was not completely written. Build the index
+  // by scanning the chunk headers; this only reads the first event of each
+  // chunk, not the entire file.
+  uint64_t offset = sizeof(BattleRecord::FileHeader);
+  size_t random_offset = 0;
+  size_t event_index = 0;
+  while (offset + sizeof(BattleRecord::ChunkHeader) <= file_size) {
+    auto chunk_header_data = this->read(offset, sizeof(BattleRecord::ChunkHeader));
+    const auto& chunk_header = *reinterpret_cast<const BattleRecord::ChunkHeader*>(chunk_header_data.data());
+    if (offset + sizeof(BattleRecord::ChunkHeader) + chunk_header.size > file_size) {
+      break;
+    }
+
+    BattleRecord::IndexEntry entry;
+    entry.offset = offset;
+    entry.type = chunk_header.type;
+    entry.flags = 0;
+    entry.first_timestamp = 0;
+    if (chunk_header.type == static_cast<uint32_t>(BattleRecord::ChunkType::RANDOM_DATA)) {
+      entry.first_index = random_offset;
+      entry.count = chunk_header.size;
+      random_offset += chunk_header.size;
+      this->index.emplace_back(entry);
+
+    } else if (chunk_header.type == static_cast<uint32_t>(BattleRecord::ChunkType::EVENTS)) {
+      this->index.emplace_back(entry);
+      auto events = this->read_chunk_events(this->index.size() - 1);
+      auto& added_entry = this->index.back();
+      added_entry.first_index = event_index;
+      added_entry.count = events.size();
+      if (!events.empty()) {
+        added_entry.first_timestamp = events[0].timestamp;
+        if (events[0].type == BattleRecord::Event::Type::KEYFRAME) {
+          added_entry.flags = BattleRecord::IndexEntry::Flag::STARTS_WITH_KEYFRAME;
+        }
+      }
+      event_index += events.size();
+    }
+
+    offset += sizeof(BattleRecord::ChunkHeader) + chunk_header.size;
+  }
+  this->index_keyframe_chunks();
+}
+
+void BattleRecordReader::index_keyframe_chunks() {
+  this->keyframe_chunks.clear();
+  for (size_t z = 0; z < this->index.size(); z++) {
+    const auto& entry = this->index[z];
+    if ((entry.type == static_cast<uint32_t>(BattleRecord::ChunkType::EVENTS)) &&
+        (entry.flags & BattleRecord::IndexEntry::Flag::STARTS_WITH_KEYFRAME)) {
+      this->keyframe_chunks.emplace_back(z);
+    }
+  }
+}
+
+string BattleRecordReader::read(uint64_t offset, size_t size) const {
+  if (fseeko(this->f.get(), offset, SEEK_SET)) {
+    throw runtime_error("cannot seek in battle record file");
+  }
+  return phosg::freadx(this->f.get(), size);
+}
+
+size_t BattleRecordReader::num_events() const {
+  size_t ret = 0;
+  for (const auto& entry : this->index) {
+    if (entry.type == static_cast<uint32_t>(BattleRecord::ChunkType::EVENTS)) {
+      ret += entry.count;
+    }
+  }
+  return ret;
+}
+
+vector<BattleRecord::Event> BattleRecordReader::read_chunk_events(size_t index_entry_num) const {
+  const auto& entry = this->index.at(index_entry_num);
+  if (entry.type != static_cast<uint32_t>(BattleRecord::ChunkType::EVENTS)) {
+    throw logic_error("index entry does not refer to an events chunk");
+  }
+  auto chunk_header_data = this->read(entry.offset, sizeof(BattleRecord::ChunkHeader));
+  const auto& chunk_header = *reinterpret_cast<const BattleRecord::ChunkHeader*>(chunk_header_data.data());
+  auto data = this->read(entry.offset + sizeof(BattleRecord::ChunkHeader), chunk_header.size);
+
+  vector<BattleRecord::Event> ret;
+  phosg::StringReader r(data);
+  while (!r.eof()) {
+    ret.emplace_back(r);
+  }
+  return ret;
+}
+
+size_t BattleRecordReader::find_keyframe_chunk(uint64_t timestamp) const {
+  // Same as BattleRecord::find_keyframe_event_index: find the first keyframe
+  // after the timestamp, and return the one before it (if any)
+  auto it = upper_bound(
+      this->keyframe_chunks.begin(), this->keyframe_chunks.end(), timestamp,
+      [&](uint64_t ts, size_t z) -> bool {
+        return ts < this->index[z].first_timestamp;
+      });
+  return (it == this->keyframe_chunks.begin()) ? this->index.size() : *(it - 1);
+}
+
+vector<BattleRecord::Event> BattleRecordReader::read_events_for_seek(uint64_t timestamp) const {
+  size_t z = this->find_keyframe_chunk(timestamp);
+  if (z >= this->index.size()) {
+    z = 0;
+  }
+
+  vector<BattleRecord::Event> ret;
+  for (; z < this->index.size(); z++) {
+    const auto& entry = this->index[z];
+    if (entry.type != static_cast<uint32_t>(BattleRecord::ChunkType::EVENTS)) {
+      continue;
+    }
+    if (entry.first_timestamp > timestamp) {
+      break;
+    }
+    for (auto& ev : this->read_chunk_events(z)) {
+      if (ev.timestamp > timestamp) {
+        return ret;
+      }
+      ret.emplace_back(std::move(ev));
+    }
+  }
+  return ret;
+}
+
+string BattleRecordReader::read_random_stream() const {
+  string ret;
+  for (const auto& entry : this->index) {
+    if (entry.type == static_cast<uint32_t>(BattleRecord::ChunkType::RANDOM_DATA)) {
+      ret += this->read(entry.offset + sizeof(BattleRecord::ChunkHeader), entry.count);
+    }
+  }
+  return ret;
+}
+
 } // namespace Episode3
@@ -8,6 +8,7 @@
 #include <phosg/Strings.hh>
 #include <string>
 #include <variant>
+#include <vector>
 
 #include "../PlayerSubordinates.hh"
 
@@ -38,6 +39,10 @@ public:
       EP3_GAME_COMMAND = 5,
       CHAT_MESSAGE = 6,
       SERVER_DATA_COMMAND = 7,
+      // data is a sequence of 6xB4 commands that set the entire battle state,
+      // as if a spectator had joined at this point. These events are not sent
+      // during normal playback; they're used for seeking.
+      KEYFRAME = 8,
     };
 
     // Fields used for all events
@@ -58,14 +63,89 @@ public:
     void print(FILE* stream) const;
   };
 
+  // Battle records are saved in a chunked format (see serialize()), which
+  // looks like this:
+  //   FileHeader
+  //   Any number of chunks, each of which is a ChunkHeader followed by data:
+  //     EVENTS: a sequence of serialized events. Each keyframe event begins a
+  //       new chunk, so keyframes are always at the start of their chunk.
+  //     RANDOM_DATA: part of the random stream. The random stream is the
+  //       concatenation of all of these chunks' data, in order.
+  //     INDEX: an IndexEntry for each EVENTS and RANDOM_DATA chunk.
+  //   FileTrailer, which points to the INDEX chunk
+  // Records that are streamed to disk during a battle are written one chunk at
+  // a time. If the battle is not finished (for example, if the server crashes)
+  // there will be no INDEX chunk or trailer, but all complete chunks can still
+  // be read by scanning the file from the beginning.
+  enum class ChunkType : uint32_t {
+    EVENTS = 0x45564E54, // 'EVNT'
+    RANDOM_DATA = 0x52414E44, // 'RAND'
+    INDEX = 0x494E4458, // 'INDX'
+  };
+  struct FileHeader {
+    le_uint64_t signature;
+    le_uint64_t battle_start_timestamp;
+    le_uint64_t battle_end_timestamp; // 0 if the file is incomplete
+    le_uint32_t behavior_flags;
+    le_uint32_t unused = 0;
+  } __packed_ws__(FileHeader, 0x20);
+  struct ChunkHeader {
+    le_uint32_t type; // ChunkType
+    le_uint32_t size; // Not including this header
+  } __packed_ws__(ChunkHeader, 0x08);
+  struct IndexEntry {
+    le_uint64_t offset; // Offset of the ChunkHeader from the start of the file
+    le_uint32_t type; // ChunkType
+    le_uint32_t flags; // IndexEntry::Flag
+    // For EVENTS chunks, these are the first event's timestamp and index, and
+    // the number of events in the chunk. For RANDOM_DATA chunks, these are 0,
+    // the offset in the random stream, and the number of bytes in the chunk.
+    le_uint64_t first_timestamp;
+    le_uint32_t first_index;
+    le_uint32_t count;
+
+    enum Flag : uint32_t {
+      STARTS_WITH_KEYFRAME = 0x00000001,
+    };
+  } __packed_ws__(IndexEntry, 0x20);
+  struct FileTrailer {
+    le_uint64_t index_offset;
+    le_uint64_t signature;
+  } __packed_ws__(FileTrailer, 0x10);
+
   explicit BattleRecord(uint32_t behavior_flags);
   explicit BattleRecord(const std::string& data);
+  ~BattleRecord() = default;
   std::string serialize() const;
 
+  // Writes the record to the given file as the battle progresses. If the
+  // battle has not started yet, the file is created when it starts (since all
+  // events before that are rewritten by set_battle_start_timestamp). The file
+  // is completed when set_battle_end_timestamp is called.
+  void stream_to_file(const std::string& filename);
+
   bool writable() const;
   bool battle_in_progress() const;
 
   const Event* get_first_event() const;
+  inline size_t num_events() const {
+    return this->events.size();
+  }
+  inline const Event& get_event(size_t index) const {
+    return this->events.at(index);
+  }
+  // Returns the index of the last keyframe event at or before the given
+  // timestamp, or num_events() if there is no such keyframe
+  size_t find_keyframe_event_index(uint64_t timestamp) const;
+  inline uint32_t get_behavior_flags() const {
+    return this->behavior_flags;
+  }
+  inline uint64_t get_battle_start_timestamp() const {
+    return this->battle_start_timestamp;
+  }
+  inline uint64_t get_battle_end_timestamp() const {
+    return this->battle_end_timestamp;
+  }
 
   void add_player(
       const PlayerLobbyDataDCGC& lobby_data,
@@ -77,6 +157,7 @@ public:
   void add_command(Event::Type type, std::string&& data);
   void add_chat_message(uint32_t guild_card_number, std::string&& data);
   void add_random_data(const void* data, size_t size);
+  void add_keyframe(std::string&& data);
   // This function collapses all the existing player join/leave events into a
   // single SET_INITIAL_PLAYERS event, and deletes all events before the latest
   // BATTLE_COMMAND command that specifies the battle map. This should provide a
@@ -92,8 +173,29 @@ public:
 private:
   static constexpr uint64_t SIGNATURE_V1 = 0x14C946D56D1DAC50;
   static constexpr uint64_t SIGNATURE_V2 = 0xD01E5EC12853C377;
+  static constexpr uint64_t SIGNATURE_V3 = 0x8C0B6D1E3A5F9247;
+  static constexpr uint64_t TRAILER_SIGNATURE_V3 = 0x3A5F92478C0B6D1E;
+  static constexpr size_t MAX_EVENTS_PER_CHUNK = 0x100;
 
   static bool is_map_definition_event(const Event& ev);
+  FileHeader file_header() const;
+  // Appends a chunk to out, and an entry for it to index. base_offset is the
+  // offset in the file where out begins.
+  static void write_chunk(
+      std::string& out,
+      uint64_t base_offset,
+      ChunkType type,
+      const std::string& data,
+      IndexEntry entry,
+      std::vector<IndexEntry>& index);
+  std::string serialize_events_chunks(
+      uint64_t base_offset, size_t start_index, size_t end_index, std::vector<IndexEntry>& index) const;
+  void parse_chunks(phosg::StringReader& r);
+  void start_stream();
+  void abort_stream(const std::exception& e);
+  void flush_stream();
+  void finish_stream();
+  void write_stream(const std::string& data);
 
   bool is_writable;
 
@@ -101,9 +203,63 @@ private:
   uint64_t battle_start_timestamp;
   uint64_t battle_end_timestamp;
   std::deque<Event> events;
+  std::vector<size_t> keyframe_event_indexes;
   std::string random_stream;
 
+  // Only used when streaming to a file
+  std::string stream_filename;
+  std::shared_ptr<FILE> stream_file;
+  uint64_t stream_offset = 0;
+  size_t stream_next_event_index = 0;
+  size_t stream_random_offset = 0;
+  std::vector<IndexEntry> stream_index;
+
   friend class BattleRecordPlayer;
+  friend class BattleRecordReader;
+};
+
+// BattleRecordReader reads a battle record file without loading all of it into
+// memory. Only the header and index are read up front; events are read one
+// chunk at a time.
+class BattleRecordReader {
+public:
+  explicit BattleRecordReader(const std::string& filename);
+  ~BattleRecordReader() = default;
+
+  inline const BattleRecord::FileHeader& get_header() const {
+    return this->header;
+  }
+  inline const std::vector<BattleRecord::IndexEntry>& get_index() const {
+    return this->index;
+  }
+  // Returns true if the file has an index (that is, it was completely written)
+  inline bool is_complete() const {
+    return this->has_trailer;
+  }
+  size_t num_events() const;
+
+  std::vector<BattleRecord::Event> read_chunk_events(size_t index_entry_num) const;
+  // Returns the index entry number of the EVENTS chunk containing the last
+  // keyframe at or before the given timestamp, or index.size() if there is no
+  // such keyframe
+  size_t find_keyframe_chunk(uint64_t timestamp) const;
+  // Returns all events from the last keyframe at or before the given timestamp
+  // (or from the beginning if there is no such keyframe) through the given
+  // timestamp
+  std::vector<BattleRecord::Event> read_events_for_seek(uint64_t timestamp) const;
+  std::string read_random_stream() const;
+
+private:
+  std::string read(uint64_t offset, size_t size) const;
+  void index_keyframe_chunks();
+
+  std::shared_ptr<FILE> f;
+  BattleRecord::FileHeader header;
+  std::vector<BattleRecord::IndexEntry> index;
+  // Index entry numbers of the EVENTS chunks that start with a keyframe, in
+  // timestamp order
+  std::vector<size_t> keyframe_chunks;
+  bool has_trailer;
 };
 
 class BattleRecordPlayer {
@@ -115,10 +271,16 @@ public:
 
   void set_lobby(std::shared_ptr<Lobby> l);
   void start();
+  // Moves playback to the given time, relative to the start of the battle. The
+  // nearest keyframe before that time is sent to the lobby, followed by all
+  // battle commands from then until the target time, so playback can resume
+  // from there without replaying the entire battle.
+  void seek(uint64_t relative_usecs);
 
 private:
   static void dispatch_schedule_events(evutil_socket_t, short, void* ctx);
   void schedule_events();
+  void play_event(std::shared_ptr<Lobby> l, const BattleRecord::Event& ev);
 
   std::shared_ptr<const BattleRecord> record;
   std::deque<BattleRecord::Event>::const_iterator event_it;
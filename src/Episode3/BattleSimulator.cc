@@ -0,0 +1,632 @@
+#include "BattleSimulator.hh"
+
+#include <stddef.h>
+
+#include <limits>
+
+#include "../PSOEncryption.hh"
+
+using namespace std;
+
+namespace Episode3 {
+
+BattleSimulator::BattleSimulator(
+    shared_ptr<const CardIndex> card_index,
+    shared_ptr<const MapIndex> map_index,
+    shared_ptr<const MapDefinition> map,
+    const array<shared_ptr<const COMDeckDefinition>, 2>& decks,
+    uint32_t random_seed,
+    uint32_t behavior_flags)
+    : map(map),
+      decks(decks) {
+  Server::Options options = {
+      .card_index = card_index,
+      .map_index = map_index,
+      .behavior_flags = (behavior_flags |
+          BehaviorFlag::IGNORE_CARD_COUNTS |
+          BehaviorFlag::DISABLE_TIME_LIMITS |
+          BehaviorFlag::DISABLE_MASKING),
+      .opt_rand_stream = nullptr,
+      .opt_rand_crypt = make_shared<PSOV2Encryption>(random_seed),
+      .tournament = nullptr,
+      .trap_card_ids = {},
+  };
+  this->server = make_shared<Server>(nullptr, std::move(options));
+  this->server->init();
+}
+
+bool BattleSimulator::map_supports_1v1(const MapDefinition& map) {
+  for (size_t team_id = 0; team_id < 2; team_id++) {
+    uint8_t start_tile = map.start_tile_definitions[team_id][0] & 0x3F;
+    if (start_tile < 2) {
+      return false;
+    }
+    bool start_tile_found = false;
+    for (size_t y = 0; (y < map.height) && !start_tile_found; y++) {
+      for (size_t x = 0; (x < map.width) && !start_tile_found; x++) {
+        start_tile_found = (map.map_tiles[y][x] == start_tile);
+      }
+    }
+    if (!start_tile_found) {
+      return false;
+    }
+  }
+  return true;
+}
+
+BattleSimulator::Result BattleSimulator::run(size_t max_steps) {
+  this->send_setup_commands();
+
+  size_t num_steps = 0;
+  while (this->server->setup_phase != SetupPhase::BATTLE_ENDED) {
+    if (num_steps++ >= max_steps || !this->step()) {
+      this->result.stalled = true;
+      break;
+    }
+  }
+
+  this->result.num_rounds = this->server->round_num;
+  if (this->server->setup_phase == SetupPhase::BATTLE_ENDED) {
+    this->result.winner_team_id = this->server->get_winner_team_id();
+  }
+  return this->result;
+}
+
+void BattleSimulator::send_setup_commands() {
+  G_SetMapState_Ep3_CAx13 map_cmd;
+  auto& mr = map_cmd.map_and_rules_state;
+  mr.map.width = this->map->width;
+  mr.map.height = this->map->height;
+  mr.map.tiles = this->map->map_tiles;
+  mr.map.start_tile_definitions = this->map->start_tile_definitions;
+  mr.num_players = 2;
+  mr.environment_number = this->map->environment_number;
+  mr.num_players_per_team = 1;
+  mr.num_team0_players = 1;
+  mr.map_number = this->map->map_number.load();
+  // Non-FF fields in the map's rules are fixed for the map; the rest are up to
+  // the players, so we use the defaults for those. All fields before the
+  // extended rules are single bytes, so we can merge them bytewise.
+  mr.rules.set_defaults();
+  uint8_t* rules_bytes = reinterpret_cast<uint8_t*>(&mr.rules);
+  const uint8_t* map_rules_bytes = reinterpret_cast<const uint8_t*>(&this->map->default_rules);
+  for (size_t z = 0; z < offsetof(Rules, def_dice_value_range); z++) {
+    if (map_rules_bytes[z] != 0xFF) {
+      rules_bytes[z] = map_rules_bytes[z];
+    }
+  }
+  map_cmd.overlay_state = this->map->overlay_state;
+  this->send(map_cmd);
+
+  for (uint8_t client_id = 0; client_id < 2; client_id++) {
+    const auto& deck = this->decks[client_id];
+
+    G_SetPlayerDeck_Ep3_CAx14 deck_cmd;
+    deck_cmd.client_id = client_id;
+    deck_cmd.is_cpu_player = 1;
+    deck_cmd.entry.name.encode(deck->deck_name);
+    deck_cmd.entry.team_id = client_id;
+    deck_cmd.entry.card_ids = deck->card_ids;
+    this->send(deck_cmd);
+
+    G_SetPlayerName_Ep3_CAx1B name_cmd;
+    name_cmd.entry.name.encode(deck->player_name);
+    name_cmd.entry.client_id = client_id;
+    name_cmd.entry.present = 1;
+    name_cmd.entry.is_cpu_player = 1;
+    this->send(name_cmd);
+  }
+
+  this->send(G_StartBattle_Ep3_CAx1D());
+  if (this->server->setup_phase == SetupPhase::REGISTRATION) {
+    throw runtime_error("battle did not start");
+  }
+}
+
+BattleSimulator::PhaseKey BattleSimulator::current_phase_key() const {
+  const auto& s = this->server;
+  PhaseKey ret;
+  ret.round_num = s->round_num;
+  ret.setup_phase = s->setup_phase;
+  ret.battle_phase = s->battle_phase;
+  ret.action_subphase = s->action_subphase;
+  ret.team_id = s->current_team_turn1;
+  if ((s->battle_phase == BattlePhase::ACTION) && (s->action_subphase == ActionSubphase::DEFENSE)) {
+    ret.attack_index = s->unknown_a14;
+  }
+  return ret;
+}
+
+bool BattleSimulator::client_is_active(uint8_t client_id) const {
+  auto ps = this->server->player_states[client_id];
+  if (!ps) {
+    return false;
+  }
+  auto sc_card = ps->get_sc_card();
+  return (sc_card && !sc_card->check_card_flag(2));
+}
+
+bool BattleSimulator::step() {
+  // Returns false if no client has anything to do, which means the battle
+  // cannot progress any further
+  auto s = this->server;
+  PhaseKey key = this->current_phase_key();
+
+  for (uint8_t client_id = 0; client_id < 4; client_id++) {
+    auto ps = s->player_states[client_id];
+    if (!ps || (this->last_action_keys[client_id] == key)) {
+      continue;
+    }
+
+    if (s->setup_phase == SetupPhase::STARTER_ROLLS) {
+      this->last_action_keys[client_id] = key;
+      G_AdvanceFromStartingRollsPhase_Ep3_CAx37 cmd;
+      cmd.client_id = client_id;
+      this->send(cmd);
+      return true;
+    }
+    if (s->setup_phase == SetupPhase::HAND_REDRAW_OPTION) {
+      this->last_action_keys[client_id] = key;
+      G_EndInitialRedrawPhase_Ep3_CAx0C cmd;
+      cmd.client_id = client_id;
+      this->send(cmd);
+      return true;
+    }
+    if (s->setup_phase != SetupPhase::MAIN_BATTLE) {
+      return false;
+    }
+    if (!this->client_is_active(client_id)) {
+      continue;
+    }
+
+    uint8_t team_id = ps->get_team_id();
+    if (s->battle_phase == BattlePhase::ACTION) {
+      if (s->action_subphase == ActionSubphase::ATTACK) {
+        if (team_id != s->current_team_turn2) {
+          continue;
+        }
+        this->last_action_keys[client_id] = key;
+        this->enqueue_attacks(client_id);
+        G_EndAttackList_Ep3_CAx12 cmd;
+        cmd.client_id = client_id;
+        this->send(cmd);
+        return true;
+
+      } else {
+        if ((team_id == s->current_team_turn1) || (s->unknown_a14 >= s->num_pending_attacks_with_cards)) {
+          continue;
+        }
+        this->last_action_keys[client_id] = key;
+        this->enqueue_defense(client_id);
+        G_EndDefenseList_Ep3_CAx28 cmd;
+        cmd.attack_number = s->unknown_a14;
+        cmd.client_id = client_id;
+        this->send(cmd);
+        return true;
+      }
+
+    } else {
+      if (team_id != s->current_team_turn1) {
+        continue;
+      }
+      this->last_action_keys[client_id] = key;
+      if (s->battle_phase == BattlePhase::SET) {
+        for (size_t z = 0; (z < 8) && this->set_one_card(client_id); z++) {
+        }
+      } else if (s->battle_phase == BattlePhase::MOVE) {
+        this->move_cards(client_id);
+      }
+      G_EndNonAttackPhase_Ep3_CAx0D cmd;
+      cmd.client_id = client_id;
+      cmd.battle_phase = static_cast<uint16_t>(key.battle_phase);
+      cmd.param1 = 0;
+      this->send(cmd);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void BattleSimulator::record_card_use(uint8_t client_id, uint16_t card_ref) {
+  auto ps = this->server->player_states[client_id];
+  uint16_t card_id = this->server->card_id_for_card_ref(card_ref);
+  if (ps && (card_id != 0xFFFF)) {
+    this->result.card_use_counts[ps->get_team_id() & 1][card_id]++;
+  }
+}
+
+vector<shared_ptr<const Card>> BattleSimulator::enemy_cards_for_client(uint8_t client_id) const {
+  const auto& s = this->server;
+  uint8_t team_id = s->player_states[client_id]->get_team_id();
+
+  vector<shared_ptr<const Card>> ret;
+  for (size_t other_client_id = 0; other_client_id < 4; other_client_id++) {
+    shared_ptr<const PlayerState> other_ps = s->player_states[other_client_id];
+    if (!other_ps || (other_ps->get_team_id() == team_id)) {
+      continue;
+    }
+    auto sc_card = other_ps->get_sc_card();
+    if (sc_card && !sc_card->check_card_flag(2)) {
+      ret.emplace_back(sc_card);
+    }
+    for (size_t set_index = 0; set_index < 8; set_index++) {
+      auto card = other_ps->get_set_card(set_index);
+      if (card && !card->check_card_flag(2)) {
+        auto ce = card->get_definition();
+        if (ce && (ce->def.type == CardType::CREATURE)) {
+          ret.emplace_back(card);
+        }
+      }
+    }
+  }
+  return ret;
+}
+
+size_t BattleSimulator::distance_to_nearest_enemy(uint8_t client_id, uint8_t x, uint8_t y, const Card** out_nearest) const {
+  size_t ret = numeric_limits<size_t>::max();
+  for (const auto& card : this->enemy_cards_for_client(client_id)) {
+    size_t distance = abs(static_cast<int16_t>(card->loc.x) - x) + abs(static_cast<int16_t>(card->loc.y) - y);
+    if (distance < ret) {
+      ret = distance;
+      if (out_nearest) {
+        *out_nearest = card.get();
+      }
+    }
+  }
+  return ret;
+}
+
+vector<uint16_t> BattleSimulator::enemy_card_refs_in_range(
+    uint8_t client_id, uint16_t range_card_id, const Location& loc) const {
+  const auto& s = this->server;
+  auto ps = s->player_states[client_id];
+
+  parray<uint8_t, 9 * 9> range;
+  compute_effective_range(range, s->options.card_index, range_card_id, loc, s->map_and_rules);
+  auto card_refs = ps->get_all_cards_within_range(range, loc, ps->get_team_id() ^ 1);
+
+  // Only SCs and creatures that haven't been destroyed can be attacked
+  vector<uint16_t> ret;
+  for (uint16_t card_ref : card_refs) {
+    auto card = s->card_for_set_card_ref(card_ref);
+    if (card && !card->check_card_flag(2) && card->card_type_is_sc_or_creature()) {
+      ret.emplace_back(card_ref);
+    }
+  }
+  return ret;
+}
+
+Direction BattleSimulator::choose_facing_direction(uint8_t client_id, shared_ptr<const Card> card, uint8_t x, uint8_t y) const {
+  const auto& s = this->server;
+  auto ps = s->player_states[client_id];
+
+  // The card's own range is used for creatures and Arkz SCs; for Hunters SCs,
+  // the equipped items' ranges matter too
+  vector<uint16_t> range_card_ids;
+  range_card_ids.emplace_back(card->get_card_id());
+  if (card == ps->get_sc_card()) {
+    for (size_t set_index = 0; set_index < 8; set_index++) {
+      auto set_card = ps->get_set_card(set_index);
+      if (set_card && !set_card->check_card_flag(2)) {
+        auto ce = set_card->get_definition();
+        if (ce && (ce->def.type == CardType::ITEM)) {
+          range_card_ids.emplace_back(set_card->get_card_id());
+        }
+      }
+    }
+  }
+
+  // Face whichever direction puts the most enemies within range. If there are
+  // no enemies in range in any direction, keep the current direction.
+  Direction ret = card->loc.direction;
+  size_t max_count = 0;
+  static const Direction directions[4] = {Direction::RIGHT, Direction::UP, Direction::LEFT, Direction::DOWN};
+  for (Direction dir : directions) {
+    Location loc(x, y, dir);
+    size_t count = 0;
+    for (uint16_t range_card_id : range_card_ids) {
+      count += this->enemy_card_refs_in_range(client_id, range_card_id, loc).size();
+    }
+    if (count > max_count) {
+      max_count = count;
+      ret = dir;
+    }
+  }
+  return ret;
+}
+
+bool BattleSimulator::set_one_card(uint8_t client_id) {
+  auto s = this->server;
+  auto ps = s->player_states[client_id];
+  auto sc_card = ps->get_sc_card();
+
+  size_t free_set_index = 0;
+  for (size_t set_index = 7; set_index < 15; set_index++) {
+    if (ps->card_refs[set_index + 1] == 0xFFFF) {
+      free_set_index = set_index;
+      break;
+    }
+  }
+
+  // Field characters (items and creatures) are set before assists, since
+  // assists are more likely to depend on the field state
+  for (size_t pass = 0; pass < 2; pass++) {
+    for (size_t hand_index = 0; hand_index < 6; hand_index++) {
+      uint16_t card_ref = ps->card_refs[hand_index];
+      if (card_ref == 0xFFFF) {
+        continue;
+      }
+      auto ce = s->definition_for_card_ref(card_ref);
+      if (!ce) {
+        continue;
+      }
+
+      G_SetCardFromHand_Ep3_CAx0F cmd;
+      cmd.client_id = client_id;
+      cmd.card_ref = card_ref;
+      cmd.assist_target_player = 0xFF;
+      if ((pass == 0) && (ce->def.type == CardType::ITEM)) {
+        if (!free_set_index) {
+          continue;
+        }
+        cmd.set_index = free_set_index;
+        cmd.loc = sc_card->loc;
+        if (ps->error_code_for_client_setting_card(card_ref, cmd.set_index, &cmd.loc, 0xFF)) {
+          continue;
+        }
+
+      } else if ((pass == 0) && (ce->def.type == CardType::CREATURE)) {
+        if (!free_set_index) {
+          continue;
+        }
+        cmd.set_index = free_set_index;
+        // Summon the creature as close to the enemy as possible
+        size_t min_distance = numeric_limits<size_t>::max();
+        for (uint8_t y = 0; y < s->map_and_rules->map.height; y++) {
+          for (uint8_t x = 0; x < s->map_and_rules->map.width; x++) {
+            size_t distance = this->distance_to_nearest_enemy(client_id, x, y, nullptr);
+            if (distance >= min_distance) {
+              continue;
+            }
+            Location loc(x, y, sc_card->loc.direction);
+            if (!ps->error_code_for_client_setting_card(card_ref, cmd.set_index, &loc, 0xFF)) {
+              cmd.loc = loc;
+              min_distance = distance;
+            }
+          }
+        }
+        if (min_distance == numeric_limits<size_t>::max()) {
+          continue;
+        }
+
+      } else if ((pass == 1) && (ce->def.type == CardType::ASSIST)) {
+        cmd.set_index = 15;
+        cmd.assist_target_player = client_id;
+        cmd.loc = sc_card->loc;
+        if (ps->error_code_for_client_setting_card(card_ref, cmd.set_index, &cmd.loc, client_id)) {
+          continue;
+        }
+
+      } else {
+        continue;
+      }
+
+      this->send(cmd);
+      if (ps->hand_index_for_card_ref(card_ref) < 0) {
+        this->record_card_use(client_id, card_ref);
+        return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+void BattleSimulator::move_cards(uint8_t client_id) {
+  auto s = this->server;
+  auto ps = s->player_states[client_id];
+
+  vector<pair<size_t, shared_ptr<Card>>> movable_cards;
+  movable_cards.emplace_back(0, ps->get_sc_card());
+  for (size_t set_index = 0; set_index < 8; set_index++) {
+    auto card = ps->get_set_card(set_index);
+    if (card) {
+      auto ce = card->get_definition();
+      if (ce && (ce->def.type == CardType::CREATURE)) {
+        movable_cards.emplace_back(set_index + 7, card);
+      }
+    }
+  }
+
+  for (const auto& [card_index, card] : movable_cards) {
+    if (!card || card->check_card_flag(2) ||
+        !s->ruler_server->card_ref_can_move(client_id, card->get_card_ref(), true)) {
+      continue;
+    }
+
+    // Move to the reachable tile that's closest to any enemy, but only if it's
+    // closer than the current location
+    size_t max_move_distance = s->ruler_server->max_move_distance_for_card_ref(card->get_card_ref());
+    size_t min_distance = this->distance_to_nearest_enemy(client_id, card->loc.x, card->loc.y, nullptr);
+    Location dest_loc;
+    bool dest_found = false;
+    for (uint8_t y = 0; y < s->map_and_rules->map.height; y++) {
+      for (uint8_t x = 0; x < s->map_and_rules->map.width; x++) {
+        size_t move_distance = abs(static_cast<int16_t>(x) - card->loc.x) + abs(static_cast<int16_t>(y) - card->loc.y);
+        if ((move_distance == 0) || (move_distance > max_move_distance)) {
+          continue;
+        }
+        size_t distance = this->distance_to_nearest_enemy(client_id, x, y, nullptr);
+        if (distance >= min_distance) {
+          continue;
+        }
+        Location loc(x, y, card->loc.direction);
+        if (!card->error_code_for_move_to_location(loc)) {
+          dest_loc = loc;
+          min_distance = distance;
+          dest_found = true;
+        }
+      }
+    }
+
+    if (dest_found) {
+      dest_loc.direction = this->choose_facing_direction(client_id, card, dest_loc.x, dest_loc.y);
+      G_MoveFieldCharacter_Ep3_CAx10 cmd;
+      cmd.client_id = client_id;
+      cmd.set_index = card_index;
+      cmd.loc = dest_loc;
+      this->send(cmd);
+    }
+  }
+}
+
+bool BattleSimulator::compute_attack_targets(ActionState& pa, const Location& attacker_loc) const {
+  const auto& s = this->server;
+
+  uint16_t action_card_id = (pa.action_card_refs[0] == 0xFFFF)
+      ? 0xFFFF
+      : s->card_id_for_card_ref(pa.action_card_refs[0]);
+  TargetMode target_mode = TargetMode::NONE;
+  uint16_t range_card_id = s->ruler_server->get_card_id_with_effective_range(
+      pa.attacker_card_ref, action_card_id, &target_mode);
+  if ((target_mode != TargetMode::SINGLE_RANGE) && (target_mode != TargetMode::MULTI_RANGE)) {
+    // Attacks that target allies or everyone are too situational for this
+    // policy, so we never use them
+    return false;
+  }
+
+  auto target_card_refs = this->enemy_card_refs_in_range(pa.client_id, range_card_id, attacker_loc);
+  if (target_card_refs.empty()) {
+    return false;
+  }
+
+  pa.target_card_refs.clear(0xFFFF);
+  if (target_mode == TargetMode::SINGLE_RANGE) {
+    // Attack the weakest card in range
+    uint16_t target_card_ref = 0xFFFF;
+    size_t min_hp = numeric_limits<size_t>::max();
+    for (uint16_t card_ref : target_card_refs) {
+      auto card = s->card_for_set_card_ref(card_ref);
+      if (card->get_current_hp() < min_hp) {
+        min_hp = card->get_current_hp();
+        target_card_ref = card_ref;
+      }
+    }
+    pa.target_card_refs[0] = target_card_ref;
+  } else {
+    for (size_t z = 0; (z < target_card_refs.size()) && (z < pa.target_card_refs.size()); z++) {
+      pa.target_card_refs[z] = target_card_refs[z];
+    }
+  }
+  return true;
+}
+
+void BattleSimulator::enqueue_attacks(uint8_t client_id) {
+  auto s = this->server;
+  auto ps = s->player_states[client_id];
+  auto sc_card = ps->get_sc_card();
+
+  vector<shared_ptr<Card>> attacker_cards;
+  attacker_cards.emplace_back(sc_card);
+  for (size_t set_index = 0; set_index < 8; set_index++) {
+    auto card = ps->get_set_card(set_index);
+    if (card) {
+      attacker_cards.emplace_back(card);
+    }
+  }
+
+  for (const auto& card : attacker_cards) {
+    if (card->check_card_flag(2) || !s->ruler_server->card_ref_can_attack(card->get_card_ref())) {
+      continue;
+    }
+    auto ce = card->get_definition();
+    // Items attack from the SC's location
+    const Location& attacker_loc = (ce && (ce->def.type == CardType::ITEM)) ? sc_card->loc : card->loc;
+
+    // Try each attack action card in the hand, then try a plain attack
+    vector<uint16_t> action_card_refs;
+    for (size_t hand_index = 0; hand_index < 6; hand_index++) {
+      uint16_t card_ref = ps->card_refs[hand_index];
+      auto action_ce = (card_ref == 0xFFFF) ? nullptr : s->definition_for_card_ref(card_ref);
+      if (action_ce &&
+          (action_ce->def.type == CardType::ACTION) &&
+          (action_ce->def.card_class() != CardClass::DEFENSE_ACTION)) {
+        action_card_refs.emplace_back(card_ref);
+      }
+    }
+    action_card_refs.emplace_back(0xFFFF);
+
+    for (uint16_t action_card_ref : action_card_refs) {
+      ActionState pa;
+      pa.client_id = client_id;
+      pa.facing_direction = attacker_loc.direction;
+      pa.attacker_card_ref = card->get_card_ref();
+      pa.action_card_refs[0] = action_card_ref;
+      if (!this->compute_attack_targets(pa, attacker_loc) ||
+          !s->ruler_server->is_attack_or_defense_valid(pa)) {
+        continue;
+      }
+
+      size_t prev_num_pending_attacks = s->num_pending_attacks;
+      G_EnqueueAttackOrDefense_Ep3_CAx11 cmd;
+      cmd.client_id = client_id;
+      cmd.entry = pa;
+      this->send(cmd);
+      if (s->num_pending_attacks > prev_num_pending_attacks) {
+        if (action_card_ref != 0xFFFF) {
+          this->record_card_use(client_id, action_card_ref);
+        }
+        break;
+      }
+    }
+  }
+}
+
+void BattleSimulator::enqueue_defense(uint8_t client_id) {
+  auto s = this->server;
+  auto ps = s->player_states[client_id];
+
+  const auto& attack = s->pending_attacks_with_cards[s->unknown_a14];
+  uint16_t target_card_ref = 0xFFFF;
+  for (size_t z = 0; (z < attack.target_card_refs.size()) && (attack.target_card_refs[z] != 0xFFFF); z++) {
+    if (client_id_for_card_ref(attack.target_card_refs[z]) == client_id) {
+      target_card_ref = attack.target_card_refs[z];
+      break;
+    }
+  }
+  if (target_card_ref == 0xFFFF) {
+    return;
+  }
+
+  // Use the first defense card that's valid for this attack
+  for (size_t hand_index = 0; hand_index < 6; hand_index++) {
+    uint16_t card_ref = ps->card_refs[hand_index];
+    auto ce = (card_ref == 0xFFFF) ? nullptr : s->definition_for_card_ref(card_ref);
+    if (!ce || (ce->def.type != CardType::ACTION) || (ce->def.card_class() != CardClass::DEFENSE_ACTION)) {
+      continue;
+    }
+
+    ActionState pa;
+    pa.client_id = client_id;
+    pa.defense_card_ref = card_ref;
+    pa.action_card_refs[0] = card_ref;
+    pa.target_card_refs[0] = target_card_ref;
+    pa.original_attacker_card_ref = attack.attacker_card_ref;
+    if (!s->ruler_server->is_attack_or_defense_valid(pa)) {
+      continue;
+    }
+
+    size_t prev_num_pending_attacks = s->num_pending_attacks;
+    G_EnqueueAttackOrDefense_Ep3_CAx11 cmd;
+    cmd.client_id = client_id;
+    cmd.entry = pa;
+    this->send(cmd);
+    if (s->num_pending_attacks > prev_num_pending_attacks) {
+      this->record_card_use(client_id, card_ref);
+      break;
+    }
+  }
+}
+
+} // namespace Episode3
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <array>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "DataIndexes.hh"
+#include "Server.hh"
+
+namespace Episode3 {
+
+// BattleSimulator runs a complete battle between two COM players on a
+// lobby-less Server, generating all the CAx commands that clients would
+// normally send. The policy used here is NOT the game's COM AI (that runs on
+// the client and isn't implemented in newserv); it's a simple greedy policy
+// that sets any affordable cards, moves toward the nearest enemy, attacks
+// anything in range, and defends when it can. This is useful for comparing
+// decks and maps against each other, and for generating battles to test the
+// rules engine with.
+
+class BattleSimulator {
+public:
+  struct Result {
+    int8_t winner_team_id = -1; // -1 if the battle was not completed
+    uint32_t num_rounds = 0;
+    size_t num_commands_sent = 0;
+    // True if the policy could not make any progress and the battle was
+    // abandoned (this usually indicates a policy or engine bug)
+    bool stalled = false;
+    // Indexed by team ID; maps card ID to the number of times the card was
+    // set or used in an attack or defense
+    std::array<std::unordered_map<uint16_t, size_t>, 2> card_use_counts;
+  };
+
+  BattleSimulator(
+      std::shared_ptr<const CardIndex> card_index,
+      std::shared_ptr<const MapIndex> map_index,
+      std::shared_ptr<const MapDefinition> map,
+      const std::array<std::shared_ptr<const COMDeckDefinition>, 2>& decks,
+      uint32_t random_seed,
+      uint32_t behavior_flags = 0);
+  ~BattleSimulator() = default;
+
+  // Returns true if the map has 1v1 start locations for both teams
+  static bool map_supports_1v1(const MapDefinition& map);
+
+  Result run(size_t max_steps = 100000);
+
+  inline std::shared_ptr<Server> get_server() const {
+    return this->server;
+  }
+
+private:
+  // Each client acts at most once per distinct PhaseKey; this is how the
+  // policy knows when the server is waiting for it
+  struct PhaseKey {
+    uint32_t round_num = 0xFFFFFFFF;
+    SetupPhase setup_phase = SetupPhase::INVALID_FF;
+    BattlePhase battle_phase = BattlePhase::INVALID_FF;
+    ActionSubphase action_subphase = ActionSubphase::INVALID_FF;
+    uint8_t team_id = 0xFF;
+    uint32_t attack_index = 0xFFFFFFFF;
+
+    bool operator==(const PhaseKey& other) const = default;
+    bool operator!=(const PhaseKey& other) const = default;
+  };
+
+  std::shared_ptr<Server> server;
+  std::shared_ptr<const MapDefinition> map;
+  std::array<std::shared_ptr<const COMDeckDefinition>, 2> decks;
+  std::array<PhaseKey, 4> last_action_keys;
+  Result result;
+
+  template <typename CmdT>
+  void send(const CmdT& cmd) {
+    this->server->on_server_data_input(nullptr, std::string(reinterpret_cast<const char*>(&cmd), sizeof(cmd)));
+    this->result.num_commands_sent++;
+  }
+
+  void send_setup_commands();
+  bool step();
+  PhaseKey current_phase_key() const;
+
+  bool client_is_active(uint8_t client_id) const;
+  void record_card_use(uint8_t client_id, uint16_t card_ref);
+
+  std::vector<std::shared_ptr<const Card>> enemy_cards_for_client(uint8_t client_id) const;
+  size_t distance_to_nearest_enemy(uint8_t client_id, uint8_t x, uint8_t y, const Card** out_nearest) const;
+  std::vector<uint16_t> enemy_card_refs_in_range(uint8_t client_id, uint16_t range_card_id, const Location& loc) const;
+  Direction choose_facing_direction(
+      uint8_t client_id, std::shared_ptr<const Card> card, uint8_t x, uint8_t y) const;
+
+  bool set_one_card(uint8_t client_id);
+  void move_cards(uint8_t client_id);
+  void enqueue_attacks(uint8_t client_id);
+  void enqueue_defense(uint8_t client_id);
+  bool compute_attack_targets(ActionState& pa, const Location& attacker_loc) const;
+};
+
+} // namespace Episode3
@@ -98,6 +98,13 @@ shared_ptr<const Server> Card::server() const {
   return s;
 }
 
+shared_ptr<Card> Card::clone(shared_ptr<Server> server) const {
+  auto ret = make_shared<Card>(*this);
+  ret->w_server = server;
+  ret->w_player_state = server->get_player_state(this->client_id);
+  return ret;
+}
+
 shared_ptr<PlayerState> Card::player_state() {
   auto s = this->w_player_state.lock();
   if (!s) {
@@ -123,7 +130,7 @@ ssize_t Card::apply_abnormal_condition(
     int8_t dice_roll_value,
     int8_t random_percent) {
   auto s = this->server();
-  auto log = s->log_stack(phosg::string_printf("apply_abnormal_condition(%02hhX, @%04X, @%04X, %hd, %hhd, %hhd): ", def_effect_index, target_card_ref, sc_card_ref, value, dice_roll_value, random_percent));
+  auto log = s->log_stack_printf("apply_abnormal_condition(%02hhX, @%04X, @%04X, %hd, %hhd, %hhd): ", def_effect_index, target_card_ref, sc_card_ref, value, dice_roll_value, random_percent);
   bool is_nte = s->options.is_nte();
 
   ssize_t existing_cond_index;
@@ -298,7 +305,7 @@ void Card::commit_attack(
     size_t strike_number,
     int16_t* out_effective_damage) {
   auto s = this->server();
-  auto log = s->log_stack(phosg::string_printf("commit_attack(@%04hX #%04hX, @%04hX #%04hX => %hd (str%zu)): ", this->get_card_ref(), this->get_card_id(), attacker_card->get_card_ref(), attacker_card->get_card_id(), damage, strike_number));
+  auto log = s->log_stack_printf("commit_attack(@%04hX #%04hX, @%04hX #%04hX => %hd (str%zu)): ", this->get_card_ref(), this->get_card_id(), attacker_card->get_card_ref(), attacker_card->get_card_id(), damage, strike_number);
   bool is_nte = s->options.is_nte();
 
   int16_t effective_damage = damage;
@@ -507,7 +514,7 @@ void Card::execute_attack(shared_ptr<Card> attacker_card) {
   }
 
   auto s = this->server();
-  auto log = s->log_stack(phosg::string_printf("execute_attack(@%04X #%04X, @%04X #%04X): ", this->get_card_ref(), this->get_card_id(), attacker_card->get_card_ref(), attacker_card->get_card_id()));
+  auto log = s->log_stack_printf("execute_attack(@%04X #%04X, @%04X #%04X): ", this->get_card_ref(), this->get_card_id(), attacker_card->get_card_ref(), attacker_card->get_card_id());
   bool is_nte = s->options.is_nte();
 
   this->card_flags &= 0xFFFFFFF3;
@@ -635,7 +642,7 @@ const Condition* Card::find_condition(ConditionType cond_type) const {
   return const_cast<Card*>(this)->find_condition(cond_type);
 }
 
-shared_ptr<const CardIndex::CardEntry> Card::get_definition() const {
+const CardIndex::CardEntry* Card::get_definition() const {
   return this->def_entry;
 }
 
@@ -906,7 +913,7 @@ void Card::clear_action_chain_and_metadata_and_most_flags() {
 
 void Card::compute_action_chain_results(bool apply_action_conditions, bool ignore_this_card_ap_tp) {
   auto s = this->server();
-  auto log = s->log_stack(phosg::string_printf("compute_action_chain_results(@%04hX #%04hX): ", this->get_card_ref(), this->get_card_id()));
+  auto log = s->log_stack_printf("compute_action_chain_results(@%04hX #%04hX): ", this->get_card_ref(), this->get_card_id());
   bool is_nte = s->options.is_nte();
 
   this->action_chain.compute_attack_medium(s);
@@ -1226,7 +1233,7 @@ void Card::move_phase_before() {
 
 void Card::unknown_80236374(shared_ptr<Card> other_card, const ActionState* as) {
   auto s = this->server();
-  auto log = s->log_stack(phosg::string_printf("unknown_80236374(@%04hX #%04hX, @%04hX #%04hX): ", this->get_card_ref(), this->get_card_id(), other_card->get_card_ref(), other_card->get_card_id()));
+  auto log = s->log_stack_printf("unknown_80236374(@%04hX #%04hX, @%04hX #%04hX): ", this->get_card_ref(), this->get_card_id(), other_card->get_card_ref(), other_card->get_card_id());
 
   if (log.should_log(phosg::LogLevel::DEBUG)) {
     if (as) {
@@ -1377,9 +1384,9 @@ bool Card::is_guard_item() const {
 
 bool Card::unknown_80236554(shared_ptr<Card> other_card, const ActionState* as) {
   auto s = this->server();
-  auto log = s->log_stack(other_card
-          ? phosg::string_printf("unknown_80236554(@%04hX #%04hX, @%04hX #%04hX): ", this->get_card_ref(), this->get_card_id(), other_card->get_card_ref(), other_card->get_card_id())
-          : phosg::string_printf("unknown_80236554(@%04hX #%04hX, null): ", this->get_card_ref(), this->get_card_id()));
+  auto log = other_card
+      ? s->log_stack_printf("unknown_80236554(@%04hX #%04hX, @%04hX #%04hX): ", this->get_card_ref(), this->get_card_id(), other_card->get_card_ref(), other_card->get_card_id())
+      : s->log_stack_printf("unknown_80236554(@%04hX #%04hX, null): ", this->get_card_ref(), this->get_card_id());
   if (log.should_log(phosg::LogLevel::DEBUG)) {
     if (as) {
       string as_str = as->str(s);
@@ -1464,7 +1471,7 @@ void Card::apply_attack_result() {
   auto ps = this->player_state();
   bool is_nte = s->options.is_nte();
 
-  auto log = s->log_stack(phosg::string_printf("apply_attack_result(@%04hX #%04hX): ", this->get_card_ref(), this->get_card_id()));
+  auto log = s->log_stack_printf("apply_attack_result(@%04hX #%04hX): ", this->get_card_ref(), this->get_card_id());
   if (!this->action_chain.can_apply_attack()) {
     return;
   }
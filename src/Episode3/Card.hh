@@ -17,6 +17,11 @@ class Card : public std::enable_shared_from_this<Card> {
 public:
   Card(uint16_t card_id, uint16_t card_ref, uint16_t client_id, std::shared_ptr<Server> server);
   void init();
+  // Returns a copy of this card that belongs to the given server. The copy's
+  // player state is the server's player state for this card's client ID;
+  // w_destroyer_sc_card still refers to the original server's card, so the
+  // caller must update it if needed.
+  std::shared_ptr<Card> clone(std::shared_ptr<Server> server) const;
   std::shared_ptr<Server> server();
   std::shared_ptr<const Server> server() const;
   std::shared_ptr<PlayerState> player_state();
@@ -55,7 +60,7 @@ public:
       uint16_t* out_value = nullptr) const;
   Condition* find_condition(ConditionType cond_type);
   const Condition* find_condition(ConditionType cond_type) const;
-  std::shared_ptr<const CardIndex::CardEntry> get_definition() const;
+  const CardIndex::CardEntry* get_definition() const;
   uint16_t get_card_ref() const;
   uint16_t get_card_id() const;
   uint8_t get_client_id() const;
@@ -95,12 +100,12 @@ private:
 public:
   int16_t max_hp;
   int16_t current_hp;
-  std::shared_ptr<const CardIndex::CardEntry> def_entry;
+  const CardIndex::CardEntry* def_entry;
   uint8_t client_id;
   uint16_t card_id;
   uint16_t card_ref;
   uint16_t sc_card_ref;
-  std::shared_ptr<const CardIndex::CardEntry> sc_def_entry;
+  const CardIndex::CardEntry* sc_def_entry;
   CardType sc_card_type;
   uint8_t team_id;
   uint32_t card_flags;
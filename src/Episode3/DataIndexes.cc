@@ -1,13 +1,18 @@
 #include "DataIndexes.hh"
 
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/stat.h>
 
 #include <array>
 #include <deque>
 #include <phosg/Filesystem.hh>
+#include <phosg/Hash.hh>
 #include <phosg/Random.hh>
 #include <phosg/Time.hh>
+#include <unordered_set>
 
+#include "../CommandFormats.hh"
 #include "../CommonFileFormats.hh"
 #include "../Compression.hh"
 #include "../Loggers.hh"
@@ -2315,104 +2320,225 @@ bool Rules::check_and_reset_invalid_fields() {
   return ret;
 }
 
+// Decoding card text and compressing maps are the slowest parts of loading
+// the Episode 3 data, so the results are saved in a cache directory. Each
+// cache file is named PREFIX-HASH.bin, where HASH is the FNV-1a hash of the
+// source file's contents, so if a source file changes, its old cache file is
+// simply not used anymore. Each file begins with a signature and a hash of
+// the rest of the file, so incomplete or corrupt cache files are ignored.
+static constexpr uint64_t DECODED_DATA_CACHE_SIGNATURE = 0x4550334341434801; // 'EP3CACH', version 1
+
+static string decoded_data_cache_filename(const string& cache_directory, const string& prefix, uint64_t source_hash) {
+  return phosg::string_printf("%s/%s-%016" PRIX64 ".bin", cache_directory.c_str(), prefix.c_str(), source_hash);
+}
+
+// Returns an empty string if the cache file doesn't exist or isn't valid
+static string load_decoded_data_cache_file(const string& filename) {
+  string data;
+  try {
+    data = phosg::load_file(filename);
+  } catch (const phosg::cannot_open_file&) {
+    return "";
+  }
+  if (data.size() < 0x10) {
+    return "";
+  }
+  phosg::StringReader r(data);
+  if (r.get_u64l() != DECODED_DATA_CACHE_SIGNATURE) {
+    return "";
+  }
+  uint64_t expected_hash = r.get_u64l();
+  string ret = data.substr(0x10);
+  return (phosg::fnv1a64(ret) == expected_hash) ? ret : "";
+}
+
+static void save_decoded_data_cache_file(const string& filename, const string& data) {
+  phosg::StringWriter w;
+  w.put_u64l(DECODED_DATA_CACHE_SIGNATURE);
+  w.put_u64l(phosg::fnv1a64(data));
+  w.write(data);
+  // Write to a temporary file first, so other processes never see a
+  // partially-written cache file
+  string temp_filename = phosg::string_printf("%s.%016" PRIX64 ".tmp", filename.c_str(), phosg::random_object<uint64_t>());
+  phosg::save_file(temp_filename, w.str());
+  if (rename(temp_filename.c_str(), filename.c_str())) {
+    remove(temp_filename.c_str());
+    throw runtime_error("cannot rename temporary cache file");
+  }
+}
+
+static void delete_unused_decoded_data_cache_files(
+    const string& cache_directory, const string& prefix, const unordered_set<string>& used_filenames) {
+  string full_prefix = prefix + "-";
+  for (const auto& filename : phosg::list_directory(cache_directory)) {
+    string path = cache_directory + "/" + filename;
+    if (filename.starts_with(full_prefix) && !used_filenames.count(path)) {
+      static_game_data_log.info("Deleting unused cache file %s", path.c_str());
+      remove(path.c_str());
+    }
+  }
+}
+
+static void parse_card_text_archive(
+    const string& text_bin_data,
+    unordered_map<uint32_t, string>& card_text,
+    unordered_map<uint32_t, vector<string>>& card_tags) {
+  phosg::StringReader r(text_bin_data);
+  while (!r.eof()) {
+    string card_id_str = r.get_cstr();
+    if (card_id_str.empty() || (static_cast<uint8_t>(card_id_str[0]) == 0xFF)) {
+      break;
+    }
+    phosg::strip_leading_whitespace(card_id_str);
+    uint32_t card_id = stoul(card_id_str);
+
+    // Read all pages for this card
+    string text;
+    string first_page;
+    for (;;) {
+      string line = r.get_cstr();
+      if (line.empty()) {
+        break;
+      }
+      if (first_page.empty()) {
+        first_page = line;
+      }
+      text += '\n';
+      text += line;
+    }
+
+    // In orig_text, turn all \t into $ (following newserv conventions)
+    string orig_text = text;
+    for (char& ch : orig_text) {
+      if (ch == '\t') {
+        ch = '$';
+      }
+    }
+
+    // Preprocess first page: first, delete all color markers
+    size_t offset = first_page.find("\tC");
+    while (offset != string::npos) {
+      first_page = first_page.substr(0, offset) + first_page.substr(offset + 3);
+      offset = first_page.find("\tC");
+    }
+    // Preprocess first page: delete all lines that don't start with \t
+    offset = first_page.find('\t');
+    if (offset == string::npos) {
+      first_page.clear();
+    } else {
+      first_page = first_page.substr(offset);
+    }
+    // Preprocess first page: merge lines that don't begin with \t
+    for (offset = 0; offset < first_page.size(); offset++) {
+      if (first_page[offset] == '\n' && first_page[offset + 1] != '\t') {
+        first_page = first_page.substr(0, offset) + first_page.substr(offset + 1);
+        offset--;
+      }
+    }
+
+    // Split first page into tags, and collapse whitespace in the tag names
+    vector<string> tags;
+    auto lines = phosg::split(first_page, '\n');
+    for (const auto& line : lines) {
+      string tag;
+      if (line[0] == '\t' && line[1] == 'D') {
+        tag = "D: " + line.substr(2);
+      } else if (line[0] == '\t' && line[1] == 'S') {
+        tag = "S: " + line.substr(2);
+      }
+      if (!tag.empty()) {
+        for (size_t offset = tag.find("  "); offset != string::npos; offset = tag.find("  ")) {
+          tag = tag.substr(0, offset) + tag.substr(offset + 1);
+        }
+        tags.emplace_back(std::move(tag));
+      }
+    }
+    phosg::strip_leading_whitespace(orig_text);
+
+    if (!card_text.emplace(card_id, std::move(orig_text)).second) {
+      throw runtime_error("duplicate card text id");
+    }
+    if (!card_tags.emplace(card_id, std::move(tags)).second) {
+      throw logic_error("duplicate card tags id");
+    }
+
+    r.go((r.where() + 0x3FF) & (~0x3FF));
+  }
+}
+
 CardIndex::CardIndex(
     const string& filename,
     const string& decompressed_filename,
     const string& text_filename,
     const string& decompressed_text_filename,
     const string& dice_text_filename,
-    const string& decompressed_dice_text_filename) {
+    const string& decompressed_dice_text_filename,
+    const string& cache_directory) {
+  if (!cache_directory.empty() && !phosg::isdir(cache_directory)) {
+    mkdir(cache_directory.c_str(), 0755);
+  }
+
   unordered_map<uint32_t, vector<string>> card_tags;
   unordered_map<uint32_t, string> card_text;
   try {
-    string text_bin_data;
+    string text_file_data;
+    bool text_file_is_compressed = false;
     if (!decompressed_text_filename.empty() && phosg::isfile(decompressed_text_filename)) {
-      text_bin_data = phosg::load_file(decompressed_text_filename);
+      text_file_data = phosg::load_file(decompressed_text_filename);
     } else if (!text_filename.empty() && phosg::isfile(text_filename)) {
-      text_bin_data = prs_decompress(phosg::load_file(text_filename));
-    }
-    if (!text_bin_data.empty()) {
-      phosg::StringReader r(text_bin_data);
-
-      while (!r.eof()) {
-        string card_id_str = r.get_cstr();
-        if (card_id_str.empty() || (static_cast<uint8_t>(card_id_str[0]) == 0xFF)) {
-          break;
-        }
-        phosg::strip_leading_whitespace(card_id_str);
-        uint32_t card_id = stoul(card_id_str);
-
-        // Read all pages for this card
-        string text;
-        string first_page;
-        for (;;) {
-          string line = r.get_cstr();
-          if (line.empty()) {
-            break;
-          }
-          if (first_page.empty()) {
-            first_page = line;
-          }
-          text += '\n';
-          text += line;
-        }
-
-        // In orig_text, turn all \t into $ (following newserv conventions)
-        string orig_text = text;
-        for (char& ch : orig_text) {
-          if (ch == '\t') {
-            ch = '$';
-          }
-        }
-
-        // Preprocess first page: first, delete all color markers
-        size_t offset = first_page.find("\tC");
-        while (offset != string::npos) {
-          first_page = first_page.substr(0, offset) + first_page.substr(offset + 3);
-          offset = first_page.find("\tC");
-        }
-        // Preprocess first page: delete all lines that don't start with \t
-        offset = first_page.find('\t');
-        if (offset == string::npos) {
-          first_page.clear();
-        } else {
-          first_page = first_page.substr(offset);
-        }
-        // Preprocess first page: merge lines that don't begin with \t
-        for (offset = 0; offset < first_page.size(); offset++) {
-          if (first_page[offset] == '\n' && first_page[offset + 1] != '\t') {
-            first_page = first_page.substr(0, offset) + first_page.substr(offset + 1);
-            offset--;
+      text_file_data = phosg::load_file(text_filename);
+      text_file_is_compressed = true;
+    }
+    if (!text_file_data.empty()) {
+      string cache_filename;
+      bool loaded_from_cache = false;
+      if (!cache_directory.empty()) {
+        cache_filename = decoded_data_cache_filename(
+            cache_directory, text_file_is_compressed ? "card-text-mnr" : "card-text-mnrd", phosg::fnv1a64(text_file_data));
+        string cached = load_decoded_data_cache_file(cache_filename);
+        if (!cached.empty()) {
+          try {
+            phosg::StringReader r(cached);
+            while (!r.eof()) {
+              uint32_t card_id = r.get_u32l();
+              card_text.emplace(card_id, r.read(r.get_u32l()));
+              auto& tags = card_tags[card_id];
+              tags.resize(r.get_u32l());
+              for (auto& tag : tags) {
+                tag = r.read(r.get_u32l());
+              }
+            }
+            loaded_from_cache = true;
+          } catch (const exception& e) {
+            static_game_data_log.warning("Ignoring invalid cache file %s: %s", cache_filename.c_str(), e.what());
+            card_text.clear();
+            card_tags.clear();
           }
         }
+      }
 
-        // Split first page into tags, and collapse whitespace in the tag names
-        vector<string> tags;
-        auto lines = phosg::split(first_page, '\n');
-        for (const auto& line : lines) {
-          string tag;
-          if (line[0] == '\t' && line[1] == 'D') {
-            tag = "D: " + line.substr(2);
-          } else if (line[0] == '\t' && line[1] == 'S') {
-            tag = "S: " + line.substr(2);
-          }
-          if (!tag.empty()) {
-            for (size_t offset = tag.find("  "); offset != string::npos; offset = tag.find("  ")) {
-              tag = tag.substr(0, offset) + tag.substr(offset + 1);
+      if (!loaded_from_cache) {
+        parse_card_text_archive(
+            text_file_is_compressed ? prs_decompress(text_file_data) : text_file_data, card_text, card_tags);
+        if (!cache_filename.empty()) {
+          try {
+            phosg::StringWriter w;
+            for (const auto& [card_id, text] : card_text) {
+              w.put_u32l(card_id);
+              w.put_u32l(text.size());
+              w.write(text);
+              const auto& tags = card_tags.at(card_id);
+              w.put_u32l(tags.size());
+              for (const auto& tag : tags) {
+                w.put_u32l(tag.size());
+                w.write(tag);
+              }
             }
-            tags.emplace_back(std::move(tag));
+            save_decoded_data_cache_file(cache_filename, w.str());
+          } catch (const exception& e) {
+            static_game_data_log.warning("Cannot write cache file %s: %s", cache_filename.c_str(), e.what());
           }
         }
-        phosg::strip_leading_whitespace(orig_text);
-
-        if (!card_text.emplace(card_id, std::move(orig_text)).second) {
-          throw runtime_error("duplicate card text id");
-        }
-        if (!card_tags.emplace(card_id, std::move(tags)).second) {
-          throw logic_error("duplicate card tags id");
-        }
-
-        r.go((r.where() + 0x3FF) & (~0x3FF));
       }
     }
   } catch (const exception& e) {
@@ -2485,6 +2611,14 @@ CardIndex::CardIndex(
         throw runtime_error(phosg::string_printf(
             "duplicate card id: %08" PRIX32, entry->def.card_id.load()));
       }
+      // Card IDs are 16 bits in all battle commands, so larger IDs can't be
+      // referenced during battles anyway
+      if (entry->def.card_id < 0x10000) {
+        if (this->card_definitions_by_id.size() <= entry->def.card_id) {
+          this->card_definitions_by_id.resize(entry->def.card_id + 1, nullptr);
+        }
+        this->card_definitions_by_id[entry->def.card_id] = entry.get();
+      }
 
       // Some cards intentionally have the same name, so we just leave them
       // unindexed (they can still be looked up by ID, of course)
@@ -2518,7 +2652,23 @@ CardIndex::CardIndex(
       }
     }
 
-    if (this->compressed_card_definitions.empty()) {
+    // Compressing the definitions can take a long time (especially if the
+    // optimal compressor is needed below), so the result is cached
+    string compressed_cache_filename;
+    bool compressed_from_cache = false;
+    if (!cache_directory.empty() &&
+        (this->compressed_card_definitions.empty() || (this->compressed_card_definitions.size() > 0x7BF8))) {
+      compressed_cache_filename = decoded_data_cache_filename(
+          cache_directory, "card-definitions", phosg::fnv1a64(decompressed_data));
+      string cached = load_decoded_data_cache_file(compressed_cache_filename);
+      if (!cached.empty()) {
+        this->compressed_card_definitions = std::move(cached);
+        compressed_from_cache = true;
+        static_game_data_log.info("Loaded compressed card definitions from %s", compressed_cache_filename.c_str());
+      }
+    }
+
+    if (!compressed_from_cache && this->compressed_card_definitions.empty()) {
       uint64_t start = phosg::now();
       this->compressed_card_definitions = prs_compress(decompressed_data);
       uint64_t diff = phosg::now() - start;
@@ -2527,7 +2677,7 @@ CardIndex::CardIndex(
           decompressed_data.size(), this->compressed_card_definitions.size(), diff);
     }
 
-    if (this->compressed_card_definitions.size() > 0x7BF8) {
+    if (!compressed_from_cache && (this->compressed_card_definitions.size() > 0x7BF8)) {
       // Try to reduce the compressed size by clearing out text
       static_game_data_log.info("Compressed card list data is too long (0x%zX bytes); removing text", this->compressed_card_definitions.size());
       for (size_t x = 0; x < count; x++) {
@@ -2548,6 +2698,13 @@ CardIndex::CardIndex(
     if (this->compressed_card_definitions.size() > 0x7BF8) {
       throw runtime_error("compressed card list data is too long");
     }
+    if (!compressed_from_cache && !compressed_cache_filename.empty()) {
+      try {
+        save_decoded_data_cache_file(compressed_cache_filename, this->compressed_card_definitions);
+      } catch (const exception& e) {
+        static_game_data_log.warning("Cannot write cache file %s: %s", compressed_cache_filename.c_str(), e.what());
+      }
+    }
 
     static_game_data_log.info("Indexed %zu Episode 3 card definitions", this->card_definitions.size());
   } catch (const exception& e) {
@@ -2607,7 +2764,9 @@ string CardIndex::normalize_card_name(const string& name) {
 
 MapIndex::VersionedMap::VersionedMap(shared_ptr<const MapDefinition> map, uint8_t language)
     : map(map),
-      language(language) {}
+      language(language) {
+  this->generate_derived_data();
+}
 
 MapIndex::VersionedMap::VersionedMap(std::string&& compressed_data, uint8_t language)
     : language(language),
@@ -2615,6 +2774,9 @@ MapIndex::VersionedMap::VersionedMap(std::string&& compressed_data, uint8_t lang
   string decompressed = prs_decompress(this->compressed_data);
   if (decompressed.size() == sizeof(MapDefinitionTrial)) {
     this->map = make_shared<MapDefinition>(*reinterpret_cast<const MapDefinitionTrial*>(decompressed.data()));
+    // The original data is in the Trial Edition format, so it can't be sent
+    // as-is to non-NTE clients
+    this->compressed_data.clear();
   } else if (decompressed.size() == sizeof(MapDefinition)) {
     this->map = make_shared<MapDefinition>(*reinterpret_cast<const MapDefinition*>(decompressed.data()));
   } else {
@@ -2622,28 +2784,39 @@ MapIndex::VersionedMap::VersionedMap(std::string&& compressed_data, uint8_t lang
         "decompressed data size is incorrect (expected %zu bytes, read %zu bytes)",
         sizeof(MapDefinition), decompressed.size()));
   }
+  this->generate_derived_data();
 }
 
-shared_ptr<const MapDefinitionTrial> MapIndex::VersionedMap::trial() const {
-  if (!this->trial_map) {
-    this->trial_map = make_shared<MapDefinitionTrial>(*this->map);
-  }
-  return this->trial_map;
+MapIndex::VersionedMap::VersionedMap(
+    shared_ptr<const MapDefinition> map,
+    uint8_t language,
+    std::string&& compressed_data,
+    std::string&& compressed_trial_data)
+    : map(map),
+      language(language),
+      compressed_data(std::move(compressed_data)),
+      compressed_trial_data(std::move(compressed_trial_data)) {
+  this->generate_derived_data();
 }
 
-const std::string& MapIndex::VersionedMap::compressed(bool is_nte) const {
-  if (is_nte) {
-    if (this->compressed_trial_data.empty()) {
-      auto md = this->trial();
-      this->compressed_trial_data = prs_compress(md.get(), sizeof(*md));
-    }
-    return this->compressed_trial_data;
-  } else {
-    if (this->compressed_data.empty()) {
-      this->compressed_data = prs_compress(this->map.get(), sizeof(*this->map));
-    }
-    return this->compressed_data;
+void MapIndex::VersionedMap::generate_derived_data() {
+  this->trial_map = make_shared<MapDefinitionTrial>(*this->map);
+  if (this->compressed_data.empty()) {
+    this->compressed_data = prs_compress(this->map.get(), sizeof(*this->map));
+  }
+  if (this->compressed_trial_data.empty()) {
+    this->compressed_trial_data = prs_compress(this->trial_map.get(), sizeof(*this->trial_map));
   }
+  this->map_command_data = this->generate_map_definition_command(this->compressed_data);
+  this->trial_map_command_data = this->generate_map_definition_command(this->compressed_trial_data);
+}
+
+string MapIndex::VersionedMap::generate_map_definition_command(const string& compressed) const {
+  phosg::StringWriter w;
+  uint32_t subcommand_size = (compressed.size() + sizeof(G_MapData_Ep3_6xB6x41) + 3) & (~3);
+  w.put<G_MapData_Ep3_6xB6x41>({{{{0xB6, 0, 0}, subcommand_size}, 0x41, {}}, this->map->map_number.load(), compressed.size(), 0});
+  w.write(compressed);
+  return std::move(w.str());
 }
 
 MapIndex::Map::Map(shared_ptr<const VersionedMap> initial_version)
@@ -2688,83 +2861,257 @@ shared_ptr<const MapIndex::VersionedMap> MapIndex::Map::version(uint8_t language
   throw logic_error("no map versions exist");
 }
 
-MapIndex::MapIndex(const string& directory) {
-  for (const auto& filename : phosg::list_directory_sorted(directory)) {
-    try {
-      string base_filename;
-      string compressed_data;
-      shared_ptr<MapDefinition> decompressed_data;
-      if (phosg::ends_with(filename, ".mnmd") || phosg::ends_with(filename, ".bind")) {
-        decompressed_data = make_shared<MapDefinition>(phosg::load_object_file<MapDefinition>(directory + "/" + filename));
-        base_filename = filename.substr(0, filename.size() - 5);
-      } else if (phosg::ends_with(filename, ".mnm") || phosg::ends_with(filename, ".bin")) {
-        compressed_data = phosg::load_file(directory + "/" + filename);
-        base_filename = filename.substr(0, filename.size() - 4);
-      } else if (phosg::ends_with(filename, ".bin.gci") || phosg::ends_with(filename, ".mnm.gci")) {
-        compressed_data = decode_gci_data(phosg::load_file(directory + "/" + filename));
-        base_filename = filename.substr(0, filename.size() - 8);
-      } else if (phosg::ends_with(filename, ".gci")) {
-        compressed_data = decode_gci_data(phosg::load_file(directory + "/" + filename));
-        base_filename = filename.substr(0, filename.size() - 4);
-      } else if (phosg::ends_with(filename, ".bin.vms") || phosg::ends_with(filename, ".mnm.vms")) {
-        compressed_data = decode_vms_data(phosg::load_file(directory + "/" + filename));
-        base_filename = filename.substr(0, filename.size() - 8);
-      } else if (phosg::ends_with(filename, ".vms")) {
-        compressed_data = decode_vms_data(phosg::load_file(directory + "/" + filename));
-        base_filename = filename.substr(0, filename.size() - 4);
-      } else if (phosg::ends_with(filename, ".bin.dlq") || phosg::ends_with(filename, ".mnm.dlq")) {
-        compressed_data = decode_dlq_data(phosg::load_file(directory + "/" + filename));
-        base_filename = filename.substr(0, filename.size() - 8);
-      } else if (phosg::ends_with(filename, ".dlq")) {
-        compressed_data = decode_dlq_data(phosg::load_file(directory + "/" + filename));
-        base_filename = filename.substr(0, filename.size() - 4);
-      } else {
-        continue; // Silently skip file
-      }
+static shared_ptr<MapIndex::VersionedMap> load_map_file(
+    const string& directory,
+    const string& filename,
+    const string& cache_directory,
+    string* out_cache_filename,
+    bool* out_from_cache) {
+  enum class Format {
+    DECOMPRESSED = 0,
+    COMPRESSED,
+    GCI,
+    VMS,
+    DLQ,
+  };
+  Format format;
+  string base_filename;
+  if (phosg::ends_with(filename, ".mnmd") || phosg::ends_with(filename, ".bind")) {
+    format = Format::DECOMPRESSED;
+    base_filename = filename.substr(0, filename.size() - 5);
+  } else if (phosg::ends_with(filename, ".mnm") || phosg::ends_with(filename, ".bin")) {
+    format = Format::COMPRESSED;
+    base_filename = filename.substr(0, filename.size() - 4);
+  } else if (phosg::ends_with(filename, ".bin.gci") || phosg::ends_with(filename, ".mnm.gci")) {
+    format = Format::GCI;
+    base_filename = filename.substr(0, filename.size() - 8);
+  } else if (phosg::ends_with(filename, ".gci")) {
+    format = Format::GCI;
+    base_filename = filename.substr(0, filename.size() - 4);
+  } else if (phosg::ends_with(filename, ".bin.vms") || phosg::ends_with(filename, ".mnm.vms")) {
+    format = Format::VMS;
+    base_filename = filename.substr(0, filename.size() - 8);
+  } else if (phosg::ends_with(filename, ".vms")) {
+    format = Format::VMS;
+    base_filename = filename.substr(0, filename.size() - 4);
+  } else if (phosg::ends_with(filename, ".bin.dlq") || phosg::ends_with(filename, ".mnm.dlq")) {
+    format = Format::DLQ;
+    base_filename = filename.substr(0, filename.size() - 8);
+  } else if (phosg::ends_with(filename, ".dlq")) {
+    format = Format::DLQ;
+    base_filename = filename.substr(0, filename.size() - 4);
+  } else {
+    return nullptr; // Silently skip file
+  }
+  string file_data = phosg::load_file(directory + "/" + filename);
 
-      if (base_filename.size() < 2) {
-        throw runtime_error("filename too short for language code");
-      }
-      if (base_filename[base_filename.size() - 2] != '-') {
-        throw runtime_error("language code not present");
+  if (base_filename.size() < 2) {
+    throw runtime_error("filename too short for language code");
+  }
+  if (base_filename[base_filename.size() - 2] != '-') {
+    throw runtime_error("language code not present");
+  }
+  uint8_t language = language_code_for_char(base_filename[base_filename.size() - 1]);
+
+  // Most of the time spent loading a map is spent decompressing it and
+  // compressing it for each client type, so if the same file was loaded
+  // before, use the results from then instead
+  if (!cache_directory.empty()) {
+    // The same data can be interpreted differently depending on the format,
+    // so the format is part of the cache key
+    static const array<const char*, 5> format_names = {"map-mnmd", "map-mnm", "map-gci", "map-vms", "map-dlq"};
+    *out_cache_filename = decoded_data_cache_filename(
+        cache_directory, format_names.at(static_cast<size_t>(format)), phosg::fnv1a64(file_data));
+    string cached = load_decoded_data_cache_file(*out_cache_filename);
+    if (!cached.empty()) {
+      try {
+        phosg::StringReader r(cached);
+        auto map = make_shared<MapDefinition>(r.get<MapDefinition>());
+        string compressed_data = r.read(r.get_u32l());
+        string compressed_trial_data = r.read(r.get_u32l());
+        *out_from_cache = true;
+        return make_shared<MapIndex::VersionedMap>(
+            map, language, std::move(compressed_data), std::move(compressed_trial_data));
+      } catch (const exception& e) {
+        static_game_data_log.warning("(%s) Ignoring invalid cache file %s: %s",
+            filename.c_str(), out_cache_filename->c_str(), e.what());
       }
-      uint8_t language = language_code_for_char(base_filename[base_filename.size() - 1]);
+    }
+  }
 
-      shared_ptr<VersionedMap> vm;
-      if (decompressed_data) {
-        vm = make_shared<VersionedMap>(decompressed_data, language);
-      } else if (!compressed_data.empty()) {
-        vm = make_shared<VersionedMap>(std::move(compressed_data), language);
-      } else {
-        throw runtime_error("unknown map file format");
+  shared_ptr<MapIndex::VersionedMap> vm;
+  if (format == Format::DECOMPRESSED) {
+    if (file_data.size() != sizeof(MapDefinition)) {
+      throw runtime_error(phosg::string_printf(
+          "file size is incorrect (expected %zu bytes, read %zu bytes)", sizeof(MapDefinition), file_data.size()));
+    }
+    auto map = make_shared<MapDefinition>(*reinterpret_cast<const MapDefinition*>(file_data.data()));
+    vm = make_shared<MapIndex::VersionedMap>(map, language);
+  } else {
+    string compressed_data;
+    if (format == Format::GCI) {
+      compressed_data = decode_gci_data(file_data);
+    } else if (format == Format::VMS) {
+      compressed_data = decode_vms_data(file_data);
+    } else if (format == Format::DLQ) {
+      compressed_data = decode_dlq_data(file_data);
+    } else {
+      compressed_data = std::move(file_data);
+    }
+    if (compressed_data.empty()) {
+      throw runtime_error("unknown map file format");
+    }
+    vm = make_shared<MapIndex::VersionedMap>(std::move(compressed_data), language);
+  }
+
+  if (!out_cache_filename->empty()) {
+    try {
+      phosg::StringWriter w;
+      w.put<MapDefinition>(*vm->map);
+      const auto& compressed_data = vm->compressed(false);
+      w.put_u32l(compressed_data.size());
+      w.write(compressed_data);
+      const auto& compressed_trial_data = vm->compressed(true);
+      w.put_u32l(compressed_trial_data.size());
+      w.write(compressed_trial_data);
+      save_decoded_data_cache_file(*out_cache_filename, w.str());
+    } catch (const exception& e) {
+      static_game_data_log.warning("(%s) Cannot write cache file %s: %s",
+          filename.c_str(), out_cache_filename->c_str(), e.what());
+    }
+  }
+  return vm;
+}
+
+MapIndex::MapIndex(const string& directory, const string& cache_directory) {
+  if (!cache_directory.empty() && !phosg::isdir(cache_directory)) {
+    mkdir(cache_directory.c_str(), 0755);
+  }
+
+  // Each map file is loaded independently of the others, so we load them all
+  // in parallel, then index them in filename order afterward so the results
+  // (and the log messages) don't depend on thread timing
+  struct LoadedFile {
+    string filename;
+    shared_ptr<VersionedMap> vm;
+    string cache_filename;
+    bool from_cache = false;
+    string error;
+  };
+  vector<LoadedFile> files;
+  for (const auto& filename : phosg::list_directory_sorted(directory)) {
+    files.emplace_back().filename = filename;
+  }
+  if (!files.empty()) {
+    phosg::parallel_range_blocks<size_t>([&](size_t index, size_t) -> bool {
+      auto& f = files[index];
+      try {
+        f.vm = load_map_file(directory, f.filename, cache_directory, &f.cache_filename, &f.from_cache);
+      } catch (const exception& e) {
+        f.error = e.what();
       }
+      return false;
+    },
+        0, files.size(), 1, 0);
+  }
+
+  unordered_set<string> used_cache_filenames;
+  for (const auto& f : files) {
+    if (!f.cache_filename.empty()) {
+      used_cache_filenames.emplace(f.cache_filename);
+    }
+    if (!f.error.empty()) {
+      static_game_data_log.warning("Failed to index Episode 3 map %s: %s", f.filename.c_str(), f.error.c_str());
+      continue;
+    }
+    if (!f.vm) {
+      continue;
+    }
 
+    try {
+      const auto& vm = f.vm;
       string name = vm->map->name.decode(vm->language);
       auto map_it = this->maps.find(vm->map->map_number);
       if (map_it == this->maps.end()) {
         map_it = this->maps.emplace(vm->map->map_number, make_shared<Map>(vm)).first;
-        static_game_data_log.info("(%s) Created Episode 3 map %08" PRIX32 " %c (%s; %s)",
-            filename.c_str(),
+        static_game_data_log.info("(%s) Created Episode 3 map %08" PRIX32 " %c (%s; %s%s)",
+            f.filename.c_str(),
             vm->map->map_number.load(),
             char_for_language_code(vm->language),
             vm->map->is_quest() ? "quest" : "free",
-            name.c_str());
+            name.c_str(),
+            f.from_cache ? "; cached" : "");
       } else {
         map_it->second->add_version(vm);
-        static_game_data_log.info("(%s) Added Episode 3 map version %08" PRIX32 " %c (%s; %s)",
-            filename.c_str(),
+        static_game_data_log.info("(%s) Added Episode 3 map version %08" PRIX32 " %c (%s; %s%s)",
+            f.filename.c_str(),
             vm->map->map_number.load(),
             char_for_language_code(vm->language),
             vm->map->is_quest() ? "quest" : "free",
-            name.c_str());
+            name.c_str(),
+            f.from_cache ? "; cached" : "");
       }
       this->maps_by_name.emplace(vm->map->name.decode(vm->language), map_it->second);
 
     } catch (const exception& e) {
       static_game_data_log.warning("Failed to index Episode 3 map %s: %s",
-          filename.c_str(), e.what());
+          f.filename.c_str(), e.what());
+    }
+  }
+
+  if (!cache_directory.empty()) {
+    delete_unused_decoded_data_cache_files(cache_directory, "map", used_cache_filenames);
+  }
+
+  // Generate the map lists for all languages and player counts. Map::version
+  // falls back to English when a map doesn't have the requested language, so
+  // if no map has a language at all, its lists are the same as English's and
+  // we don't need to generate them again. The lists are independent of each
+  // other, so they're also generated in parallel.
+  array<bool, NUM_MAP_LIST_LANGUAGES> generate_language;
+  for (uint8_t language = 0; language < NUM_MAP_LIST_LANGUAGES; language++) {
+    generate_language[language] = (language == 1);
+    for (const auto& it : this->maps) {
+      if (generate_language[language]) {
+        break;
+      }
+      generate_language[language] = it.second->has_version(language);
     }
   }
+  phosg::parallel_range_blocks<size_t>([&](size_t index, size_t) -> bool {
+    uint8_t language = index / 4;
+    size_t num_players = (index % 4) + 1;
+    if (generate_language[language]) {
+      this->compressed_map_lists[language][num_players - 1] = this->generate_compressed_list(num_players, language);
+    }
+    return false;
+  },
+      0, NUM_MAP_LIST_LANGUAGES * 4, 1, 0);
+
+  for (uint8_t language = 0; language < NUM_MAP_LIST_LANGUAGES; language++) {
+    if (!generate_language[language]) {
+      this->compressed_map_lists[language] = this->compressed_map_lists[1];
+    }
+
+    for (size_t num_players = 1; num_players <= 4; num_players++) {
+      const string& list_data = this->compressed_map_lists[language][num_players - 1];
+      if (list_data.empty()) {
+        continue;
+      }
+      phosg::StringWriter w;
+      uint32_t subcommand_size = (list_data.size() + sizeof(G_MapList_Ep3_6xB6x40) + 3) & (~3);
+      w.put<G_MapList_Ep3_6xB6x40>(G_MapList_Ep3_6xB6x40{{{{0xB6, 0, 0}, subcommand_size}, 0x40, {}}, list_data.size(), 0});
+      w.write(list_data);
+      while (w.size() & 3) {
+        w.put_u8(0);
+      }
+      this->map_list_commands[language][num_players - 1] = std::move(w.str());
+    }
+  }
+}
+
+uint8_t MapIndex::map_list_language(uint8_t language) {
+  return (language < NUM_MAP_LIST_LANGUAGES) ? language : 1;
 }
 
 const string& MapIndex::get_compressed_list(size_t num_players, uint8_t language) const {
@@ -2774,79 +3121,98 @@ const string& MapIndex::get_compressed_list(size_t num_players, uint8_t language
   if (num_players > 4) {
     throw logic_error("player count is too high in map list generation");
   }
+  const auto& ret = this->compressed_map_lists[this->map_list_language(language)][num_players - 1];
+  if (ret.empty()) {
+    throw runtime_error("compressed map list is too large");
+  }
+  return ret;
+}
 
-  if (language >= this->compressed_map_lists.size()) {
-    this->compressed_map_lists.resize(language + 1);
+const string& MapIndex::get_map_list_command(size_t num_players, uint8_t language) const {
+  if (num_players == 0) {
+    throw runtime_error("cannot generate map list for no players");
+  }
+  if (num_players > 4) {
+    throw logic_error("player count is too high in map list generation");
+  }
+  const auto& ret = this->map_list_commands[this->map_list_language(language)][num_players - 1];
+  if (ret.empty()) {
+    throw runtime_error("compressed map list is too large");
   }
-  string& compressed_map_list = this->compressed_map_lists[language].at(num_players - 1);
-  if (compressed_map_list.empty()) {
-    phosg::StringWriter entries_w;
-    phosg::StringWriter strings_w;
+  return ret;
+}
 
-    size_t num_maps = 0;
-    for (const auto& map_it : this->maps) {
-      auto vm = map_it.second->version(language);
-      size_t map_num_players = 0;
-      for (size_t z = 0; z < 4; z++) {
-        uint8_t player_type = vm->map->entry_states[z].player_type;
-        if (player_type == 0x00 || player_type == 0x01 || player_type == 0xFF) {
-          map_num_players++;
-        }
-      }
-      if (map_num_players < num_players) {
-        continue;
+string MapIndex::generate_compressed_list(size_t num_players, uint8_t language) const {
+  phosg::StringWriter entries_w;
+  phosg::StringWriter strings_w;
+
+  size_t num_maps = 0;
+  for (const auto& map_it : this->maps) {
+    auto vm = map_it.second->version(language);
+    size_t map_num_players = 0;
+    for (size_t z = 0; z < 4; z++) {
+      uint8_t player_type = vm->map->entry_states[z].player_type;
+      if (player_type == 0x00 || player_type == 0x01 || player_type == 0xFF) {
+        map_num_players++;
       }
+    }
+    if (map_num_players < num_players) {
+      continue;
+    }
 
-      MapList::Entry e;
-      e.map_x = vm->map->map_x;
-      e.map_y = vm->map->map_y;
-      e.environment_number = vm->map->environment_number;
-      e.map_number = vm->map->map_number.load();
-      e.width = vm->map->width;
-      e.height = vm->map->height;
-      e.map_tiles = vm->map->map_tiles;
-      e.modification_tiles = vm->map->overlay_state.tiles;
-
-      e.name_offset = strings_w.size();
-      strings_w.write(vm->map->name.data, vm->map->name.used_chars_8());
-      strings_w.put_u8(0);
-      e.location_name_offset = strings_w.size();
-      strings_w.write(vm->map->location_name.data, vm->map->location_name.used_chars_8());
-      strings_w.put_u8(0);
-      e.quest_name_offset = strings_w.size();
-      strings_w.write(vm->map->quest_name.data, vm->map->quest_name.used_chars_8());
-      strings_w.put_u8(0);
-      e.description_offset = strings_w.size();
-      strings_w.write(vm->map->description.data, vm->map->description.used_chars_8());
-      strings_w.put_u8(0);
-      e.map_category = vm->map->map_category;
-
-      entries_w.put(e);
-      num_maps++;
-    }
-
-    MapList header;
-    header.num_maps = num_maps;
-    header.unknown_a1 = 0;
-    header.strings_offset = entries_w.size();
-    header.total_size = sizeof(MapList) + entries_w.size() + strings_w.size();
-
-    PRSCompressor prs;
-    prs.add(&header, sizeof(header));
-    prs.add(entries_w.str());
-    prs.add(strings_w.str());
-
-    phosg::StringWriter compressed_w;
-    compressed_w.put_u32b(prs.input_size());
-    compressed_w.write(prs.close());
-    compressed_map_list = std::move(compressed_w.str());
-    if (compressed_map_list.size() > 0x7BEC) {
-      throw runtime_error(phosg::string_printf("compressed map list for %zu players is too large (0x%zX bytes)", num_players, compressed_map_list.size()));
-    }
-    size_t decompressed_size = sizeof(header) + entries_w.size() + strings_w.size();
-    static_game_data_log.info("Generated Episode 3 compressed map list for %zu player(s) (%zu maps; 0x%zX -> 0x%zX bytes)",
-        num_players, num_maps, decompressed_size, compressed_map_list.size());
-  }
+    MapList::Entry e;
+    e.map_x = vm->map->map_x;
+    e.map_y = vm->map->map_y;
+    e.environment_number = vm->map->environment_number;
+    e.map_number = vm->map->map_number.load();
+    e.width = vm->map->width;
+    e.height = vm->map->height;
+    e.map_tiles = vm->map->map_tiles;
+    e.modification_tiles = vm->map->overlay_state.tiles;
+
+    e.name_offset = strings_w.size();
+    strings_w.write(vm->map->name.data, vm->map->name.used_chars_8());
+    strings_w.put_u8(0);
+    e.location_name_offset = strings_w.size();
+    strings_w.write(vm->map->location_name.data, vm->map->location_name.used_chars_8());
+    strings_w.put_u8(0);
+    e.quest_name_offset = strings_w.size();
+    strings_w.write(vm->map->quest_name.data, vm->map->quest_name.used_chars_8());
+    strings_w.put_u8(0);
+    e.description_offset = strings_w.size();
+    strings_w.write(vm->map->description.data, vm->map->description.used_chars_8());
+    strings_w.put_u8(0);
+    e.map_category = vm->map->map_category;
+
+    entries_w.put(e);
+    num_maps++;
+  }
+
+  MapList header;
+  header.num_maps = num_maps;
+  header.unknown_a1 = 0;
+  header.strings_offset = entries_w.size();
+  header.total_size = sizeof(MapList) + entries_w.size() + strings_w.size();
+
+  PRSCompressor prs;
+  prs.add(&header, sizeof(header));
+  prs.add(entries_w.str());
+  prs.add(strings_w.str());
+
+  phosg::StringWriter compressed_w;
+  compressed_w.put_u32b(prs.input_size());
+  compressed_w.write(prs.close());
+  string compressed_map_list = std::move(compressed_w.str());
+  if (compressed_map_list.size() > 0x7BEC) {
+    // An empty list causes get_compressed_list and get_map_list_command to
+    // throw, so the error will still be reported to the requesting client
+    static_game_data_log.warning("Compressed map list for %zu players and language %c is too large (0x%zX bytes)",
+        num_players, char_for_language_code(language), compressed_map_list.size());
+    return "";
+  }
+  size_t decompressed_size = sizeof(header) + entries_w.size() + strings_w.size();
+  static_game_data_log.info("Generated Episode 3 compressed map list for %zu player(s) and language %c (%zu maps; 0x%zX -> 0x%zX bytes)",
+      num_players, char_for_language_code(language), num_maps, decompressed_size, compressed_map_list.size());
   return compressed_map_list;
 }
 
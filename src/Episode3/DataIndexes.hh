@@ -1544,7 +1544,10 @@ public:
       const std::string& text_filename = "",
       const std::string& decompressed_text_filename = "",
       const std::string& dice_text_filename = "",
-      const std::string& decompressed_dice_text_filename = "");
+      const std::string& decompressed_dice_text_filename = "",
+      // If not empty, decoded card text and compressed card definitions are
+      // cached here, so unchanged files load faster the next time
+      const std::string& cache_directory = "");
 
   struct CardEntry {
     CardDefinition def;
@@ -1556,6 +1559,12 @@ public:
 
   const std::string& get_compressed_definitions() const;
   std::shared_ptr<const CardEntry> definition_for_id(uint32_t id) const;
+  // Returns nullptr if there is no card with the given ID. The battle engine
+  // looks up card definitions very frequently, so this is a direct array
+  // lookup rather than a hash table lookup.
+  inline const CardEntry* find_definition(uint32_t id) const {
+    return (id < this->card_definitions_by_id.size()) ? this->card_definitions_by_id[id] : nullptr;
+  }
   std::shared_ptr<const CardEntry> definition_for_name(const std::string& name) const;
   std::shared_ptr<const CardEntry> definition_for_name_normalized(const std::string& name) const;
   std::set<uint32_t> all_ids() const;
@@ -1567,6 +1576,9 @@ private:
 
   std::string compressed_card_definitions;
   std::unordered_map<uint32_t, std::shared_ptr<CardEntry>> card_definitions;
+  // Indexed by card ID; entries are null for nonexistent cards. The pointers
+  // are owned by card_definitions.
+  std::vector<const CardEntry*> card_definitions_by_id;
   std::unordered_map<std::string, std::shared_ptr<CardEntry>> card_definitions_by_name;
   std::unordered_map<std::string, std::shared_ptr<CardEntry>> card_definitions_by_name_normalized;
   uint64_t mtime_for_card_definitions;
@@ -1574,7 +1586,9 @@ private:
 
 class MapIndex {
 public:
-  MapIndex(const std::string& directory);
+  // If cache_directory is not empty, decoded and compressed maps are cached
+  // there, so unchanged map files load faster the next time
+  explicit MapIndex(const std::string& directory, const std::string& cache_directory = "");
 
   class VersionedMap {
   public:
@@ -1583,14 +1597,36 @@ public:
 
     VersionedMap(std::shared_ptr<const MapDefinition> map, uint8_t language);
     VersionedMap(std::string&& compressed_data, uint8_t language);
-
-    std::shared_ptr<const MapDefinitionTrial> trial() const;
-    const std::string& compressed(bool is_nte) const;
+    // Used when loading from the cache; the compressed data must match map
+    VersionedMap(
+        std::shared_ptr<const MapDefinition> map,
+        uint8_t language,
+        std::string&& compressed_data,
+        std::string&& compressed_trial_data);
+
+    inline std::shared_ptr<const MapDefinitionTrial> trial() const {
+      return this->trial_map;
+    }
+    inline const std::string& compressed(bool is_nte) const {
+      return is_nte ? this->compressed_trial_data : this->compressed_data;
+    }
+    // Returns the complete 6xB6x41 command (header and compressed map data)
+    // that sends this map to a client
+    inline const std::string& map_definition_command(bool is_nte) const {
+      return is_nte ? this->trial_map_command_data : this->map_command_data;
+    }
 
   private:
-    mutable std::shared_ptr<const MapDefinitionTrial> trial_map;
-    mutable std::string compressed_data;
-    mutable std::string compressed_trial_data;
+    // All of these are generated when the map is loaded, so VersionedMap is
+    // immutable after construction and can be shared between threads
+    std::shared_ptr<const MapDefinitionTrial> trial_map;
+    std::string compressed_data;
+    std::string compressed_trial_data;
+    std::string map_command_data;
+    std::string trial_map_command_data;
+
+    void generate_derived_data();
+    std::string generate_map_definition_command(const std::string& compressed) const;
   };
 
   class Map {
@@ -1612,15 +1648,25 @@ public:
   };
 
   const std::string& get_compressed_list(size_t num_players, uint8_t language) const;
+  // Returns the complete 6xB6x40 command (header, compressed map list, and
+  // padding) for the given player count and language
+  const std::string& get_map_list_command(size_t num_players, uint8_t language) const;
   std::shared_ptr<const Map> for_number(uint32_t id) const;
   std::shared_ptr<const Map> for_name(const std::string& name) const;
   std::set<uint32_t> all_numbers() const;
 
 private:
-  // The compressed map lists are generated on demand from the maps map below
-  mutable std::vector<std::array<std::string, 4>> compressed_map_lists;
+  // The compressed map lists and 6xB6x40 commands are generated when the index
+  // is loaded, for each player count (1-4) and each language (0-7). Languages
+  // outside that range use the English lists.
+  static constexpr size_t NUM_MAP_LIST_LANGUAGES = 8;
+  std::array<std::array<std::string, 4>, NUM_MAP_LIST_LANGUAGES> compressed_map_lists;
+  std::array<std::array<std::string, 4>, NUM_MAP_LIST_LANGUAGES> map_list_commands;
   std::map<uint32_t, std::shared_ptr<Map>> maps;
   std::unordered_map<std::string, std::shared_ptr<Map>> maps_by_name;
+
+  std::string generate_compressed_list(size_t num_players, uint8_t language) const;
+  static uint8_t map_list_language(uint8_t language);
 };
 
 class COMDeckIndex {
@@ -59,6 +59,12 @@ bool DeckState::contains_card_ref(uint16_t card_ref) const {
   return index_for_card_ref(card_ref) < this->entries.size();
 }
 
+shared_ptr<DeckState> DeckState::clone(shared_ptr<Server> server) const {
+  auto ret = make_shared<DeckState>(*this);
+  ret->server = server;
+  return ret;
+}
+
 void DeckState::disable_loop() {
   this->loop_enabled = false;
 }
@@ -76,6 +76,8 @@ public:
     this->entries[0].state = CardState::STORY_CHARACTER;
   }
 
+  std::shared_ptr<DeckState> clone(std::shared_ptr<Server> server) const;
+
   void disable_loop();
   void disable_shuffle();
 
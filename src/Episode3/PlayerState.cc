@@ -124,6 +124,12 @@ shared_ptr<Server> PlayerState::server() {
   return s;
 }
 
+shared_ptr<PlayerState> PlayerState::clone(shared_ptr<Server> server) const {
+  auto ret = make_shared<PlayerState>(*this);
+  ret->w_server = server;
+  return ret;
+}
+
 shared_ptr<const Server> PlayerState::server() const {
   auto s = this->w_server.lock();
   if (!s) {
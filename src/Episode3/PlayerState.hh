@@ -44,6 +44,10 @@ class PlayerState : public std::enable_shared_from_this<PlayerState> {
 public:
   PlayerState(uint8_t client_id, std::shared_ptr<Server> server);
   void init();
+  // Returns a copy of this player state that belongs to the given server. The
+  // copy still shares its cards, deck state, and other subordinate objects
+  // with this player state; Server::clone replaces them.
+  std::shared_ptr<PlayerState> clone(std::shared_ptr<Server> server) const;
   std::shared_ptr<Server> server();
   std::shared_ptr<const Server> server() const;
 
@@ -29,10 +29,8 @@ void compute_effective_range(
     // Heavy Fog: one tile directly in front
     range_def[3] = 0x00000100;
   } else {
-    shared_ptr<const CardIndex::CardEntry> ce;
-    try {
-      ce = card_index->definition_for_id(card_id);
-    } catch (const out_of_range&) {
+    auto ce = card_index->find_definition(card_id);
+    if (!ce) {
       return;
     }
     for (size_t z = 0; z < 6; z++) {
@@ -114,9 +112,9 @@ void compute_effective_range(
 }
 
 bool card_linkage_is_valid(
-    shared_ptr<const CardIndex::CardEntry> right_ce,
-    shared_ptr<const CardIndex::CardEntry> left_ce,
-    shared_ptr<const CardIndex::CardEntry> sc_ce,
+    const CardIndex::CardEntry* right_ce,
+    const CardIndex::CardEntry* left_ce,
+    const CardIndex::CardEntry* sc_ce,
     bool has_permission_effect) {
   if (!right_ce) {
     return false;
@@ -190,6 +188,12 @@ shared_ptr<Server> RulerServer::server() {
   return s;
 }
 
+shared_ptr<RulerServer> RulerServer::clone(shared_ptr<Server> server) const {
+  auto ret = make_shared<RulerServer>(*this);
+  ret->w_server = server;
+  return ret;
+}
+
 shared_ptr<const Server> RulerServer::server() const {
   auto s = this->w_server.lock();
   if (!s) {
@@ -941,7 +945,7 @@ bool RulerServer::check_usability_or_condition_apply(
     AttackMedium attack_medium) const {
   auto s = this->server();
   bool is_nte = s->options.is_nte();
-  auto log = s->log_stack(phosg::string_printf("check_usability_or_condition_apply(%02hhX, #%04hX, %02hhX, #%04hX, #%04hX, %02hhX, %s, %s): ", client_id1, card_id1, client_id2, card_id2, card_id3, def_effect_index, is_item_usability_check ? "true" : "false", phosg::name_for_enum(attack_medium)));
+  auto log = s->log_stack_printf("check_usability_or_condition_apply(%02hhX, #%04hX, %02hhX, #%04hX, #%04hX, %02hhX, %s, %s): ", client_id1, card_id1, client_id2, card_id2, card_id3, def_effect_index, is_item_usability_check ? "true" : "false", phosg::name_for_enum(attack_medium));
 
   if (static_cast<uint8_t>(attack_medium) & 0x80) {
     attack_medium = AttackMedium::UNKNOWN;
@@ -1672,7 +1676,7 @@ bool RulerServer::defense_card_matches_any_attack_card_top_color(const ActionSta
   return false;
 }
 
-shared_ptr<const CardIndex::CardEntry> RulerServer::definition_for_card_ref(uint16_t card_ref) const {
+const CardIndex::CardEntry* RulerServer::definition_for_card_ref(uint16_t card_ref) const {
   uint16_t card_id = this->card_id_for_card_ref(card_ref);
   if (card_id == 0xFFFF) {
     return nullptr;
@@ -2053,13 +2057,13 @@ uint16_t RulerServer::get_ally_sc_card_ref(uint16_t card_ref) const {
   return 0xFFFF;
 }
 
-shared_ptr<const CardIndex::CardEntry> RulerServer::definition_for_card_id(uint32_t card_id) const {
+const CardIndex::CardEntry* RulerServer::definition_for_card_id(uint32_t card_id) const {
   return this->server()->definition_for_card_id(card_id);
 }
 
 uint32_t RulerServer::get_card_id_with_effective_range(
     uint16_t card_ref, uint16_t card_id_override, TargetMode* out_target_mode) const {
-  auto log = this->server()->log_stack(phosg::string_printf("get_card_id_with_effective_range(@%04hX, #%04hX): ", card_ref, card_id_override));
+  auto log = this->server()->log_stack_printf("get_card_id_with_effective_range(@%04hX, #%04hX): ", card_ref, card_id_override);
 
   uint16_t card_id = (card_id_override == 0xFFFF)
       ? this->card_id_for_card_ref(card_ref)
@@ -22,9 +22,9 @@ void compute_effective_range(
     phosg::PrefixedLogger* log = nullptr);
 
 bool card_linkage_is_valid(
-    std::shared_ptr<const CardIndex::CardEntry> right_def,
-    std::shared_ptr<const CardIndex::CardEntry> left_def,
-    std::shared_ptr<const CardIndex::CardEntry> sc_def,
+    const CardIndex::CardEntry* right_def,
+    const CardIndex::CardEntry* left_def,
+    const CardIndex::CardEntry* sc_def,
     bool has_permission_effect);
 
 class RulerServer {
@@ -46,6 +46,9 @@ public:
   };
 
   explicit RulerServer(std::shared_ptr<Server> server);
+  // The copy still shares its per-player state objects, map and rules, state
+  // flags, and assist server with this object; Server::clone replaces them.
+  std::shared_ptr<RulerServer> clone(std::shared_ptr<Server> server) const;
   std::shared_ptr<Server> server();
   std::shared_ptr<const Server> server() const;
 
@@ -122,7 +125,7 @@ public:
       uint16_t attacker_card_ref,
       uint16_t attacker_sc_card_ref) const;
   bool defense_card_matches_any_attack_card_top_color(const ActionState& pa) const;
-  std::shared_ptr<const CardIndex::CardEntry> definition_for_card_ref(uint16_t card_ref) const;
+  const CardIndex::CardEntry* definition_for_card_ref(uint16_t card_ref) const;
   int32_t error_code_for_client_setting_card(
       uint8_t client_id,
       uint16_t card_ref,
@@ -148,7 +151,7 @@ public:
       size_t num_occupied_tiles,
       size_t num_vacant_tiles) const;
   uint16_t get_ally_sc_card_ref(uint16_t card_ref) const;
-  std::shared_ptr<const CardIndex::CardEntry> definition_for_card_id(uint32_t card_id) const;
+  const CardIndex::CardEntry* definition_for_card_id(uint32_t card_id) const;
   uint32_t get_card_id_with_effective_range(
       uint16_t card_ref, uint16_t card_id_override, TargetMode* out_target_mode) const;
   uint8_t get_card_ref_max_hp(uint16_t card_ref) const;
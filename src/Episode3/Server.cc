@@ -1,9 +1,12 @@
 #include "Server.hh"
 
+#include <functional>
 #include <phosg/Random.hh>
 #include <phosg/Time.hh>
+#include <unordered_map>
 
 #include "../Loggers.hh"
+#include "../PSOEncryption.hh"
 #include "../Revision.hh"
 #include "../SendCommands.hh"
 
@@ -29,6 +32,29 @@ void Server::PresenceEntry::clear() {
   this->is_cpu_player = 0;
 }
 
+Server::Options Server::options_for_record_replay(
+    shared_ptr<const BattleRecord> rec,
+    shared_ptr<const CardIndex> card_index,
+    shared_ptr<const MapIndex> map_index,
+    const array<vector<uint16_t>, 5>& trap_card_ids) {
+  uint32_t behavior_flags = rec->get_behavior_flags() &
+      ~(BehaviorFlag::ENABLE_RECORDING |
+          BehaviorFlag::ENABLE_STATUS_MESSAGES |
+          BehaviorFlag::LOG_COMMANDS_IF_LOBBY_MISSING);
+  // Masking is disabled so the generated commands can be compared directly,
+  // and time limits are disabled since there is no real time in a replay
+  behavior_flags |= (BehaviorFlag::DISABLE_MASKING | BehaviorFlag::DISABLE_TIME_LIMITS);
+  return Options{
+      .card_index = card_index,
+      .map_index = map_index,
+      .behavior_flags = behavior_flags,
+      .opt_rand_stream = make_shared<phosg::StringReader>(rec->get_random_stream()),
+      .opt_rand_crypt = nullptr,
+      .tournament = nullptr,
+      .trap_card_ids = trap_card_ids,
+  };
+}
+
 Server::Server(shared_ptr<Lobby> lobby, Options&& options)
     : lobby(lobby),
       battle_record(lobby ? lobby->battle_record : nullptr),
@@ -120,10 +146,229 @@ void Server::init() {
   this->send_6xB4x46();
 }
 
-Server::StackLogger::StackLogger(const Server* s, const std::string& prefix)
-    : PrefixedLogger(s->logger_stack.back()->prefix + prefix, s->logger_stack.back()->min_level),
-      server(s) {
-  s->logger_stack.push_back(this);
+template <typename T>
+class SharedObjectCopier {
+public:
+  explicit SharedObjectCopier(function<shared_ptr<T>(const T&)> copy_fn = [](const T& obj) -> shared_ptr<T> {
+    return make_shared<T>(obj);
+  })
+      : copy_fn(std::move(copy_fn)) {}
+
+  // Returns the copy of obj, making it if needed. Each object is copied only
+  // once, so objects shared between several owners remain shared between the
+  // corresponding copies of those owners.
+  shared_ptr<T> operator()(const shared_ptr<T>& obj) {
+    if (!obj) {
+      return nullptr;
+    }
+    auto it = this->copies.find(obj.get());
+    if (it == this->copies.end()) {
+      it = this->copies.emplace(obj.get(), this->copy_fn(*obj)).first;
+    }
+    return it->second;
+  }
+
+  shared_ptr<T> find(const T* obj) const {
+    auto it = this->copies.find(obj);
+    return (it == this->copies.end()) ? nullptr : it->second;
+  }
+
+  const unordered_map<const T*, shared_ptr<T>>& all() const {
+    return this->copies;
+  }
+
+private:
+  function<shared_ptr<T>(const T&)> copy_fn;
+  unordered_map<const T*, shared_ptr<T>> copies;
+};
+
+static shared_ptr<PSOLFGEncryption> copy_random_crypt(shared_ptr<const PSOLFGEncryption> crypt) {
+  if (!crypt) {
+    return nullptr;
+  }
+  switch (crypt->type()) {
+    case PSOEncryption::Type::V2:
+      return make_shared<PSOV2Encryption>(*static_pointer_cast<const PSOV2Encryption>(crypt));
+    case PSOEncryption::Type::V3:
+      return make_shared<PSOV3Encryption>(*static_pointer_cast<const PSOV3Encryption>(crypt));
+    default:
+      throw logic_error("unsupported random generator type");
+  }
+}
+
+shared_ptr<Server> Server::clone() const {
+  // Clones can only be made between commands; in the middle of a command, some
+  // state is held on the stack and wouldn't be copied
+  if (this->logger_stack.size() != 1) {
+    throw logic_error("cannot clone server while a command is being processed");
+  }
+
+  Options options = this->options;
+  if (options.opt_rand_stream) {
+    options.opt_rand_stream = make_shared<phosg::StringReader>(*options.opt_rand_stream);
+  }
+  options.opt_rand_crypt = copy_random_crypt(options.opt_rand_crypt);
+  auto ret = make_shared<Server>(nullptr, std::move(options));
+
+  // Note: When adding fields to Server, they must also be copied here. The
+  // lobby and battle record are intentionally not copied, since a clone must
+  // not send anything to (or record anything for) the original's clients.
+  ret->last_chosen_map = this->last_chosen_map;
+  ret->tournament_match_result_sent = this->tournament_match_result_sent;
+  ret->override_environment_number = this->override_environment_number;
+  ret->def_dice_value_range_override = this->def_dice_value_range_override;
+  ret->atk_dice_value_range_2v1_override = this->atk_dice_value_range_2v1_override;
+  ret->def_dice_value_range_2v1_override = this->def_dice_value_range_2v1_override;
+  ret->presence_entries = this->presence_entries;
+  ret->num_clients_present = this->num_clients_present;
+  ret->name_entries = this->name_entries;
+  ret->name_entries_valid = this->name_entries_valid;
+  ret->overlay_state = this->overlay_state;
+  ret->client_card_counts = this->client_card_counts;
+  ret->battle_finished = this->battle_finished;
+  ret->battle_in_progress = this->battle_in_progress;
+  ret->round_num = this->round_num;
+  ret->battle_phase = this->battle_phase;
+  ret->first_team_turn = this->first_team_turn;
+  ret->current_team_turn1 = this->current_team_turn1;
+  ret->setup_phase = this->setup_phase;
+  ret->registration_phase = this->registration_phase;
+  ret->action_subphase = this->action_subphase;
+  ret->current_team_turn2 = this->current_team_turn2;
+  ret->pending_attacks = this->pending_attacks;
+  ret->num_pending_attacks = this->num_pending_attacks;
+  ret->client_done_enqueuing_attacks = this->client_done_enqueuing_attacks;
+  ret->player_ready_to_end_phase = this->player_ready_to_end_phase;
+  ret->unknown_a10 = this->unknown_a10;
+  ret->overall_time_expired = this->overall_time_expired;
+  ret->battle_start_usecs = this->battle_start_usecs;
+  ret->should_copy_prev_states_to_current_states = this->should_copy_prev_states_to_current_states;
+  ret->clients_done_in_mulligan_phase = this->clients_done_in_mulligan_phase;
+  ret->num_pending_attacks_with_cards = this->num_pending_attacks_with_cards;
+  ret->pending_attacks_with_cards = this->pending_attacks_with_cards;
+  ret->unknown_a14 = this->unknown_a14;
+  ret->unknown_a15 = this->unknown_a15;
+  ret->defense_list_ended_for_client = this->defense_list_ended_for_client;
+  ret->next_assist_card_set_number = this->next_assist_card_set_number;
+  ret->warp_positions = this->warp_positions;
+  ret->team_exp = this->team_exp;
+  ret->team_dice_bonus = this->team_dice_bonus;
+  ret->team_client_count = this->team_client_count;
+  ret->team_num_ally_fcs_destroyed = this->team_num_ally_fcs_destroyed;
+  ret->team_num_cards_destroyed = this->team_num_cards_destroyed;
+  ret->num_trap_tiles_of_type = this->num_trap_tiles_of_type;
+  ret->chosen_trap_tile_index_of_type = this->chosen_trap_tile_index_of_type;
+  ret->trap_tile_locs = this->trap_tile_locs;
+  ret->trap_tile_locs_nte = this->trap_tile_locs_nte;
+  ret->num_trap_tiles_nte = this->num_trap_tiles_nte;
+  ret->pb_action_states = this->pb_action_states;
+  ret->has_done_pb = this->has_done_pb;
+  ret->has_done_pb_with_client = this->has_done_pb_with_client;
+  ret->num_6xB4x06_commands_sent = this->num_6xB4x06_commands_sent;
+  ret->prev_num_6xB4x06_commands_sent = this->prev_num_6xB4x06_commands_sent;
+
+  // The remaining state is spread across several objects that refer to each
+  // other, so we copy each object once and point all the copies' references at
+  // the other copies. Card definitions, maps, and the tournament are immutable
+  // and are shared with the original.
+  SharedObjectCopier<MapAndRulesState> copy_map_and_rules;
+  SharedObjectCopier<StateFlags> copy_state_flags;
+  SharedObjectCopier<DeckEntry> copy_deck_entry;
+  SharedObjectCopier<HandAndEquipState> copy_hes;
+  SharedObjectCopier<parray<CardShortStatus, 0x10>> copy_short_statuses;
+  SharedObjectCopier<parray<ActionChainWithConds, 9>> copy_action_chains;
+  SharedObjectCopier<parray<ActionMetadata, 9>> copy_action_metadatas;
+  SharedObjectCopier<Card> copy_card([&](const Card& card) -> shared_ptr<Card> {
+    return card.clone(ret);
+  });
+
+  ret->map_and_rules = copy_map_and_rules(this->map_and_rules);
+  ret->state_flags = copy_state_flags(this->state_flags);
+  for (size_t z = 0; z < 4; z++) {
+    ret->deck_entries[z] = copy_deck_entry(this->deck_entries[z]);
+  }
+
+  // Player states must all exist before any cards are copied, since cards look
+  // up their player states by client ID
+  for (size_t z = 0; z < 4; z++) {
+    ret->player_states[z] = this->player_states[z] ? this->player_states[z]->clone(ret) : nullptr;
+  }
+  for (size_t z = 0; z < 4; z++) {
+    auto ps = ret->player_states[z];
+    if (!ps) {
+      continue;
+    }
+    ps->sc_card = copy_card(ps->sc_card);
+    for (size_t set_index = 0; set_index < ps->set_cards.size(); set_index++) {
+      ps->set_cards[set_index] = copy_card(ps->set_cards[set_index]);
+    }
+    ps->deck_state = ps->deck_state ? ps->deck_state->clone(ret) : nullptr;
+    ps->hand_and_equip = copy_hes(ps->hand_and_equip);
+    ps->card_short_statuses = copy_short_statuses(ps->card_short_statuses);
+    ps->set_card_action_chains = copy_action_chains(ps->set_card_action_chains);
+    ps->set_card_action_metadatas = copy_action_metadatas(ps->set_card_action_metadatas);
+  }
+  for (size_t z = 0; z < this->attack_cards.size(); z++) {
+    ret->attack_cards[z] = copy_card(this->attack_cards[z]);
+  }
+  // Destroyer cards are always SCs, which were all copied above
+  for (const auto& [orig_card, new_card] : copy_card.all()) {
+    auto orig_destroyer_card = orig_card->w_destroyer_sc_card.lock();
+    new_card->w_destroyer_sc_card = orig_destroyer_card ? copy_card.find(orig_destroyer_card.get()) : nullptr;
+  }
+
+  if (this->card_special) {
+    ret->card_special = make_shared<CardSpecial>(ret);
+  }
+  if (this->assist_server) {
+    ret->assist_server = this->assist_server->clone(ret);
+    for (size_t z = 0; z < 4; z++) {
+      ret->assist_server->hand_and_equip_states[z] = copy_hes(this->assist_server->hand_and_equip_states[z]);
+      ret->assist_server->card_short_statuses[z] = copy_short_statuses(this->assist_server->card_short_statuses[z]);
+      ret->assist_server->deck_entries[z] = copy_deck_entry(this->assist_server->deck_entries[z]);
+      ret->assist_server->set_card_action_chains[z] = copy_action_chains(this->assist_server->set_card_action_chains[z]);
+      ret->assist_server->set_card_action_metadatas[z] = copy_action_metadatas(this->assist_server->set_card_action_metadatas[z]);
+    }
+  }
+  if (this->ruler_server) {
+    ret->ruler_server = this->ruler_server->clone(ret);
+    for (size_t z = 0; z < 4; z++) {
+      ret->ruler_server->hand_and_equip_states[z] = copy_hes(this->ruler_server->hand_and_equip_states[z]);
+      ret->ruler_server->short_statuses[z] = copy_short_statuses(this->ruler_server->short_statuses[z]);
+      ret->ruler_server->deck_entries[z] = copy_deck_entry(this->ruler_server->deck_entries[z]);
+      ret->ruler_server->set_card_action_chains[z] = copy_action_chains(this->ruler_server->set_card_action_chains[z]);
+      ret->ruler_server->set_card_action_metadatas[z] = copy_action_metadatas(this->ruler_server->set_card_action_metadatas[z]);
+    }
+    ret->ruler_server->link_objects(
+        copy_map_and_rules(this->ruler_server->map_and_rules),
+        copy_state_flags(this->ruler_server->state_flags),
+        ret->assist_server);
+  }
+
+  return ret;
+}
+
+static phosg::LogLevel inert_logger_min_level(phosg::LogLevel parent_min_level) {
+  return (parent_min_level < phosg::LogLevel::INFO) ? phosg::LogLevel::INFO : parent_min_level;
+}
+
+bool Server::StackLogger::debug_enabled(const Server* s) {
+#ifdef EP3_DISABLE_DEBUG_LOGGING
+  (void)s;
+  return false;
+#else
+  return s->logger_stack.back()->should_log(phosg::LogLevel::DEBUG);
+#endif
+}
+
+Server::StackLogger::StackLogger(const Server* s, const char* prefix)
+    : PrefixedLogger(
+          debug_enabled(s) ? (s->logger_stack.back()->prefix + prefix) : std::string(),
+          debug_enabled(s) ? s->logger_stack.back()->min_level : inert_logger_min_level(s->logger_stack.back()->min_level)),
+      server(debug_enabled(s) ? s : nullptr) {
+  if (this->server) {
+    s->logger_stack.push_back(this);
+  }
 }
 
 Server::StackLogger::StackLogger(const Server* s, const std::string& prefix, phosg::LogLevel min_level)
@@ -135,33 +380,52 @@ Server::StackLogger::StackLogger(const Server* s, const std::string& prefix, pho
 Server::StackLogger::StackLogger(StackLogger&& other)
     : PrefixedLogger(std::move(other)),
       server(other.server) {
-  if (this->server->logger_stack.back() != &other) {
-    throw logic_error("cannot move StackLogger unless it is the last one");
+  if (this->server) {
+    if (this->server->logger_stack.back() != &other) {
+      throw logic_error("cannot move StackLogger unless it is the last one");
+    }
+    this->server->logger_stack.back() = this;
+    other.server = nullptr;
   }
-  this->server->logger_stack.back() = this;
 }
 
 Server::StackLogger& Server::StackLogger::operator=(StackLogger&& other) {
   this->PrefixedLogger::operator=(std::move(other));
   this->server = other.server;
-  if (this->server->logger_stack.back() != &other) {
-    throw logic_error("cannot move StackLogger unless it is the last one");
+  if (this->server) {
+    if (this->server->logger_stack.back() != &other) {
+      throw logic_error("cannot move StackLogger unless it is the last one");
+    }
+    this->server->logger_stack.back() = this;
+    other.server = nullptr;
   }
-  this->server->logger_stack.back() = this;
   return *this;
 }
 
 Server::StackLogger::~StackLogger() noexcept(false) {
-  if (this->server->logger_stack.back() != this) {
-    throw logic_error("incorrect logger stack unwind order");
+  if (this->server) {
+    if (this->server->logger_stack.back() != this) {
+      throw logic_error("incorrect logger stack unwind order");
+    }
+    this->server->logger_stack.pop_back();
   }
-  this->server->logger_stack.pop_back();
 }
 
-Server::StackLogger Server::log_stack(const std::string& prefix) const {
+Server::StackLogger Server::log_stack(const char* prefix) const {
   return StackLogger(this, prefix);
 }
 
+Server::StackLogger Server::log_stack_printf(const char* fmt, ...) const {
+  if (!StackLogger::debug_enabled(this)) {
+    return StackLogger(this, "");
+  }
+  va_list va;
+  va_start(va, fmt);
+  std::string prefix = phosg::string_vprintf(fmt, va);
+  va_end(va);
+  return StackLogger(this, prefix.c_str());
+}
+
 const Server::StackLogger& Server::log() const {
   return *this->logger_stack.back();
 }
@@ -259,9 +523,14 @@ void Server::send(const void* data, size_t size, uint8_t command, bool enable_ma
       this->battle_record->add_command(BattleRecord::Event::Type::BATTLE_COMMAND, data, size);
     }
 
-  } else if ((this->options.behavior_flags & BehaviorFlag::LOG_COMMANDS_IF_LOBBY_MISSING) &&
-      this->log().info("Generated command")) {
-    phosg::print_data(stderr, data, size, 0, nullptr, phosg::PrintDataFlags::PRINT_ASCII | phosg::PrintDataFlags::DISABLE_COLOR | phosg::PrintDataFlags::OFFSET_16_BITS);
+  } else {
+    if (this->lobbyless_command_handler) {
+      this->lobbyless_command_handler(command, data, size);
+    }
+    if ((this->options.behavior_flags & BehaviorFlag::LOG_COMMANDS_IF_LOBBY_MISSING) &&
+        this->log().info("Generated command")) {
+      phosg::print_data(stderr, data, size, 0, nullptr, phosg::PrintDataFlags::PRINT_ASCII | phosg::PrintDataFlags::DISABLE_COLOR | phosg::PrintDataFlags::OFFSET_16_BITS);
+    }
   }
 }
 
@@ -279,16 +548,8 @@ void Server::send_6xB4x46() const {
   this->send(cmd);
 }
 
-string Server::prepare_6xB6x41_map_definition(shared_ptr<const MapIndex::Map> map, uint8_t language, bool is_nte) {
-  auto vm = map->version(language);
-
-  const auto& compressed = vm->compressed(is_nte);
-
-  phosg::StringWriter w;
-  uint32_t subcommand_size = (compressed.size() + sizeof(G_MapData_Ep3_6xB6x41) + 3) & (~3);
-  w.put<G_MapData_Ep3_6xB6x41>({{{{0xB6, 0, 0}, subcommand_size}, 0x41, {}}, vm->map->map_number.load(), compressed.size(), 0});
-  w.write(compressed);
-  return std::move(w.str());
+const string& Server::prepare_6xB6x41_map_definition(shared_ptr<const MapIndex::Map> map, uint8_t language, bool is_nte) {
+  return map->version(language)->map_definition_command(is_nte);
 }
 
 void Server::send_commands_for_joining_spectator(Channel& ch) const {
@@ -303,44 +564,65 @@ void Server::send_commands_for_joining_spectator(Channel& ch) const {
   }
 
   if (this->last_chosen_map) {
-    string data = this->prepare_6xB6x41_map_definition(this->last_chosen_map, ch.language, this->options.is_nte());
+    const auto& data = this->prepare_6xB6x41_map_definition(this->last_chosen_map, ch.language, this->options.is_nte());
     this->log().info("Sending %c version of map %08" PRIX32, char_for_language_code(ch.language), this->last_chosen_map->map_number);
     ch.send(0x6C, 0x00, data);
   }
 
   if (should_send_state) {
-    ch.send(0xC9, 0x00, this->prepare_6xB4x03());
-    for (uint8_t client_id = 0; client_id < 4; client_id++) {
-      auto ps = this->player_states[client_id];
-      if (ps) {
-        ch.send(0xC9, 0x00, ps->prepare_6xB4x02());
-        ch.send(0xC9, 0x00, ps->prepare_6xB4x04());
-      }
-    }
-    if (ch.version == Version::GC_EP3_NTE) {
-      G_UpdateMap_Ep3NTE_6xB4x05 cmd;
-      cmd.state = *this->map_and_rules;
-      ch.send(0xC9, 0x00, cmd);
-    } else {
-      G_UpdateMap_Ep3_6xB4x05 cmd;
-      cmd.state = *this->map_and_rules;
+    for (const auto& cmd : this->prepare_battle_state_commands(ch.version == Version::GC_EP3_NTE)) {
       ch.send(0xC9, 0x00, cmd);
     }
-    // TODO: Sega does something like this; do we have to do this too?
-    // for (uint8_t client_id = 0; client_id < 4; client_id++) {
-    //   (send 6xB4x4E, 6xB4x4C, 6xB4x4D for each set card)
-    //   (send 6xB4x4F for client_id)
-    // }
-    ch.send(0xC9, 0x00, this->prepare_6xB4x07_decks_update());
-    // TODO: Sega sends 6xB4x05 here again; why? Is that necessary? They also
-    // send 6xB4x02 again for each player after that (but not 6xB4x04)
-    ch.send(0xC9, 0x00, this->prepare_6xB4x1C_names_update());
-    ch.send(0xC9, 0x00, this->prepare_6xB4x50_trap_tile_locations());
-    {
-      G_LoadCurrentEnvironment_Ep3_6xB4x3B cmd_3B;
-      ch.send(0xC9, 0x00, &cmd_3B, sizeof(cmd_3B));
+  }
+}
+
+template <typename CmdT>
+static void append_state_command(vector<string>& ret, const CmdT& cmd) {
+  ret.emplace_back(reinterpret_cast<const char*>(&cmd), sizeof(cmd));
+}
+
+vector<string> Server::prepare_battle_state_commands(bool is_nte) const {
+  vector<string> ret;
+  append_state_command(ret, this->prepare_6xB4x03());
+  for (uint8_t client_id = 0; client_id < 4; client_id++) {
+    auto ps = this->player_states[client_id];
+    if (ps) {
+      append_state_command(ret, ps->prepare_6xB4x02());
+      append_state_command(ret, ps->prepare_6xB4x04());
     }
   }
+  if (is_nte) {
+    G_UpdateMap_Ep3NTE_6xB4x05 cmd;
+    cmd.state = *this->map_and_rules;
+    append_state_command(ret, cmd);
+  } else {
+    G_UpdateMap_Ep3_6xB4x05 cmd;
+    cmd.state = *this->map_and_rules;
+    append_state_command(ret, cmd);
+  }
+  // TODO: Sega does something like this; do we have to do this too?
+  // for (uint8_t client_id = 0; client_id < 4; client_id++) {
+  //   (send 6xB4x4E, 6xB4x4C, 6xB4x4D for each set card)
+  //   (send 6xB4x4F for client_id)
+  // }
+  append_state_command(ret, this->prepare_6xB4x07_decks_update());
+  // TODO: Sega sends 6xB4x05 here again; why? Is that necessary? They also
+  // send 6xB4x02 again for each player after that (but not 6xB4x04)
+  append_state_command(ret, this->prepare_6xB4x1C_names_update());
+  append_state_command(ret, this->prepare_6xB4x50_trap_tile_locations());
+  append_state_command(ret, G_LoadCurrentEnvironment_Ep3_6xB4x3B());
+  return ret;
+}
+
+void Server::record_keyframe_if_needed() {
+  if (!this->battle_record || !this->battle_record->writable() || !this->battle_record->battle_in_progress()) {
+    return;
+  }
+  string data;
+  for (const auto& cmd : this->prepare_battle_state_commands(this->options.is_nte())) {
+    data += cmd;
+  }
+  this->battle_record->add_keyframe(std::move(data));
 }
 
 __attribute__((format(printf, 2, 3))) void Server::send_debug_message_printf(const char* fmt, ...) const {
@@ -428,6 +710,7 @@ bool Server::advance_battle_phase() {
 }
 
 void Server::action_phase_after() {
+  auto timer = this->time_phase(PerformanceCounters::Phase::ACTION_PHASE_AFTER);
   this->send_6xB4x02_for_all_players_if_needed();
   this->battle_phase = BattlePhase::DRAW;
 }
@@ -440,12 +723,8 @@ void Server::draw_phase_before() {
   }
 }
 
-shared_ptr<const CardIndex::CardEntry> Server::definition_for_card_ref(uint16_t card_ref) const {
-  try {
-    return this->options.card_index->definition_for_id(this->card_id_for_card_ref(card_ref));
-  } catch (const out_of_range&) {
-    return nullptr;
-  }
+const CardIndex::CardEntry* Server::definition_for_card_ref(uint16_t card_ref) const {
+  return this->options.card_index->find_definition(this->card_id_for_card_ref(card_ref));
 }
 
 shared_ptr<Card> Server::card_for_set_card_ref(uint16_t card_ref) {
@@ -688,6 +967,7 @@ void Server::clear_player_flags_after_dice_phase() {
 }
 
 void Server::compute_all_map_occupied_bits() {
+  auto timer = this->time_phase(PerformanceCounters::Phase::COMPUTE_ALL_MAP_OCCUPIED_BITS);
   for (size_t y = 0; y < 0x10; y++) {
     for (size_t x = 0; x < 0x10; x++) {
       this->map_and_rules->clear_occupied_bit_for_tile(x, y);
@@ -721,12 +1001,8 @@ void Server::copy_player_states_to_prev_states() {
   }
 }
 
-shared_ptr<const CardIndex::CardEntry> Server::definition_for_card_id(uint16_t card_id) const {
-  try {
-    return this->options.card_index->definition_for_id(card_id);
-  } catch (const out_of_range&) {
-    return nullptr;
-  }
+const CardIndex::CardEntry* Server::definition_for_card_id(uint16_t card_id) const {
+  return this->options.card_index->find_definition(card_id);
 }
 
 void Server::destroy_cards_with_zero_hp() {
@@ -778,6 +1054,7 @@ void Server::determine_first_team_turn() {
 }
 
 void Server::dice_phase_after() {
+  auto timer = this->time_phase(PerformanceCounters::Phase::DICE_PHASE_AFTER);
   for (size_t client_id = 0; client_id < 4; client_id++) {
     auto ps = this->player_states[client_id];
     if (!ps) {
@@ -831,6 +1108,7 @@ void Server::draw_phase_after() {
   this->battle_phase = BattlePhase::DICE;
   this->current_team_turn1 ^= 1;
   this->round_num++;
+  this->record_keyframe_if_needed();
 
   if (this->current_team_turn1 == this->first_team_turn) {
     if (this->map_and_rules->rules.overall_time_limit > 0) {
@@ -1351,6 +1629,7 @@ void Server::set_battle_started() {
   this->update_battle_state_flags_and_send_6xB4x03_if_needed();
   this->send_6xB4x02_for_all_players_if_needed();
   this->send_6xB4x05();
+  this->record_keyframe_if_needed();
 }
 
 bool Server::player_can_receive_dice_boost(uint8_t client_id) const {
@@ -1778,32 +2057,70 @@ bool Server::update_registration_phase() {
   return true;
 }
 
-const unordered_map<uint8_t, Server::handler_t> Server::subcommand_handlers({
-    {0x0B, &Server::handle_CAx0B_mulligan_hand},
-    {0x0C, &Server::handle_CAx0C_end_mulligan_phase},
-    {0x0D, &Server::handle_CAx0D_end_non_action_phase},
-    {0x0E, &Server::handle_CAx0E_discard_card_from_hand},
-    {0x0F, &Server::handle_CAx0F_set_card_from_hand},
-    {0x10, &Server::handle_CAx10_move_fc_to_location},
-    {0x11, &Server::handle_CAx11_enqueue_attack_or_defense},
-    {0x12, &Server::handle_CAx12_end_attack_list},
-    {0x13, &Server::handle_CAx13_update_map_during_setup},
-    {0x14, &Server::handle_CAx14_update_deck_during_setup},
-    {0x15, &Server::handle_CAx15_unused_hard_reset_server_state},
-    {0x1B, &Server::handle_CAx1B_update_player_name},
-    {0x1D, &Server::handle_CAx1D_start_battle},
-    {0x21, &Server::handle_CAx21_end_battle},
-    {0x28, &Server::handle_CAx28_end_defense_list},
-    {0x2B, &Server::handle_CAx2B_legacy_set_card},
-    {0x34, &Server::handle_CAx34_subtract_ally_atk_points},
-    {0x37, &Server::handle_CAx37_client_ready_to_advance_from_starter_roll_phase},
-    {0x3A, &Server::handle_CAx3A_time_limit_expired},
-    {0x40, &Server::handle_CAx40_map_list_request},
-    {0x41, &Server::handle_CAx41_map_request},
-    {0x48, &Server::handle_CAx48_end_turn},
-    {0x49, &Server::handle_CAx49_card_counts},
+#define HANDLER_ENTRY(subsubcommand, name) \
+  {subsubcommand, {&Server::name, #name}}
+
+const unordered_map<uint8_t, Server::HandlerEntry> Server::subcommand_handlers({
+    HANDLER_ENTRY(0x0B, handle_CAx0B_mulligan_hand),
+    HANDLER_ENTRY(0x0C, handle_CAx0C_end_mulligan_phase),
+    HANDLER_ENTRY(0x0D, handle_CAx0D_end_non_action_phase),
+    HANDLER_ENTRY(0x0E, handle_CAx0E_discard_card_from_hand),
+    HANDLER_ENTRY(0x0F, handle_CAx0F_set_card_from_hand),
+    HANDLER_ENTRY(0x10, handle_CAx10_move_fc_to_location),
+    HANDLER_ENTRY(0x11, handle_CAx11_enqueue_attack_or_defense),
+    HANDLER_ENTRY(0x12, handle_CAx12_end_attack_list),
+    HANDLER_ENTRY(0x13, handle_CAx13_update_map_during_setup),
+    HANDLER_ENTRY(0x14, handle_CAx14_update_deck_during_setup),
+    HANDLER_ENTRY(0x15, handle_CAx15_unused_hard_reset_server_state),
+    HANDLER_ENTRY(0x1B, handle_CAx1B_update_player_name),
+    HANDLER_ENTRY(0x1D, handle_CAx1D_start_battle),
+    HANDLER_ENTRY(0x21, handle_CAx21_end_battle),
+    HANDLER_ENTRY(0x28, handle_CAx28_end_defense_list),
+    HANDLER_ENTRY(0x2B, handle_CAx2B_legacy_set_card),
+    HANDLER_ENTRY(0x34, handle_CAx34_subtract_ally_atk_points),
+    HANDLER_ENTRY(0x37, handle_CAx37_client_ready_to_advance_from_starter_roll_phase),
+    HANDLER_ENTRY(0x3A, handle_CAx3A_time_limit_expired),
+    HANDLER_ENTRY(0x40, handle_CAx40_map_list_request),
+    HANDLER_ENTRY(0x41, handle_CAx41_map_request),
+    HANDLER_ENTRY(0x48, handle_CAx48_end_turn),
+    HANDLER_ENTRY(0x49, handle_CAx49_card_counts),
 });
 
+#undef HANDLER_ENTRY
+
+const char* Server::name_for_subcommand_handler(uint8_t subsubcommand) {
+  auto it = subcommand_handlers.find(subsubcommand);
+  return (it == subcommand_handlers.end()) ? nullptr : it->second.name;
+}
+
+const char* Server::PerformanceCounters::name_for_phase(Phase phase) {
+  switch (phase) {
+    case Phase::DICE_PHASE_AFTER:
+      return "dice_phase_after";
+    case Phase::ACTION_PHASE_AFTER:
+      return "action_phase_after";
+    case Phase::COMPUTE_ALL_MAP_OCCUPIED_BITS:
+      return "compute_all_map_occupied_bits";
+    case Phase::CARD_SPECIAL_APPLY_ACTION_CONDITIONS:
+      return "CardSpecial::apply_action_conditions";
+    case Phase::CARD_SPECIAL_EVALUATE_AND_APPLY_EFFECTS:
+      return "CardSpecial::evaluate_and_apply_effects";
+    default:
+      throw invalid_argument("invalid phase");
+  }
+}
+
+void Server::PerformanceCounters::add(const PerformanceCounters& other) {
+  for (size_t z = 0; z < this->phases.size(); z++) {
+    this->phases[z].count += other.phases[z].count;
+    this->phases[z].total_nsecs += other.phases[z].total_nsecs;
+  }
+  for (size_t z = 0; z < this->handlers.size(); z++) {
+    this->handlers[z].count += other.handlers[z].count;
+    this->handlers[z].total_nsecs += other.handlers[z].total_nsecs;
+  }
+}
+
 void Server::on_server_data_input(shared_ptr<Client> sender_c, const string& data) {
   auto header = check_size_t<G_CardBattleCommandHeader>(data, 0xFFFF);
   size_t expected_size = header.size * 4;
@@ -1817,7 +2134,7 @@ void Server::on_server_data_input(shared_ptr<Client> sender_c, const string& dat
 
   handler_t handler = nullptr;
   try {
-    handler = this->subcommand_handlers.at(header.subsubcommand);
+    handler = this->subcommand_handlers.at(header.subsubcommand).handler;
   } catch (const out_of_range&) {
     throw runtime_error("unknown CAx subsubcommand");
   }
@@ -1826,6 +2143,9 @@ void Server::on_server_data_input(shared_ptr<Client> sender_c, const string& dat
     this->battle_record->add_command(BattleRecord::Event::Type::SERVER_DATA_COMMAND, data.data(), data.size());
   }
 
+  PerformanceCounters::Timer timer(this->performance_counters
+          ? &this->performance_counters->handlers[header.subsubcommand]
+          : nullptr);
   if ((sender_c && (sender_c->version() == Version::GC_EP3_NTE)) || !header.mask_key) {
     (this->*handler)(sender_c, data);
   } else {
@@ -2540,17 +2860,7 @@ void Server::handle_CAx40_map_list_request(shared_ptr<Client> sender_c, const st
 
   size_t num_players = l ? l->count_clients() : 1;
   uint8_t language = sender_c ? sender_c->language() : 1;
-  const auto& list_data = this->options.map_index->get_compressed_list(num_players, language);
-
-  phosg::StringWriter w;
-  uint32_t subcommand_size = (list_data.size() + sizeof(G_MapList_Ep3_6xB6x40) + 3) & (~3);
-  w.put<G_MapList_Ep3_6xB6x40>(G_MapList_Ep3_6xB6x40{{{{0xB6, 0, 0}, subcommand_size}, 0x40, {}}, list_data.size(), 0});
-  w.write(list_data);
-  while (w.size() & 3) {
-    w.put_u8(0);
-  }
-
-  const auto& out_data = w.str();
+  const auto& out_data = this->options.map_index->get_map_list_command(num_players, language);
   this->send(out_data.data(), out_data.size(), 0x6C, false);
 }
 
@@ -2561,20 +2871,20 @@ void Server::send_6xB6x41_to_all_clients() const {
 
   auto l = this->lobby.lock();
   if (l) {
-    vector<string> map_commands_by_language;
+    // The commands are precomputed by the map index, so this only refers to
+    // them; the first one sent is the one that goes into the battle record
+    const string* first_map_command = nullptr;
     auto send_to_client = [&](shared_ptr<Client> c) -> void {
       if (!c) {
         return;
       }
-      if (map_commands_by_language.size() <= c->language()) {
-        map_commands_by_language.resize(c->language() + 1);
-      }
-      if (map_commands_by_language[c->language()].empty()) {
-        map_commands_by_language[c->language()] = this->prepare_6xB6x41_map_definition(
-            this->last_chosen_map, c->language(), this->options.is_nte());
+      const auto& map_command = this->prepare_6xB6x41_map_definition(
+          this->last_chosen_map, c->language(), this->options.is_nte());
+      if (!first_map_command) {
+        first_map_command = &map_command;
       }
       this->log().info("Sending %c version of map %08" PRIX32, char_for_language_code(c->language()), this->last_chosen_map->map_number);
-      send_command(c, 0x6C, 0x00, map_commands_by_language[c->language()]);
+      send_command(c, 0x6C, 0x00, map_command);
     };
     for (const auto& c : l->clients) {
       send_to_client(c);
@@ -2589,17 +2899,14 @@ void Server::send_6xB6x41_to_all_clients() const {
       // TODO: It's not great that we just pick the first one; ideally we'd put
       // all of them in the recording and send the appropriate one to the client
       // in the playback lobby
-      for (string& data : map_commands_by_language) {
-        if (!data.empty()) {
-          this->battle_record->add_command(
-              BattleRecord::Event::Type::BATTLE_COMMAND, std::move(data));
-          break;
-        }
+      if (first_map_command) {
+        this->battle_record->add_command(
+            BattleRecord::Event::Type::BATTLE_COMMAND, first_map_command->data(), first_map_command->size());
       }
     }
 
   } else {
-    auto out_data = this->prepare_6xB6x41_map_definition(this->last_chosen_map, 1, false);
+    const auto& out_data = this->prepare_6xB6x41_map_definition(this->last_chosen_map, 1, false);
     this->send(out_data.data(), out_data.size(), 0x6C, false);
   }
 }
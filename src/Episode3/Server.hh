@@ -3,6 +3,8 @@
 #include <stdint.h>
 
 #include <array>
+#include <chrono>
+#include <functional>
 #include <memory>
 
 #include "../Channel.hh"
@@ -81,13 +83,36 @@ public:
       return (this->behavior_flags & BehaviorFlag::IS_TRIAL_EDITION);
     }
   };
+  // Returns options for replaying a battle record without a lobby. The
+  // recorded behavior flags are used, except for those that only affect
+  // recording, logging, time limits, and masking, so the replay follows the
+  // same rules as the original battle. trap_card_ids should be the trap
+  // configuration of the server that made the record.
+  static Options options_for_record_replay(
+      std::shared_ptr<const BattleRecord> rec,
+      std::shared_ptr<const CardIndex> card_index,
+      std::shared_ptr<const MapIndex> map_index,
+      const std::array<std::vector<uint16_t>, 5>& trap_card_ids);
+
   Server(std::shared_ptr<Lobby> lobby, Options&& options);
   ~Server() noexcept(false);
   void init();
 
+  // Returns a deep copy of the battle state, including the random generator's
+  // state. Commands sent to the clone don't affect this server (and vice
+  // versa), so this can be used to take a snapshot of a battle and restore it
+  // later (by cloning the snapshot again), or to explore many possible
+  // continuations from a common prefix. The clone has no lobby or battle
+  // record, so it doesn't send commands to any clients.
+  std::shared_ptr<Server> clone() const;
+
+  // Stack loggers are only used for debug messages. If debug messages would be
+  // discarded anyway, a new StackLogger is inert: it doesn't build its prefix
+  // and isn't pushed onto the logger stack, so creating one is nearly free.
+  // Building with EP3_DISABLE_DEBUG_LOGGING makes all stack loggers inert.
   class StackLogger : public phosg::PrefixedLogger {
   public:
-    StackLogger(const Server* s, const std::string& prefix);
+    StackLogger(const Server* s, const char* prefix);
     StackLogger(const Server* s, const std::string& prefix, phosg::LogLevel min_level);
     StackLogger(const StackLogger&) = delete;
     StackLogger(StackLogger&&);
@@ -95,10 +120,74 @@ public:
     StackLogger& operator=(StackLogger&&);
     ~StackLogger() noexcept(false);
 
+    static bool debug_enabled(const Server* s);
+
   private:
-    const Server* server;
+    const Server* server; // null if this logger is inert
+  };
+  // Performance counters measure the time spent in each CAx command handler
+  // and in a few expensive parts of the rules engine. They're only used for
+  // benchmarking (see the ep3-engine benchmark in Benchmarks.cc); if a
+  // server's performance_counters is null (the default), nothing is measured
+  // and a Timer is a single pointer check.
+  struct PerformanceCounters {
+    enum class Phase {
+      DICE_PHASE_AFTER = 0,
+      ACTION_PHASE_AFTER,
+      COMPUTE_ALL_MAP_OCCUPIED_BITS,
+      CARD_SPECIAL_APPLY_ACTION_CONDITIONS,
+      CARD_SPECIAL_EVALUATE_AND_APPLY_EFFECTS,
+      NUM_PHASES,
+    };
+    // Nested (recursive) calls are counted as part of the outermost call, so
+    // total_nsecs never counts the same time twice
+    struct Counter {
+      uint64_t count = 0;
+      uint64_t total_nsecs = 0;
+      size_t depth = 0;
+    };
+    std::array<Counter, static_cast<size_t>(Phase::NUM_PHASES)> phases;
+    std::array<Counter, 0x100> handlers; // Indexed by CAx subsubcommand
+
+    static const char* name_for_phase(Phase phase);
+    void add(const PerformanceCounters& other);
+
+    class Timer {
+    public:
+      explicit inline Timer(Counter* counter) : counter(counter) {
+        if (this->counter && (this->counter->depth++ == 0)) {
+          this->start = std::chrono::steady_clock::now();
+        }
+      }
+      Timer(const Timer&) = delete;
+      Timer(Timer&&) = delete;
+      Timer& operator=(const Timer&) = delete;
+      Timer& operator=(Timer&&) = delete;
+      inline ~Timer() {
+        if (this->counter && (--this->counter->depth == 0)) {
+          auto duration = std::chrono::steady_clock::now() - this->start;
+          this->counter->total_nsecs += std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+          this->counter->count++;
+        }
+      }
+
+    private:
+      Counter* counter;
+      std::chrono::steady_clock::time_point start;
+    };
   };
-  StackLogger log_stack(const std::string& prefix) const;
+  inline PerformanceCounters::Timer time_phase(PerformanceCounters::Phase phase) const {
+    return PerformanceCounters::Timer(this->performance_counters
+            ? &this->performance_counters->phases[static_cast<size_t>(phase)]
+            : nullptr);
+  }
+  // Returns the name of the handler function for a CAx subsubcommand, or null
+  // if there is no handler for it
+  static const char* name_for_subcommand_handler(uint8_t subsubcommand);
+
+  StackLogger log_stack(const char* prefix) const;
+  // Like log_stack, but the prefix is only formatted if it will be used
+  __attribute__((format(printf, 2, 3))) StackLogger log_stack_printf(const char* fmt, ...) const;
   const StackLogger& log() const;
 
   std::string debug_str_for_card_ref(uint16_t card_ref) const;
@@ -146,6 +235,10 @@ public:
   }
   void send(const void* data, size_t size, uint8_t command = 0xC9, bool enable_masking = true) const;
   void send_commands_for_joining_spectator(Channel& ch) const;
+  // Returns the 6xB4 commands that set the entire battle state (these are sent
+  // to joining spectators, and are saved in battle records as keyframes)
+  std::vector<std::string> prepare_battle_state_commands(bool is_nte) const;
+  void record_keyframe_if_needed();
 
   void force_battle_result(uint8_t surrendered_client_id, bool set_winner);
   void force_replace_assist_card(uint8_t client_id, uint16_t card_id);
@@ -166,7 +259,7 @@ public:
   bool advance_battle_phase();
   void action_phase_after();
   void draw_phase_before();
-  std::shared_ptr<const CardIndex::CardEntry> definition_for_card_ref(uint16_t card_ref) const;
+  const CardIndex::CardEntry* definition_for_card_ref(uint16_t card_ref) const;
   std::shared_ptr<Card> card_for_set_card_ref(uint16_t card_ref);
   std::shared_ptr<const Card> card_for_set_card_ref(uint16_t card_ref) const;
   uint16_t card_id_for_card_ref(uint16_t card_ref) const;
@@ -178,7 +271,7 @@ public:
   void compute_all_map_occupied_bits();
   void compute_team_dice_bonus(uint8_t team_id);
   void copy_player_states_to_prev_states();
-  std::shared_ptr<const CardIndex::CardEntry> definition_for_card_id(uint16_t card_id) const;
+  const CardIndex::CardEntry* definition_for_card_id(uint16_t card_id) const;
   void destroy_cards_with_zero_hp();
   void determine_first_team_turn();
   void dice_phase_after();
@@ -262,7 +355,7 @@ public:
 
   G_UpdateDecks_Ep3_6xB4x07 prepare_6xB4x07_decks_update() const;
   G_SetPlayerNames_Ep3_6xB4x1C prepare_6xB4x1C_names_update() const;
-  static std::string prepare_6xB6x41_map_definition(std::shared_ptr<const MapIndex::Map> map, uint8_t language, bool is_nte);
+  static const std::string& prepare_6xB6x41_map_definition(std::shared_ptr<const MapIndex::Map> map, uint8_t language, bool is_nte);
   void send_6xB6x41_to_all_clients() const;
   G_SetTrapTileLocations_Ep3_6xB4x50 prepare_6xB4x50_trap_tile_locations() const;
 
@@ -271,7 +364,11 @@ public:
 
 private:
   typedef void (Server::*handler_t)(std::shared_ptr<Client>, const std::string&);
-  static const std::unordered_map<uint8_t, handler_t> subcommand_handlers;
+  struct HandlerEntry {
+    handler_t handler;
+    const char* name;
+  };
+  static const std::unordered_map<uint8_t, HandlerEntry> subcommand_handlers;
 
 public:
   // These fields are not part of the original implementation
@@ -286,6 +383,11 @@ public:
   uint8_t atk_dice_value_range_2v1_override;
   uint8_t def_dice_value_range_2v1_override;
   mutable std::deque<StackLogger*> logger_stack;
+  // If set, this is called for each command the server generates when it has
+  // no lobby (before masking). This is used for verifying battle replays.
+  std::function<void(uint8_t command, const void* data, size_t size)> lobbyless_command_handler;
+  // If set, timings are accumulated here; see PerformanceCounters above
+  std::shared_ptr<PerformanceCounters> performance_counters;
 
   // These fields were originally contained in the TCardServerBase object
   struct PresenceEntry {
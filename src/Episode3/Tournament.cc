@@ -1,8 +1,11 @@
 #include "Tournament.hh"
 
+#include <stdio.h>
+
 #include <phosg/Random.hh>
 
 #include "../CommandFormats.hh"
+#include "../Loggers.hh"
 #include "../SendCommands.hh"
 
 using namespace std;
@@ -791,7 +794,9 @@ TournamentIndex::TournamentIndex(
     bool skip_load_state)
     : map_index(map_index),
       com_deck_index(com_deck_index),
-      state_filename(state_filename) {
+      state_filename(state_filename),
+      journal_filename(state_filename.empty() ? "" : (state_filename + ".journal")),
+      num_journal_entries(0) {
   if (this->state_filename.empty() || skip_load_state) {
     return;
   }
@@ -836,9 +841,80 @@ TournamentIndex::TournamentIndex(
   } else {
     throw runtime_error("tournament state root phosg::JSON is not a list or dict");
   }
+
+  this->load_journal();
 }
 
-void TournamentIndex::save() const {
+void TournamentIndex::load_journal() {
+  string data;
+  try {
+    data = phosg::load_file(this->journal_filename);
+  } catch (const phosg::cannot_open_file&) {
+    return;
+  }
+
+  // Every complete entry ends with a newline, so if the file doesn't, the last
+  // entry was only partially written
+  bool has_partial_last_entry = !data.empty() && (data.back() != '\n');
+
+  auto lines = phosg::split(data, '\n');
+  for (size_t line_num = 0; line_num < lines.size(); line_num++) {
+    const auto& line = lines[line_num];
+    if (line.empty()) {
+      continue;
+    }
+
+    phosg::JSON entry;
+    try {
+      entry = phosg::JSON::parse(line);
+    } catch (const exception& e) {
+      // If the server crashed while writing the last entry, it may be
+      // incomplete; in that case the change it describes was never confirmed,
+      // so we can safely ignore it. Errors on any other line mean the journal
+      // is corrupt.
+      if (line_num == lines.size() - 1) {
+        static_game_data_log.warning("Ignoring incomplete last entry in tournament journal");
+        break;
+      }
+      throw runtime_error(phosg::string_printf("tournament journal entry %zu is invalid: %s", line_num, e.what()));
+    }
+
+    const string& op = entry.get_string("op");
+    if (op == "update") {
+      auto tourn = make_shared<Tournament>(this->map_index, this->com_deck_index, entry.at("tournament"));
+      tourn->init();
+      auto it = this->name_to_tournament.find(tourn->get_name());
+      if (it != this->name_to_tournament.end()) {
+        uint32_t menu_item_id = it->second->get_menu_item_id();
+        tourn->set_menu_item_id(menu_item_id);
+        this->menu_item_id_to_tournament.at(menu_item_id) = tourn;
+        it->second = tourn;
+      } else {
+        this->add_tournament(tourn);
+      }
+    } else if (op == "delete") {
+      auto it = this->name_to_tournament.find(entry.get_string("name"));
+      if (it != this->name_to_tournament.end()) {
+        this->remove_tournament(it);
+      }
+    } else {
+      throw runtime_error("unknown tournament journal operation: " + op);
+    }
+    this->num_journal_entries++;
+  }
+  static_game_data_log.info("Applied %zu changes from tournament journal", this->num_journal_entries);
+
+  // New entries are appended to the end of the file, so a partial entry must
+  // be removed before anything else is written; otherwise, the next entry
+  // would be appended to the same line and would make the journal unreadable.
+  // Rewriting the state file also clears the journal.
+  if (has_partial_last_entry) {
+    static_game_data_log.info("Rewriting tournament state to remove incomplete journal entry");
+    this->save();
+  }
+}
+
+void TournamentIndex::save() {
   if (this->state_filename.empty()) {
     return;
   }
@@ -847,22 +923,44 @@ void TournamentIndex::save() const {
   for (const auto& it : this->name_to_tournament) {
     json.emplace(it.second->get_name(), it.second->json());
   }
-  phosg::save_file(this->state_filename, json.serialize(phosg::JSON::SerializeOption::FORMAT | phosg::JSON::SerializeOption::HEX_INTEGERS | phosg::JSON::SerializeOption::ESCAPE_CONTROLS_ONLY));
+  // Write the state to a temporary file first, so that if we crash while
+  // writing it, the previous state file and journal are still intact
+  string temp_filename = this->state_filename + ".tmp";
+  phosg::save_file(temp_filename, json.serialize(phosg::JSON::SerializeOption::FORMAT | phosg::JSON::SerializeOption::HEX_INTEGERS | phosg::JSON::SerializeOption::ESCAPE_CONTROLS_ONLY));
+  if (rename(temp_filename.c_str(), this->state_filename.c_str())) {
+    throw runtime_error("cannot replace tournament state file");
+  }
+
+  this->journal_file.reset();
+  this->num_journal_entries = 0;
+  remove(this->journal_filename.c_str());
 }
 
-shared_ptr<Tournament> TournamentIndex::create_tournament(
-    const string& name,
-    shared_ptr<const MapIndex::Map> map,
-    const Rules& rules,
-    size_t num_teams,
-    uint8_t flags) {
-  if (this->name_to_tournament.size() >= 0x20) {
-    throw runtime_error("there can be at most 32 tournaments at a time");
+void TournamentIndex::append_journal_entry(const phosg::JSON& entry) {
+  if (this->state_filename.empty()) {
+    return;
+  }
+  if (this->num_journal_entries >= this->MAX_JOURNAL_ENTRIES) {
+    // The caller has already made the change, so save() will include it
+    this->save();
+    return;
   }
 
-  auto t = make_shared<Tournament>(
-      this->map_index, this->com_deck_index, name, map, rules, num_teams, flags);
-  t->init();
+  if (!this->journal_file) {
+    this->journal_file = phosg::fopen_shared(this->journal_filename, "ab");
+  }
+  string line = entry.serialize(phosg::JSON::SerializeOption::HEX_INTEGERS | phosg::JSON::SerializeOption::ESCAPE_CONTROLS_ONLY);
+  line.push_back('\n');
+  phosg::fwritex(this->journal_file.get(), line);
+  fflush(this->journal_file.get());
+  this->num_journal_entries++;
+}
+
+void TournamentIndex::save_tournament(shared_ptr<const Tournament> tourn) {
+  this->append_journal_entry(phosg::JSON::dict({{"op", "update"}, {"tournament", tourn->json()}}));
+}
+
+void TournamentIndex::add_tournament(shared_ptr<Tournament> t) {
   if (!this->name_to_tournament.emplace(t->get_name(), t).second) {
     throw runtime_error("a tournament with the same name already exists");
   }
@@ -879,8 +977,33 @@ shared_ptr<Tournament> TournamentIndex::create_tournament(
     t->set_menu_item_id(this->menu_item_id_to_tournament.size());
     this->menu_item_id_to_tournament.emplace_back(t);
   }
+}
+
+void TournamentIndex::remove_tournament(unordered_map<string, shared_ptr<Tournament>>::iterator it) {
+  for (size_t z = 0; z < this->menu_item_id_to_tournament.size(); z++) {
+    if (this->menu_item_id_to_tournament[z] == it->second) {
+      this->menu_item_id_to_tournament[z] = nullptr;
+      it->second->set_menu_item_id(0xFFFFFFFF);
+    }
+  }
+  this->name_to_tournament.erase(it);
+}
+
+shared_ptr<Tournament> TournamentIndex::create_tournament(
+    const string& name,
+    shared_ptr<const MapIndex::Map> map,
+    const Rules& rules,
+    size_t num_teams,
+    uint8_t flags) {
+  if (this->name_to_tournament.size() >= 0x20) {
+    throw runtime_error("there can be at most 32 tournaments at a time");
+  }
 
-  this->save();
+  auto t = make_shared<Tournament>(
+      this->map_index, this->com_deck_index, name, map, rules, num_teams, flags);
+  t->init();
+  this->add_tournament(t);
+  this->save_tournament(t);
   return t;
 }
 
@@ -889,15 +1012,9 @@ bool TournamentIndex::delete_tournament(const string& name) {
   if (it == this->name_to_tournament.end()) {
     return false;
   }
-  for (size_t z = 0; z < this->menu_item_id_to_tournament.size(); z++) {
-    if (this->menu_item_id_to_tournament[z] == it->second) {
-      this->menu_item_id_to_tournament[z] = nullptr;
-      it->second->set_menu_item_id(0xFFFFFFFF);
-    }
-  }
   it->second->send_all_state_updates_on_deletion();
-  this->name_to_tournament.erase(it);
-  this->save();
+  this->remove_tournament(it);
+  this->append_journal_entry(phosg::JSON::dict({{"op", "delete"}, {"name", name}}));
   return true;
 }
 
@@ -203,7 +203,17 @@ public:
       bool skip_load_state = false);
   ~TournamentIndex() = default;
 
-  void save() const;
+  // Tournament state is saved in two files: the state file, which contains the
+  // entire state of all tournaments, and the journal, which contains one line
+  // for each change since the state file was last written. Each line in the
+  // journal is a JSON object containing either the entire new state of one
+  // tournament or the name of a deleted tournament; when loading, the journal
+  // is applied on top of the state file. This way, only the tournament that
+  // changed has to be written when a player registers or a match ends.
+  // save() writes the state file and clears the journal; this is done
+  // automatically when the journal becomes long.
+  void save();
+  void save_tournament(std::shared_ptr<const Tournament> tourn);
 
   inline const std::unordered_map<std::string, std::shared_ptr<Tournament>>& all_tournaments() const {
     return this->name_to_tournament;
@@ -237,9 +247,19 @@ public:
   void link_all_clients(std::shared_ptr<ServerState> s);
 
 private:
+  static constexpr size_t MAX_JOURNAL_ENTRIES = 0x100;
+
+  void add_tournament(std::shared_ptr<Tournament> tourn);
+  void remove_tournament(std::unordered_map<std::string, std::shared_ptr<Tournament>>::iterator it);
+  void load_journal();
+  void append_journal_entry(const phosg::JSON& entry);
+
   std::shared_ptr<const MapIndex> map_index;
   std::shared_ptr<const COMDeckIndex> com_deck_index;
   std::string state_filename;
+  std::string journal_filename;
+  std::shared_ptr<FILE> journal_file;
+  size_t num_journal_entries;
   std::unordered_map<std::string, std::shared_ptr<Tournament>> name_to_tournament;
   std::vector<std::shared_ptr<Tournament>> menu_item_id_to_tournament;
 };
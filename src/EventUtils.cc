@@ -45,6 +45,75 @@ void call_on_event_thread<void>(shared_ptr<struct event_base> base, function<voi
   }
 }
 
+WorkerPool::WorkerPool(shared_ptr<struct event_base> base, size_t num_threads)
+    : base(base),
+      should_exit(false) {
+  while (this->threads.size() < num_threads) {
+    this->threads.emplace_back(&WorkerPool::thread_fn, this);
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    lock_guard<mutex> g(this->lock);
+    this->should_exit = true;
+  }
+  this->cv.notify_all();
+  for (auto& th : this->threads) {
+    th.join();
+  }
+}
+
+void WorkerPool::submit(function<void()>&& fn, function<void(exception_ptr)>&& on_complete) {
+  if (this->threads.empty()) {
+    exception_ptr exc;
+    try {
+      fn();
+    } catch (...) {
+      exc = current_exception();
+    }
+    if (on_complete) {
+      on_complete(exc);
+    }
+    return;
+  }
+
+  {
+    lock_guard<mutex> g(this->lock);
+    this->queue.emplace_back(Job{.fn = std::move(fn), .on_complete = std::move(on_complete)});
+  }
+  this->cv.notify_one();
+}
+
+void WorkerPool::thread_fn() {
+  for (;;) {
+    Job job;
+    {
+      unique_lock<mutex> g(this->lock);
+      this->cv.wait(g, [&]() -> bool { return this->should_exit || !this->queue.empty(); });
+      if (this->queue.empty()) {
+        return; // should_exit is set and there's nothing left to do
+      }
+      job = std::move(this->queue.front());
+      this->queue.pop_front();
+    }
+
+    exception_ptr exc;
+    try {
+      job.fn();
+    } catch (...) {
+      exc = current_exception();
+    }
+    // The completion callback may own objects that must be destroyed on the
+    // event thread, so it must not be destroyed here
+    if (job.on_complete) {
+      forward_to_event_thread(this->base, [on_complete = std::move(job.on_complete), exc]() -> void {
+        on_complete(exc);
+      });
+    }
+  }
+}
+
 string evbuffer_remove_str(struct evbuffer* buf, ssize_t size) {
   if (!buf) {
     return "";
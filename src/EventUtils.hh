@@ -3,12 +3,16 @@
 #include <event2/event.h>
 
 #include <condition_variable>
+#include <deque>
+#include <exception>
 #include <functional>
 #include <memory>
 #include <mutex>
 #include <optional>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
 // Calls a function on the given base's event thread. This function returns
 // when the call has been enqueued, not necessarily after it returns.
@@ -43,3 +47,41 @@ template <>
 void call_on_event_thread<void>(std::shared_ptr<struct event_base> base, std::function<void()>&& compute);
 
 std::string evbuffer_remove_str(struct evbuffer* buf, ssize_t size = -1);
+
+// Runs functions on a fixed set of background threads. When a function
+// returns, its completion callback (if any) is called on the given base's
+// event thread, so the callback can safely use objects owned by that thread;
+// the function itself must not. If the function throws, the exception is
+// passed to the completion callback (or ignored if there isn't one). If
+// num_threads is zero, submit() calls the function and its completion callback
+// immediately on the calling thread instead.
+class WorkerPool {
+public:
+  WorkerPool(std::shared_ptr<struct event_base> base, size_t num_threads);
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool(WorkerPool&&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+  WorkerPool& operator=(WorkerPool&&) = delete;
+  ~WorkerPool(); // Runs all queued functions before returning
+
+  inline size_t num_threads() const {
+    return this->threads.size();
+  }
+
+  void submit(std::function<void()>&& fn, std::function<void(std::exception_ptr)>&& on_complete = nullptr);
+
+private:
+  struct Job {
+    std::function<void()> fn;
+    std::function<void(std::exception_ptr)> on_complete;
+  };
+
+  std::shared_ptr<struct event_base> base;
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<Job> queue;
+  bool should_exit;
+  std::vector<std::thread> threads;
+
+  void thread_fn();
+};
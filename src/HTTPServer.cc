@@ -165,7 +165,19 @@ const string& HTTPServer::get_url_param(
 }
 
 HTTPServer::HTTPServer(shared_ptr<ServerState> state, shared_ptr<struct event_base> shared_base)
-    : state(state) {
+    : state(state),
+      snapshot_interval_usecs(state->http_snapshot_interval_usecs),
+      // Keep refreshing a snapshot for a while after it was last requested, so
+      // clients that poll less often than the refresh interval still get
+      // reasonably fresh data without blocking on the game thread
+      snapshot_keepalive_usecs(max<uint64_t>(60000000, this->snapshot_interval_usecs * 10)),
+      refresh_snapshots_event(
+          event_new(state->base.get(), -1, EV_TIMEOUT | EV_PERSIST, &HTTPServer::dispatch_refresh_snapshots, this),
+          event_free) {
+  if (this->snapshot_interval_usecs) {
+    auto tv = phosg::usecs_to_timeval(this->snapshot_interval_usecs);
+    event_add(this->refresh_snapshots_event.get(), &tv);
+  }
   if (!shared_base) {
     this->base.reset(event_base_new(), event_base_free);
   } else {
@@ -957,156 +969,233 @@ phosg::JSON HTTPServer::generate_lobby_json_st(shared_ptr<const Lobby> l, shared
   return ret;
 }
 
-phosg::JSON HTTPServer::generate_accounts_json() const {
-  return call_on_event_thread<phosg::JSON>(this->state->base, [&]() {
-    auto res = phosg::JSON::list();
-    for (const auto& it : this->state->account_index->all()) {
-      res.emplace_back(it->json());
-    }
-    return res;
-  });
+phosg::JSON HTTPServer::generate_accounts_json_st() const {
+  auto res = phosg::JSON::list();
+  for (const auto& it : this->state->account_index->all()) {
+    res.emplace_back(it->json());
+  }
+  return res;
 }
 
-phosg::JSON HTTPServer::generate_game_server_clients_json() const {
-  return call_on_event_thread<phosg::JSON>(this->state->base, [&]() {
-    auto res = phosg::JSON::list();
-    for (const auto& it : this->state->channel_to_client) {
-      res.emplace_back(this->generate_game_client_json_st(it.second, this->state->item_name_index_opt(it.second->version())));
-    }
-    return res;
-  });
+phosg::JSON HTTPServer::generate_game_server_clients_json_st() const {
+  auto res = phosg::JSON::list();
+  for (const auto& it : this->state->channel_to_client) {
+    res.emplace_back(this->generate_game_client_json_st(it.second, this->state->item_name_index_opt(it.second->version())));
+  }
+  return res;
 }
 
-phosg::JSON HTTPServer::generate_proxy_server_clients_json() const {
-  return call_on_event_thread<phosg::JSON>(this->state->base, [&]() {
-    phosg::JSON res = phosg::JSON::list();
-    if (this->state->proxy_server) {
-      for (const auto& it : this->state->proxy_server->all_sessions()) {
-        res.emplace_back(this->generate_proxy_client_json_st(it.second));
-      }
+phosg::JSON HTTPServer::generate_proxy_server_clients_json_st() const {
+  phosg::JSON res = phosg::JSON::list();
+  if (this->state->proxy_server) {
+    for (const auto& it : this->state->proxy_server->all_sessions()) {
+      res.emplace_back(this->generate_proxy_client_json_st(it.second));
     }
-    return res;
-  });
+  }
+  return res;
 }
 
-phosg::JSON HTTPServer::generate_server_info_json() const {
-  return call_on_event_thread<phosg::JSON>(this->state->base, [&]() {
-    size_t game_count = 0;
-    size_t lobby_count = 0;
-    for (const auto& it : this->state->id_to_lobby) {
-      if (it.second->is_game()) {
-        game_count++;
-      } else {
-        lobby_count++;
-      }
+phosg::JSON HTTPServer::generate_server_info_json_st() const {
+  size_t game_count = 0;
+  size_t lobby_count = 0;
+  for (const auto& it : this->state->id_to_lobby) {
+    if (it.second->is_game()) {
+      game_count++;
+    } else {
+      lobby_count++;
     }
-    uint64_t uptime_usecs = phosg::now() - this->state->creation_time;
-    return phosg::JSON::dict({
-        {"StartTimeUsecs", this->state->creation_time},
-        {"StartTime", phosg::format_time(this->state->creation_time)},
-        {"UptimeUsecs", uptime_usecs},
-        {"Uptime", phosg::format_duration(uptime_usecs)},
-        {"LobbyCount", lobby_count},
-        {"GameCount", game_count},
-        {"ClientCount", this->state->channel_to_client.size()},
-        {"ProxySessionCount", this->state->proxy_server ? this->state->proxy_server->num_sessions() : 0},
-        {"ServerName", this->state->name},
-    });
+  }
+  uint64_t uptime_usecs = phosg::now() - this->state->creation_time;
+  return phosg::JSON::dict({
+      {"StartTimeUsecs", this->state->creation_time},
+      {"StartTime", phosg::format_time(this->state->creation_time)},
+      {"UptimeUsecs", uptime_usecs},
+      {"Uptime", phosg::format_duration(uptime_usecs)},
+      {"LobbyCount", lobby_count},
+      {"GameCount", game_count},
+      {"ClientCount", this->state->channel_to_client.size()},
+      {"ProxySessionCount", this->state->proxy_server ? this->state->proxy_server->num_sessions() : 0},
+      {"ServerName", this->state->name},
   });
 }
 
-phosg::JSON HTTPServer::generate_lobbies_json() const {
+phosg::JSON HTTPServer::generate_rate_limits_json() const {
   return call_on_event_thread<phosg::JSON>(this->state->base, [&]() {
-    phosg::JSON res = phosg::JSON::list();
-    for (const auto& it : this->state->id_to_lobby) {
-      auto leader = it.second->clients[it.second->leader_id];
-      Version v = leader ? leader->version() : Version::BB_V4;
-      res.emplace_back(this->generate_lobby_json_st(it.second, this->state->item_name_index_opt(v)));
-    }
-    return res;
+    return this->state->rate_limiter->json();
   });
 }
 
-phosg::JSON HTTPServer::generate_summary_json() const {
-  auto ret = call_on_event_thread<phosg::JSON>(this->state->base, [&]() {
-    auto clients_json = phosg::JSON::list();
-    for (const auto& it : this->state->channel_to_client) {
-      auto c = it.second;
-      auto p = c->character(false, false);
-      auto l = c->lobby.lock();
-      clients_json.emplace_back(phosg::JSON::dict({
-          {"ID", c->id},
-          {"AccountID", c->login ? c->login->account->account_id : phosg::JSON(nullptr)},
-          {"Name", p ? p->disp.name.decode(it.second->language()) : phosg::JSON(nullptr)},
+phosg::JSON HTTPServer::generate_lobbies_json_st() const {
+  phosg::JSON res = phosg::JSON::list();
+  for (const auto& it : this->state->id_to_lobby) {
+    auto leader = it.second->clients[it.second->leader_id];
+    Version v = leader ? leader->version() : Version::BB_V4;
+    res.emplace_back(this->generate_lobby_json_st(it.second, this->state->item_name_index_opt(v)));
+  }
+  return res;
+}
+
+phosg::JSON HTTPServer::generate_summary_json_st() const {
+  auto clients_json = phosg::JSON::list();
+  for (const auto& it : this->state->channel_to_client) {
+    auto c = it.second;
+    auto p = c->character(false, false);
+    auto l = c->lobby.lock();
+    clients_json.emplace_back(phosg::JSON::dict({
+        {"ID", c->id},
+        {"AccountID", c->login ? c->login->account->account_id : phosg::JSON(nullptr)},
+        {"Name", p ? p->disp.name.decode(it.second->language()) : phosg::JSON(nullptr)},
+        {"Version", phosg::name_for_enum(it.second->version())},
+        {"Language", name_for_language_code(it.second->language())},
+        {"Level", p ? p->disp.stats.level + 1 : phosg::JSON(nullptr)},
+        {"Class", p ? name_for_char_class(p->disp.visual.char_class) : phosg::JSON(nullptr)},
+        {"SectionID", p ? name_for_section_id(p->disp.visual.section_id) : phosg::JSON(nullptr)},
+        {"LobbyID", l ? l->lobby_id : phosg::JSON(nullptr)},
+    }));
+  }
+
+  auto proxy_clients_json = phosg::JSON::list();
+  if (this->state->proxy_server) {
+    for (const auto& it : this->state->proxy_server->all_sessions()) {
+      proxy_clients_json.emplace_back(phosg::JSON::dict({
+          {"AccountID", it.second->login ? it.second->login->account->account_id : phosg::JSON(nullptr)},
+          {"Name", it.second->character_name},
           {"Version", phosg::name_for_enum(it.second->version())},
           {"Language", name_for_language_code(it.second->language())},
-          {"Level", p ? p->disp.stats.level + 1 : phosg::JSON(nullptr)},
-          {"Class", p ? name_for_char_class(p->disp.visual.char_class) : phosg::JSON(nullptr)},
-          {"SectionID", p ? name_for_section_id(p->disp.visual.section_id) : phosg::JSON(nullptr)},
-          {"LobbyID", l ? l->lobby_id : phosg::JSON(nullptr)},
       }));
     }
+  }
 
-    auto proxy_clients_json = phosg::JSON::list();
-    if (this->state->proxy_server) {
-      for (const auto& it : this->state->proxy_server->all_sessions()) {
-        proxy_clients_json.emplace_back(phosg::JSON::dict({
-            {"AccountID", it.second->login ? it.second->login->account->account_id : phosg::JSON(nullptr)},
-            {"Name", it.second->character_name},
-            {"Version", phosg::name_for_enum(it.second->version())},
-            {"Language", name_for_language_code(it.second->language())},
-        }));
+  auto games_json = phosg::JSON::list();
+  for (const auto& it : this->state->id_to_lobby) {
+    auto l = it.second;
+    if (l->is_game()) {
+      auto game_json = phosg::JSON::dict({
+          {"ID", l->lobby_id},
+          {"Name", l->name},
+          {"Players", l->count_clients()},
+          {"CheatsEnabled", l->check_flag(Lobby::Flag::CHEATS_ENABLED)},
+          {"Episode", name_for_episode(l->episode)},
+          {"HasPassword", !l->password.empty()},
+      });
+      if (l->episode == Episode::EP3) {
+        auto ep3s = l->ep3_server;
+        game_json.emplace("BattleInProgress", l->check_flag(Lobby::Flag::BATTLE_IN_PROGRESS));
+        game_json.emplace("IsSpectatorTeam", l->check_flag(Lobby::Flag::IS_SPECTATOR_TEAM));
+        game_json.emplace("MapNumber", (ep3s && ep3s->last_chosen_map) ? ep3s->last_chosen_map->map_number : phosg::JSON(nullptr));
+        game_json.emplace("Rules", (ep3s && ep3s->map_and_rules) ? ep3s->map_and_rules->rules.json() : nullptr);
+      } else {
+        game_json.emplace("QuestSelectionInProgress", l->check_flag(Lobby::Flag::QUEST_SELECTION_IN_PROGRESS));
+        game_json.emplace("QuestInProgress", l->check_flag(Lobby::Flag::QUEST_IN_PROGRESS));
+        game_json.emplace("JoinableQuestInProgress", l->check_flag(Lobby::Flag::JOINABLE_QUEST_IN_PROGRESS));
+        game_json.emplace("SectionID", name_for_section_id(l->effective_section_id()));
+        game_json.emplace("Mode", name_for_mode(l->mode));
+        game_json.emplace("Difficulty", name_for_difficulty(l->difficulty));
+        game_json.emplace("Quest", l->quest ? l->quest->json() : phosg::JSON(nullptr));
       }
+      games_json.emplace_back(std::move(game_json));
     }
+  }
 
-    auto games_json = phosg::JSON::list();
-    for (const auto& it : this->state->id_to_lobby) {
-      auto l = it.second;
-      if (l->is_game()) {
-        auto game_json = phosg::JSON::dict({
-            {"ID", l->lobby_id},
-            {"Name", l->name},
-            {"Players", l->count_clients()},
-            {"CheatsEnabled", l->check_flag(Lobby::Flag::CHEATS_ENABLED)},
-            {"Episode", name_for_episode(l->episode)},
-            {"HasPassword", !l->password.empty()},
-        });
-        if (l->episode == Episode::EP3) {
-          auto ep3s = l->ep3_server;
-          game_json.emplace("BattleInProgress", l->check_flag(Lobby::Flag::BATTLE_IN_PROGRESS));
-          game_json.emplace("IsSpectatorTeam", l->check_flag(Lobby::Flag::IS_SPECTATOR_TEAM));
-          game_json.emplace("MapNumber", (ep3s && ep3s->last_chosen_map) ? ep3s->last_chosen_map->map_number : phosg::JSON(nullptr));
-          game_json.emplace("Rules", (ep3s && ep3s->map_and_rules) ? ep3s->map_and_rules->rules.json() : nullptr);
-        } else {
-          game_json.emplace("QuestSelectionInProgress", l->check_flag(Lobby::Flag::QUEST_SELECTION_IN_PROGRESS));
-          game_json.emplace("QuestInProgress", l->check_flag(Lobby::Flag::QUEST_IN_PROGRESS));
-          game_json.emplace("JoinableQuestInProgress", l->check_flag(Lobby::Flag::JOINABLE_QUEST_IN_PROGRESS));
-          game_json.emplace("SectionID", name_for_section_id(l->effective_section_id()));
-          game_json.emplace("Mode", name_for_mode(l->mode));
-          game_json.emplace("Difficulty", name_for_difficulty(l->difficulty));
-          game_json.emplace("Quest", l->quest ? l->quest->json() : phosg::JSON(nullptr));
-        }
-        games_json.emplace_back(std::move(game_json));
-      }
-    }
+  return phosg::JSON::dict({
+      {"Clients", std::move(clients_json)},
+      {"ProxyClients", std::move(proxy_clients_json)},
+      {"Games", std::move(games_json)},
+      {"Server", this->generate_server_info_json_st()},
+  });
+}
 
+phosg::JSON HTTPServer::generate_all_json() const {
+  return call_on_event_thread<phosg::JSON>(this->state->base, [&]() {
     return phosg::JSON::dict({
-        {"Clients", std::move(clients_json)},
-        {"ProxyClients", std::move(proxy_clients_json)},
-        {"Games", std::move(games_json)},
+        {"Clients", this->generate_game_server_clients_json_st()},
+        {"ProxyClients", this->generate_proxy_server_clients_json_st()},
+        {"Lobbies", this->generate_lobbies_json_st()},
+        {"Server", this->generate_server_info_json_st()},
     });
   });
-  ret.emplace("Server", this->generate_server_info_json());
-  return ret;
 }
 
-phosg::JSON HTTPServer::generate_all_json() const {
-  return phosg::JSON::dict({
-      {"Clients", this->generate_game_server_clients_json()},
-      {"ProxyClients", this->generate_proxy_server_clients_json()},
-      {"Lobbies", this->generate_lobbies_json()},
-      {"Server", this->generate_server_info_json()},
+phosg::JSON HTTPServer::generate_snapshot_st(SnapshotType type) const {
+  switch (type) {
+    case SnapshotType::ACCOUNTS:
+      return this->generate_accounts_json_st();
+    case SnapshotType::GAME_SERVER_CLIENTS:
+      return this->generate_game_server_clients_json_st();
+    case SnapshotType::PROXY_SERVER_CLIENTS:
+      return this->generate_proxy_server_clients_json_st();
+    case SnapshotType::LOBBIES:
+      return this->generate_lobbies_json_st();
+    case SnapshotType::SERVER_INFO:
+      return this->generate_server_info_json_st();
+    case SnapshotType::SUMMARY:
+      return this->generate_summary_json_st();
+    default:
+      throw logic_error("invalid snapshot type");
+  }
+}
+
+shared_ptr<const phosg::JSON> HTTPServer::get_snapshot(SnapshotType type, uint64_t* generated_time) {
+  size_t index = static_cast<size_t>(type);
+  if (this->snapshot_interval_usecs) {
+    this->snapshot_request_times[index] = phosg::now();
+    lock_guard g(this->snapshots_lock);
+    const auto& snapshot = this->snapshots[index];
+    if (snapshot.data) {
+      *generated_time = snapshot.generated_time;
+      return snapshot.data;
+    }
+  }
+
+  // There is no snapshot yet (or snapshots are disabled), so generate one now
+  Snapshot snapshot;
+  snapshot.data = call_on_event_thread<shared_ptr<const phosg::JSON>>(this->state->base, [&]() {
+    return make_shared<const phosg::JSON>(this->generate_snapshot_st(type));
   });
+  snapshot.generated_time = phosg::now();
+  *generated_time = snapshot.generated_time;
+  if (this->snapshot_interval_usecs) {
+    lock_guard g(this->snapshots_lock);
+    if (this->snapshots[index].generated_time < snapshot.generated_time) {
+      this->snapshots[index] = snapshot;
+    }
+  }
+  return snapshot.data;
+}
+
+void HTTPServer::dispatch_refresh_snapshots(evutil_socket_t, short, void* ctx) {
+  reinterpret_cast<HTTPServer*>(ctx)->refresh_snapshots_st();
+}
+
+void HTTPServer::refresh_snapshots_st() {
+  uint64_t now = phosg::now();
+  for (size_t index = 0; index < NUM_SNAPSHOT_TYPES; index++) {
+    uint64_t request_time = this->snapshot_request_times[index].load();
+    if (!request_time || (request_time + this->snapshot_keepalive_usecs < now)) {
+      continue;
+    }
+    {
+      // Skip snapshots that were just generated synchronously by a request, so
+      // the same data isn't built twice in a row
+      lock_guard g(this->snapshots_lock);
+      const auto& existing = this->snapshots[index];
+      if (existing.data && (existing.generated_time + (this->snapshot_interval_usecs / 2) > now)) {
+        continue;
+      }
+    }
+    // Build the JSON outside the lock, so the HTTP thread can still serve the
+    // previous snapshot while this one is being built
+    Snapshot snapshot;
+    try {
+      snapshot.data = make_shared<const phosg::JSON>(this->generate_snapshot_st(static_cast<SnapshotType>(index)));
+      snapshot.generated_time = phosg::now();
+    } catch (const exception& e) {
+      server_log.warning("Failed to generate HTTP snapshot: %s", e.what());
+      continue;
+    }
+    lock_guard g(this->snapshots_lock);
+    this->snapshots[index] = std::move(snapshot);
+  }
 }
 
 phosg::JSON HTTPServer::generate_ep3_cards_json(bool trial) const {
@@ -1183,6 +1272,7 @@ phosg::JSON HTTPServer::require_POST(struct evhttp_request* req) {
 
 void HTTPServer::handle_request(struct evhttp_request* req) {
   shared_ptr<const phosg::JSON> ret;
+  uint64_t snapshot_time = 0;
   uint32_t serialize_options = 0;
   uint64_t start_time = phosg::now();
   string uri = evhttp_request_get_uri(req);
@@ -1252,22 +1342,25 @@ void HTTPServer::handle_request(struct evhttp_request* req) {
       ret = call_on_event_thread<shared_ptr<const phosg::JSON>>(this->state->base, [this]() { return this->state->config_json; });
     } else if (uri == "/y/accounts") {
       this->require_GET(req);
-      ret = make_shared<phosg::JSON>(this->generate_accounts_json());
+      ret = this->get_snapshot(SnapshotType::ACCOUNTS, &snapshot_time);
     } else if (uri == "/y/clients") {
       this->require_GET(req);
-      ret = make_shared<phosg::JSON>(this->generate_game_server_clients_json());
+      ret = this->get_snapshot(SnapshotType::GAME_SERVER_CLIENTS, &snapshot_time);
     } else if (uri == "/y/proxy-clients") {
       this->require_GET(req);
-      ret = make_shared<phosg::JSON>(this->generate_proxy_server_clients_json());
+      ret = this->get_snapshot(SnapshotType::PROXY_SERVER_CLIENTS, &snapshot_time);
     } else if (uri == "/y/lobbies") {
       this->require_GET(req);
-      ret = make_shared<phosg::JSON>(this->generate_lobbies_json());
+      ret = this->get_snapshot(SnapshotType::LOBBIES, &snapshot_time);
     } else if (uri == "/y/server") {
       this->require_GET(req);
-      ret = make_shared<phosg::JSON>(this->generate_server_info_json());
+      ret = this->get_snapshot(SnapshotType::SERVER_INFO, &snapshot_time);
+    } else if (uri == "/y/rate-limits") {
+      this->require_GET(req);
+      ret = make_shared<phosg::JSON>(this->generate_rate_limits_json());
     } else if (uri == "/y/summary") {
       this->require_GET(req);
-      ret = make_shared<phosg::JSON>(this->generate_summary_json());
+      ret = this->get_snapshot(SnapshotType::SUMMARY, &snapshot_time);
 
     } else {
       throw http_error(404, "unknown action");
@@ -1300,6 +1393,10 @@ void HTTPServer::handle_request(struct evhttp_request* req) {
     delete reinterpret_cast<string*>(s);
   };
   evbuffer_add_reference(out_buffer.get(), serialized->data(), serialized->size(), cleanup, serialized);
+  if (snapshot_time) {
+    string age_str = phosg::string_printf("%" PRIu64, (snapshot_time < start_time) ? (start_time - snapshot_time) : 0);
+    evhttp_add_header(evhttp_request_get_output_headers(req), "X-Snapshot-Age-Usecs", age_str.c_str());
+  }
   this->send_response(req, 200, "application/json", out_buffer.get());
 
   string handler_time = phosg::format_duration(handler_end - start_time);
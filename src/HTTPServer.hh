@@ -5,7 +5,10 @@
 #include <event2/http.h>
 #include <stdlib.h>
 
+#include <array>
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <string>
 
 #include "ProxyServer.hh"
@@ -66,6 +69,43 @@ protected:
 
   std::unordered_map<struct bufferevent*, std::shared_ptr<WebsocketClient>> bev_to_websocket_client;
 
+  // The endpoints that describe the server's dynamic state (clients, lobbies,
+  // etc.) are served from snapshots, so that frequent polling doesn't stall
+  // the game thread. While a snapshot is being polled (that is, until
+  // snapshot_keepalive_usecs after the last request for it), it's regenerated
+  // on the game thread once per snapshot_interval_usecs; it's then serialized
+  // on the HTTP thread for each request. Requests are always served from the
+  // latest snapshot, even if nobody has polled it recently, and the
+  // X-Snapshot-Age-Usecs response header says how old it is. Only the first
+  // request for each type of snapshot is generated synchronously.
+  enum class SnapshotType {
+    ACCOUNTS = 0,
+    GAME_SERVER_CLIENTS,
+    PROXY_SERVER_CLIENTS,
+    LOBBIES,
+    SERVER_INFO,
+    SUMMARY,
+    NUM_TYPES,
+  };
+  static constexpr size_t NUM_SNAPSHOT_TYPES = static_cast<size_t>(SnapshotType::NUM_TYPES);
+  struct Snapshot {
+    uint64_t generated_time = 0;
+    std::shared_ptr<const phosg::JSON> data;
+  };
+  uint64_t snapshot_interval_usecs;
+  uint64_t snapshot_keepalive_usecs;
+  std::mutex snapshots_lock;
+  std::array<Snapshot, NUM_SNAPSHOT_TYPES> snapshots;
+  std::array<std::atomic<uint64_t>, NUM_SNAPSHOT_TYPES> snapshot_request_times;
+  std::unique_ptr<struct event, void (*)(struct event*)> refresh_snapshots_event; // On the game thread
+
+  // Returns the latest snapshot of the given type, and sets *generated_time to
+  // the time it was generated
+  std::shared_ptr<const phosg::JSON> get_snapshot(SnapshotType type, uint64_t* generated_time);
+  phosg::JSON generate_snapshot_st(SnapshotType type) const;
+  static void dispatch_refresh_snapshots(evutil_socket_t, short, void* ctx);
+  void refresh_snapshots_st();
+
   static void require_GET(struct evhttp_request* req);
   static phosg::JSON require_POST(struct evhttp_request* req);
 
@@ -106,12 +146,13 @@ protected:
   static phosg::JSON generate_game_client_json_st(std::shared_ptr<const Client> c, std::shared_ptr<const ItemNameIndex> item_name_index);
   static phosg::JSON generate_proxy_client_json_st(std::shared_ptr<const ProxyServer::LinkedSession> ses);
   static phosg::JSON generate_lobby_json_st(std::shared_ptr<const Lobby> l, std::shared_ptr<const ItemNameIndex> item_name_index);
-  phosg::JSON generate_accounts_json() const;
-  phosg::JSON generate_game_server_clients_json() const;
-  phosg::JSON generate_proxy_server_clients_json() const;
-  phosg::JSON generate_server_info_json() const;
-  phosg::JSON generate_lobbies_json() const;
-  phosg::JSON generate_summary_json() const;
+  phosg::JSON generate_accounts_json_st() const;
+  phosg::JSON generate_game_server_clients_json_st() const;
+  phosg::JSON generate_proxy_server_clients_json_st() const;
+  phosg::JSON generate_server_info_json_st() const;
+  phosg::JSON generate_rate_limits_json() const;
+  phosg::JSON generate_lobbies_json_st() const;
+  phosg::JSON generate_summary_json_st() const;
   phosg::JSON generate_all_json() const;
 
   phosg::JSON generate_ep3_cards_json(bool trial) const;
@@ -1,6 +1,10 @@
 #include "IPFrameInfo.hh"
 
 #include <inttypes.h>
+#include <string.h>
+
+#include <array>
+#include <bit>
 
 #include <phosg/Strings.hh>
 
@@ -13,6 +17,46 @@ static inline uint16_t collapse_checksum(uint32_t sum) {
   return (sum & 0xFFFF) + (sum >> 16);
 }
 
+uint16_t FrameInfo::ones_complement_sum(const void* data, size_t size) {
+  // The one's-complement sum doesn't depend on byte order (RFC 1071 section
+  // 2(B)), so we can add native-order words and swap the result at the end.
+  // Each 8-byte chunk is added as two 32-bit halves so no carries are lost;
+  // the accumulator can't overflow unless size is more than 16GB.
+  const uint8_t* u8_data = reinterpret_cast<const uint8_t*>(data);
+  uint64_t sum = 0;
+  size_t offset = 0;
+  for (; offset + 8 <= size; offset += 8) {
+    uint64_t word;
+    memcpy(&word, u8_data + offset, 8);
+    sum += (word & 0xFFFFFFFF) + (word >> 32);
+  }
+  if (offset < size) {
+    // The zero padding here makes an odd trailing byte the high byte of its
+    // 16-bit word, as RFC 1071 requires
+    uint64_t word = 0;
+    memcpy(&word, u8_data + offset, size - offset);
+    sum += (word & 0xFFFFFFFF) + (word >> 32);
+  }
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+  uint16_t ret = collapse_checksum(sum);
+  return (std::endian::native == std::endian::little) ? ((ret >> 8) | (ret << 8)) : ret;
+}
+
+uint16_t FrameInfo::updated_checksum(uint16_t checksum, uint16_t old_value, uint16_t new_value) {
+  // RFC 1624 equation 3: HC' = ~(~HC + ~m + m')
+  return ~collapse_checksum(static_cast<uint16_t>(~checksum) + static_cast<uint16_t>(~old_value) + new_value);
+}
+
+uint16_t FrameInfo::updated_checksum32(uint16_t checksum, uint32_t old_value, uint32_t new_value) {
+  return ~collapse_checksum(
+      static_cast<uint16_t>(~checksum) +
+      static_cast<uint16_t>(~old_value >> 16) +
+      static_cast<uint16_t>(~old_value) +
+      (new_value >> 16) +
+      (new_value & 0xFFFF));
+}
+
 FrameInfo::FrameInfo(LinkType link_type, const string& data)
     : FrameInfo(link_type, data.data(), data.size()) {}
 
@@ -242,15 +286,8 @@ uint16_t FrameInfo::computed_udp4_checksum(
       udp.size +
       udp.src_port +
       udp.dest_port +
-      udp.size;
-
-  const uint8_t* u8_data = reinterpret_cast<const uint8_t*>(data);
-  for (size_t offset = 0; offset + 2 <= size; offset += 2) {
-    sum += *reinterpret_cast<const be_uint16_t*>(u8_data + offset);
-  }
-  if (size & 1) {
-    sum += u8_data[size - 1] << 8;
-  }
+      udp.size +
+      FrameInfo::ones_complement_sum(data, size);
   return ~collapse_checksum(sum);
 }
 
@@ -283,15 +320,8 @@ uint16_t FrameInfo::computed_tcp4_checksum(
       (tcp.ack_num & 0xFFFF) +
       tcp.flags +
       tcp.window +
-      tcp.urgent_ptr;
-
-  const uint8_t* u8_data = reinterpret_cast<const uint8_t*>(data);
-  for (size_t offset = 0; offset + 2 <= size; offset += 2) {
-    sum += *reinterpret_cast<const be_uint16_t*>(u8_data + offset);
-  }
-  if (size & 1) {
-    sum += u8_data[size - 1] << 8;
-  }
+      tcp.urgent_ptr +
+      FrameInfo::ones_complement_sum(data, size);
   return ~collapse_checksum(sum);
 }
 
@@ -307,14 +337,25 @@ uint16_t FrameInfo::computed_tcp4_checksum() const {
       this->payload_size + this->tcp_options_size);
 }
 
-uint16_t FrameInfo::computed_hdlc_checksum(const void* vdata, size_t size) {
-  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
-  uint16_t crc = 0xFFFF;
-  for (size_t z = 0; z < size; z++) {
-    crc ^= data[z];
+static constexpr array<uint16_t, 0x100> generate_hdlc_checksum_table() {
+  array<uint16_t, 0x100> ret;
+  for (size_t z = 0; z < 0x100; z++) {
+    uint16_t crc = z;
     for (size_t b = 0; b < 8; b++) {
       crc = (crc & 1) ? ((crc >> 1) ^ 0x8408) : (crc >> 1);
     }
+    ret[z] = crc;
+  }
+  return ret;
+}
+
+static constexpr array<uint16_t, 0x100> HDLC_CHECKSUM_TABLE = generate_hdlc_checksum_table();
+
+uint16_t FrameInfo::computed_hdlc_checksum(const void* vdata, size_t size, uint16_t prev_checksum) {
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  uint16_t crc = ~prev_checksum;
+  for (size_t z = 0; z < size; z++) {
+    crc = (crc >> 8) ^ HDLC_CHECKSUM_TABLE[(crc ^ data[z]) & 0xFF];
   }
   return ~crc;
 }
@@ -169,6 +169,16 @@ struct FrameInfo {
 
   size_t size_from_header() const;
 
+  // Returns the 16-bit one's-complement sum of data (as big-endian words),
+  // without the final inversion. The result can be added to other partial
+  // sums before computing a checksum.
+  static uint16_t ones_complement_sum(const void* data, size_t size);
+  // Returns a new checksum after a 16-bit or 32-bit field covered by it has
+  // been changed from old_value to new_value (RFC 1624). This is faster than
+  // recomputing the entire checksum when only a few fields are edited.
+  static uint16_t updated_checksum(uint16_t checksum, uint16_t old_value, uint16_t new_value);
+  static uint16_t updated_checksum32(uint16_t checksum, uint32_t old_value, uint32_t new_value);
+
   static uint16_t computed_ipv4_header_checksum(const IPv4Header& ipv4);
   uint16_t computed_ipv4_header_checksum() const;
   static uint16_t computed_udp4_checksum(const IPv4Header& ipv4, const UDPHeader& udp, const void* data, size_t size);
@@ -176,7 +186,9 @@ struct FrameInfo {
   static uint16_t computed_tcp4_checksum(const IPv4Header& ip, const TCPHeader& tcp, const void* data, size_t size);
   uint16_t computed_tcp4_checksum() const;
 
-  static uint16_t computed_hdlc_checksum(const void* data, size_t size);
+  // To compute the checksum of discontiguous data, pass the result of the
+  // previous call as prev_checksum.
+  static uint16_t computed_hdlc_checksum(const void* data, size_t size, uint16_t prev_checksum = 0);
   uint16_t computed_hdlc_checksum() const;
   uint16_t stored_hdlc_checksum() const;
 };
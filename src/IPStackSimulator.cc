@@ -8,6 +8,7 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <array>
 #include <phosg/Network.hh>
 #include <phosg/Random.hh>
 #include <phosg/Time.hh>
@@ -19,65 +20,77 @@
 
 using namespace std;
 
-static const size_t DEFAULT_RESEND_PUSH_USECS = 200000; // 200ms
-
-static string unescape_hdlc_frame(const void* data, size_t size) {
-  phosg::StringReader r(data, size);
-  if (r.get_u8(data) != 0x7E) {
+// Retransmission timeout limits for TCP connections. The initial timeout is
+// much shorter than RFC 6298 recommends (1 second), since clients are usually
+// on the same machine or network as the server.
+static const uint64_t INITIAL_RTO_USECS = 200000; // 200ms
+static const uint64_t MIN_RTO_USECS = 50000; // 50ms
+static const uint64_t MAX_RTO_USECS = 5000000; // 5 seconds
+
+// Unescapes an HDLC frame (including its start and end sentinels) into dest,
+// which must have room for at least size bytes. Returns the size of the
+// unescaped frame. This uses memchr to find the escape bytes, since they are
+// rare in most frames and memchr is vectorized on most platforms.
+static size_t unescape_hdlc_frame(void* dest, const void* data, size_t size) {
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(data);
+  if ((size < 2) || (src[0] != 0x7E)) {
     throw runtime_error("HDLC frame does not begin with 7E");
   }
-  string ret("\x7E", 1);
-
-  while (r.get_u8(false) != 0x7E) {
-    uint8_t ch = r.get_u8();
-    if (ch == 0x7D) {
-      ch = r.get_u8();
-      if (ch == 0x7E) {
-        throw runtime_error("abort sequence received");
-      }
-      ret.push_back(ch ^ 0x20);
-    } else {
-      ret.push_back(ch);
-    }
+  const uint8_t* src_end = reinterpret_cast<const uint8_t*>(memchr(src + 1, 0x7E, size - 1));
+  if (!src_end) {
+    throw runtime_error("HDLC frame does not end with 7E");
   }
-  ret.push_back(0x7E);
-  return ret;
-}
 
-static string unescape_hdlc_frame(const string& data) {
-  return unescape_hdlc_frame(data.data(), data.size());
+  uint8_t* out = reinterpret_cast<uint8_t*>(dest);
+  *(out++) = 0x7E;
+  const uint8_t* p = src + 1;
+  while (p < src_end) {
+    const uint8_t* escape = reinterpret_cast<const uint8_t*>(memchr(p, 0x7D, src_end - p));
+    size_t run_size = (escape ? escape : src_end) - p;
+    memcpy(out, p, run_size);
+    out += run_size;
+    if (!escape) {
+      break;
+    }
+    if (escape + 1 >= src_end) {
+      throw runtime_error("abort sequence received");
+    }
+    *(out++) = escape[1] ^ 0x20;
+    p = escape + 2;
+  }
+  *(out++) = 0x7E;
+  return out - reinterpret_cast<uint8_t*>(dest);
 }
 
-static string escape_hdlc_frame(const void* data, size_t size, uint32_t escape_control_character_flags = 0xFFFFFFFF) {
-  if (size < 2) {
-    throw runtime_error("HDLC frame too small for start and end sentinels");
-  }
+// A 256-bit map of which bytes must be escaped in outgoing HDLC frames. The
+// low 32 bits are the client's escaped control character flags; 7D and 7E
+// are always escaped.
+using HDLCEscapeMap = array<uint64_t, 4>;
 
-  phosg::StringReader r(data, size);
-  if (r.pget_u8(size - 1) != 0x7E) {
-    throw runtime_error("HDLC frame does not end with 7E");
-  }
-  r.truncate(size - 1);
-  if (r.get_u8() != 0x7E) {
-    throw runtime_error("HDLC frame does not begin with 7E");
-  }
-  string ret("\x7E", 1);
+static inline HDLCEscapeMap hdlc_escape_map_for_flags(uint32_t escape_control_character_flags) {
+  return HDLCEscapeMap{escape_control_character_flags, (1ULL << (0x7D - 0x40)) | (1ULL << (0x7E - 0x40)), 0, 0};
+}
 
-  while (!r.eof()) {
-    uint8_t ch = r.get_u8();
-    if ((ch == 0x7D) || (ch == 0x7E) || ((ch < 0x20) && ((escape_control_character_flags >> ch) & 1))) {
-      ret.push_back(0x7D);
-      ret.push_back(ch ^ 0x20);
-    } else {
-      ret.push_back(ch);
+// Escapes data into dest, which must have room for at least (size * 2) bytes.
+// Returns the number of bytes written. Unlike unescape_hdlc_frame, this does
+// not handle the start and end sentinels.
+static size_t escape_hdlc_data(void* dest, const void* data, size_t size, const HDLCEscapeMap& escape_map) {
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(data);
+  uint8_t* out = reinterpret_cast<uint8_t*>(dest);
+  size_t run_start = 0;
+  for (size_t z = 0; z < size; z++) {
+    uint8_t ch = src[z];
+    if ((escape_map[ch >> 6] >> (ch & 0x3F)) & 1) {
+      memcpy(out, src + run_start, z - run_start);
+      out += (z - run_start);
+      *(out++) = 0x7D;
+      *(out++) = ch ^ 0x20;
+      run_start = z + 1;
     }
   }
-  ret.push_back(0x7E);
-  return ret;
-}
-
-static string escape_hdlc_frame(const string& data, uint32_t escape_control_character_flags = 0xFFFFFFFF) {
-  return escape_hdlc_frame(data.data(), data.size(), escape_control_character_flags);
+  memcpy(out, src + run_start, size - run_start);
+  out += (size - run_start);
+  return out - reinterpret_cast<uint8_t*>(dest);
 }
 
 // Note: these functions exist because seq nums are allowed to wrap around the
@@ -193,14 +206,8 @@ IPStackSimulator::IPClient::IPClient(
       protocol(protocol),
       mac_addr(0),
       ipv4_addr(0),
-      idle_timeout_event(event_new(sim->base.get(), -1, EV_TIMEOUT, &IPStackSimulator::IPClient::dispatch_on_idle_timeout, this), event_free) {
-  uint64_t idle_timeout_usecs = sim->state->client_idle_timeout_usecs;
-  struct timeval tv = phosg::usecs_to_timeval(idle_timeout_usecs);
-  event_add(this->idle_timeout_event.get(), &tv);
-}
-
-void IPStackSimulator::IPClient::dispatch_on_idle_timeout(evutil_socket_t, short, void* ctx) {
-  reinterpret_cast<IPStackSimulator::IPClient*>(ctx)->on_idle_timeout();
+      idle_timeout_timer(sim->state->timer_wheel, [this]() -> void { this->on_idle_timeout(); }) {
+  this->idle_timeout_timer.schedule(sim->state->client_idle_timeout_usecs);
 }
 
 void IPStackSimulator::IPClient::on_idle_timeout() {
@@ -221,14 +228,25 @@ static void flush_and_free_bufferevent(struct bufferevent* bev) {
 IPStackSimulator::IPClient::TCPConnection::TCPConnection()
     : server_bev(nullptr, flush_and_free_bufferevent),
       pending_data(evbuffer_new(), evbuffer_free),
-      resend_push_event(nullptr, event_free),
       awaiting_first_ack(true),
       server_addr(0),
       server_port(0),
       client_port(0),
       next_client_seq(0),
       acked_server_seq(0),
-      resend_push_usecs(DEFAULT_RESEND_PUSH_USECS),
+      next_server_seq(0),
+      client_window(0),
+      congestion_window(0),
+      slow_start_threshold(0),
+      window_scale_enabled(false),
+      client_window_shift(0),
+      max_sent_server_seq(0),
+      srtt_usecs(0),
+      rttvar_usecs(0),
+      rto_usecs(INITIAL_RTO_USECS),
+      rtt_sample_active(false),
+      rtt_sample_end_seq(0),
+      rtt_sample_start_usecs(0),
       next_push_max_frame_size(1024),
       max_frame_size(1024),
       bytes_received(0),
@@ -303,69 +321,70 @@ void IPStackSimulator::IPClient::on_client_input(struct bufferevent* bev) {
     return;
   }
 
-  uint64_t idle_timeout_usecs = sim ? sim->state->client_idle_timeout_usecs : 60000000;
-  struct timeval tv = phosg::usecs_to_timeval(idle_timeout_usecs);
-  event_add(this->idle_timeout_event.get(), &tv);
+  this->idle_timeout_timer.schedule(sim->state->client_idle_timeout_usecs);
+
+  // Frames are parsed in place from the input buffer, and all complete frames
+  // are consumed with a single drain at the end
+  size_t available_bytes = evbuffer_get_length(buf);
+  if (available_bytes < 2) {
+    return;
+  }
+  const uint8_t* data = evbuffer_pullup(buf, -1);
+  if (!data) {
+    ip_stack_simulator_log.warning("Cannot linearize input buffer (0x%zX bytes)", available_bytes);
+    return;
+  }
+
+  size_t offset = 0;
+  auto process_frame = [&](const void* frame_data, size_t frame_size) -> void {
+    try {
+      sim->on_client_frame(this->shared_from_this(), frame_data, frame_size);
+    } catch (const exception& e) {
+      if (ip_stack_simulator_log.warning("Failed to process frame: %s", e.what())) {
+        phosg::print_data(stderr, frame_data, frame_size);
+      }
+    }
+  };
 
   switch (this->protocol) {
     case Protocol::ETHERNET_TAPSERVER:
     case Protocol::HDLC_TAPSERVER:
-      while (evbuffer_get_length(buf) >= 2) {
-        uint16_t frame_size;
-        evbuffer_copyout(buf, &frame_size, 2);
-        if (evbuffer_get_length(buf) < static_cast<size_t>(frame_size + 2)) {
+      while (available_bytes - offset >= 2) {
+        le_uint16_t frame_size;
+        memcpy(&frame_size, data + offset, 2);
+        if (available_bytes - offset < static_cast<size_t>(frame_size + 2)) {
           break; // No complete frame available; done for now
         }
-
-        evbuffer_drain(buf, 2);
-        string frame(frame_size, '\0');
-        evbuffer_remove(buf, frame.data(), frame.size());
-
-        try {
-          sim->on_client_frame(this->shared_from_this(), frame);
-        } catch (const exception& e) {
-          if (ip_stack_simulator_log.warning("Failed to process frame: %s", e.what())) {
-            phosg::print_data(stderr, frame);
-          }
-        }
+        process_frame(data + offset + 2, frame_size);
+        offset += frame_size + 2;
       }
       break;
     case Protocol::HDLC_RAW:
-      while (evbuffer_get_length(buf) >= 2) {
-        struct evbuffer_ptr res = evbuffer_search(buf, "\x7E", 1, nullptr);
-        if (res.pos < 0) {
+      while (available_bytes - offset >= 2) {
+        const uint8_t* start = reinterpret_cast<const uint8_t*>(memchr(data + offset, 0x7E, available_bytes - offset));
+        if (!start) {
+          // There's no frame start in the buffer, so none of the data can be
+          // part of a valid frame
+          offset = available_bytes;
           break;
         }
-        size_t start_offset = res.pos;
+        // Skip any garbage before the start of the frame
+        offset = start - data;
 
-        if (evbuffer_ptr_set(buf, &res, 1, EVBUFFER_PTR_ADD)) {
-          ip_stack_simulator_log.warning("Cannot advance search for end of frame");
+        const uint8_t* end = reinterpret_cast<const uint8_t*>(memchr(start + 1, 0x7E, available_bytes - offset - 1));
+        if (!end) {
           break;
         }
-
-        struct evbuffer_ptr end_res = evbuffer_search(buf, "\x7E", 1, &res);
-        if (end_res.pos < 0) {
-          break;
-        }
-        size_t frame_size = end_res.pos + 1 - start_offset;
-
-        if (start_offset) {
-          evbuffer_drain(buf, start_offset);
-        }
-
-        string frame(frame_size, '\0');
-        evbuffer_remove(buf, frame.data(), frame.size());
-
-        try {
-          sim->on_client_frame(this->shared_from_this(), frame);
-        } catch (const exception& e) {
-          if (ip_stack_simulator_log.warning("Failed to process frame: %s", e.what())) {
-            phosg::print_data(stderr, frame);
-          }
-        }
+        size_t frame_size = end + 1 - start;
+        process_frame(start, frame_size);
+        offset += frame_size;
       }
       break;
   }
+
+  if (offset) {
+    evbuffer_drain(buf, offset);
+  }
 }
 
 void IPStackSimulator::IPClient::dispatch_on_client_error(struct bufferevent* bev, short events, void* ctx) {
@@ -451,25 +470,47 @@ void IPStackSimulator::send_layer3_frame(shared_ptr<IPClient> c, FrameInfo::Prot
           throw logic_error("unknown layer 3 protocol");
       }
 
-      phosg::StringWriter w;
-      w.put(hdlc);
-      w.write(data, size);
-      w.put_u16l(FrameInfo::computed_hdlc_checksum(w.str().data() + 1, w.size() - 1));
-      w.put_u8(0x7E);
-
-      string escaped = escape_hdlc_frame(w.str(), c->hdlc_escape_control_character_flags);
-      if (ip_stack_simulator_log.debug("Sending HDLC frame to virtual network (escaped to %zX bytes)", escaped.size())) {
-        phosg::print_data(stderr, w.str());
+      // Build the escaped frame directly in the output buffer. In the worst
+      // case, every byte except the sentinels must be escaped; for tapserver
+      // clients, the frame is also preceded by its size.
+      bool is_tapserver = (c->protocol == Protocol::HDLC_TAPSERVER);
+      size_t header_bytes = is_tapserver ? 2 : 0;
+      size_t max_escaped_size = ((sizeof(HDLCHeader) - 1 + size + 2) * 2) + 2;
+      struct evbuffer_iovec iov;
+      if (evbuffer_reserve_space(out_buf, header_bytes + max_escaped_size, &iov, 1) != 1) {
+        throw runtime_error("cannot allocate space for HDLC frame");
       }
 
-      if (c->protocol == Protocol::HDLC_TAPSERVER) {
-        le_uint16_t frame_size = escaped.size();
-        evbuffer_add(out_buf, &frame_size, 2);
+      auto escape_map = hdlc_escape_map_for_flags(c->hdlc_escape_control_character_flags);
+      uint8_t* frame_start = reinterpret_cast<uint8_t*>(iov.iov_base) + header_bytes;
+      uint8_t* out = frame_start;
+      *(out++) = 0x7E;
+      out += escape_hdlc_data(out, &hdlc.address, sizeof(HDLCHeader) - 1, escape_map);
+      out += escape_hdlc_data(out, data, size, escape_map);
+      le_uint16_t checksum = FrameInfo::computed_hdlc_checksum(
+          data, size, FrameInfo::computed_hdlc_checksum(&hdlc.address, sizeof(HDLCHeader) - 1));
+      out += escape_hdlc_data(out, &checksum, sizeof(checksum), escape_map);
+      *(out++) = 0x7E;
+      size_t escaped_size = out - frame_start;
+
+      if (ip_stack_simulator_log.debug("Sending HDLC frame to virtual network (escaped to %zX bytes)", escaped_size)) {
+        phosg::StringWriter w;
+        w.put(hdlc);
+        w.write(data, size);
+        w.put(checksum);
+        w.put_u8(0x7E);
+        phosg::print_data(stderr, w.str());
       }
-      evbuffer_add(out_buf, escaped.data(), escaped.size());
       if (this->pcap_text_log_file) {
-        this->log_frame(escaped);
+        this->log_frame(frame_start, escaped_size);
       }
+
+      if (is_tapserver) {
+        le_uint16_t frame_size = escaped_size;
+        memcpy(iov.iov_base, &frame_size, sizeof(frame_size));
+      }
+      iov.iov_len = header_bytes + escaped_size;
+      evbuffer_commit_space(out_buf, &iov, 1);
       break;
     }
 
@@ -478,23 +519,26 @@ void IPStackSimulator::send_layer3_frame(shared_ptr<IPClient> c, FrameInfo::Prot
   }
 }
 
-void IPStackSimulator::on_client_frame(shared_ptr<IPClient> c, const string& frame) {
+void IPStackSimulator::on_client_frame(shared_ptr<IPClient> c, const void* data, size_t size) {
   FrameInfo::LinkType link_type = (c->protocol == Protocol::ETHERNET_TAPSERVER)
       ? FrameInfo::LinkType::ETHERNET
       : FrameInfo::LinkType::HDLC;
 
-  const string* effective_data = &frame;
-  string hdlc_unescaped_data;
+  // Ethernet frames are parsed directly from the client's input buffer; HDLC
+  // frames are unescaped into a reusable buffer first
   if (link_type == FrameInfo::LinkType::HDLC) {
-    hdlc_unescaped_data = unescape_hdlc_frame(frame);
-    effective_data = &hdlc_unescaped_data;
+    if (this->hdlc_unescape_buffer.size() < size) {
+      this->hdlc_unescape_buffer.resize(size);
+    }
+    size = unescape_hdlc_frame(this->hdlc_unescape_buffer.data(), data, size);
+    data = this->hdlc_unescape_buffer.data();
   }
   if (ip_stack_simulator_log.debug("Virtual network sent frame")) {
-    phosg::print_data(stderr, *effective_data);
+    phosg::print_data(stderr, data, size);
   }
-  this->log_frame(*effective_data);
+  this->log_frame(data, size);
 
-  FrameInfo fi(link_type, *effective_data);
+  FrameInfo fi(link_type, data, size);
   if (ip_stack_simulator_log.should_log(phosg::LogLevel::DEBUG)) {
     string fi_header = fi.header_str();
     ip_stack_simulator_log.debug("Frame header: %s", fi_header.c_str());
@@ -1081,6 +1125,8 @@ void IPStackSimulator::on_client_tcp_frame(
 
     phosg::StringReader options_r(fi.tcp + 1, fi.tcp_options_size);
     size_t max_frame_size = 1400;
+    bool window_scale_requested = false;
+    uint8_t client_window_shift = 0;
     while (!options_r.eof()) {
       uint8_t option = options_r.get_u8();
       uint8_t option_size = (option < 2) ? 1 : options_r.get_u8();
@@ -1096,11 +1142,13 @@ void IPStackSimulator::on_client_tcp_frame(
           }
           max_frame_size = options_r.get_u16b();
           break;
-        case 3: // Window scale (ignored)
+        case 3: // Window scale
           if (option_size != 3) {
             throw runtime_error("incorrect size for TCP window scale option");
           }
-          options_r.skip(option_size);
+          window_scale_requested = true;
+          // RFC 7323 limits the shift count to 14
+          client_window_shift = min<uint8_t>(options_r.get_u8(), 14);
           break;
         case 4: // Selective ACK supported (ignored)
           if (option_size != 2) {
@@ -1129,14 +1177,38 @@ void IPStackSimulator::on_client_tcp_frame(
     if (emplace_ret.second) {
       // Connection is new; initialize it
       conn.client = c;
-      conn.resend_push_event.reset(event_new(this->base.get(), -1, EV_TIMEOUT,
-          &IPStackSimulator::dispatch_on_resend_push, &conn));
+      conn.resend_push_timer = make_unique<TimerWheel::Timer>(this->state->timer_wheel, [conn_ptr = &conn]() -> void {
+        auto c = conn_ptr->client.lock();
+        if (!c.get()) {
+          ip_stack_simulator_log.warning("Resend push timer fired for deleted client; ignoring");
+          return;
+        }
+        auto sim = c->sim.lock();
+        if (!sim) {
+          ip_stack_simulator_log.warning("Resend push timer fired for client on deleted simulator; ignoring");
+          return;
+        }
+        sim->on_resend_push_timeout(c, *conn_ptr);
+      });
       conn.server_addr = fi.ipv4->dest_addr;
       conn.server_port = fi.tcp->dest_port;
       conn.client_port = fi.tcp->src_port;
       conn.next_client_seq = fi.tcp->seq_num + 1;
       conn.acked_server_seq = phosg::random_object<uint32_t>();
-      conn.resend_push_usecs = DEFAULT_RESEND_PUSH_USECS;
+      conn.next_server_seq = conn.acked_server_seq;
+      // The window in a SYN is never scaled
+      conn.client_window = fi.tcp->window;
+      conn.window_scale_enabled = window_scale_requested;
+      conn.client_window_shift = window_scale_requested ? client_window_shift : 0;
+      // RFC 5681 section 3.1 gives the initial window for this segment size
+      conn.congestion_window = (max_frame_size > 2190) ? (2 * max_frame_size) : (max_frame_size > 1095) ? (3 * max_frame_size)
+                                                                                                      : (4 * max_frame_size);
+      conn.slow_start_threshold = 0xFFFFFFFF;
+      conn.max_sent_server_seq = conn.next_server_seq;
+      conn.srtt_usecs = 0;
+      conn.rttvar_usecs = 0;
+      conn.rto_usecs = INITIAL_RTO_USECS;
+      conn.rtt_sample_active = false;
       conn.next_push_max_frame_size = max_frame_size;
       conn.awaiting_first_ack = true;
       conn.max_frame_size = max_frame_size;
@@ -1174,7 +1246,7 @@ void IPStackSimulator::on_client_tcp_frame(
       throw runtime_error("non-SYN frame does not correspond to any open TCP connection");
     }
     bool conn_valid = true;
-    bool acked_seq_changed = false;
+    bool can_send_more = false;
 
     if (fi.tcp->flags & TCPHeader::Flag::ACK) {
       ip_stack_simulator_log.debug("Client sent ACK %08" PRIX32, fi.tcp->ack_num.load());
@@ -1183,29 +1255,32 @@ void IPStackSimulator::on_client_tcp_frame(
           throw runtime_error("first ack_num was not acked_server_seq + 1");
         }
         conn->acked_server_seq++;
+        conn->next_server_seq = conn->acked_server_seq;
+        conn->max_sent_server_seq = conn->acked_server_seq;
         conn->awaiting_first_ack = false;
+        conn->client_window = fi.tcp->window << conn->client_window_shift;
+
+      } else if (seq_num_less(fi.tcp->ack_num, conn->acked_server_seq)) {
+        // With multiple segments in flight, the client's ACKs can arrive out
+        // of order; an older ACK has no new information, so ignore it
+        ip_stack_simulator_log.debug("Ignoring old ACK %08" PRIX32 " (acked_server_seq=%08" PRIX32 ")",
+            fi.tcp->ack_num.load(), conn->acked_server_seq);
 
       } else {
+        // After a retransmission timeout, next_server_seq is moved back, so the
+        // client may acknowledge data beyond it that was sent before the timeout
+        if (seq_num_greater(fi.tcp->ack_num, conn->max_sent_server_seq)) {
+          throw runtime_error("client acknowledged beyond end of sent data");
+        }
         if (seq_num_greater(fi.tcp->ack_num, conn->acked_server_seq)) {
-          ip_stack_simulator_log.debug("Advancing acked_server_seq from %08" PRIX32, conn->acked_server_seq);
-          uint32_t ack_delta = fi.tcp->ack_num - conn->acked_server_seq;
-          size_t pending_bytes = evbuffer_get_length(conn->pending_data.get());
-          if (pending_bytes < ack_delta) {
-            throw runtime_error("client acknowledged beyond end of sent data");
-          }
-
-          evbuffer_drain(conn->pending_data.get(), ack_delta);
-          conn->acked_server_seq += ack_delta;
-          conn->resend_push_usecs = DEFAULT_RESEND_PUSH_USECS;
-          conn->next_push_max_frame_size = conn->max_frame_size;
-          acked_seq_changed = true;
-
-          ip_stack_simulator_log.debug("Removed %08" PRIX32 " bytes from pending buffer and advanced acked_server_seq to %08" PRIX32,
-              ack_delta, conn->acked_server_seq);
-
-        } else if (seq_num_less(fi.tcp->ack_num, conn->acked_server_seq)) {
-          throw runtime_error("client sent lower ack num than previous frame");
+          this->on_client_ack(*conn, fi.tcp->ack_num);
+          can_send_more = true;
         }
+        size_t new_client_window = fi.tcp->window << conn->client_window_shift;
+        if (new_client_window > conn->client_window) {
+          can_send_more = true;
+        }
+        conn->client_window = new_client_window;
       }
 
       if (!conn->server_bev.get()) {
@@ -1308,9 +1383,9 @@ void IPStackSimulator::on_client_tcp_frame(
           conn_str.c_str(), conn->acked_server_seq, conn->next_client_seq, conn->bytes_received);
     }
 
-    if (conn_valid && acked_seq_changed) {
+    if (conn_valid && can_send_more) {
       // Try to send some more data if the client is waiting on it
-      this->send_pending_push_frame(c, *conn, true);
+      this->send_pending_push_frames(c, *conn);
     }
   }
 }
@@ -1360,59 +1435,159 @@ void IPStackSimulator::open_server_connection(shared_ptr<IPClient> c, IPClient::
   }
 }
 
-void IPStackSimulator::send_pending_push_frame(
-    shared_ptr<IPClient> c, IPClient::TCPConnection& conn, bool always_send) {
-  size_t pending_bytes = evbuffer_get_length(conn.pending_data.get());
-  if (!pending_bytes) {
-    event_del(conn.resend_push_event.get());
-    return;
+void IPStackSimulator::on_client_ack(IPClient::TCPConnection& conn, uint32_t ack_num) {
+  uint32_t ack_delta = ack_num - conn.acked_server_seq;
+  evbuffer_drain(conn.pending_data.get(), ack_delta);
+  conn.acked_server_seq = ack_num;
+  if (seq_num_greater(ack_num, conn.next_server_seq)) {
+    conn.next_server_seq = ack_num;
+  }
+  conn.next_push_max_frame_size = conn.max_frame_size;
+  ip_stack_simulator_log.debug("Removed %08" PRIX32 " bytes from pending buffer and advanced acked_server_seq to %08" PRIX32,
+      ack_delta, conn.acked_server_seq);
+
+  // Update the RTT estimate and retransmission timeout (RFC 6298 section 2)
+  if (conn.rtt_sample_active && !seq_num_less(ack_num, conn.rtt_sample_end_seq)) {
+    uint64_t rtt_usecs = phosg::now() - conn.rtt_sample_start_usecs;
+    if (!conn.srtt_usecs) {
+      conn.srtt_usecs = max<uint64_t>(rtt_usecs, 1);
+      conn.rttvar_usecs = rtt_usecs / 2;
+    } else {
+      uint64_t delta = (conn.srtt_usecs > rtt_usecs) ? (conn.srtt_usecs - rtt_usecs) : (rtt_usecs - conn.srtt_usecs);
+      conn.rttvar_usecs = (3 * conn.rttvar_usecs + delta) / 4;
+      conn.srtt_usecs = max<uint64_t>((7 * conn.srtt_usecs + rtt_usecs) / 8, 1);
+    }
+    conn.rto_usecs = min<uint64_t>(max<uint64_t>(conn.srtt_usecs + 4 * conn.rttvar_usecs, MIN_RTO_USECS), MAX_RTO_USECS);
+    conn.rtt_sample_active = false;
   }
 
-  // If we're waiting to receive an ACK from the client, don't send another PSH
-  // until we get the ACK (unless this is a resend of a previous PSH due to a
-  // timeout)
-  if (!always_send && event_pending(conn.resend_push_event.get(), EV_TIMEOUT, nullptr)) {
-    return;
+  // Grow the congestion window (RFC 5681 section 3.1)
+  if (conn.congestion_window < conn.slow_start_threshold) {
+    conn.congestion_window += min<size_t>(ack_delta, conn.max_frame_size);
+  } else {
+    conn.congestion_window += max<size_t>(1, (conn.max_frame_size * conn.max_frame_size) / conn.congestion_window);
   }
 
-  size_t bytes_to_send = min<size_t>(pending_bytes, conn.next_push_max_frame_size);
+  // New data was acknowledged, so restart the retransmission timer (RFC 6298
+  // section 5.3); send_pending_push_frames starts it again if any data is
+  // still in flight
+  conn.resend_push_timer->cancel();
+}
+
+void IPStackSimulator::send_pending_push_frames(shared_ptr<IPClient> c, IPClient::TCPConnection& conn) {
+  size_t pending_bytes = evbuffer_get_length(conn.pending_data.get());
+  size_t bytes_in_flight = conn.next_server_seq - conn.acked_server_seq;
+
+  size_t max_segment_size = conn.next_push_max_frame_size;
+  size_t window = min<size_t>(conn.client_window, conn.congestion_window);
   if (c->protocol == Protocol::HDLC_TAPSERVER) {
     // There is a bug in Dolphin's modem implementation (which I wrote, so it's
     // my fault) that causes commands to be dropped when too much data is sent
     // at once. To work around this, we only send up to 200 bytes in each push
-    // frame.
-    bytes_to_send = min<size_t>(bytes_to_send, 200);
+    // frame, and only send one frame at a time.
+    max_segment_size = min<size_t>(max_segment_size, 200);
+    window = min<size_t>(window, max_segment_size);
   }
 
-  ip_stack_simulator_log.debug("Sending PSH frame with seq_num %08" PRIX32 ", 0x%zX/0x%zX data bytes",
-      conn.acked_server_seq, bytes_to_send, pending_bytes);
-
-  this->send_tcp_frame(c, conn, TCPHeader::Flag::PSH, conn.pending_data.get(), bytes_to_send);
-  struct timeval resend_push_timeout = phosg::usecs_to_timeval(conn.resend_push_usecs);
-  event_add(conn.resend_push_event.get(), &resend_push_timeout);
-
-  // If the client isn't responding to our PSHes, back off exponentially up to
-  // a limit of 5 seconds between PSH frames. This window is reset when
-  // acked_server_seq changes (that is, when the client has acknowledged any new
-  // data). It seems some situations cause GameCube clients to drop packets more
-  // often; to alleviate this, we also try to resend less data.
-  conn.resend_push_usecs *= 2;
-  if (conn.resend_push_usecs > 5000000) {
-    conn.resend_push_usecs = 5000000;
+  string segment_data;
+  while (bytes_in_flight < pending_bytes) {
+    size_t window_remaining = (window > bytes_in_flight) ? (window - bytes_in_flight) : 0;
+    // If the client's window is closed and nothing is in flight, send a single
+    // byte anyway; the client will ACK it (or not) with its current window, so
+    // we'll find out when the window opens again
+    if (!window_remaining && !bytes_in_flight) {
+      window_remaining = 1;
+    }
+    size_t bytes_to_send = min<size_t>(min<size_t>(pending_bytes - bytes_in_flight, max_segment_size), window_remaining);
+    if (!bytes_to_send) {
+      break;
+    }
+
+    segment_data.resize(bytes_to_send);
+    struct evbuffer_ptr ptr;
+    evbuffer_ptr_set(conn.pending_data.get(), &ptr, bytes_in_flight, EVBUFFER_PTR_SET);
+    if (evbuffer_copyout_from(conn.pending_data.get(), &ptr, segment_data.data(), bytes_to_send) != static_cast<ssize_t>(bytes_to_send)) {
+      throw logic_error("cannot read pending data for TCP segment");
+    }
+
+    ip_stack_simulator_log.debug("Sending PSH frame with seq_num %08" PRIX32 ", 0x%zX/0x%zX data bytes (0x%zX in flight)",
+        conn.next_server_seq, bytes_to_send, pending_bytes, bytes_in_flight);
+    this->send_tcp_frame(c, conn, TCPHeader::Flag::PSH, conn.next_server_seq, segment_data.data(), bytes_to_send);
+
+    // Only time segments that contain no previously-sent data (Karn's
+    // algorithm; RFC 6298 section 3)
+    uint32_t end_seq = conn.next_server_seq + bytes_to_send;
+    if (!seq_num_less(conn.next_server_seq, conn.max_sent_server_seq)) {
+      if (!conn.rtt_sample_active) {
+        conn.rtt_sample_active = true;
+        conn.rtt_sample_end_seq = end_seq;
+        conn.rtt_sample_start_usecs = phosg::now();
+      }
+    }
+    if (seq_num_greater(end_seq, conn.max_sent_server_seq)) {
+      conn.max_sent_server_seq = end_seq;
+    }
+    conn.next_server_seq += bytes_to_send;
+    bytes_in_flight += bytes_to_send;
+  }
+
+  if (!bytes_in_flight) {
+    conn.resend_push_timer->cancel();
+  } else if (!conn.resend_push_timer->is_pending()) {
+    conn.resend_push_timer->schedule(conn.rto_usecs);
   }
-  conn.next_push_max_frame_size = max<size_t>(0x100, conn.next_push_max_frame_size - 0x100);
+}
+
+void IPStackSimulator::on_resend_push_timeout(shared_ptr<IPClient> c, IPClient::TCPConnection& conn) {
+  size_t bytes_in_flight = conn.next_server_seq - conn.acked_server_seq;
+  if (bytes_in_flight) {
+    ip_stack_simulator_log.debug("Retransmission timeout; resending from seq_num %08" PRIX32 " (0x%zX bytes were in flight)",
+        conn.acked_server_seq, bytes_in_flight);
+
+    // Resend everything after the last acknowledged byte, but reduce the
+    // congestion window first (RFC 5681 section 3.1) so only one segment is
+    // sent now; the rest follow as the client acknowledges them
+    conn.slow_start_threshold = max<size_t>(bytes_in_flight / 2, 2 * conn.max_frame_size);
+    conn.congestion_window = conn.max_frame_size;
+    conn.next_server_seq = conn.acked_server_seq;
+    conn.rtt_sample_active = false;
+
+    // If the client isn't responding, back off exponentially up to a limit of
+    // 5 seconds between retransmissions (RFC 6298 section 5.5). It seems some
+    // situations cause GameCube clients to drop packets more often; to
+    // alleviate this, we also try to resend less data in each frame. The frame
+    // size is reset when the client acknowledges any new data.
+    conn.rto_usecs = min<uint64_t>(conn.rto_usecs * 2, MAX_RTO_USECS);
+    conn.next_push_max_frame_size = max<size_t>(0x100, conn.next_push_max_frame_size - 0x100);
+  }
+  this->send_pending_push_frames(c, conn);
+}
+
+void IPStackSimulator::send_tcp_frame(shared_ptr<IPClient> c, IPClient::TCPConnection& conn, uint16_t flags) {
+  this->send_tcp_frame(c, conn, flags, conn.next_server_seq, nullptr, 0);
 }
 
 void IPStackSimulator::send_tcp_frame(
     shared_ptr<IPClient> c,
     IPClient::TCPConnection& conn,
     uint16_t flags,
-    struct evbuffer* src_buf,
-    size_t src_bytes) {
-  if (!src_bytes != !(flags & TCPHeader::Flag::PSH)) {
+    uint32_t seq_num,
+    const void* data,
+    size_t size) {
+  if (!size != !(flags & TCPHeader::Flag::PSH)) {
     throw logic_error("data should be given if and only if PSH is given");
   }
 
+  // If the client asked for window scaling, the SYN+ACK must also contain the
+  // window scale option, or the client won't scale its window. Our own window
+  // is small, so we use a shift count of 0.
+  static const uint8_t syn_ack_options[4] = {0x01, 0x03, 0x03, 0x00}; // NOP, window scale (shift 0)
+  bool send_options = (flags & TCPHeader::Flag::SYN) && conn.window_scale_enabled;
+  if (send_options && size) {
+    throw logic_error("cannot send data in a SYN frame");
+  }
+  size_t options_size = send_options ? sizeof(syn_ack_options) : 0;
+
   IPv4Header ipv4;
   ipv4.version_ihl = 0x45;
   ipv4.tos = 0;
@@ -1428,44 +1603,35 @@ void IPStackSimulator::send_tcp_frame(
   TCPHeader tcp;
   tcp.src_port = conn.server_port;
   tcp.dest_port = conn.client_port;
-  tcp.seq_num = conn.acked_server_seq;
+  tcp.seq_num = seq_num;
   tcp.ack_num = conn.next_client_seq;
-  tcp.flags = (5 << 12) | TCPHeader::Flag::ACK | flags;
+  tcp.flags = static_cast<uint16_t>(((5 + options_size / 4) << 12) | TCPHeader::Flag::ACK | flags);
   tcp.window = 0x1000;
   tcp.urgent_ptr = 0;
   // tcp.checksum filled in later
 
-  ipv4.size = sizeof(IPv4Header) + sizeof(TCPHeader) + src_bytes;
+  ipv4.size = sizeof(IPv4Header) + sizeof(TCPHeader) + options_size + size;
   ipv4.checksum = FrameInfo::computed_ipv4_header_checksum(ipv4);
 
-  const void* linear_data = src_bytes ? evbuffer_pullup(src_buf, src_bytes) : nullptr;
-  tcp.checksum = FrameInfo::computed_tcp4_checksum(ipv4, tcp, linear_data, src_bytes);
+  // The checksum covers the options and data, which are never both present
+  tcp.checksum = send_options
+      ? FrameInfo::computed_tcp4_checksum(ipv4, tcp, syn_ack_options, options_size)
+      : FrameInfo::computed_tcp4_checksum(ipv4, tcp, data, size);
 
   phosg::StringWriter w;
   w.put(ipv4);
   w.put(tcp);
-  if (src_bytes) {
-    w.write(linear_data, src_bytes);
+  if (send_options) {
+    w.write(syn_ack_options, options_size);
+  }
+  if (size) {
+    w.write(data, size);
   }
+  conn.bytes_sent += size;
 
   this->send_layer3_frame(c, FrameInfo::Protocol::IPV4, w.str());
 }
 
-void IPStackSimulator::dispatch_on_resend_push(evutil_socket_t, short, void* ctx) {
-  auto* conn = reinterpret_cast<IPClient::TCPConnection*>(ctx);
-  auto c = conn->client.lock();
-  if (!c.get()) {
-    ip_stack_simulator_log.warning("Resend push event triggered for deleted client; ignoring");
-  } else {
-    auto sim = c->sim.lock();
-    if (!sim) {
-      ip_stack_simulator_log.warning("Resend push event triggered for client on deleted simulator; ignoring");
-    } else {
-      sim->send_pending_push_frame(c, *conn, true);
-    }
-  }
-}
-
 void IPStackSimulator::dispatch_on_server_input(struct bufferevent*, void* ctx) {
   auto* conn = reinterpret_cast<IPClient::TCPConnection*>(ctx);
   auto c = conn->client.lock();
@@ -1486,13 +1652,10 @@ void IPStackSimulator::on_server_input(shared_ptr<IPClient> c, IPClient::TCPConn
   ip_stack_simulator_log.debug("Server input event: 0x%zX bytes to read",
       evbuffer_get_length(buf));
 
-  auto sim = c->sim.lock();
-  uint64_t idle_timeout_usecs = sim ? sim->state->client_idle_timeout_usecs : 60000000;
-  struct timeval tv = phosg::usecs_to_timeval(idle_timeout_usecs);
-  event_add(c->idle_timeout_event.get(), &tv);
+  c->idle_timeout_timer.schedule(this->state->client_idle_timeout_usecs);
 
   evbuffer_add_buffer(conn.pending_data.get(), buf);
-  this->send_pending_push_frame(c, conn, false);
+  this->send_pending_push_frames(c, conn);
 }
 
 void IPStackSimulator::dispatch_on_server_error(
@@ -1533,8 +1696,12 @@ void IPStackSimulator::on_server_error(
 }
 
 void IPStackSimulator::log_frame(const string& data) const {
+  this->log_frame(data.data(), data.size());
+}
+
+void IPStackSimulator::log_frame(const void* data, size_t size) const {
   if (this->pcap_text_log_file) {
-    phosg::print_data(this->pcap_text_log_file, data, 0, nullptr, phosg::PrintDataFlags::SKIP_SEPARATOR);
+    phosg::print_data(this->pcap_text_log_file, data, size, 0, nullptr, phosg::PrintDataFlags::SKIP_SEPARATOR);
     fputc('\n', this->pcap_text_log_file);
     fflush(this->pcap_text_log_file);
   }
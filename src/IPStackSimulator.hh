@@ -13,6 +13,7 @@
 #include "Server.hh"
 #include "ServerState.hh"
 #include "Text.hh"
+#include "TimerWheel.hh"
 
 class IPStackSimulator : public std::enable_shared_from_this<IPStackSimulator> {
 public:
@@ -25,7 +26,6 @@ public:
   using unique_listener = std::unique_ptr<struct evconnlistener, void (*)(struct evconnlistener*)>;
   using unique_bufferevent = std::unique_ptr<struct bufferevent, void (*)(struct bufferevent*)>;
   using unique_evbuffer = std::unique_ptr<struct evbuffer, void (*)(struct evbuffer*)>;
-  using unique_event = std::unique_ptr<struct event, void (*)(struct event*)>;
 
   struct IPClient : std::enable_shared_from_this<IPClient> {
     std::weak_ptr<IPStackSimulator> sim;
@@ -50,7 +50,7 @@ public:
       // TODO: Get rid of pending_data and just use server_bev's input buffer in
       // its place
       unique_evbuffer pending_data;
-      unique_event resend_push_event;
+      std::unique_ptr<TimerWheel::Timer> resend_push_timer;
 
       bool awaiting_first_ack;
 
@@ -58,8 +58,38 @@ public:
       uint16_t server_port;
       uint16_t client_port;
       uint32_t next_client_seq;
+
+      // Data sent to the client uses a sliding window. pending_data begins
+      // with the oldest unacknowledged byte, whose sequence number is
+      // acked_server_seq; next_server_seq is the sequence number of the next
+      // byte that hasn't been sent yet. The bytes between the two are in
+      // flight, and there may be at most client_window of them.
       uint32_t acked_server_seq;
-      size_t resend_push_usecs;
+      uint32_t next_server_seq;
+      size_t client_window;
+      // Congestion control follows RFC 5681 (slow start and congestion
+      // avoidance; a retransmission timeout resets the congestion window)
+      size_t congestion_window;
+      size_t slow_start_threshold;
+      // Window scaling is used only if the client requested it in its SYN
+      bool window_scale_enabled;
+      uint8_t client_window_shift;
+
+      // Retransmission timeout state, as described in RFC 6298. srtt_usecs is
+      // zero until the first RTT measurement. Only one segment is timed at a
+      // time, and the measurement is abandoned if anything is retransmitted
+      // before it's acknowledged. Retransmitted segments are never timed
+      // (Karn's algorithm), so a sample is only started for a segment that
+      // begins at or after max_sent_server_seq, which is the sequence number
+      // after the last byte ever sent.
+      uint32_t max_sent_server_seq;
+      uint64_t srtt_usecs;
+      uint64_t rttvar_usecs;
+      uint64_t rto_usecs;
+      bool rtt_sample_active;
+      uint32_t rtt_sample_end_seq;
+      uint64_t rtt_sample_start_usecs;
+
       size_t next_push_max_frame_size;
       size_t max_frame_size;
       size_t bytes_received;
@@ -69,7 +99,7 @@ public:
     };
     std::unordered_map<uint64_t, TCPConnection> tcp_connections;
 
-    unique_event idle_timeout_event;
+    TimerWheel::Timer idle_timeout_timer;
 
     IPClient(std::shared_ptr<IPStackSimulator> sim, uint64_t network_id, Protocol protocol, struct bufferevent* bev);
 
@@ -78,7 +108,6 @@ public:
     static void dispatch_on_client_error(struct bufferevent* bev, short events, void* ctx);
     void on_client_error(struct bufferevent* bev, short events);
 
-    static void dispatch_on_idle_timeout(evutil_socket_t fd, short events, void* ctx);
     void on_idle_timeout();
   };
 
@@ -125,6 +154,10 @@ private:
 
   FILE* pcap_text_log_file;
 
+  // Scratch buffer for unescaping incoming HDLC frames; reused across frames
+  // to avoid allocating for each one
+  std::string hdlc_unescape_buffer;
+
   static uint64_t tcp_conn_key_for_connection(const IPClient::TCPConnection& conn);
   static uint64_t tcp_conn_key_for_client_frame(const IPv4Header& ipv4, const TCPHeader& tcp);
   static uint64_t tcp_conn_key_for_client_frame(const FrameInfo& fi);
@@ -141,7 +174,7 @@ private:
   void send_layer3_frame(std::shared_ptr<IPClient> c, FrameInfo::Protocol proto, const std::string& data) const;
   void send_layer3_frame(std::shared_ptr<IPClient> c, FrameInfo::Protocol proto, const void* data, size_t size) const;
 
-  void on_client_frame(std::shared_ptr<IPClient> c, const std::string& frame);
+  void on_client_frame(std::shared_ptr<IPClient> c, const void* data, size_t size);
   void on_client_lcp_frame(std::shared_ptr<IPClient> c, const FrameInfo& fi);
   void on_client_pap_frame(std::shared_ptr<IPClient> c, const FrameInfo& fi);
   void on_client_ipcp_frame(std::shared_ptr<IPClient> c, const FrameInfo& fi);
@@ -154,16 +187,23 @@ private:
   static void dispatch_on_server_error(struct bufferevent* bev, short events, void* ctx);
   void on_server_error(std::shared_ptr<IPClient> c, IPClient::TCPConnection& conn, short events);
 
-  static void dispatch_on_resend_push(evutil_socket_t, short, void* ctx);
-  void send_pending_push_frame(std::shared_ptr<IPClient> c, IPClient::TCPConnection& conn, bool always_send);
+  void on_resend_push_timeout(std::shared_ptr<IPClient> c, IPClient::TCPConnection& conn);
+  void on_client_ack(IPClient::TCPConnection& conn, uint32_t ack_num);
+  void send_pending_push_frames(std::shared_ptr<IPClient> c, IPClient::TCPConnection& conn);
+  void send_tcp_frame(
+      std::shared_ptr<IPClient> c,
+      IPClient::TCPConnection& conn,
+      uint16_t flags = 0);
   void send_tcp_frame(
       std::shared_ptr<IPClient> c,
       IPClient::TCPConnection& conn,
-      uint16_t flags = 0,
-      struct evbuffer* src_buf = nullptr,
-      size_t src_bytes = 0);
+      uint16_t flags,
+      uint32_t seq_num,
+      const void* data,
+      size_t size);
 
   void open_server_connection(std::shared_ptr<IPClient> c, IPClient::TCPConnection& conn);
 
   void log_frame(const std::string& data) const;
+  void log_frame(const void* data, size_t size) const;
 };
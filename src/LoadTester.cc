@@ -0,0 +1,689 @@
+#include "LoadTester.hh"
+
+#include <ctype.h>
+#include <event2/bufferevent.h>
+#include <inttypes.h>
+#include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <array>
+#include <phosg/Filesystem.hh>
+#include <phosg/Hash.hh>
+#include <phosg/Network.hh>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+
+#include "CommandFormats.hh"
+#include "Loggers.hh"
+#include "PSOProtocol.hh"
+
+using namespace std;
+
+static uint16_t command_for_data(Version version, const string& data) {
+  PSOCommandHeader header;
+  memcpy(&header, data.data(), min<size_t>(data.size(), sizeof(header)));
+  return header.command(version);
+}
+
+LoadTester::Script::Script(const string& name, FILE* input_log) : name(name) {
+  // This parser accepts the same log format as ReplaySession's, but ignores
+  // the masks, since the contents of received commands aren't checked
+  Event* parsing_command = nullptr;
+  size_t line_num = 0;
+  while (!feof(input_log)) {
+    line_num++;
+    string line = phosg::fgets(input_log);
+    if (phosg::ends_with(line, "\n")) {
+      line.resize(line.size() - 1);
+    }
+    if (line.empty()) {
+      continue;
+    }
+
+    if (parsing_command) {
+      string expected_start = phosg::string_printf("%04zX |", parsing_command->data.size());
+      if (phosg::starts_with(line, expected_start)) {
+        parsing_command->data += phosg::parse_data_string(line.substr(expected_start.size(), 16 * 3 + 1));
+        continue;
+      }
+      Version version = this->clients.at(parsing_command->client_id).version;
+      parsing_command->command = command_for_data(version, parsing_command->data);
+      if (parsing_command->type == Event::Type::SEND) {
+        this->collect_identifiers(*parsing_command, version);
+      }
+      parsing_command = nullptr;
+    }
+
+    if (!phosg::starts_with(line, "I ")) {
+      continue;
+    }
+
+    if (line.find(" - [Server] Client connected: C-") != string::npos) {
+      auto tokens = phosg::split(line, ' ');
+      if (tokens.size() != 15 || !phosg::starts_with(tokens[8], "C-")) {
+        throw runtime_error(phosg::string_printf("(%s:%zu) client connection message format is incorrect", name.c_str(), line_num));
+      }
+      auto listen_tokens = phosg::split(tokens[14], '-');
+      if (listen_tokens.size() < 4) {
+        throw runtime_error(phosg::string_printf("(%s:%zu) client connection message listening socket token format is incorrect", name.c_str(), line_num));
+      }
+      uint64_t client_id = stoull(tokens[8].substr(2), nullptr, 16);
+      Client c{static_cast<uint16_t>(stoul(listen_tokens[1], nullptr, 10)), phosg::enum_for_name<Version>(listen_tokens[2].c_str())};
+      if (is_patch(c.version)) {
+        throw runtime_error(phosg::string_printf("(%s:%zu) patch server connections are not supported", name.c_str(), line_num));
+      }
+      if (!this->clients.emplace(client_id, c).second) {
+        throw runtime_error(phosg::string_printf("(%s:%zu) duplicate client ID in input log", name.c_str(), line_num));
+      }
+      this->events.emplace_back(Event{Event::Type::CONNECT, client_id, 0, "", line_num});
+
+    } else if (line.find(" - [Server] Client disconnected: C-") != string::npos) {
+      auto tokens = phosg::split(line, ' ');
+      if (tokens.size() < 9 || !phosg::starts_with(tokens[8], "C-")) {
+        throw runtime_error(phosg::string_printf("(%s:%zu) client disconnection message format is incorrect", name.c_str(), line_num));
+      }
+      uint64_t client_id = stoull(tokens[8].substr(2), nullptr, 16);
+      if (!this->clients.count(client_id)) {
+        throw runtime_error(phosg::string_printf("(%s:%zu) unknown disconnecting client ID in input log", name.c_str(), line_num));
+      }
+      this->events.emplace_back(Event{Event::Type::DISCONNECT, client_id, 0, "", line_num});
+
+    } else if ((line.find(" - [Commands] Sending to C-") != string::npos) ||
+        (line.find(" - [Commands] Received from C-") != string::npos)) {
+      auto tokens = phosg::split(line, ' ');
+      if (tokens.size() < 10) {
+        throw runtime_error(phosg::string_printf("(%s:%zu) command header line too short", name.c_str(), line_num));
+      }
+      uint64_t client_id = stoull(tokens[8].substr(2), nullptr, 16);
+      if (!this->clients.count(client_id)) {
+        throw runtime_error(phosg::string_printf("(%s:%zu) input log contains command for missing client", name.c_str(), line_num));
+      }
+      bool from_client = (tokens[6] == "Received");
+      parsing_command = &this->events.emplace_back(
+          Event{from_client ? Event::Type::SEND : Event::Type::RECEIVE, client_id, 0, "", line_num});
+    }
+  }
+
+  if (parsing_command) {
+    Version version = this->clients.at(parsing_command->client_id).version;
+    parsing_command->command = command_for_data(version, parsing_command->data);
+    if (parsing_command->type == Event::Type::SEND) {
+      this->collect_identifiers(*parsing_command, version);
+    }
+  }
+  if (this->events.empty()) {
+    throw runtime_error(phosg::string_printf("(%s) log contains no events", name.c_str()));
+  }
+}
+
+void LoadTester::Script::add_identifier(const string& s) {
+  // Only ASCII identifiers are replaced, since the replacements must be the
+  // same length as the originals in every text encoding
+  if (s.empty() || any_of(s.begin(), s.end(), [](char ch) { return ch & 0x80; })) {
+    return;
+  }
+  if ((find(this->identifiers.begin(), this->identifiers.end(), s) == this->identifiers.end())) {
+    this->identifiers.emplace_back(s);
+  }
+}
+
+void LoadTester::Script::collect_identifiers(Event& ev, Version version) {
+  size_t header_size = PSOCommandHeader::header_size(version);
+  if (ev.data.size() < header_size) {
+    return;
+  }
+  const void* cmd_data = ev.data.data() + header_size;
+  size_t cmd_size = ev.data.size() - header_size;
+
+  // Replacements are only made within the fields recorded here, so they can't
+  // match unrelated bytes elsewhere in the command (or in other commands).
+  // Guild card numbers, security tokens, and client configs aren't added as
+  // identifiers, since their replacements are learned from the server's 04
+  // and E6 commands during each session.
+  auto add_field = [&](const auto& field) -> void {
+    size_t offset = reinterpret_cast<const char*>(&field) - ev.data.data();
+    ev.identifier_fields.emplace_back(offset, sizeof(field));
+  };
+  auto add_string_field = [&](const auto& field) -> void {
+    this->add_identifier(field.decode());
+    add_field(field);
+  };
+
+  // These are the same commands that ReplaySession::check_for_password looks
+  // at, but here we collect the fields that identify the player instead
+  try {
+    if (version == Version::BB_V4) {
+      if (ev.command == 0x04) {
+        add_string_field(check_size_t<C_LegacyLogin_BB_04>(cmd_data, cmd_size).username);
+      } else if (ev.command == 0x93) {
+        const auto& cmd = check_size_t<C_LoginBase_BB_93>(cmd_data, cmd_size, 0xFFFF);
+        add_field(cmd.guild_card_number);
+        add_field(cmd.security_token);
+        add_string_field(cmd.username);
+        if (cmd_size == sizeof(C_LoginWithHardwareInfo_BB_93)) {
+          add_field(check_size_t<C_LoginWithHardwareInfo_BB_93>(cmd_data, cmd_size).client_config);
+        } else if (cmd_size == sizeof(C_LoginWithoutHardwareInfo_BB_93)) {
+          add_field(check_size_t<C_LoginWithoutHardwareInfo_BB_93>(cmd_data, cmd_size).client_config);
+        }
+      } else if (ev.command == 0x9C) {
+        add_string_field(check_size_t<C_Register_BB_9C>(cmd_data, cmd_size).username);
+      } else if (ev.command == 0x9E) {
+        const auto& cmd = check_size_t<C_LoginExtended_BB_9E>(cmd_data, cmd_size);
+        add_field(cmd.guild_card_number);
+        add_string_field(cmd.username);
+        add_field(cmd.client_config);
+      }
+      return;
+    }
+
+    switch (ev.command) {
+      case 0x03:
+        add_string_field(check_size_t<C_LegacyLogin_PC_V3_03>(cmd_data, cmd_size).serial_number2);
+        break;
+      case 0x04:
+        add_string_field(check_size_t<C_LegacyLogin_PC_V3_04>(cmd_data, cmd_size).serial_number);
+        break;
+      case 0x90:
+        add_string_field(check_size_t<C_LoginV1_DC_PC_V3_90>(cmd_data, cmd_size, 0xFFFF).serial_number);
+        break;
+      case 0x93:
+        if (is_v1(version)) {
+          const auto& cmd = check_size_t<C_LoginV1_DC_93>(cmd_data, cmd_size, sizeof(C_LoginExtendedV1_DC_93));
+          add_field(cmd.guild_card_number);
+          add_string_field(cmd.serial_number);
+          add_string_field(cmd.serial_number2);
+          add_string_field(cmd.name);
+        }
+        break;
+      case 0x9A: {
+        const auto& cmd = check_size_t<C_Login_DC_PC_V3_9A>(cmd_data, cmd_size);
+        add_string_field(cmd.v1_serial_number);
+        add_string_field(cmd.serial_number);
+        add_field(cmd.guild_card_number);
+        add_string_field(cmd.serial_number2);
+        break;
+      }
+      case 0x9C:
+        add_string_field(check_size_t<C_Register_DC_PC_V3_9C>(cmd_data, cmd_size).serial_number);
+        break;
+      case 0x9D:
+      case 0x9E: {
+        const auto& cmd = check_size_t<C_Login_DC_PC_GC_9D>(cmd_data, cmd_size, 0xFFFF);
+        add_field(cmd.guild_card_number);
+        add_string_field(cmd.v1_serial_number);
+        add_string_field(cmd.serial_number);
+        add_string_field(cmd.serial_number2);
+        add_string_field(cmd.name);
+        // XB doesn't send the client config in 9E (see CommandFormats.hh)
+        if ((ev.command == 0x9E) && (version != Version::XB_V3) && (cmd_size >= sizeof(C_Login_GC_9E))) {
+          add_field(check_size_t<C_Login_GC_9E>(cmd_data, cmd_size, 0xFFFF).client_config);
+        }
+        break;
+      }
+      case 0xDB: {
+        const auto& cmd = check_size_t<C_VerifyAccount_V3_DB>(cmd_data, cmd_size);
+        add_string_field(cmd.v1_serial_number);
+        add_string_field(cmd.serial_number);
+        add_string_field(cmd.serial_number2);
+        break;
+      }
+    }
+  } catch (const exception& e) {
+    config_log.warning("(%s:%zu) cannot parse login command %02hX: %s", this->name.c_str(), ev.line_num, ev.command, e.what());
+  }
+}
+
+LoadTester::Connection::Connection(Session* session, uint64_t client_id, Version version)
+    : session(session),
+      client_id(client_id),
+      channel(
+          version,
+          1,
+          &LoadTester::dispatch_on_command_received,
+          &LoadTester::dispatch_on_error,
+          this,
+          phosg::string_printf("L-%zu-%" PRIX64, session->session_num, client_id)) {}
+
+LoadTester::Session::Session(LoadTester* tester, shared_ptr<const Script> script, size_t session_num)
+    : tester(tester),
+      script(script),
+      session_num(session_num),
+      event_complete(script->events.size(), false) {
+  // Generate a replacement for each identifier that's the same length as the
+  // original and unique to this session. Hex strings (serial numbers) are
+  // replaced with other hex strings; other strings keep their prefix and end
+  // with the session number in base 36.
+  for (const auto& ident : script->identifiers) {
+    string replacement = ident;
+    bool is_hex = all_of(ident.begin(), ident.end(), [](char ch) { return isxdigit(ch); });
+    if (is_hex) {
+      bool lowercase = any_of(ident.begin(), ident.end(), [](char ch) { return (ch >= 'a') && (ch <= 'f'); });
+      const char* alphabet = lowercase ? "0123456789abcdef" : "0123456789ABCDEF";
+      uint64_t hash = phosg::fnv1a64(ident, phosg::fnv1a64(script->name, session_num + 1));
+      for (size_t z = 0; z < replacement.size(); z++) {
+        replacement[replacement.size() - z - 1] = alphabet[hash & 0xF];
+        hash = (hash >> 4) | (hash << 60);
+      }
+    } else {
+      static const char* alphabet = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+      size_t value = session_num;
+      for (size_t z = 0; z < min<size_t>(replacement.size(), 4); z++) {
+        replacement[replacement.size() - z - 1] = alphabet[value % 36];
+        value /= 36;
+      }
+    }
+    this->replacements.emplace_back(ident, replacement);
+  }
+}
+
+LoadTester::LoadTester(shared_ptr<struct event_base> base, const Config& config)
+    : base(base),
+      config(config) {}
+
+void LoadTester::add_log(const string& name, FILE* input_log) {
+  auto script = make_shared<Script>(name, input_log);
+
+  bool has_bb_clients = false;
+  for (const auto& it : script->clients) {
+    has_bb_clients |= (it.second.version == Version::BB_V4);
+  }
+  if (has_bb_clients && this->bb_private_keys.empty()) {
+    for (const string& filename : phosg::list_directory_sorted("system/blueburst/keys")) {
+      if (phosg::ends_with(filename, ".nsk")) {
+        this->bb_private_keys.emplace_back(make_shared<PSOBBEncryption::KeyFile>(
+            phosg::load_object_file<PSOBBEncryption::KeyFile>("system/blueburst/keys/" + filename)));
+      }
+    }
+    if (this->bb_private_keys.empty()) {
+      throw runtime_error("BB sessions require a key file in system/blueburst/keys");
+    }
+  }
+
+  this->scripts.emplace_back(script);
+  for (size_t z = 0; z < this->config.sessions_per_log; z++) {
+    this->sessions.emplace_back(make_unique<Session>(this, script, this->sessions.size()));
+  }
+}
+
+void LoadTester::start() {
+  if (this->sessions.empty()) {
+    throw runtime_error("no sessions to run");
+  }
+
+  // Interleave the logs, so the server sees a mix of all of them from the
+  // beginning instead of one log at a time
+  vector<Session*> start_order;
+  for (size_t z = 0; z < this->config.sessions_per_log; z++) {
+    for (size_t log_index = 0; log_index < this->scripts.size(); log_index++) {
+      start_order.emplace_back(this->sessions[log_index * this->config.sessions_per_log + z].get());
+    }
+  }
+
+  this->start_time = phosg::now();
+  for (size_t z = 0; z < start_order.size(); z++) {
+    Session* s = start_order[z];
+    s->start_ev.reset(event_new(this->base.get(), -1, EV_TIMEOUT, &LoadTester::dispatch_start_session, s), event_free);
+    auto tv = phosg::usecs_to_timeval(z * this->config.start_interval_usecs);
+    event_add(s->start_ev.get(), &tv);
+  }
+}
+
+void LoadTester::dispatch_start_session(evutil_socket_t, short, void* ctx) {
+  Session* s = reinterpret_cast<Session*>(ctx);
+  s->tester->start_session(*s);
+}
+
+void LoadTester::start_session(Session& s) {
+  s.start_time = phosg::now();
+  this->update_timeout_event(s);
+  this->execute_pending_events(s);
+}
+
+void LoadTester::update_timeout_event(Session& s) {
+  if (!s.timeout_ev) {
+    s.timeout_ev.reset(event_new(this->base.get(), -1, EV_TIMEOUT, &LoadTester::dispatch_on_timeout, &s), event_free);
+  }
+  auto tv = phosg::usecs_to_timeval(this->config.receive_timeout_usecs);
+  event_add(s.timeout_ev.get(), &tv);
+}
+
+void LoadTester::dispatch_on_timeout(evutil_socket_t, short, void* ctx) {
+  Session* s = reinterpret_cast<Session*>(ctx);
+  const auto& ev = s->script->events.at(s->next_event_index);
+  s->tester->finish_session(*s, phosg::string_printf(
+                                    "(%s:%zu) timeout waiting for command %02hX",
+                                    s->script->name.c_str(), ev.line_num, ev.command));
+}
+
+void LoadTester::finish_session(Session& s, const string& failure_reason) {
+  if (s.finished) {
+    return;
+  }
+  s.finished = true;
+  s.timeout_ev.reset();
+  for (auto& it : s.connections) {
+    it.second->channel.disconnect();
+  }
+  // The connections can't be destroyed yet, since this may be called from one
+  // of their callbacks; they're destroyed along with the session instead
+
+  this->num_sessions_finished++;
+  if (failure_reason.empty()) {
+    this->add_latency(LatencyType::SESSION, phosg::now() - s.start_time);
+  } else {
+    this->num_sessions_failed++;
+    this->failure_reason_counts[failure_reason]++;
+  }
+  if (this->num_sessions_finished == this->sessions.size()) {
+    this->end_time = phosg::now();
+    event_base_loopexit(this->base.get(), nullptr);
+  }
+}
+
+void LoadTester::add_latency(LatencyType type, uint64_t usecs) {
+  this->latencies[static_cast<size_t>(type)].emplace_back(usecs);
+}
+
+void LoadTester::connect(Session& s, uint64_t client_id) {
+  const auto& client = s.script->clients.at(client_id);
+  auto conn = make_unique<Connection>(&s, client_id, client.version);
+  for (size_t z = s.next_event_index; z < s.script->events.size(); z++) {
+    const auto& ev = s.script->events[z];
+    if ((ev.client_id == client_id) && (ev.type == Script::Event::Type::RECEIVE)) {
+      conn->receive_event_indexes.emplace_back(z);
+    }
+  }
+
+  auto [ss, ss_size] = phosg::make_sockaddr_storage(this->config.host, client.port);
+  struct bufferevent* bev = bufferevent_socket_new(this->base.get(), -1, BEV_OPT_CLOSE_ON_FREE);
+  if (!bev) {
+    throw runtime_error("cannot create bufferevent");
+  }
+  bufferevent_setcb(bev, nullptr, nullptr, &LoadTester::dispatch_on_connect_event, conn.get());
+  conn->connect_start_time = phosg::now();
+  if (bufferevent_socket_connect(bev, reinterpret_cast<const sockaddr*>(&ss), ss_size) != 0) {
+    bufferevent_free(bev);
+    throw runtime_error(phosg::string_printf("cannot connect to %s:%hu", this->config.host.c_str(), client.port));
+  }
+  s.connections[client_id] = std::move(conn);
+}
+
+void LoadTester::dispatch_on_connect_event(struct bufferevent* bev, short events, void* ctx) {
+  Connection* conn = reinterpret_cast<Connection*>(ctx);
+  Session& s = *conn->session;
+  if (s.finished) {
+    bufferevent_free(bev);
+  } else if (events & BEV_EVENT_CONNECTED) {
+    // The channel takes ownership of the bufferevent and replaces its
+    // callbacks. Channel looks up the socket's addresses, which can only be
+    // done after the connection is established, so it can't take the
+    // bufferevent before now.
+    conn->channel.set_bufferevent(bev, 0);
+  } else if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF)) {
+    bufferevent_free(bev);
+    s.tester->finish_session(s, "connection failed");
+  }
+}
+
+string LoadTester::rewrite_send_data(const Session& s, const Script::Event& ev) const {
+  string ret = ev.data;
+  for (const auto& [field_offset, field_size] : ev.identifier_fields) {
+    size_t field_end = min<size_t>(field_offset + field_size, ret.size());
+    for (const auto& [from, to] : s.replacements) {
+      if (from.empty()) {
+        continue;
+      }
+      for (size_t offset = ret.find(from, field_offset);
+          (offset != string::npos) && (offset + from.size() <= field_end);
+          offset = ret.find(from, offset + from.size())) {
+        ret.replace(offset, to.size(), to);
+      }
+    }
+  }
+  return ret;
+}
+
+void LoadTester::learn_replacements(
+    Session& s, Version version, uint16_t command, const string& expected_data, const string& data) {
+  // The server assigns guild card numbers and client configs, which the client
+  // sends back in later commands (e.g. 9E when connecting to another server).
+  // Replace the values from the log with the ones this server assigned.
+  size_t header_size = PSOCommandHeader::header_size(version);
+  if (expected_data.size() < header_size) {
+    return;
+  }
+  string expected = expected_data.substr(header_size);
+  auto add = [&](size_t offset, size_t size) -> void {
+    if ((offset + size > expected.size()) || (offset + size > data.size())) {
+      return;
+    }
+    string from = expected.substr(offset, size);
+    string to = data.substr(offset, size);
+    if (from == to) {
+      return;
+    }
+    for (auto& it : s.replacements) {
+      if (it.first == from) {
+        it.second = std::move(to);
+        return;
+      }
+    }
+    s.replacements.emplace_back(std::move(from), std::move(to));
+  };
+
+  if ((version == Version::BB_V4) && (command == 0x00E6)) {
+    add(offsetof(S_ClientInit_BB_00E6, guild_card_number), sizeof(le_uint32_t));
+    add(offsetof(S_ClientInit_BB_00E6, security_token), sizeof(le_uint32_t));
+    add(offsetof(S_ClientInit_BB_00E6, client_config), sizeof(S_ClientInit_BB_00E6::client_config));
+  } else if (command == 0x04) {
+    add(offsetof(S_UpdateClientConfig_DC_PC_04, guild_card_number), sizeof(le_uint32_t));
+    if (version == Version::BB_V4) {
+      add(offsetof(S_UpdateClientConfig_BB_04, client_config), sizeof(S_UpdateClientConfig_BB_04::client_config));
+    } else if (!is_v1_or_v2(version) || (version == Version::GC_NTE)) {
+      add(offsetof(S_UpdateClientConfig_V3_04, client_config), sizeof(S_UpdateClientConfig_V3_04::client_config));
+    }
+  }
+}
+
+void LoadTester::execute_pending_events(Session& s) {
+  try {
+    while (!s.finished && (s.next_event_index < s.script->events.size())) {
+      size_t index = s.next_event_index;
+      if (!s.event_complete[index]) {
+        const auto& ev = s.script->events[index];
+        switch (ev.type) {
+          case Script::Event::Type::CONNECT:
+            this->connect(s, ev.client_id);
+            break;
+          case Script::Event::Type::DISCONNECT: {
+            auto it = s.connections.find(ev.client_id);
+            if (it != s.connections.end()) {
+              it->second->channel.disconnect();
+            }
+            break;
+          }
+          case Script::Event::Type::SEND: {
+            auto& conn = s.connections.at(ev.client_id);
+            if (!conn->channel.connected()) {
+              throw runtime_error(phosg::string_printf("(%s:%zu) send event attempted on unconnected client", s.script->name.c_str(), ev.line_num));
+            }
+            string data = this->rewrite_send_data(s, ev);
+            conn->channel.send(data, true);
+            conn->last_send_time = phosg::now();
+            this->commands_sent++;
+            this->bytes_sent += data.size();
+            break;
+          }
+          case Script::Event::Type::RECEIVE:
+            // Wait for on_command_received to mark this event complete
+            return;
+          default:
+            throw logic_error("unhandled event type");
+        }
+        s.event_complete[index] = true;
+      }
+      s.next_event_index++;
+    }
+    this->finish_session(s, "");
+  } catch (const exception& e) {
+    this->finish_session(s, e.what());
+  }
+}
+
+bool LoadTester::can_receive_event(const Session& s, const Connection& conn, size_t event_index) const {
+  // An expected command can only be received if everything this client does
+  // before it in the log has been done. (Events on other connections may
+  // still be pending; ReplaySession allows this too.)
+  for (size_t z = s.next_event_index; z < event_index; z++) {
+    const auto& ev = s.script->events[z];
+    if (!s.event_complete[z] && (ev.client_id == conn.client_id) && (ev.type != Script::Event::Type::RECEIVE)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void LoadTester::set_up_encryption(Connection& conn, uint16_t command, const string& data) {
+  // This is the same as in ReplaySession::on_command_received
+  Version version = conn.channel.version;
+  if (version == Version::BB_V4) {
+    if (command == 0x03 || command == 0x9B) {
+      auto& cmd = check_size_t<S_ServerInitDefault_BB_03_9B>(data, 0xFFFF);
+      conn.channel.crypt_in = make_shared<PSOBBEncryption>(
+          *this->bb_private_keys[0], cmd.server_key.data(), cmd.server_key.size());
+      conn.channel.crypt_out = make_shared<PSOBBEncryption>(
+          *this->bb_private_keys[0], cmd.client_key.data(), cmd.client_key.size());
+    }
+  } else if (command == 0x02 || command == 0x17 || command == 0x91 || command == 0x9B) {
+    auto& cmd = check_size_t<S_ServerInitDefault_DC_PC_V3_02_17_91_9B>(data, 0xFFFF);
+    if (is_v1_or_v2(version)) {
+      conn.channel.crypt_in = make_shared<PSOV2Encryption>(cmd.server_key);
+      conn.channel.crypt_out = make_shared<PSOV2Encryption>(cmd.client_key);
+    } else {
+      conn.channel.crypt_in = make_shared<PSOV3Encryption>(cmd.server_key);
+      conn.channel.crypt_out = make_shared<PSOV3Encryption>(cmd.client_key);
+    }
+  }
+}
+
+void LoadTester::dispatch_on_command_received(Channel& ch, uint16_t command, uint32_t flag, string& data) {
+  Connection* conn = reinterpret_cast<Connection*>(ch.context_obj);
+  conn->session->tester->on_command_received(*conn, command, flag, data);
+}
+
+void LoadTester::dispatch_on_error(Channel& ch, short events) {
+  Connection* conn = reinterpret_cast<Connection*>(ch.context_obj);
+  conn->session->tester->on_error(*conn, events);
+}
+
+void LoadTester::on_command_received(Connection& conn, uint16_t command, uint32_t, string& data) {
+  Session& s = *conn.session;
+  if (s.finished) {
+    return;
+  }
+  uint64_t now = phosg::now();
+  this->commands_received++;
+  this->bytes_received += data.size() + PSOCommandHeader::header_size(conn.channel.version);
+  if (!conn.received_any) {
+    conn.received_any = true;
+    this->add_latency(LatencyType::CONNECT, now - conn.connect_start_time);
+  }
+
+  try {
+    this->set_up_encryption(conn, command, data);
+  } catch (const exception& e) {
+    this->finish_session(s, phosg::string_printf("cannot set up encryption: %s", e.what()));
+    return;
+  }
+
+  if (conn.receive_event_indexes.empty()) {
+    this->unexpected_commands_received++;
+    return;
+  }
+  size_t event_index = conn.receive_event_indexes.front();
+  const auto& ev = s.script->events[event_index];
+  if ((ev.command != command) || !this->can_receive_event(s, conn, event_index)) {
+    this->unexpected_commands_received++;
+    return;
+  }
+
+  conn.receive_event_indexes.pop_front();
+  s.event_complete[event_index] = true;
+  this->learn_replacements(s, conn.channel.version, command, ev.data, data);
+
+  if (conn.last_send_time) {
+    uint64_t latency = now - conn.last_send_time;
+    this->add_latency(LatencyType::RESPONSE, latency);
+    if ((command == 0x04) || ((command == 0x00E6) && (conn.channel.version == Version::BB_V4))) {
+      this->add_latency(LatencyType::LOGIN, latency);
+    } else if (command == 0x64) {
+      this->add_latency(LatencyType::GAME_JOIN, latency);
+    }
+    conn.last_send_time = 0;
+  }
+
+  this->update_timeout_event(s);
+  this->execute_pending_events(s);
+}
+
+void LoadTester::on_error(Connection& conn, short events) {
+  Session& s = *conn.session;
+  if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF)) {
+    conn.channel.disconnect();
+    if (s.finished) {
+      return;
+    }
+    // The server may disconnect the client as part of the recorded session;
+    // this is only an error if the client still expects commands
+    if (!conn.receive_event_indexes.empty()) {
+      const auto& ev = s.script->events[conn.receive_event_indexes.front()];
+      this->finish_session(s, phosg::string_printf(
+                                  "(%s:%zu) server disconnected client while waiting for command %02hX",
+                                  s.script->name.c_str(), ev.line_num, ev.command));
+    }
+  }
+}
+
+void LoadTester::print_report(FILE* stream) const {
+  uint64_t end_time = this->end_time ? this->end_time : phosg::now();
+  uint64_t usecs = end_time - this->start_time;
+  double secs = usecs / 1000000.0;
+
+  fprintf(stream, "%zu sessions (%zu logs x %zu) in %s; %zu completed, %zu failed\n",
+      this->sessions.size(), this->scripts.size(), this->config.sessions_per_log,
+      phosg::format_duration(usecs).c_str(),
+      this->num_sessions_finished - this->num_sessions_failed, this->num_sessions_failed);
+  for (const auto& [reason, count] : this->failure_reason_counts) {
+    fprintf(stream, "  %zu failed: %s\n", count, reason.c_str());
+  }
+  if (secs > 0) {
+    fprintf(stream, "Sent %zu commands (%zu bytes): %.1f commands/sec, %.1f KB/sec\n",
+        this->commands_sent, this->bytes_sent, this->commands_sent / secs, this->bytes_sent / (secs * 1024.0));
+    fprintf(stream, "Received %zu commands (%zu bytes; %zu unexpected): %.1f commands/sec, %.1f KB/sec\n",
+        this->commands_received, this->bytes_received, this->unexpected_commands_received,
+        this->commands_received / secs, this->bytes_received / (secs * 1024.0));
+  }
+
+  static const array<const char*, static_cast<size_t>(LatencyType::NUM_TYPES)> names = {
+      "Connect", "Login", "Game join", "Any response", "Session"};
+  fprintf(stream, "Latency        count        p50        p90        p99        max\n");
+  for (size_t type = 0; type < static_cast<size_t>(LatencyType::NUM_TYPES); type++) {
+    vector<uint64_t> values = this->latencies[type];
+    if (values.empty()) {
+      fprintf(stream, "%-12s %7zu          -          -          -          -\n", names[type], values.size());
+      continue;
+    }
+    sort(values.begin(), values.end());
+    auto percentile = [&](double p) -> string {
+      // Nearest-rank method: the smallest value such that at least p of the
+      // values are less than or equal to it
+      size_t rank = static_cast<size_t>(ceil(p * values.size()));
+      size_t index = min<size_t>(values.size() - 1, max<size_t>(rank, 1) - 1);
+      return phosg::format_duration(values[index]);
+    };
+    fprintf(stream, "%-12s %7zu %10s %10s %10s %10s\n", names[type], values.size(),
+        percentile(0.5).c_str(), percentile(0.9).c_str(), percentile(0.99).c_str(),
+        phosg::format_duration(values.back()).c_str());
+  }
+}
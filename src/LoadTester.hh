@@ -0,0 +1,174 @@
+#pragma once
+
+#include <event2/event.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Channel.hh"
+#include "PSOEncryption.hh"
+#include "Version.hh"
+
+// LoadTester runs many copies of recorded client sessions (replay logs, in the
+// same format used by ReplaySession) against a running server over TCP, and
+// measures how long the server takes to respond. Unlike ReplaySession, it
+// doesn't check the contents of received commands: an expected command is
+// considered received when a command with the same number arrives on the same
+// connection, and unexpected commands (e.g. from other synthetic clients in
+// the same lobby) are ignored.
+//
+// To keep the copies of a session from colliding with each other on the
+// server, each copy rewrites the identifiers in the commands it sends: serial
+// numbers, BB usernames, and character names in the login commands in the log
+// are replaced with unique values of the same length, and guild card numbers,
+// security tokens, and client configs assigned by the server (in 04 and E6
+// commands) replace the ones the server assigned during the recording. These
+// replacements are only made in the login commands' fields that hold these
+// values, not anywhere else in the commands. The target server should allow
+// unregistered users.
+class LoadTester {
+public:
+  struct Config {
+    std::string host = "127.0.0.1";
+    size_t sessions_per_log = 10;
+    uint64_t start_interval_usecs = 10000;
+    uint64_t receive_timeout_usecs = 10000000;
+  };
+
+  LoadTester(std::shared_ptr<struct event_base> base, const Config& config);
+  LoadTester(const LoadTester&) = delete;
+  LoadTester(LoadTester&&) = delete;
+  LoadTester& operator=(const LoadTester&) = delete;
+  LoadTester& operator=(LoadTester&&) = delete;
+  ~LoadTester() = default;
+
+  void add_log(const std::string& name, FILE* input_log);
+
+  // Starts all sessions (staggered by start_interval_usecs). When all of them
+  // have completed or failed, the event loop is stopped.
+  void start();
+
+  void print_report(FILE* stream) const;
+
+private:
+  struct Script {
+    struct Event {
+      enum class Type {
+        CONNECT = 0,
+        DISCONNECT,
+        SEND,
+        RECEIVE,
+      };
+      Type type;
+      uint64_t client_id;
+      uint16_t command; // Only used for SEND and RECEIVE
+      std::string data; // Only used for SEND and RECEIVE
+      size_t line_num;
+      // (offset, size) of each field in data that may contain an identifier
+      // (only used for SEND)
+      std::vector<std::pair<size_t, size_t>> identifier_fields;
+    };
+    struct Client {
+      uint16_t port;
+      Version version;
+    };
+
+    std::string name;
+    std::unordered_map<uint64_t, Client> clients;
+    std::vector<Event> events;
+    // Strings sent by the client that identify the player (serial numbers,
+    // usernames, names). These are replaced in every copy of the session.
+    std::vector<std::string> identifiers;
+
+    Script(const std::string& name, FILE* input_log);
+    void add_identifier(const std::string& s);
+    void collect_identifiers(Event& ev, Version version);
+  };
+
+  enum class LatencyType {
+    CONNECT = 0, // CONNECT event until the server's first command
+    LOGIN, // Client's last command until 04 (or E6 on BB)
+    GAME_JOIN, // Client's last command until 64
+    RESPONSE, // Client's last command until any expected command
+    SESSION, // Start of session until all events are done
+    NUM_TYPES,
+  };
+
+  struct Session;
+
+  struct Connection {
+    Session* session;
+    uint64_t client_id;
+    Channel channel;
+    std::deque<size_t> receive_event_indexes;
+    uint64_t connect_start_time = 0;
+    uint64_t last_send_time = 0;
+    bool received_any = false;
+
+    Connection(Session* session, uint64_t client_id, Version version);
+  };
+
+  struct Session {
+    LoadTester* tester;
+    std::shared_ptr<const Script> script;
+    size_t session_num;
+    std::shared_ptr<struct event> start_ev;
+    std::shared_ptr<struct event> timeout_ev;
+    std::unordered_map<uint64_t, std::unique_ptr<Connection>> connections;
+    std::vector<bool> event_complete;
+    size_t next_event_index = 0;
+    // Byte sequences from the log that are replaced with per-session values
+    // in the identifier fields of sent commands. All replacements are the
+    // same length as the original, so command sizes don't change.
+    std::vector<std::pair<std::string, std::string>> replacements;
+    uint64_t start_time = 0;
+    bool finished = false;
+
+    Session(LoadTester* tester, std::shared_ptr<const Script> script, size_t session_num);
+  };
+
+  std::shared_ptr<struct event_base> base;
+  Config config;
+  std::vector<std::shared_ptr<PSOBBEncryption::KeyFile>> bb_private_keys;
+
+  std::vector<std::shared_ptr<const Script>> scripts;
+  std::vector<std::unique_ptr<Session>> sessions;
+  size_t num_sessions_finished = 0;
+  size_t num_sessions_failed = 0;
+  std::map<std::string, size_t> failure_reason_counts;
+
+  uint64_t start_time = 0;
+  uint64_t end_time = 0;
+  size_t commands_sent = 0;
+  size_t bytes_sent = 0;
+  size_t commands_received = 0;
+  size_t bytes_received = 0;
+  size_t unexpected_commands_received = 0;
+  std::vector<uint64_t> latencies[static_cast<size_t>(LatencyType::NUM_TYPES)];
+
+  void add_latency(LatencyType type, uint64_t usecs);
+
+  void start_session(Session& s);
+  void execute_pending_events(Session& s);
+  void finish_session(Session& s, const std::string& failure_reason);
+  void update_timeout_event(Session& s);
+  void connect(Session& s, uint64_t client_id);
+  std::string rewrite_send_data(const Session& s, const Script::Event& ev) const;
+  void learn_replacements(Session& s, Version version, uint16_t command, const std::string& expected_data, const std::string& data);
+  bool can_receive_event(const Session& s, const Connection& conn, size_t event_index) const;
+  void set_up_encryption(Connection& conn, uint16_t command, const std::string& data);
+
+  static void dispatch_start_session(evutil_socket_t fd, short events, void* ctx);
+  static void dispatch_on_timeout(evutil_socket_t fd, short events, void* ctx);
+  static void dispatch_on_connect_event(struct bufferevent* bev, short events, void* ctx);
+  static void dispatch_on_command_received(Channel& ch, uint16_t command, uint32_t flag, std::string& data);
+  static void dispatch_on_error(Channel& ch, short events);
+  void on_command_received(Connection& conn, uint16_t command, uint32_t flag, std::string& data);
+  void on_error(Connection& conn, short events);
+};
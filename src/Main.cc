@@ -1,12 +1,18 @@
 #include <event2/event.h>
 #include <event2/thread.h>
 #include <pwd.h>
+#include <errno.h>
 #include <signal.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <mutex>
 #include <phosg/Arguments.hh>
 #include <phosg/Filesystem.hh>
+#include <phosg/Hash.hh>
 #include <phosg/JSON.hh>
 #include <phosg/Math.hh>
 #include <phosg/Network.hh>
@@ -28,10 +34,13 @@
 #include "DCSerialNumbers.hh"
 #include "DNSServer.hh"
 #include "DownloadSession.hh"
+#include "Episode3/BattleSimulator.hh"
 #include "GSLArchive.hh"
 #include "GVMEncoder.hh"
 #include "HTTPServer.hh"
+#include "IPFrameInfo.hh"
 #include "IPStackSimulator.hh"
+#include "LoadTester.hh"
 #include "Loggers.hh"
 #include "NetworkAddresses.hh"
 #include "PSOGCObjectGraph.hh"
@@ -47,6 +56,7 @@
 #include "Server.hh"
 #include "ServerShell.hh"
 #include "ServerState.hh"
+#include "SessionCapture.hh"
 #include "SignalWatcher.hh"
 #include "StaticGameData.hh"
 #include "Text.hh"
@@ -1912,6 +1922,130 @@ Action a_download_files(
       event_base_dispatch(base.get());
     });
 
+Action a_dns_load_test(
+    "dns-load-test", "\
+  dns-load-test ADDR:PORT\n\
+    Send DNS queries to the given server as quickly as it can answer them, and\n\
+    report how many responses per second were received. Options:\n\
+      --duration=SECONDS: Run for this long (default 10 seconds).\n\
+      --window=COUNT: Keep this many queries in flight (default 64).\n\
+      --name=HOSTNAME: Query for this name (default gc01.st-pso.games.sega.net).\n",
+    +[](phosg::Arguments& args) {
+      auto remote = phosg::make_sockaddr_storage(phosg::parse_netloc(args.get<string>(1))).first;
+      uint64_t duration_usecs = args.get<uint64_t>("duration", 10) * 1000000;
+      size_t window = args.get<size_t>("window", 64);
+      string name = args.get<string>("name", false);
+      if (name.empty()) {
+        name = "gc01.st-pso.games.sega.net";
+      }
+      if (window == 0) {
+        throw invalid_argument("window must be at least 1");
+      }
+
+      int fd = socket(remote.ss_family, SOCK_DGRAM, 0);
+      if (fd < 0) {
+        throw runtime_error(phosg::string_printf("cannot create socket (%d)", errno));
+      }
+      if (connect(fd, reinterpret_cast<const sockaddr*>(&remote), sizeof(sockaddr_in)) != 0) {
+        close(fd);
+        throw runtime_error(phosg::string_printf("cannot connect socket (%d)", errno));
+      }
+      // If no response arrives in this time, all queries in flight are
+      // assumed to be lost and a new window is sent
+      struct timeval tv = phosg::usecs_to_timeval(200000);
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+      // Only the transaction ID changes between queries
+      string query = DNSServer::query_for_name(0, name);
+      uint16_t next_id = 0;
+      size_t num_sent = 0;
+      size_t num_received = 0;
+      size_t num_lost = 0;
+      auto send_query = [&]() -> void {
+        query[0] = next_id >> 8;
+        query[1] = next_id;
+        next_id++;
+        if (send(fd, query.data(), query.size(), 0) == static_cast<ssize_t>(query.size())) {
+          num_sent++;
+        }
+      };
+
+      uint64_t start_time = phosg::now();
+      uint64_t end_time = start_time + duration_usecs;
+      for (size_t z = 0; z < window; z++) {
+        send_query();
+      }
+      char response[0x200];
+      while (phosg::now() < end_time) {
+        ssize_t bytes = recv(fd, response, sizeof(response), 0);
+        if (bytes < 0) {
+          if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            close(fd);
+            throw runtime_error(phosg::string_printf("cannot receive from socket (%d)", errno));
+          }
+          num_lost += window;
+          for (size_t z = 0; z < window; z++) {
+            send_query();
+          }
+        } else {
+          num_received++;
+          send_query();
+        }
+      }
+      uint64_t elapsed_usecs = phosg::now() - start_time;
+      close(fd);
+
+      fprintf(stderr, "%zu queries sent, %zu responses received, %zu queries timed out\n",
+          num_sent, num_received, num_lost);
+      fprintf(stderr, "%s elapsed; %g responses/sec\n",
+          phosg::format_duration(elapsed_usecs).c_str(),
+          static_cast<double>(num_received * 1000000) / elapsed_usecs);
+    });
+
+Action a_load_test(
+    "load-test", "\
+  load-test LOG-FILENAME [LOG-FILENAME...] [OPTIONS...]\n\
+    Run many copies of the client sessions recorded in the given logs (in the\n\
+    same format as replay tests) against a running server, and report how long\n\
+    the server took to respond. Each copy uses different serial numbers,\n\
+    usernames, and character names, so the server should allow unregistered\n\
+    users. The clients connect to the ports recorded in the logs. Options:\n\
+      --host=ADDR: Connect to this server (default 127.0.0.1).\n\
+      --clients=N: Run this many copies of each log (default 10).\n\
+      --start-interval=USECS: Start the copies this far apart (default 10000).\n\
+      --timeout=USECS: Fail a copy if it waits this long for any expected\n\
+        command (default 10000000).\n",
+    +[](phosg::Arguments& args) {
+      signal(SIGPIPE, SIG_IGN);
+
+      LoadTester::Config config;
+      config.host = args.get<string>("host", false);
+      if (config.host.empty()) {
+        config.host = "127.0.0.1";
+      }
+      config.sessions_per_log = args.get<size_t>("clients", 10);
+      config.start_interval_usecs = args.get<uint64_t>("start-interval", 10000);
+      config.receive_timeout_usecs = args.get<uint64_t>("timeout", 10000000);
+
+      shared_ptr<struct event_base> base(event_base_new(), event_base_free);
+      LoadTester tester(base, config);
+      for (size_t z = 1;; z++) {
+        const string& filename = args.get<string>(z, false);
+        if (filename.empty()) {
+          if (z == 1) {
+            throw invalid_argument("at least one log filename is required");
+          }
+          break;
+        }
+        auto f = phosg::fopen_unique(filename, "rt");
+        tester.add_log(filename, f.get());
+      }
+
+      tester.start();
+      event_base_dispatch(base.get());
+      tester.print_report(stderr);
+    });
+
 Action a_convert_rare_item_set(
     "convert-rare-item-set", "\
   convert-rare-item-set INPUT-FILENAME [OUTPUT-FILENAME] [OPTIONS]\n\
@@ -2628,6 +2762,124 @@ Action a_show_battle_params(
       s->battle_params->get_table(true, Episode::EP4).print(stdout);
     });
 
+Action a_ep3_tournament_journal_test(
+    "ep3-tournament-journal-test", nullptr, +[](phosg::Arguments& args) {
+      // Checks that an incomplete entry at the end of the tournament journal
+      // (as left behind if the server crashes while writing it) doesn't cause
+      // later entries to be lost
+      string state_filename = args.get<string>(1, true);
+      string journal_filename = state_filename + ".journal";
+
+      auto s = make_shared<ServerState>(get_config_filename(args));
+      s->load_config_early();
+      s->load_ep3_cards(false);
+      s->load_ep3_maps(false);
+      auto map = s->ep3_map_index->for_number(*s->ep3_map_index->all_numbers().begin());
+      Episode3::Rules rules;
+      rules.set_defaults();
+
+      auto make_index = [&]() -> shared_ptr<Episode3::TournamentIndex> {
+        return make_shared<Episode3::TournamentIndex>(s->ep3_map_index, s->ep3_com_deck_index, state_filename);
+      };
+      auto check_tournaments = [&](shared_ptr<Episode3::TournamentIndex> index, const vector<string>& names) -> void {
+        if (index->all_tournaments().size() != names.size()) {
+          throw runtime_error(phosg::string_printf("expected %zu tournaments, found %zu",
+              names.size(), index->all_tournaments().size()));
+        }
+        for (const auto& name : names) {
+          if (!index->get_tournament(name)) {
+            throw runtime_error("tournament " + name + " is missing");
+          }
+        }
+      };
+
+      auto index = make_index();
+      index->create_tournament("Journal Test 1", map, rules, 4, 0);
+      index.reset();
+
+      // Simulate a crash in the middle of writing an entry
+      {
+        auto f = phosg::fopen_unique(journal_filename, "ab");
+        phosg::fwritex(f.get(), "{\"op\": \"update\", \"tourn");
+      }
+
+      index = make_index();
+      check_tournaments(index, {"Journal Test 1"});
+      index->create_tournament("Journal Test 2", map, rules, 4, 0);
+      index.reset();
+
+      index = make_index();
+      check_tournaments(index, {"Journal Test 1", "Journal Test 2"});
+      index->delete_tournament("Journal Test 1");
+      index.reset();
+
+      index = make_index();
+      check_tournaments(index, {"Journal Test 2"});
+      index.reset();
+
+      remove(state_filename.c_str());
+      remove(journal_filename.c_str());
+      fprintf(stderr, "Tournament journal recovered correctly\n");
+    });
+
+Action a_ip_checksums_test(
+    "ip-checksums-test", nullptr, +[](phosg::Arguments&) {
+      auto reference_sum = +[](const void* data, size_t size) -> uint16_t {
+        const uint8_t* u8_data = reinterpret_cast<const uint8_t*>(data);
+        uint32_t sum = 0;
+        for (size_t z = 0; z < size; z++) {
+          sum += (z & 1) ? u8_data[z] : (u8_data[z] << 8);
+          sum = (sum & 0xFFFF) + (sum >> 16);
+        }
+        return sum;
+      };
+
+      // Check all small sizes at several alignments, so every length of
+      // leftover tail after the 8-byte words is covered
+      string buffer(0x2400, '\0');
+      phosg::random_data(buffer.data(), buffer.size());
+      for (size_t offset = 0; offset < 0x20; offset++) {
+        for (size_t size = 0; size < 0x200; size++) {
+          uint16_t expected = reference_sum(buffer.data() + offset, size);
+          uint16_t actual = FrameInfo::ones_complement_sum(buffer.data() + offset, size);
+          if (expected != actual) {
+            throw runtime_error(phosg::string_printf(
+                "incorrect sum for %zu bytes at offset %zu (expected %04hX, received %04hX)", size, offset, expected, actual));
+          }
+        }
+      }
+      for (size_t size : {576, 1460, 1500, 9000}) {
+        uint16_t expected = reference_sum(buffer.data(), size);
+        uint16_t actual = FrameInfo::ones_complement_sum(buffer.data(), size);
+        if (expected != actual) {
+          throw runtime_error(phosg::string_printf(
+              "incorrect sum for %zu bytes (expected %04hX, received %04hX)", size, expected, actual));
+        }
+      }
+      // All-0xFF data exercises the carry handling
+      string ff_data(9000, '\xFF');
+      if (reference_sum(ff_data.data(), ff_data.size()) != FrameInfo::ones_complement_sum(ff_data.data(), ff_data.size())) {
+        throw runtime_error("incorrect sum for all-0xFF data");
+      }
+
+      string header(20, '\0');
+      phosg::random_data(header.data(), header.size());
+      uint16_t checksum = ~FrameInfo::ones_complement_sum(header.data(), header.size());
+      for (size_t z = 0; z < 0x10000; z++) {
+        be_uint32_t* field = reinterpret_cast<be_uint32_t*>(header.data() + 4);
+        uint32_t old_value = *field;
+        uint32_t new_value = old_value + 0x10001;
+        *field = new_value;
+        checksum = FrameInfo::updated_checksum32(checksum, old_value, new_value);
+        uint16_t expected = ~reference_sum(header.data(), header.size());
+        if (checksum != expected) {
+          throw runtime_error(phosg::string_printf(
+              "incorrect incremental checksum after %zu updates (expected %04hX, received %04hX)", z + 1, expected, checksum));
+        }
+      }
+      fprintf(stderr, "IP checksums are correct\n");
+    });
+
 Action a_load_maps_test(
     "load-maps-test", nullptr, +[](phosg::Arguments& args) {
       bool save_disassembly = args.get<bool>("disassemble");
@@ -2922,13 +3174,13 @@ Action a_replay_ep3_battle_commands(
         }
       }
 
-      auto run_replay = [&](int64_t seed, size_t) {
+      auto make_server = [&](shared_ptr<PSOLFGEncryption> crypt) {
         Episode3::Server::Options options = {
             .card_index = s->ep3_card_index,
             .map_index = s->ep3_map_index,
             .behavior_flags = 0x0092,
             .opt_rand_stream = nullptr,
-            .opt_rand_crypt = (seed >= 0) ? make_shared<PSOV2Encryption>(seed) : nullptr,
+            .opt_rand_crypt = crypt,
             .tournament = nullptr,
             .trap_card_ids = {},
         };
@@ -2940,8 +3192,30 @@ Action a_replay_ep3_battle_commands(
         }
         auto server = make_shared<Episode3::Server>(nullptr, std::move(options));
         server->init();
-        for (const auto& command : commands) {
-          server->on_server_data_input(nullptr, command);
+        return server;
+      };
+
+      // The commands before the first one that uses any random data result in
+      // the same state regardless of the seed, so we only run them once and
+      // start each seed's replay from a clone of the resulting state
+      auto prefix_crypt = make_shared<PSOV2Encryption>(0);
+      auto prefix_server = make_server(prefix_crypt);
+      size_t prefix_length = 0;
+      for (; prefix_length < commands.size(); prefix_length++) {
+        auto snapshot = prefix_server->clone();
+        size_t prev_offset = prefix_crypt->absolute_offset();
+        prefix_server->on_server_data_input(nullptr, commands[prefix_length]);
+        if (prefix_crypt->absolute_offset() != prev_offset) {
+          prefix_server = snapshot;
+          break;
+        }
+      }
+
+      auto run_replay = [&](int64_t seed, size_t) {
+        auto server = prefix_server->clone();
+        server->options.opt_rand_crypt = make_shared<PSOV2Encryption>(seed);
+        for (size_t z = prefix_length; z < commands.size(); z++) {
+          server->on_server_data_input(nullptr, commands[z]);
         }
         return false;
       };
@@ -2989,9 +3263,626 @@ Action a_replay_ep3_battle_record(
       }
     });
 
+Action a_verify_ep3_battle_records(
+    "verify-ep3-battle-records", "\
+  verify-ep3-battle-records DIRECTORY [OPTIONS...]\n\
+    Replay all Episode 3 battle records (.mzrd files) in the given directory\n\
+    and check that the battle engine still produces the same results. For each\n\
+    record, the 6xB4 commands generated by the server are compared against the\n\
+    6xB4 commands that were sent during the original battle, which are stored\n\
+    in the record. Overall battle time limits are disabled during replays,\n\
+    since they depend on the current time, so records of battles that ended\n\
+    due to the overall time limit will not match. Replays use the behavior\n\
+    flags stored in each record and the Episode3TrapCards list from the config\n\
+    file, which should match that of the server that made the records.\n\
+    Options:\n\
+      --threads=N: Use this many threads (default is one per CPU core).\n",
+    +[](phosg::Arguments& args) {
+      string directory = args.get<string>(1, true);
+      size_t num_threads = args.get<size_t>("threads", 0);
+
+      auto s = make_shared<ServerState>(get_config_filename(args));
+      s->load_config_early();
+      s->load_ep3_cards(false);
+      s->load_ep3_maps(false);
+      s->load_ep3_trap_cards();
+
+      vector<string> filenames;
+      for (const auto& filename : phosg::list_directory_sorted(directory)) {
+        if (filename.ends_with(".mzrd")) {
+          filenames.emplace_back(directory + "/" + filename);
+        }
+      }
+
+      struct RecordResult {
+        bool passed = false;
+        string message;
+        size_t num_commands = 0;
+        uint64_t usecs = 0;
+      };
+      vector<RecordResult> results(filenames.size());
+
+      auto verify_record = [&](size_t index, size_t) -> bool {
+        const string& filename = filenames[index];
+        auto& result = results[index];
+        uint64_t start = phosg::now();
+        try {
+          auto rec = make_shared<Episode3::BattleRecord>(phosg::load_file(filename));
+
+          // Only 6xB4 commands are compared, and 6xB4x46 is skipped because it
+          // contains the server's build date. Commands in the record may be
+          // masked, so they're unmasked before comparing.
+          auto should_compare = +[](const string& data) -> bool {
+            if (data.size() < sizeof(G_CardBattleCommandHeader)) {
+              return false;
+            }
+            const auto& header = *reinterpret_cast<const G_CardBattleCommandHeader*>(data.data());
+            return (header.subcommand == 0xB4) && (header.subsubcommand != 0x46);
+          };
+          vector<string> expected_commands;
+          for (size_t z = 0; z < rec->num_events(); z++) {
+            const auto& ev = rec->get_event(z);
+            if ((ev.type == Episode3::BattleRecord::Event::Type::BATTLE_COMMAND) && should_compare(ev.data)) {
+              string& cmd = expected_commands.emplace_back(ev.data);
+              set_mask_for_ep3_game_command(cmd.data(), cmd.size(), 0);
+            }
+          }
+
+          auto options = Episode3::Server::options_for_record_replay(
+              rec, s->ep3_card_index, s->ep3_map_index, s->ep3_trap_card_ids);
+          auto server = make_shared<Episode3::Server>(nullptr, std::move(options));
+          server->init();
+
+          vector<string> commands;
+          server->lobbyless_command_handler = [&](uint8_t, const void* data, size_t size) -> void {
+            string cmd(reinterpret_cast<const char*>(data), size);
+            if (should_compare(cmd)) {
+              commands.emplace_back(std::move(cmd));
+            }
+          };
+          for (const auto& command : rec->get_all_server_data_commands()) {
+            server->on_server_data_input(nullptr, command);
+          }
+          result.num_commands = commands.size();
+
+          size_t z;
+          for (z = 0; (z < expected_commands.size()) && (z < commands.size()); z++) {
+            if (expected_commands[z] != commands[z]) {
+              break;
+            }
+          }
+          if (z < min<size_t>(expected_commands.size(), commands.size())) {
+            result.message = phosg::string_printf(
+                "command stream diverges at 6xB4 command %zu (expected 6xB4x%02hhX, received 6xB4x%02hhX)",
+                z, static_cast<uint8_t>(expected_commands[z][4]), static_cast<uint8_t>(commands[z][4]));
+          } else if (expected_commands.size() != commands.size()) {
+            result.message = phosg::string_printf(
+                "command stream diverges at 6xB4 command %zu (expected %zu commands, received %zu)",
+                z, expected_commands.size(), commands.size());
+          } else {
+            result.passed = true;
+            result.message = phosg::string_printf("ok (winner: team %hhd)", server->get_winner_team_id());
+          }
+        } catch (const exception& e) {
+          result.message = phosg::string_printf("failed: %s", e.what());
+        }
+        result.usecs = phosg::now() - start;
+        return false;
+      };
+      phosg::parallel_range_blocks<size_t>(verify_record, 0, filenames.size(), 1, num_threads);
+
+      size_t num_failed = 0;
+      for (size_t z = 0; z < filenames.size(); z++) {
+        const auto& result = results[z];
+        if (!result.passed) {
+          num_failed++;
+        }
+        double commands_per_sec = result.usecs ? (result.num_commands * 1000000.0 / result.usecs) : 0.0;
+        fprintf(stderr, "%s %s: %s (%zu commands in %s; %g commands/sec)\n",
+            result.passed ? "PASS" : "FAIL", filenames[z].c_str(), result.message.c_str(),
+            result.num_commands, phosg::format_duration(result.usecs).c_str(), commands_per_sec);
+      }
+      fprintf(stderr, "%zu records verified; %zu failed\n", filenames.size(), num_failed);
+      if (num_failed) {
+        throw runtime_error("some battle records did not replay correctly");
+      }
+    });
+
 Action a_disassemble_ep3_battle_record(
     "disassemble-ep3-battle-record", nullptr, +[](phosg::Arguments& args) {
-      Episode3::BattleRecord(read_input_data(args)).print(stdout);
+      // With --at=SECONDS, only the events from the nearest keyframe up to the
+      // given time are read from the file, so long records can be browsed
+      // without loading them entirely
+      const string& at_str = args.get<string>("at", false);
+      if (at_str.empty()) {
+        Episode3::BattleRecord(read_input_data(args)).print(stdout);
+        return;
+      }
+
+      const string& input_filename = args.get<string>(1, true);
+      Episode3::BattleRecordReader reader(input_filename);
+      const auto& header = reader.get_header();
+      uint64_t target_ts = header.battle_start_timestamp + stoull(at_str, nullptr, 0) * 1000000;
+      size_t keyframe_chunk = reader.find_keyframe_chunk(target_ts);
+      fprintf(stdout, "BattleRecord (%s) behavior_flags=%08" PRIX32 " start=%016" PRIX64 " end=%016" PRIX64 "; %zu events; %s\n",
+          reader.is_complete() ? "complete" : "incomplete",
+          header.behavior_flags.load(),
+          header.battle_start_timestamp.load(),
+          header.battle_end_timestamp.load(),
+          reader.num_events(),
+          (keyframe_chunk < reader.get_index().size()) ? "starting from keyframe" : "no keyframe before target time; starting from beginning");
+      for (const auto& ev : reader.read_events_for_seek(target_ts)) {
+        ev.print(stdout);
+      }
+    });
+
+Action a_simulate_ep3_battles(
+    "simulate-ep3-battles", "\
+  simulate-ep3-battles [OPTIONS...]\n\
+    Run 1v1 Episode 3 battles between two COM players without any clients,\n\
+    using a simple built-in policy to decide each player\'s actions, and print\n\
+    win rates, battle lengths, and card usage statistics. Options:\n\
+      --num-battles=N: Run this many battles (default 100).\n\
+      --map=NAME-OR-NUMBER: Use this map (may be given multiple times). If not\n\
+          given, all maps that support 1v1 battles are used.\n\
+      --deck-a=DECK and --deck-b=DECK: Use this deck for team A or team B.\n\
+          DECK may be the name or index of a COM deck, or a comma-separated\n\
+          list of 31 card IDs in hex (the first must be an SC card). If not\n\
+          given, a random COM deck is used for each battle.\n\
+      --seed=SEED: Use this random seed for the first battle; subsequent\n\
+          battles use SEED+1, SEED+2, etc. Results are deterministic for a\n\
+          given seed.\n\
+      --max-steps=N: Abandon each battle after this many policy steps\n\
+          (default 100000).\n\
+      --threads=N: Use this many threads (default is one per CPU core).\n",
+    +[](phosg::Arguments& args) {
+      auto s = make_shared<ServerState>(get_config_filename(args));
+      s->load_ep3_cards(false);
+      s->load_ep3_maps(false);
+
+      size_t num_battles = args.get<size_t>("num-battles", 100);
+      size_t max_steps = args.get<size_t>("max-steps", 100000);
+      size_t num_threads = args.get<size_t>("threads", 0);
+      int64_t base_seed = args.get<int64_t>("seed", -1);
+      if (base_seed < 0) {
+        base_seed = phosg::random_object<uint32_t>();
+      }
+
+      vector<shared_ptr<const Episode3::MapDefinition>> maps;
+      for (const auto& map_name : args.get_multi<string>("map")) {
+        shared_ptr<const Episode3::MapIndex::Map> map;
+        try {
+          map = s->ep3_map_index->for_name(map_name);
+        } catch (const out_of_range&) {
+          map = s->ep3_map_index->for_number(stoul(map_name, nullptr, 0));
+        }
+        if (!Episode3::BattleSimulator::map_supports_1v1(*map->initial_version->map)) {
+          throw runtime_error("map " + map_name + " does not support 1v1 battles");
+        }
+        maps.emplace_back(map->initial_version->map);
+      }
+      if (maps.empty()) {
+        for (uint32_t map_number : s->ep3_map_index->all_numbers()) {
+          auto map = s->ep3_map_index->for_number(map_number)->initial_version->map;
+          if (Episode3::BattleSimulator::map_supports_1v1(*map)) {
+            maps.emplace_back(map);
+          }
+        }
+      }
+      if (maps.empty()) {
+        throw runtime_error("no maps support 1v1 battles");
+      }
+
+      auto parse_deck = [&](const string& arg_name) -> shared_ptr<const Episode3::COMDeckDefinition> {
+        string spec = args.get<string>(arg_name, false);
+        if (spec.empty()) {
+          return nullptr;
+        }
+        if (spec.find(',') != string::npos) {
+          auto tokens = phosg::split(spec, ',');
+          auto deck = make_shared<Episode3::COMDeckDefinition>();
+          if (tokens.size() != deck->card_ids.size()) {
+            throw runtime_error(phosg::string_printf(
+                "--%s must contain exactly %zu card IDs", arg_name.c_str(), deck->card_ids.size()));
+          }
+          deck->index = 0;
+          deck->player_name = arg_name;
+          deck->deck_name = arg_name;
+          for (size_t z = 0; z < tokens.size(); z++) {
+            deck->card_ids[z] = stoul(tokens[z], nullptr, 16);
+          }
+          return deck;
+        }
+        try {
+          return s->ep3_com_deck_index->deck_for_name(spec);
+        } catch (const out_of_range&) {
+          return s->ep3_com_deck_index->deck_for_index(stoul(spec, nullptr, 0));
+        }
+      };
+      array<shared_ptr<const Episode3::COMDeckDefinition>, 2> fixed_decks = {
+          parse_deck("deck-a"), parse_deck("deck-b")};
+      if ((!fixed_decks[0] || !fixed_decks[1]) && (s->ep3_com_deck_index->num_decks() == 0)) {
+        throw runtime_error("no COM decks are available; use --deck-a and --deck-b");
+      }
+
+      struct BattleResult {
+        array<shared_ptr<const Episode3::COMDeckDefinition>, 2> decks;
+        shared_ptr<const Episode3::MapDefinition> map;
+        Episode3::BattleSimulator::Result result;
+        string error;
+      };
+      vector<BattleResult> results(num_battles);
+
+      uint64_t start_time = phosg::now();
+      phosg::parallel_range_blocks<size_t>([&](size_t battle_index, size_t) -> bool {
+        auto& res = results[battle_index];
+        uint32_t seed = base_seed + battle_index;
+        // Choose the map and decks with a separate stream, so the choices
+        // don't affect the battle's own random stream
+        PSOV2Encryption choice_crypt(seed ^ 0x45503342);
+        res.map = maps[choice_crypt.next() % maps.size()];
+        for (size_t z = 0; z < 2; z++) {
+          res.decks[z] = fixed_decks[z]
+              ? fixed_decks[z]
+              : s->ep3_com_deck_index->deck_for_index(choice_crypt.next() % s->ep3_com_deck_index->num_decks());
+        }
+        try {
+          Episode3::BattleSimulator sim(s->ep3_card_index, s->ep3_map_index, res.map, res.decks, seed);
+          res.result = sim.run(max_steps);
+        } catch (const exception& e) {
+          res.error = e.what();
+        }
+        return false;
+      },
+          0, num_battles, 1, num_threads);
+      uint64_t end_time = phosg::now();
+
+      struct DeckStats {
+        size_t num_battles = 0;
+        size_t num_wins = 0;
+        size_t num_mirror_matches = 0;
+      };
+      map<string, DeckStats> deck_stats;
+      array<size_t, 2> team_wins = {0, 0};
+      size_t num_completed = 0;
+      size_t num_stalled = 0;
+      size_t num_errors = 0;
+      size_t total_rounds = 0;
+      size_t total_commands = 0;
+      uint32_t min_rounds = 0xFFFFFFFF;
+      uint32_t max_rounds = 0;
+      unordered_map<uint16_t, size_t> card_use_counts;
+      for (size_t z = 0; z < results.size(); z++) {
+        const auto& res = results[z];
+        if (!res.error.empty()) {
+          num_errors++;
+          phosg::log_warning("Battle %zu (seed %08" PRIX32 ") failed: %s",
+              z, static_cast<uint32_t>(base_seed + z), res.error.c_str());
+          continue;
+        }
+        total_commands += res.result.num_commands_sent;
+        for (size_t team_id = 0; team_id < 2; team_id++) {
+          for (const auto& [card_id, count] : res.result.card_use_counts[team_id]) {
+            card_use_counts[card_id] += count;
+          }
+        }
+        if (res.result.stalled) {
+          num_stalled++;
+          phosg::log_warning("Battle %zu (seed %08" PRIX32 ") stalled in round %" PRIu32,
+              z, static_cast<uint32_t>(base_seed + z), res.result.num_rounds);
+          continue;
+        }
+        num_completed++;
+        total_rounds += res.result.num_rounds;
+        min_rounds = min<uint32_t>(min_rounds, res.result.num_rounds);
+        max_rounds = max<uint32_t>(max_rounds, res.result.num_rounds);
+        // A mirror match counts as one battle for its deck (and one win, if
+        // either team won), so it doesn't inflate the deck's totals
+        bool is_mirror_match = (res.decks[0]->deck_name == res.decks[1]->deck_name);
+        for (size_t team_id = 0; team_id < (is_mirror_match ? 1 : 2); team_id++) {
+          auto& stats = deck_stats[res.decks[team_id]->deck_name];
+          stats.num_battles++;
+          if (is_mirror_match) {
+            stats.num_mirror_matches++;
+            if (res.result.winner_team_id >= 0) {
+              stats.num_wins++;
+            }
+          } else if (res.result.winner_team_id == static_cast<int8_t>(team_id)) {
+            stats.num_wins++;
+          }
+        }
+        if (res.result.winner_team_id >= 0) {
+          team_wins.at(res.result.winner_team_id)++;
+        }
+      }
+
+      double elapsed_secs = static_cast<double>(end_time - start_time) / 1000000.0;
+      fprintf(stdout, "%zu battles in %s (%g battles/sec, %g commands/sec)\n",
+          num_battles, phosg::format_duration(end_time - start_time).c_str(),
+          num_battles / elapsed_secs, total_commands / elapsed_secs);
+      fprintf(stdout, "%zu completed, %zu stalled, %zu failed\n", num_completed, num_stalled, num_errors);
+      if (num_completed == 0) {
+        return;
+      }
+      fprintf(stdout, "Rounds: %g average, %" PRIu32 " min, %" PRIu32 " max\n",
+          static_cast<double>(total_rounds) / num_completed, min_rounds, max_rounds);
+      fprintf(stdout, "Team A won %zu (%g%%); team B won %zu (%g%%)\n",
+          team_wins[0], static_cast<double>(team_wins[0] * 100) / num_completed,
+          team_wins[1], static_cast<double>(team_wins[1] * 100) / num_completed);
+
+      fprintf(stdout, "\nDeck results:\n");
+      for (const auto& [deck_name, stats] : deck_stats) {
+        fprintf(stdout, "  %-20s %5zu/%5zu (%g%%)", deck_name.c_str(), stats.num_wins, stats.num_battles,
+            static_cast<double>(stats.num_wins * 100) / stats.num_battles);
+        if (stats.num_mirror_matches) {
+          fprintf(stdout, " including %zu mirror matches", stats.num_mirror_matches);
+        }
+        fputc('\n', stdout);
+      }
+
+      vector<pair<size_t, uint16_t>> sorted_card_uses;
+      for (const auto& [card_id, count] : card_use_counts) {
+        sorted_card_uses.emplace_back(count, card_id);
+      }
+      sort(sorted_card_uses.begin(), sorted_card_uses.end(), greater<pair<size_t, uint16_t>>());
+      fprintf(stdout, "\nMost-used cards:\n");
+      for (size_t z = 0; z < min<size_t>(sorted_card_uses.size(), 30); z++) {
+        const auto& [count, card_id] = sorted_card_uses[z];
+        string name;
+        try {
+          name = s->ep3_card_index->definition_for_id(card_id)->def.en_name.decode();
+        } catch (const out_of_range&) {
+        }
+        fprintf(stdout, "  %04hX %-20s %zu\n", card_id, name.c_str(), count);
+      }
+    });
+
+static shared_ptr<FILE> open_session_capture_arg(phosg::Arguments& args, size_t index, bool is_output) {
+  auto nop_destructor = +[](FILE*) {};
+  const string& filename = args.get<string>(index, false);
+  if (filename.empty() || (filename == "-")) {
+    return shared_ptr<FILE>(is_output ? stdout : stdin, nop_destructor);
+  }
+  return phosg::fopen_shared(filename, is_output ? "wb" : "rb");
+}
+
+Action a_convert_session_capture(
+    "convert-session-capture", "\
+  convert-session-capture [INPUT-FILENAME [OUTPUT-FILENAME]]\n\
+    Convert a binary session capture (written when SessionCaptureDirectory is\n\
+    set in config.json) to the text format used by the command data log. The\n\
+    output can be used as a replay test log (see the tests directory).\n",
+    +[](phosg::Arguments& args) {
+      auto in_f = open_session_capture_arg(args, 1, false);
+      auto out_f = open_session_capture_arg(args, 2, true);
+      SessionCaptureReader r(in_f.get());
+      SessionCaptureRecord rec;
+      while (r.read(rec)) {
+        rec.print_as_log(out_f.get());
+      }
+      fflush(out_f.get());
+    });
+
+Action a_filter_session_capture(
+    "filter-session-capture", "\
+  filter-session-capture [INPUT-FILENAME [OUTPUT-FILENAME]] [OPTIONS...]\n\
+    Write a binary session capture containing only some of the records from\n\
+    another capture. Options:\n\
+      --command=CMD: Keep only commands with this number (in hex). May be given\n\
+          multiple times.\n\
+      --channel=ID: Keep only records for this channel (in hex, as shown by\n\
+          convert-session-capture). May be given multiple times.\n\
+    Connect and disconnect records are kept for all channels that match the\n\
+    --channel options, so the result can still be converted to a replay log.\n",
+    +[](phosg::Arguments& args) {
+      unordered_set<uint16_t> commands;
+      for (const auto& s : args.get_multi<string>("command")) {
+        commands.emplace(stoul(s, nullptr, 16));
+      }
+      unordered_set<uint64_t> channel_ids;
+      for (const auto& s : args.get_multi<string>("channel")) {
+        channel_ids.emplace(stoull(s, nullptr, 16));
+      }
+
+      auto in_f = open_session_capture_arg(args, 1, false);
+      auto out_f = open_session_capture_arg(args, 2, true);
+      SessionCaptureReader r(in_f.get());
+      write_session_capture_signature(out_f.get());
+      SessionCaptureRecord rec;
+      size_t num_records = 0;
+      size_t num_written = 0;
+      while (r.read(rec)) {
+        num_records++;
+        if (!channel_ids.empty() && !channel_ids.count(rec.channel_id)) {
+          continue;
+        }
+        bool is_command = (rec.type == SessionCaptureRecordType::RECEIVE) || (rec.type == SessionCaptureRecordType::SEND);
+        if (is_command && !commands.empty() && !commands.count(rec.command)) {
+          continue;
+        }
+        write_session_capture_record(out_f.get(), rec);
+        num_written++;
+      }
+      fflush(out_f.get());
+      fprintf(stderr, "%zu/%zu records written\n", num_written, num_records);
+    });
+
+Action a_run_replay_tests(
+    "run-replay-tests", "\
+  run-replay-tests DIRECTORY [OPTIONS...]\n\
+    Run all replay tests in the given directory (.test.txt files, and also\n\
+    .rdtest.txt files if newserv was built with client function support). The\n\
+    server state is loaded only once, then each test runs in a forked copy of\n\
+    the process, so tests run in parallel but can't affect each other's state.\n\
+    The result and time taken for each test are shown as the tests finish, and\n\
+    the logs from any failed tests are shown at the end. Options:\n\
+      --jobs=N: Run this many tests at once (default is one per CPU core).\n\
+    The tests in this repository expect --config=tests/config.json.\n",
+    +[](phosg::Arguments& args) {
+      string directory = args.get<string>(1, true);
+      size_t num_jobs = args.get<size_t>("jobs", 0);
+      if (num_jobs == 0) {
+        num_jobs = max<size_t>(thread::hardware_concurrency(), 1);
+      }
+
+      vector<string> filenames;
+      for (const auto& filename : phosg::list_directory_sorted(directory)) {
+#ifdef HAVE_RESOURCE_FILE
+        bool is_test = filename.ends_with(".test.txt") || filename.ends_with(".rdtest.txt");
+#else
+        bool is_test = filename.ends_with(".test.txt");
+#endif
+        if (is_test) {
+          filenames.emplace_back(directory + "/" + filename);
+        }
+      }
+      if (filenames.empty()) {
+        throw runtime_error("no replay tests found");
+      }
+
+      if (evthread_use_pthreads()) {
+        throw runtime_error("failed to set up libevent threads");
+      }
+      if (!phosg::isdir("system/players")) {
+        mkdir("system/players", 0755);
+      }
+      signal(SIGPIPE, SIG_IGN);
+      set_function_compiler_available(false);
+
+      // Load everything the same way as for --replay-log. This state is never
+      // used in this process; each child gets its own copy of it when forked,
+      // so lazily-populated caches (e.g. in ItemParameterTable) and mutable
+      // state (lobbies, accounts, etc.) are never shared between tests.
+      uint64_t load_start = phosg::now();
+      shared_ptr<struct event_base> base(event_base_new(), event_base_free);
+      auto state = make_shared<ServerState>(base, get_config_filename(args), true);
+      state->load_all();
+      uint64_t load_usecs = phosg::now() - load_start;
+      fprintf(stderr, "Server state loaded in %s; running %zu tests with %zu jobs\n",
+          phosg::format_duration(load_usecs).c_str(), filenames.size(), num_jobs);
+
+      auto run_test = [&](const string& filename) -> int {
+        try {
+          if (event_reinit(base.get())) {
+            throw runtime_error("failed to reinitialize event base");
+          }
+          state->proxy_server = make_shared<ProxyServer>(base, state);
+          state->game_server = make_shared<Server>(base, state);
+          auto log_f = phosg::fopen_shared(filename, "rt");
+          auto replay_session = make_shared<ReplaySession>(base, log_f.get(), state, false);
+          replay_session->start();
+          event_base_dispatch(base.get());
+          // As for --replay-log, make sure the server doesn't send anything
+          // unexpected after the end of the session
+          auto tv = phosg::usecs_to_timeval(500000);
+          event_base_loopexit(base.get(), &tv);
+          event_base_dispatch(base.get());
+          return 0;
+        } catch (const exception& e) {
+          fprintf(stderr, "Replay failed: %s\n", e.what());
+          return 1;
+        }
+      };
+
+      struct TestResult {
+        string output_filename;
+        uint64_t start_time = 0;
+        uint64_t usecs = 0;
+        string failure_description; // Empty if the test passed
+      };
+      vector<TestResult> results(filenames.size());
+      unordered_map<pid_t, size_t> running_pids;
+      size_t next_index = 0;
+      size_t num_failed = 0;
+      uint64_t start = phosg::now();
+      while ((next_index < filenames.size()) || !running_pids.empty()) {
+        while ((next_index < filenames.size()) && (running_pids.size() < num_jobs)) {
+          auto& res = results[next_index];
+          char output_filename[] = "/tmp/newserv-replay-test-XXXXXX";
+          int output_fd = mkstemp(output_filename);
+          if (output_fd < 0) {
+            throw runtime_error("cannot create temporary file for test output");
+          }
+          res.output_filename = output_filename;
+          res.start_time = phosg::now();
+
+          fflush(stdout);
+          fflush(stderr);
+          pid_t pid = fork();
+          if (pid < 0) {
+            close(output_fd);
+            throw runtime_error("cannot fork test process");
+          }
+          if (pid == 0) {
+            dup2(output_fd, STDOUT_FILENO);
+            dup2(output_fd, STDERR_FILENO);
+            close(output_fd);
+            int exit_code = run_test(filenames[next_index]);
+            fflush(stdout);
+            fflush(stderr);
+            _exit(exit_code);
+          }
+          close(output_fd);
+          running_pids.emplace(pid, next_index);
+          next_index++;
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          throw runtime_error("cannot wait for test processes");
+        }
+        auto it = running_pids.find(pid);
+        if (it == running_pids.end()) {
+          continue;
+        }
+        size_t index = it->second;
+        running_pids.erase(it);
+
+        auto& res = results[index];
+        res.usecs = phosg::now() - res.start_time;
+        if (WIFSIGNALED(status)) {
+          res.failure_description = phosg::string_printf("killed by signal %d", WTERMSIG(status));
+        } else if (!WIFEXITED(status)) {
+          res.failure_description = "terminated abnormally";
+        } else if (WEXITSTATUS(status) != 0) {
+          res.failure_description = phosg::string_printf("exited with code %d", WEXITSTATUS(status));
+        }
+        if (res.failure_description.empty()) {
+          fprintf(stderr, "PASS %s (%s)\n", filenames[index].c_str(), phosg::format_duration(res.usecs).c_str());
+          unlink(res.output_filename.c_str());
+        } else {
+          fprintf(stderr, "FAIL %s (%s; %s)\n", filenames[index].c_str(),
+              phosg::format_duration(res.usecs).c_str(), res.failure_description.c_str());
+          num_failed++;
+        }
+      }
+      uint64_t usecs = phosg::now() - start;
+
+      for (size_t z = 0; z < results.size(); z++) {
+        auto& res = results[z];
+        if (res.failure_description.empty()) {
+          continue;
+        }
+        fprintf(stderr, "\n===== %s (%s) =====\n", filenames[z].c_str(), res.failure_description.c_str());
+        try {
+          string output = phosg::load_file(res.output_filename);
+          fwrite(output.data(), 1, output.size(), stderr);
+        } catch (const exception& e) {
+          fprintf(stderr, "(cannot read test output: %s)\n", e.what());
+        }
+        unlink(res.output_filename.c_str());
+      }
+
+      fprintf(stderr, "\n%zu/%zu tests passed in %s (plus %s to load server state)\n",
+          filenames.size() - num_failed, filenames.size(),
+          phosg::format_duration(usecs).c_str(), phosg::format_duration(load_usecs).c_str());
+      if (num_failed) {
+        throw runtime_error(phosg::string_printf("%zu replay test(s) failed", num_failed));
+      }
     });
 
 Action a_run_server_replay_log(
@@ -3031,6 +3922,21 @@ Action a_run_server_replay_log(
       auto state = make_shared<ServerState>(base, get_config_filename(args), is_replay);
       state->load_all();
 
+      if (!state->session_capture_directory.empty() && !is_replay) {
+        if (!phosg::isdir(state->session_capture_directory)) {
+          config_log.info("Session capture directory does not exist; creating it");
+          mkdir(state->session_capture_directory.c_str(), 0755);
+        }
+        string filename = phosg::string_printf("%s/%" PRIu64 ".nscap", state->session_capture_directory.c_str(), phosg::now());
+        state->session_capture = make_shared<SessionCaptureWriter>(filename);
+        config_log.info("Writing session capture to %s", filename.c_str());
+      }
+
+      if (state->ep3_stream_battle_records && !phosg::isdir("system/ep3/battle-records")) {
+        config_log.info("Battle records directory does not exist; creating it");
+        mkdir("system/ep3/battle-records", 0755);
+      }
+
       if (state->dns_server_port && !is_replay) {
         if (!state->dns_server_addr.empty()) {
           config_log.info("Starting DNS server on %s:%hu", state->dns_server_addr.c_str(), state->dns_server_port);
@@ -348,6 +348,9 @@ void PatchServer::on_listen_accept(struct evconnlistener* listener, evutil_socke
   c->channel.on_error = PatchServer::on_client_error;
   c->channel.context_obj = this;
   this->channel_to_client.emplace(&c->channel, c);
+  if (this->config->session_capture) {
+    c->channel.start_capture(this->config->session_capture, listening_socket->addr_str);
+  }
 
   server_log.info("Patch client connected: C-%" PRIX64 " on fd %d via %d (%s)",
       c->id, fd, listen_fd, listening_socket->addr_str.c_str());
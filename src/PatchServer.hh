@@ -25,6 +25,7 @@ public:
     std::shared_ptr<const PatchFileIndex> patch_file_index;
     std::shared_ptr<const IPV4RangeSet> banned_ipv4_ranges;
     std::shared_ptr<struct event_base> shared_base;
+    std::shared_ptr<SessionCaptureWriter> session_capture;
   };
 
   PatchServer() = delete;
@@ -703,6 +703,8 @@ static HandlerResult S_B2(shared_ptr<ProxyServer::LinkedSession> ses, uint16_t,
     uint64_t filename_timestamp = phosg::now();
     string code = data.substr(sizeof(S_ExecuteCode_B2));
 
+    // Decrypting and decompressing the code is done here, so if the code is
+    // invalid, the command is not forwarded to the client
     if (ses->config.check_flag(Client::Flag::ENCRYPTED_SEND_FUNCTION_CALL)) {
       phosg::StringReader r(code);
       bool is_big_endian = ::is_big_endian(ses->version());
@@ -730,84 +732,92 @@ static HandlerResult S_B2(shared_ptr<ProxyServer::LinkedSession> ses, uint16_t,
       }
 
     } else {
-      code = data.substr(sizeof(S_ExecuteCode_B2));
       if (code.size() < cmd.code_size) {
         code.resize(cmd.code_size);
       }
     }
 
-    string output_filename = phosg::string_printf("code.%" PRId64 ".bin", filename_timestamp);
-    phosg::save_file(output_filename, data);
-    ses->log.info("Wrote code from server to file %s", output_filename.c_str());
+    // Saving and disassembling the code can be slow, so it's done in the
+    // background
+    ses->run_in_background(
+        [data = data,
+            code = std::move(code),
+            version = ses->version(),
+            cmd = cmd,
+            filename_timestamp](phosg::PrefixedLogger& log) -> void {
+          string output_filename = phosg::string_printf("code.%" PRId64 ".bin", filename_timestamp);
+          phosg::save_file(output_filename, data);
+          log.info("Wrote code from server to file %s", output_filename.c_str());
 
 #ifdef HAVE_RESOURCE_FILE
-    using FooterT = RELFileFooterT<BE>;
-
-    // TODO: Support SH-4 disassembly too
-    bool is_ppc = ::is_ppc(ses->version());
-    bool is_x86 = ::is_x86(ses->version());
-    bool is_sh4 = ::is_sh4(ses->version());
-    if (is_ppc || is_x86 || is_sh4) {
-      try {
-        if (code.size() < sizeof(FooterT)) {
-          throw runtime_error("code section is too small");
-        }
-
-        size_t footer_offset = code.size() - sizeof(FooterT);
-
-        phosg::StringReader r(code.data(), code.size());
-        const auto& footer = r.pget<FooterT>(footer_offset);
-
-        multimap<uint32_t, string> labels;
-        r.go(footer.relocations_offset);
-        uint32_t reloc_offset = 0;
-        for (size_t x = 0; x < footer.num_relocations; x++) {
-          reloc_offset += (r.get<U16T<BE>>() * 4);
-          labels.emplace(reloc_offset, phosg::string_printf("reloc%zu", x));
-        }
-        labels.emplace(footer.root_offset.load(), "entry_ptr");
-        labels.emplace(footer_offset, "footer");
-        labels.emplace(r.pget<U32T<BE>>(footer.root_offset), "start");
-
-        string disassembly;
-        if (is_ppc) {
-          disassembly = ResourceDASM::PPC32Emulator::disassemble(
-              &r.pget<uint8_t>(0, code.size()),
-              code.size(),
-              0,
-              &labels);
-        } else if (is_x86) {
-          disassembly = ResourceDASM::X86Emulator::disassemble(
-              &r.pget<uint8_t>(0, code.size()),
-              code.size(),
-              0,
-              &labels);
-        } else if (is_sh4) {
-          disassembly = ResourceDASM::SH4Emulator::disassemble(
-              &r.pget<uint8_t>(0, code.size()),
-              code.size(),
-              0,
-              &labels);
-        } else {
-          // We shouldn't have entered the outer if statement if this happens
-          throw logic_error("unsupported architecture");
-        }
-
-        output_filename = phosg::string_printf("code.%" PRId64 ".txt", filename_timestamp);
-        {
-          auto f = phosg::fopen_unique(output_filename, "wt");
-          fprintf(f.get(), "// code_size = 0x%" PRIX32 "\n", cmd.code_size.load());
-          fprintf(f.get(), "// checksum_addr = 0x%" PRIX32 "\n", cmd.checksum_start.load());
-          fprintf(f.get(), "// checksum_size = 0x%" PRIX32 "\n", cmd.checksum_size.load());
-          phosg::fwritex(f.get(), disassembly);
-        }
-        ses->log.info("Wrote disassembly to file %s", output_filename.c_str());
-
-      } catch (const exception& e) {
-        ses->log.info("Failed to disassemble code from server: %s", e.what());
-      }
-    }
+          using FooterT = RELFileFooterT<BE>;
+
+          // TODO: Support SH-4 disassembly too
+          bool is_ppc = ::is_ppc(version);
+          bool is_x86 = ::is_x86(version);
+          bool is_sh4 = ::is_sh4(version);
+          if (is_ppc || is_x86 || is_sh4) {
+            try {
+              if (code.size() < sizeof(FooterT)) {
+                throw runtime_error("code section is too small");
+              }
+
+              size_t footer_offset = code.size() - sizeof(FooterT);
+
+              phosg::StringReader r(code.data(), code.size());
+              const auto& footer = r.pget<FooterT>(footer_offset);
+
+              multimap<uint32_t, string> labels;
+              r.go(footer.relocations_offset);
+              uint32_t reloc_offset = 0;
+              for (size_t x = 0; x < footer.num_relocations; x++) {
+                reloc_offset += (r.get<U16T<BE>>() * 4);
+                labels.emplace(reloc_offset, phosg::string_printf("reloc%zu", x));
+              }
+              labels.emplace(footer.root_offset.load(), "entry_ptr");
+              labels.emplace(footer_offset, "footer");
+              labels.emplace(r.pget<U32T<BE>>(footer.root_offset), "start");
+
+              string disassembly;
+              if (is_ppc) {
+                disassembly = ResourceDASM::PPC32Emulator::disassemble(
+                    &r.pget<uint8_t>(0, code.size()),
+                    code.size(),
+                    0,
+                    &labels);
+              } else if (is_x86) {
+                disassembly = ResourceDASM::X86Emulator::disassemble(
+                    &r.pget<uint8_t>(0, code.size()),
+                    code.size(),
+                    0,
+                    &labels);
+              } else if (is_sh4) {
+                disassembly = ResourceDASM::SH4Emulator::disassemble(
+                    &r.pget<uint8_t>(0, code.size()),
+                    code.size(),
+                    0,
+                    &labels);
+              } else {
+                // We shouldn't have entered the outer if statement if this happens
+                throw logic_error("unsupported architecture");
+              }
+
+              output_filename = phosg::string_printf("code.%" PRId64 ".txt", filename_timestamp);
+              {
+                auto f = phosg::fopen_unique(output_filename, "wt");
+                fprintf(f.get(), "// code_size = 0x%" PRIX32 "\n", cmd.code_size.load());
+                fprintf(f.get(), "// checksum_addr = 0x%" PRIX32 "\n", cmd.checksum_start.load());
+                fprintf(f.get(), "// checksum_size = 0x%" PRIX32 "\n", cmd.checksum_size.load());
+                phosg::fwritex(f.get(), disassembly);
+              }
+              log.info("Wrote disassembly to file %s", output_filename.c_str());
+
+            } catch (const exception& e) {
+              log.info("Failed to disassemble code from server: %s", e.what());
+            }
+          }
 #endif
+        });
   }
 
   if (ses->config.check_flag(Client::Flag::PROXY_BLOCK_FUNCTION_CALLS)) {
@@ -842,9 +852,11 @@ static HandlerResult C_B3(shared_ptr<ProxyServer::LinkedSession> ses, uint16_t,
 
 static HandlerResult S_B_E7(shared_ptr<ProxyServer::LinkedSession> ses, uint16_t, uint32_t, string& data) {
   if (ses->config.check_flag(Client::Flag::PROXY_SAVE_FILES)) {
-    string output_filename = phosg::string_printf("player.%" PRId64 ".bin", phosg::now());
-    phosg::save_file(output_filename, data);
-    ses->log.info("Wrote player data to file %s", output_filename.c_str());
+    ses->run_in_background([data = data](phosg::PrefixedLogger& log) -> void {
+      string output_filename = phosg::string_printf("player.%" PRId64 ".bin", phosg::now());
+      phosg::save_file(output_filename, data);
+      log.info("Wrote player data to file %s", output_filename.c_str());
+    });
   }
   return HandlerResult::Type::FORWARD;
 }
@@ -1078,15 +1090,16 @@ static HandlerResult S_6x(shared_ptr<ProxyServer::LinkedSession> ses, uint16_t,
           const auto& cmd = check_size_t<G_MapData_Ep3_6xB6x41>(data, 0xFFFF);
           string filename = phosg::string_printf("map%08" PRIX32 ".%" PRIu64 ".mnmd",
               cmd.map_number.load(), phosg::now());
-          string map_data = prs_decompress(
-              data.data() + sizeof(cmd), data.size() - sizeof(cmd));
-          phosg::save_file(filename, map_data);
-          if (map_data.size() != sizeof(Episode3::MapDefinition) && map_data.size() != sizeof(Episode3::MapDefinitionTrial)) {
-            ses->log.warning("Wrote %zu bytes to %s (expected %zu or %zu bytes; the file may be invalid)",
-                map_data.size(), filename.c_str(), sizeof(Episode3::MapDefinitionTrial), sizeof(Episode3::MapDefinition));
-          } else {
-            ses->log.info("Wrote %zu bytes to %s", map_data.size(), filename.c_str());
-          }
+          ses->run_in_background([filename = std::move(filename), compressed_data = data.substr(sizeof(cmd))](phosg::PrefixedLogger& log) -> void {
+            string map_data = prs_decompress(compressed_data);
+            phosg::save_file(filename, map_data);
+            if (map_data.size() != sizeof(Episode3::MapDefinition) && map_data.size() != sizeof(Episode3::MapDefinitionTrial)) {
+              log.warning("Wrote %zu bytes to %s (expected %zu or %zu bytes; the file may be invalid)",
+                  map_data.size(), filename.c_str(), sizeof(Episode3::MapDefinitionTrial), sizeof(Episode3::MapDefinition));
+            } else {
+              log.info("Wrote %zu bytes to %s", map_data.size(), filename.c_str());
+            }
+          });
         }
       }
     }
@@ -1407,47 +1420,84 @@ static HandlerResult S_13_A7(shared_ptr<ProxyServer::LinkedSession> ses, uint16_
   if (is_last_block) {
     if (ses->config.check_flag(Client::Flag::PROXY_SAVE_FILES)) {
       ses->log.info("Writing file %s => %s", sf->basename.c_str(), sf->output_filename.c_str());
-
-      if (sf->is_download && (phosg::ends_with(sf->basename, ".bin") || phosg::ends_with(sf->basename, ".dat") || phosg::ends_with(sf->basename, ".pvr"))) {
-        sf->data = decode_dlq_data(sf->data);
-      }
-      phosg::save_file(sf->output_filename, sf->data);
-      if (phosg::ends_with(sf->basename, ".bin")) {
-        try {
-          string decompressed = prs_decompress(sf->data);
-          auto disassembly = disassemble_quest_script(decompressed.data(), decompressed.size(), ses->version(), ses->language(), false);
-          phosg::save_file(sf->output_filename + ".txt", disassembly);
-        } catch (const exception& e) {
-          ses->log.warning("Failed to disassemble quest file: %s", e.what());
-        }
-      }
+      // Decoding and saving the file is done in the background, but quest
+      // script disassembly decodes text, which is only safe on the event
+      // thread, so that part is done in the completion callback
+      auto decoded_data = make_shared<string>(sf->data);
+      ses->run_in_background(
+          [basename = sf->basename,
+              output_filename = sf->output_filename,
+              is_download = sf->is_download,
+              decoded_data](phosg::PrefixedLogger&) -> void {
+            if (is_download && (phosg::ends_with(basename, ".bin") || phosg::ends_with(basename, ".dat") || phosg::ends_with(basename, ".pvr"))) {
+              *decoded_data = decode_dlq_data(*decoded_data);
+            }
+            phosg::save_file(output_filename, *decoded_data);
+          },
+          [wses = weak_ptr<ProxyServer::LinkedSession>(ses),
+              basename = sf->basename,
+              output_filename = sf->output_filename,
+              decoded_data,
+              version = ses->version(),
+              language = ses->language()]() -> void {
+            auto ses = wses.lock();
+            if (!ses || !phosg::ends_with(basename, ".bin")) {
+              return;
+            }
+            try {
+              string decompressed = prs_decompress(*decoded_data);
+              auto disassembly = disassemble_quest_script(decompressed.data(), decompressed.size(), version, language, false);
+              phosg::save_file(output_filename + ".txt", disassembly);
+            } catch (const exception& e) {
+              ses->log.warning("Failed to disassemble quest file: %s", e.what());
+            }
+          });
     } else {
       ses->log.info("Download complete for file %s", sf->basename.c_str());
     }
 
     if (!sf->is_download && phosg::ends_with(sf->basename, ".dat")) {
-      auto quest_dat_data = make_shared<std::string>(prs_decompress(sf->data));
-      try {
-        auto map_file = make_shared<MapFile>(quest_dat_data);
-        auto materialized_map_file = map_file->materialize_random_sections(ses->lobby_random_seed);
-
-        array<shared_ptr<const MapFile>, NUM_VERSIONS> map_files;
-        map_files.at(static_cast<size_t>(ses->version())) = materialized_map_file;
-        auto supermap = make_shared<SuperMap>(ses->lobby_episode, map_files);
-
-        ses->map_state = make_shared<MapState>(
-            ses->id,
-            ses->lobby_difficulty,
-            ses->lobby_event,
-            ses->lobby_random_seed,
-            MapState::DEFAULT_RARE_ENEMIES,
-            make_shared<PSOV2Encryption>(ses->lobby_random_seed),
-            supermap);
-
-      } catch (const exception& e) {
-        ses->log.warning("Failed to load quest map: %s", e.what());
-        ses->map_state.reset();
-      }
+      // Parsing the map can be slow, but later commands (e.g. item drop
+      // requests) depend on the map state, so commands are paused in both
+      // directions until it's ready
+      auto supermap = make_shared<shared_ptr<SuperMap>>();
+      ses->run_in_background(
+          [supermap,
+              compressed_data = sf->data,
+              version = ses->version(),
+              episode = ses->lobby_episode,
+              random_seed = ses->lobby_random_seed](phosg::PrefixedLogger& log) -> void {
+            try {
+              auto quest_dat_data = make_shared<std::string>(prs_decompress(compressed_data));
+              auto map_file = make_shared<MapFile>(quest_dat_data);
+              auto materialized_map_file = map_file->materialize_random_sections(random_seed);
+
+              array<shared_ptr<const MapFile>, NUM_VERSIONS> map_files;
+              map_files.at(static_cast<size_t>(version)) = materialized_map_file;
+              *supermap = make_shared<SuperMap>(episode, map_files);
+            } catch (const exception& e) {
+              log.warning("Failed to load quest map: %s", e.what());
+            }
+          },
+          [wses = weak_ptr<ProxyServer::LinkedSession>(ses), supermap]() -> void {
+            auto ses = wses.lock();
+            if (!ses) {
+              return;
+            }
+            if (!*supermap) {
+              ses->map_state.reset();
+              return;
+            }
+            ses->map_state = make_shared<MapState>(
+                ses->id,
+                ses->lobby_difficulty,
+                ses->lobby_event,
+                ses->lobby_random_seed,
+                MapState::DEFAULT_RARE_ENEMIES,
+                make_shared<PSOV2Encryption>(ses->lobby_random_seed),
+                *supermap);
+          },
+          true);
     }
 
     ses->saving_files.erase(cmd.filename.decode());
@@ -1486,9 +1536,11 @@ static HandlerResult S_G_B8(shared_ptr<ProxyServer::LinkedSession> ses, uint16_t
       return HandlerResult::Type::FORWARD;
     }
 
-    string output_filename = phosg::string_printf("card-definitions.%" PRIu64 ".mnr", phosg::now());
-    phosg::save_file(output_filename, r.read(size));
-    ses->log.info("Wrote %zu bytes to %s", size, output_filename.c_str());
+    ses->run_in_background([card_data = r.read(size)](phosg::PrefixedLogger& log) -> void {
+      string output_filename = phosg::string_printf("card-definitions.%" PRIu64 ".mnr", phosg::now());
+      phosg::save_file(output_filename, card_data);
+      log.info("Wrote %zu bytes to %s", card_data.size(), output_filename.c_str());
+    });
   }
 
   // Unset the flag specifying that the client has newserv's card definitions,
@@ -1507,9 +1559,6 @@ static HandlerResult S_G_B9(shared_ptr<ProxyServer::LinkedSession> ses, uint16_t
         throw runtime_error("Media data size extends beyond end of command; not saving file");
       }
 
-      string decompressed_data = prs_decompress(
-          data.data() + sizeof(header), data.size() - sizeof(header));
-
       string output_filename = phosg::string_printf("media-update.%" PRIu64, phosg::now());
       if (header.type == 1) {
         output_filename += ".gvm";
@@ -1518,9 +1567,11 @@ static HandlerResult S_G_B9(shared_ptr<ProxyServer::LinkedSession> ses, uint16_t
       } else {
         output_filename += ".bin";
       }
-      phosg::save_file(output_filename, decompressed_data);
-      ses->log.info("Wrote %zu bytes to %s",
-          decompressed_data.size(), output_filename.c_str());
+      ses->run_in_background([output_filename = std::move(output_filename), compressed_data = data.substr(sizeof(header))](phosg::PrefixedLogger& log) -> void {
+        string decompressed_data = prs_decompress(compressed_data);
+        phosg::save_file(output_filename, decompressed_data);
+        log.info("Wrote %zu bytes to %s", decompressed_data.size(), output_filename.c_str());
+      });
     } catch (const exception& e) {
       ses->log.warning("Failed to save file: %s", e.what());
     }
@@ -2411,6 +2462,10 @@ static on_command_t get_handler(Version version, bool from_server, uint8_t comma
   return ret ? ret : default_handler;
 }
 
+bool proxy_command_is_opaque(Version version, bool from_server, uint16_t command) {
+  return get_handler(version, from_server, command) == default_handler;
+}
+
 void on_proxy_command(
     shared_ptr<ProxyServer::LinkedSession> ses,
     bool from_server,
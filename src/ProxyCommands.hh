@@ -7,6 +7,10 @@
 #include "ProxyServer.hh"
 #include "ServerState.hh"
 
+// Returns true if the proxy never inspects or modifies the given command, so
+// it can be forwarded without being passed to on_proxy_command at all
+bool proxy_command_is_opaque(Version version, bool from_server, uint16_t command);
+
 void on_proxy_command(
     std::shared_ptr<ProxyServer::LinkedSession> ses,
     bool from_server,
@@ -41,6 +41,8 @@ ProxyServer::ProxyServer(
     : base(base),
       destroy_sessions_ev(event_new(this->base.get(), -1, EV_TIMEOUT, &ProxyServer::dispatch_destroy_sessions, this), event_free),
       state(state),
+      // Replays must be deterministic, so background work is done inline there
+      worker_pool(make_shared<WorkerPool>(this->base, state->is_replay ? 0 : state->proxy_worker_threads)),
       next_unlinked_session_id(this->FIRST_UNLINKED_SESSION_ID),
       next_logged_out_session_id(this->FIRST_LINKED_LOGGED_OUT_SESSION_ID) {}
 
@@ -105,6 +107,10 @@ void ProxyServer::ListeningSocket::on_listen_accept(int fd) {
     close(fd);
     return;
   }
+  if (!this->server->state->rate_limiter->check_connection(remote_addr)) {
+    close(fd);
+    return;
+  }
 
   this->log.info("Client connected on fd %d (port %hu, version %s)", fd, this->port, phosg::name_for_enum(this->version));
   auto* bev = bufferevent_socket_new(this->server->base.get(), fd, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
@@ -160,6 +166,9 @@ void ProxyServer::on_client_connect(
     ses->log.info("Opened linked session");
 
     Channel ch(bev, virtual_network_id, version, 1, nullptr, nullptr, ses.get(), "", phosg::TerminalFormat::FG_YELLOW, phosg::TerminalFormat::FG_GREEN);
+    if (this->state->session_capture) {
+      ch.start_capture(this->state->session_capture, phosg::string_printf("T-%hu-%s-proxy-client", listen_port, phosg::name_for_enum(version)));
+    }
     ses->resume(std::move(ch));
 
   } else {
@@ -263,6 +272,9 @@ ProxyServer::UnlinkedSession::UnlinkedSession(
       local_port(local_port) {
   string ip_str = server->state->format_address_for_channel_name(this->channel.remote_addr, this->channel.virtual_network_id);
   this->channel.name = phosg::string_printf("US-%" PRIX64 " @ %s", this->id, ip_str.c_str());
+  if (server->state->session_capture) {
+    this->channel.start_capture(server->state->session_capture, phosg::string_printf("T-%hu-%s-proxy-client", local_port, phosg::name_for_enum(version)));
+  }
   memset(&this->next_destination, 0, sizeof(this->next_destination));
 }
 
@@ -525,7 +537,9 @@ ProxyServer::LinkedSession::LinkedSession(
     : server(server),
       id(id),
       log(phosg::string_printf("[ProxyServer:LS-%016" PRIX64 "] ", this->id), proxy_server_log.min_level),
-      timeout_event(event_new(server->base.get(), -1, EV_TIMEOUT, &LinkedSession::dispatch_on_timeout, this), event_free),
+      timeout_timer(server->state->timer_wheel, [this]() -> void { this->on_timeout(); }),
+      idle_timeout_timer(server->state->timer_wheel, [this]() -> void { this->on_idle_timeout(); }),
+      idle_timeout_usecs(server->state->proxy_session_idle_timeout_usecs),
       login(nullptr),
       client_channel(
           version,
@@ -707,11 +721,29 @@ void ProxyServer::LinkedSession::connect() {
   this->server_channel.on_command_received = ProxyServer::LinkedSession::on_input;
   this->server_channel.on_error = ProxyServer::LinkedSession::on_error;
   this->server_channel.context_obj = this;
+  auto s = this->require_server_state();
+  if (s->session_capture) {
+    string description = phosg::string_printf("R-%hu-%s-proxy-server-%s",
+        ntohs(dest_sin->sin_port), phosg::name_for_enum(this->server_channel.version), netloc_str.c_str());
+    this->server_channel.start_capture(s->session_capture, description, true);
+  }
+
+  // Commands that the proxy doesn't look at are forwarded directly between the
+  // channels' buffers instead of going through on_input
+  this->client_channel.passthrough_target = &this->server_channel;
+  this->client_channel.is_passthrough_command = ProxyServer::LinkedSession::is_passthrough_command;
+  this->client_channel.on_passthrough_command = ProxyServer::LinkedSession::on_passthrough_command;
+  this->server_channel.passthrough_target = &this->client_channel;
+  this->server_channel.is_passthrough_command = ProxyServer::LinkedSession::is_passthrough_command;
+  this->server_channel.on_passthrough_command = ProxyServer::LinkedSession::on_passthrough_command;
 
   this->update_channel_names();
 
   // Cancel the session delete timeout
-  event_del(this->timeout_event.get());
+  this->timeout_timer.cancel();
+  if (this->idle_timeout_usecs) {
+    this->idle_timeout_timer.schedule(this->idle_timeout_usecs);
+  }
 }
 
 void ProxyServer::LinkedSession::update_channel_names() {
@@ -733,14 +765,82 @@ ProxyServer::LinkedSession::SavingFile::SavingFile(
       is_download(is_download),
       total_size(total_size) {}
 
-void ProxyServer::LinkedSession::dispatch_on_timeout(evutil_socket_t, short, void* ctx) {
-  reinterpret_cast<LinkedSession*>(ctx)->on_timeout();
-}
-
 void ProxyServer::LinkedSession::on_timeout() {
   this->require_server()->delete_session(this->id);
 }
 
+void ProxyServer::LinkedSession::on_idle_timeout() {
+  this->log.info("Idle timeout expired");
+  // The client isn't likely to reconnect, so delete the session soon after
+  // disconnecting (this can't be done immediately, since the session would be
+  // destroyed during this call)
+  this->disconnect_action = DisconnectAction::CLOSE_IMMEDIATELY;
+  this->disconnect();
+}
+
+void ProxyServer::LinkedSession::run_in_background(
+    function<void(phosg::PrefixedLogger& log)>&& fn,
+    function<void()>&& on_complete,
+    bool pause_input) {
+  auto server = this->require_server();
+  // If the work is done inline, on_complete is called before this function
+  // returns, so there's nothing to pause
+  pause_input &= (server->worker_pool->num_threads() > 0);
+  if (pause_input && (this->num_input_pausing_jobs++ == 0)) {
+    this->client_channel.set_input_paused(true);
+    this->server_channel.set_input_paused(true);
+  }
+
+  string log_prefix = phosg::string_printf("[ProxyServer:LS-%016" PRIX64 "] ", this->id);
+  auto wrapped_fn = [fn = std::move(fn), log_prefix = std::move(log_prefix)]() -> void {
+    phosg::PrefixedLogger log(log_prefix, proxy_server_log.min_level);
+    try {
+      fn(log);
+    } catch (const exception& e) {
+      log.warning("Background task failed: %s", e.what());
+    }
+  };
+  auto wrapped_on_complete = [wses = this->weak_from_this(), on_complete = std::move(on_complete), pause_input](exception_ptr) -> void {
+    auto ses = wses.lock();
+    if (!ses) {
+      return;
+    }
+    if (on_complete) {
+      try {
+        on_complete();
+      } catch (const exception& e) {
+        ses->log.warning("Background task completion failed: %s", e.what());
+      }
+    }
+    if (pause_input && (--ses->num_input_pausing_jobs == 0)) {
+      // Processing the client's pending commands could start another job that
+      // pauses input again
+      ses->client_channel.set_input_paused(false);
+      if (ses->num_input_pausing_jobs == 0) {
+        ses->server_channel.set_input_paused(false);
+      }
+    }
+  };
+  server->worker_pool->submit(std::move(wrapped_fn), std::move(wrapped_on_complete));
+}
+
+bool ProxyServer::LinkedSession::is_passthrough_command(Channel& ch, uint16_t command, uint32_t) {
+  auto* ses = reinterpret_cast<LinkedSession*>(ch.context_obj);
+  bool is_server_stream = (&ch == &ses->server_channel);
+  return proxy_command_is_opaque(ses->version(), is_server_stream, command);
+}
+
+void ProxyServer::LinkedSession::on_passthrough_command(Channel& ch, uint16_t, uint32_t, const void* data, size_t size) {
+  auto* ses = reinterpret_cast<LinkedSession*>(ch.context_obj);
+  if (ses->idle_timeout_usecs) {
+    ses->idle_timeout_timer.schedule(ses->idle_timeout_usecs);
+  }
+  if (&ch == &ses->server_channel) {
+    size_t bytes_to_save = min<size_t>(size, sizeof(ses->prev_server_command_bytes));
+    memcpy(ses->prev_server_command_bytes, data, bytes_to_save);
+  }
+}
+
 void ProxyServer::LinkedSession::on_error(Channel& ch, short events) {
   auto* ses = reinterpret_cast<LinkedSession*>(ch.context_obj);
   bool is_server_stream = (&ch == &ses->server_channel);
@@ -933,8 +1033,8 @@ void ProxyServer::LinkedSession::disconnect() {
 
   // Set a timeout to delete the session entirely (in case the client doesn't
   // reconnect)
-  struct timeval tv = phosg::usecs_to_timeval(this->timeout_for_disconnect_action(this->disconnect_action));
-  event_add(this->timeout_event.get(), &tv);
+  this->idle_timeout_timer.cancel();
+  this->timeout_timer.schedule(this->timeout_for_disconnect_action(this->disconnect_action));
 }
 
 bool ProxyServer::LinkedSession::is_connected() const {
@@ -945,6 +1045,10 @@ void ProxyServer::LinkedSession::on_input(Channel& ch, uint16_t command, uint32_
   auto* ses = reinterpret_cast<LinkedSession*>(ch.context_obj);
   bool is_server_stream = (&ch == &ses->server_channel);
 
+  if (ses->idle_timeout_usecs) {
+    ses->idle_timeout_timer.schedule(ses->idle_timeout_usecs);
+  }
+
   try {
     if (is_server_stream) {
       size_t bytes_to_save = min<size_t>(data.size(), sizeof(ses->prev_server_command_bytes));
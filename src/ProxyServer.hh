@@ -15,6 +15,7 @@
 #include "PSOEncryption.hh"
 #include "PSOProtocol.hh"
 #include "ServerState.hh"
+#include "TimerWheel.hh"
 
 class ProxyServer : public std::enable_shared_from_this<ProxyServer> {
 public:
@@ -35,7 +36,12 @@ public:
     uint64_t id;
     phosg::PrefixedLogger log;
 
-    std::unique_ptr<struct event, void (*)(struct event*)> timeout_event;
+    // timeout_timer deletes the session some time after it's disconnected (see
+    // DisconnectAction); idle_timeout_timer disconnects the session if neither
+    // end sends anything for too long
+    TimerWheel::Timer timeout_timer;
+    TimerWheel::Timer idle_timeout_timer;
+    uint64_t idle_timeout_usecs;
 
     std::shared_ptr<Login> login;
 
@@ -186,10 +192,12 @@ public:
     void connect();
 
     static uint64_t timeout_for_disconnect_action(DisconnectAction action);
-    static void dispatch_on_timeout(evutil_socket_t fd, short what, void* ctx);
     static void on_input(Channel& ch, uint16_t, uint32_t, std::string& msg);
+    static bool is_passthrough_command(Channel& ch, uint16_t command, uint32_t flag);
+    static void on_passthrough_command(Channel& ch, uint16_t, uint32_t, const void* data, size_t size);
     static void on_error(Channel& ch, short events);
     void on_timeout();
+    void on_idle_timeout();
 
     void update_channel_names();
 
@@ -200,6 +208,19 @@ public:
     void send_to_game_server(const char* error_message = nullptr);
     void disconnect();
     bool is_connected() const;
+
+    // Runs fn on the proxy's worker threads, so expensive work for one session
+    // doesn't delay all the others. fn must not access the session or any
+    // other state owned by the event thread; it gets its own logger with the
+    // same prefix as the session's. on_complete is called on the event thread
+    // afterward, but only if the session still exists. If pause_input is true,
+    // no commands are processed in either direction until on_complete has been
+    // called; this should be used when later commands depend on the result.
+    void run_in_background(
+        std::function<void(phosg::PrefixedLogger& log)>&& fn,
+        std::function<void()>&& on_complete = nullptr,
+        bool pause_input = false);
+    size_t num_input_pausing_jobs = 0;
   };
 
   std::shared_ptr<LinkedSession> get_session() const;
@@ -293,6 +314,7 @@ private:
   std::shared_ptr<struct event_base> base;
   std::shared_ptr<struct event> destroy_sessions_ev;
   std::shared_ptr<ServerState> state;
+  std::shared_ptr<WorkerPool> worker_pool;
   std::map<int, std::shared_ptr<ListeningSocket>> listeners;
   std::unordered_map<uint64_t, std::shared_ptr<UnlinkedSession>> id_to_unlinked_session;
   std::unordered_set<std::shared_ptr<UnlinkedSession>> unlinked_sessions_to_destroy;
@@ -0,0 +1,127 @@
+#include "RateLimiter.hh"
+
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <phosg/Time.hh>
+
+using namespace std;
+
+TokenBucket::TokenBucket(double capacity, uint64_t now_usecs)
+    : tokens(capacity),
+      last_update_usecs(now_usecs) {}
+
+bool TokenBucket::consume(double rate_per_sec, double capacity, uint64_t now_usecs) {
+  if (now_usecs > this->last_update_usecs) {
+    this->tokens = min<double>(capacity, this->tokens + (rate_per_sec * (now_usecs - this->last_update_usecs)) / 1000000.0);
+    this->last_update_usecs = now_usecs;
+  }
+  if (this->tokens < 1.0) {
+    return false;
+  }
+  this->tokens -= 1.0;
+  return true;
+}
+
+bool TokenBucket::is_full(double rate_per_sec, double capacity, uint64_t now_usecs) const {
+  uint64_t elapsed_usecs = (now_usecs > this->last_update_usecs) ? (now_usecs - this->last_update_usecs) : 0;
+  return (this->tokens + (rate_per_sec * elapsed_usecs) / 1000000.0) >= capacity;
+}
+
+void RateLimiter::set_config(const phosg::JSON& json) {
+  this->connections_per_sec = json.get_float("ConnectionsPerSecond", 0.0);
+  this->connection_burst = max<double>(json.get_float("ConnectionBurst", this->connections_per_sec), 1.0);
+  int64_t subnet_mask_bits = json.get_int("SubnetMaskBits", 32);
+  if (subnet_mask_bits < 0 || subnet_mask_bits > 32) {
+    throw runtime_error("SubnetMaskBits must be between 0 and 32");
+  }
+  this->subnet_mask_bits = subnet_mask_bits;
+  try {
+    this->exempt_ranges = IPV4RangeSet(json.at("ExemptIPV4Ranges"));
+  } catch (const out_of_range&) {
+    this->exempt_ranges = IPV4RangeSet();
+  }
+  this->commands_per_sec = json.get_float("CommandsPerSecond", 0.0);
+  this->command_burst = max<double>(json.get_float("CommandBurst", this->commands_per_sec), 1.0);
+
+  // The subnet size may have changed, so the existing buckets may no longer
+  // correspond to the right subnets
+  this->subnet_buckets.clear();
+}
+
+void RateLimiter::disable_command_limit() {
+  this->commands_per_sec = 0.0;
+}
+
+bool RateLimiter::check_connection(const struct sockaddr_storage& ss) {
+  if ((this->connections_per_sec <= 0.0) || (ss.ss_family != AF_INET)) {
+    this->num_connections_accepted++;
+    return true;
+  }
+  if (this->exempt_ranges.check(ss)) {
+    this->num_connections_exempt++;
+    this->num_connections_accepted++;
+    return true;
+  }
+
+  const sockaddr_in* sin = reinterpret_cast<const sockaddr_in*>(&ss);
+  uint32_t addr = ntohl(sin->sin_addr.s_addr);
+  uint32_t subnet = this->subnet_mask_bits ? (addr & (0xFFFFFFFF << (32 - this->subnet_mask_bits))) : 0;
+
+  uint64_t now_usecs = phosg::now();
+  auto it = this->subnet_buckets.try_emplace(subnet, this->connection_burst, now_usecs).first;
+  if (!it->second.consume(this->connections_per_sec, this->connection_burst, now_usecs)) {
+    this->num_connections_rejected++;
+    return false;
+  }
+  this->num_connections_accepted++;
+  if (now_usecs >= this->next_prune_usecs) {
+    this->prune_subnet_buckets(now_usecs);
+  }
+  return true;
+}
+
+void RateLimiter::prune_subnet_buckets(uint64_t now_usecs) {
+  // A full bucket behaves the same as a missing one, so full buckets can be
+  // deleted. This keeps the map from growing without bound when connections
+  // come from many different addresses (e.g. a scan).
+  for (auto it = this->subnet_buckets.begin(); it != this->subnet_buckets.end();) {
+    if (it->second.is_full(this->connections_per_sec, this->connection_burst, now_usecs)) {
+      it = this->subnet_buckets.erase(it);
+    } else {
+      it++;
+    }
+  }
+  this->next_prune_usecs = now_usecs + 60000000;
+}
+
+TokenBucket RateLimiter::make_command_bucket() const {
+  return TokenBucket(this->command_burst, phosg::now());
+}
+
+bool RateLimiter::check_command(TokenBucket& bucket) {
+  if (this->commands_per_sec <= 0.0) {
+    return true;
+  }
+  if (!bucket.consume(this->commands_per_sec, this->command_burst, phosg::now())) {
+    this->num_commands_rejected++;
+    return false;
+  }
+  return true;
+}
+
+phosg::JSON RateLimiter::json() const {
+  return phosg::JSON::dict({
+      {"ConnectionsPerSecond", this->connections_per_sec},
+      {"ConnectionBurst", this->connection_burst},
+      {"SubnetMaskBits", static_cast<uint64_t>(this->subnet_mask_bits)},
+      {"ExemptIPV4Ranges", this->exempt_ranges.json()},
+      {"CommandsPerSecond", this->commands_per_sec},
+      {"CommandBurst", this->command_burst},
+      {"TrackedSubnetCount", this->subnet_buckets.size()},
+      {"ConnectionsAccepted", this->num_connections_accepted},
+      {"ConnectionsRejected", this->num_connections_rejected},
+      {"ConnectionsExempt", this->num_connections_exempt},
+      {"CommandFloodDisconnects", this->num_commands_rejected},
+  });
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <phosg/JSON.hh>
+#include <unordered_map>
+
+#include "IPV4RangeSet.hh"
+
+// A token bucket holds up to some number of tokens (the burst size), and
+// refills continuously at a fixed rate. Each event consumes one token; events
+// that arrive when the bucket is empty are rejected. The rate and capacity
+// aren't stored in the bucket, since they're the same for all buckets owned by
+// a RateLimiter and can change when the config is reloaded.
+class TokenBucket {
+public:
+  TokenBucket(double capacity, uint64_t now_usecs);
+
+  // Refills the bucket for the time elapsed since the last call, then takes a
+  // token if one is available. Returns false if the bucket was empty.
+  bool consume(double rate_per_sec, double capacity, uint64_t now_usecs);
+  // Returns true if the bucket would be full at the given time; that is, if
+  // it's indistinguishable from a newly-created bucket
+  bool is_full(double rate_per_sec, double capacity, uint64_t now_usecs) const;
+
+private:
+  double tokens;
+  uint64_t last_update_usecs;
+};
+
+// RateLimiter limits how often new connections are accepted from each source
+// subnet, and how often each client may send commands. Connection limiting is
+// done before any per-client state is allocated, so a flood of connections
+// from one place costs only an accept() and close(). All limits are disabled
+// by default (and when the rate is zero). This object is not thread-safe; it
+// must only be used on the game server's event thread.
+class RateLimiter {
+public:
+  RateLimiter() = default;
+  ~RateLimiter() = default;
+
+  // Replaces all limits with the ones in the given config dict (the
+  // ConnectionRateLimit field in config.json). The counters are not reset, but
+  // the per-subnet connection buckets are, since the subnet size may change.
+  void set_config(const phosg::JSON& json);
+  // Disables the per-client command limit (used in replays, where commands
+  // arrive as fast as the replay can send them)
+  void disable_command_limit();
+
+  // Returns false if the connection should be rejected.
+  bool check_connection(const struct sockaddr_storage& ss);
+
+  // Returns a bucket for a new client's commands. Pass it to check_command
+  // for each command received from the client.
+  TokenBucket make_command_bucket() const;
+  // Returns false if the client is sending commands too quickly.
+  bool check_command(TokenBucket& bucket);
+
+  phosg::JSON json() const;
+
+private:
+  double connections_per_sec = 0.0;
+  double connection_burst = 0.0;
+  uint8_t subnet_mask_bits = 32;
+  IPV4RangeSet exempt_ranges;
+  double commands_per_sec = 0.0;
+  double command_burst = 0.0;
+
+  std::unordered_map<uint32_t, TokenBucket> subnet_buckets;
+  uint64_t next_prune_usecs = 0;
+
+  size_t num_connections_accepted = 0;
+  size_t num_connections_rejected = 0;
+  size_t num_connections_exempt = 0;
+  size_t num_commands_rejected = 0;
+
+  void prune_subnet_buckets(uint64_t now_usecs);
+};
@@ -1667,7 +1667,7 @@ static void on_tournament_bracket_updated(
     }
     s->ep3_tournament_index->delete_tournament(tourn->get_name());
   } else {
-    s->ep3_tournament_index->save();
+    s->ep3_tournament_index->save_tournament(tourn);
   }
 }
 
@@ -1713,6 +1713,10 @@ static void on_CA_Ep3(shared_ptr<Client> c, uint16_t, uint32_t, string& data) {
               c->ep3_config ? (c->ep3_config->online_clv_exp / 100) : 0);
         }
       }
+      if (s->ep3_stream_battle_records) {
+        l->battle_record->stream_to_file(phosg::string_printf(
+            "system/ep3/battle-records/live.%08" PRIX32 ".%" PRIu64 ".mzrd", l->lobby_id, phosg::now()));
+      }
     }
 
     l->create_ep3_server();
@@ -2799,7 +2803,7 @@ partner (if any) and opponent(s).",
                 tourn->get_name().c_str());
             send_ep3_timed_message_box(c->channel, 240, message.c_str());
 
-            s->ep3_tournament_index->save();
+            s->ep3_tournament_index->save_tournament(tourn);
 
           } catch (const exception& e) {
             string message = phosg::string_printf("Cannot join team:\n%s", e.what());
@@ -99,6 +99,10 @@ void Server::on_listen_accept(struct evconnlistener* listener, evutil_socket_t f
     close(fd);
     return;
   }
+  if (!this->state->rate_limiter->check_connection(remote_addr)) {
+    close(fd);
+    return;
+  }
 
   int listen_fd = evconnlistener_get_fd(listener);
   ListeningSocket* listening_socket;
@@ -117,6 +121,9 @@ void Server::on_listen_accept(struct evconnlistener* listener, evutil_socket_t f
   c->channel.on_error = Server::on_client_error;
   c->channel.context_obj = this;
   this->state->channel_to_client.emplace(&c->channel, c);
+  if (this->state->session_capture) {
+    c->channel.start_capture(this->state->session_capture, listening_socket->addr_str);
+  }
 
   server_log.info("Client connected: C-%" PRIX64 " on fd %d via %d (%s)",
       c->id, fd, listen_fd, listening_socket->addr_str.c_str());
@@ -142,6 +149,10 @@ void Server::connect_virtual_client(
   c->channel.on_error = Server::on_client_error;
   c->channel.context_obj = this;
   this->state->channel_to_client.emplace(&c->channel, c);
+  if (this->state->session_capture) {
+    c->channel.start_capture(this->state->session_capture, phosg::string_printf("T-%hu-%s-%s-VI",
+        server_port, phosg::name_for_enum(version), phosg::name_for_enum(initial_state)));
+  }
 
   server_log.info(
       "Client connected: C-%" PRIX64 " on virtual network N-%" PRIu64 " via T-%hu-%s-%s-VI",
@@ -185,6 +196,9 @@ void Server::on_client_input(Channel& ch, uint16_t command, uint32_t flag, std::
 
   if (c->should_disconnect) {
     server->disconnect_client(c);
+  } else if (!server->state->rate_limiter->check_command(c->command_rate_bucket)) {
+    c->log.warning("Client is sending commands too quickly; disconnecting");
+    server->disconnect_client(c);
   } else {
     if (server->state->catch_handler_exceptions) {
       try {
@@ -2,6 +2,7 @@
 
 #include <string.h>
 
+#include <future>
 #include <memory>
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
@@ -77,6 +78,7 @@ ServerState::ServerState(shared_ptr<struct event_base> base, const string& confi
       bb_system_cache(new FileContentsCache(3600000000ULL)),
       gba_files_cache(new FileContentsCache(3600000000ULL)),
       player_files_manager(this->base ? make_shared<PlayerFilesManager>(base) : nullptr),
+      timer_wheel(this->base ? make_shared<TimerWheel>(base) : nullptr),
       destroy_lobbies_event(this->base ? event_new(base.get(), -1, EV_TIMEOUT, &ServerState::dispatch_destroy_lobbies, this) : nullptr, event_free) {}
 
 void ServerState::add_client_to_available_lobby(shared_ptr<Client> c) {
@@ -788,9 +790,26 @@ void ServerState::load_config_early() {
     this->banned_ipv4_ranges = make_shared<IPV4RangeSet>();
   }
 
+  // The rate limiter is reconfigured in place so its counters survive config
+  // reloads
+  if (!this->rate_limiter) {
+    this->rate_limiter = make_shared<RateLimiter>();
+  }
+  try {
+    this->rate_limiter->set_config(this->config_json->at("ConnectionRateLimit"));
+  } catch (const out_of_range&) {
+    this->rate_limiter->set_config(phosg::JSON::dict());
+  }
+  if (this->is_replay) {
+    this->rate_limiter->disable_command_limit();
+  }
+
   this->client_ping_interval_usecs = this->config_json->get_int("ClientPingInterval", 30000000);
   this->client_idle_timeout_usecs = this->config_json->get_int("ClientIdleTimeout", 60000000);
   this->patch_client_idle_timeout_usecs = this->config_json->get_int("PatchClientIdleTimeout", 300000000);
+  this->proxy_session_idle_timeout_usecs = this->config_json->get_int("ProxySessionIdleTimeout", 300000000);
+  this->proxy_worker_threads = this->config_json->get_int("ProxyWorkerThreads", 2);
+  this->http_snapshot_interval_usecs = this->config_json->get_int("HTTPSnapshotInterval", 1000000);
 
   this->ip_stack_debug = this->config_json->get_bool("IPStackDebug", false);
   this->allow_unregistered_users = this->config_json->get_bool("AllowUnregisteredUsers", false);
@@ -904,8 +923,10 @@ void ServerState::load_config_early() {
   this->ep3_final_round_meseta_bonus = this->config_json->get_int("Episode3FinalRoundMesetaBonus", 300);
   this->ep3_jukebox_is_free = this->config_json->get_bool("Episode3JukeboxIsFree", false);
   this->ep3_behavior_flags = this->config_json->get_int("Episode3BehaviorFlags", 0);
+  this->ep3_stream_battle_records = this->config_json->get_bool("Episode3StreamBattleRecords", false);
   this->ep3_card_auction_points = this->config_json->get_int("CardAuctionPoints", 0);
   this->hide_download_commands = this->config_json->get_bool("HideDownloadCommands", true);
+  this->session_capture_directory = this->config_json->get_string("SessionCaptureDirectory", "");
   this->proxy_allow_save_files = this->config_json->get_bool("ProxyAllowSaveFiles", true);
   this->proxy_enable_login_options = this->config_json->get_bool("ProxyEnableLoginOptions", false);
 
@@ -1334,37 +1355,7 @@ void ServerState::load_config_late() {
   } catch (const out_of_range&) {
   }
 
-  for (auto& trap_card_ids : this->ep3_trap_card_ids) {
-    trap_card_ids.clear();
-  }
-  if (this->ep3_card_index) {
-    try {
-      const auto& ep3_trap_cards_json = this->config_json->get_list("Episode3TrapCards");
-      if (!ep3_trap_cards_json.empty()) {
-        if (ep3_trap_cards_json.size() != 5) {
-          throw runtime_error("Episode3TrapCards must be a list of 5 lists");
-        }
-        for (size_t trap_type = 0; trap_type < 5; trap_type++) {
-          auto& trap_card_ids = this->ep3_trap_card_ids[trap_type];
-          for (const auto& card_it : ep3_trap_cards_json.at(trap_type)->as_list()) {
-            const string& card_name = card_it->as_string();
-            try {
-              const auto& card = this->ep3_card_index->definition_for_name_normalized(card_name);
-              if (card->def.type != Episode3::CardType::ASSIST) {
-                throw runtime_error(phosg::string_printf("Ep3 card \"%s\" in trap card list is not an assist card", card_name.c_str()));
-              }
-              trap_card_ids.emplace_back(card->def.card_id);
-            } catch (const out_of_range&) {
-              throw runtime_error(phosg::string_printf("Ep3 card \"%s\" in trap card list does not exist", card_name.c_str()));
-            }
-          }
-        }
-      }
-    } catch (const out_of_range&) {
-    }
-  } else {
-    config_log.warning("Episode 3 card definitions missing; cannot set trap card IDs from config");
-  }
+  this->load_ep3_trap_cards();
 
   this->quest_F95E_results.clear();
   this->quest_F95F_results.clear();
@@ -1455,6 +1446,40 @@ void ServerState::load_config_late() {
   }
 }
 
+void ServerState::load_ep3_trap_cards() {
+  for (auto& trap_card_ids : this->ep3_trap_card_ids) {
+    trap_card_ids.clear();
+  }
+  if (this->ep3_card_index) {
+    try {
+      const auto& ep3_trap_cards_json = this->config_json->get_list("Episode3TrapCards");
+      if (!ep3_trap_cards_json.empty()) {
+        if (ep3_trap_cards_json.size() != 5) {
+          throw runtime_error("Episode3TrapCards must be a list of 5 lists");
+        }
+        for (size_t trap_type = 0; trap_type < 5; trap_type++) {
+          auto& trap_card_ids = this->ep3_trap_card_ids[trap_type];
+          for (const auto& card_it : ep3_trap_cards_json.at(trap_type)->as_list()) {
+            const string& card_name = card_it->as_string();
+            try {
+              const auto& card = this->ep3_card_index->definition_for_name_normalized(card_name);
+              if (card->def.type != Episode3::CardType::ASSIST) {
+                throw runtime_error(phosg::string_printf("Ep3 card \"%s\" in trap card list is not an assist card", card_name.c_str()));
+              }
+              trap_card_ids.emplace_back(card->def.card_id);
+            } catch (const out_of_range&) {
+              throw runtime_error(phosg::string_printf("Ep3 card \"%s\" in trap card list does not exist", card_name.c_str()));
+            }
+          }
+        }
+      }
+    } catch (const out_of_range&) {
+    }
+  } else {
+    config_log.warning("Episode 3 card definitions missing; cannot set trap card IDs from config");
+  }
+}
+
 void ServerState::load_bb_private_keys(bool from_non_event_thread) {
   vector<shared_ptr<const PSOBBEncryption::KeyFile>> new_keys;
   for (const string& filename : phosg::list_directory("system/blueburst/keys")) {
@@ -2074,22 +2099,28 @@ void ServerState::load_item_definitions(bool from_non_event_thread) {
 }
 
 void ServerState::load_ep3_cards(bool from_non_event_thread) {
-  config_log.info("Loading Episode 3 card definitions");
+  // The two card indexes don't depend on each other, so the trial card index
+  // is loaded on another thread while the main card index is loaded here
+  config_log.info("Loading Episode 3 card definitions and trial card definitions");
+  auto trial_future = async(launch::async, []() -> shared_ptr<Episode3::CardIndex> {
+    return make_shared<Episode3::CardIndex>(
+        "system/ep3/card-definitions-trial.mnr",
+        "system/ep3/card-definitions-trial.mnrd",
+        "system/ep3/card-text-trial.mnr",
+        "system/ep3/card-text-trial.mnrd",
+        "system/ep3/card-dice-text-trial.mnr",
+        "system/ep3/card-dice-text-trial.mnrd",
+        "system/ep3/cache");
+  });
   auto new_ep3_card_index = make_shared<Episode3::CardIndex>(
       "system/ep3/card-definitions.mnr",
       "system/ep3/card-definitions.mnrd",
       "system/ep3/card-text.mnr",
       "system/ep3/card-text.mnrd",
       "system/ep3/card-dice-text.mnr",
-      "system/ep3/card-dice-text.mnrd");
-  config_log.info("Loading Episode 3 trial card definitions");
-  auto new_ep3_card_index_trial = make_shared<Episode3::CardIndex>(
-      "system/ep3/card-definitions-trial.mnr",
-      "system/ep3/card-definitions-trial.mnrd",
-      "system/ep3/card-text-trial.mnr",
-      "system/ep3/card-text-trial.mnrd",
-      "system/ep3/card-dice-text-trial.mnr",
-      "system/ep3/card-dice-text-trial.mnrd");
+      "system/ep3/card-dice-text.mnrd",
+      "system/ep3/cache");
+  auto new_ep3_card_index_trial = trial_future.get();
   config_log.info("Loading Episode 3 COM decks");
   auto new_ep3_com_deck_index = make_shared<Episode3::COMDeckIndex>("system/ep3/com-decks.json");
 
@@ -2106,7 +2137,7 @@ void ServerState::load_ep3_cards(bool from_non_event_thread) {
 
 void ServerState::load_ep3_maps(bool from_non_event_thread) {
   config_log.info("Collecting Episode 3 maps");
-  auto new_ep3_map_index = make_shared<Episode3::MapIndex>("system/ep3/maps");
+  auto new_ep3_map_index = make_shared<Episode3::MapIndex>("system/ep3/maps", "system/ep3/cache");
 
   auto set = [s = this->shared_from_this(), new_ep3_map_index = std::move(new_ep3_map_index)]() {
     s->ep3_map_index = std::move(new_ep3_map_index);
@@ -2248,6 +2279,7 @@ shared_ptr<PatchServer::Config> ServerState::generate_patch_server_config(bool i
 #endif
   ret->allow_unregistered_users = this->allow_unregistered_users;
   ret->hide_data_from_logs = this->hide_download_commands;
+  ret->session_capture = this->session_capture;
   ret->idle_timeout_usecs = this->patch_client_idle_timeout_usecs;
   ret->message = is_bb ? this->bb_patch_server_message : this->pc_patch_server_message;
   ret->account_index = this->account_index;
@@ -29,7 +29,10 @@
 #include "PatchServer.hh"
 #include "PlayerFilesManager.hh"
 #include "Quest.hh"
+#include "RateLimiter.hh"
+#include "SessionCapture.hh"
 #include "TeamIndex.hh"
+#include "TimerWheel.hh"
 #include "WordSelectTable.hh"
 
 // Forward declarations due to reference cycles
@@ -111,6 +114,9 @@ struct ServerState : public std::enable_shared_from_this<ServerState> {
   uint64_t client_ping_interval_usecs = 30000000;
   uint64_t client_idle_timeout_usecs = 60000000;
   uint64_t patch_client_idle_timeout_usecs = 300000000;
+  uint64_t proxy_session_idle_timeout_usecs = 300000000;
+  size_t proxy_worker_threads = 2;
+  uint64_t http_snapshot_interval_usecs = 1000000;
   bool ip_stack_debug = false;
   bool allow_unregistered_users = false;
   bool allow_pc_nte = false;
@@ -151,7 +157,9 @@ struct ServerState : public std::enable_shared_from_this<ServerState> {
   uint32_t ep3_final_round_meseta_bonus = 300;
   bool ep3_jukebox_is_free = false;
   uint32_t ep3_behavior_flags = 0;
+  bool ep3_stream_battle_records = false;
   bool hide_download_commands = true;
+  std::string session_capture_directory;
   RunShellBehavior run_shell_behavior = RunShellBehavior::DEFAULT;
   BehaviorSwitch cheat_mode_behavior = BehaviorSwitch::OFF_BY_DEFAULT;
   bool default_switch_assist_enabled = false;
@@ -256,6 +264,7 @@ struct ServerState : public std::enable_shared_from_this<ServerState> {
 
   std::shared_ptr<AccountIndex> account_index;
   std::shared_ptr<IPV4RangeSet> banned_ipv4_ranges;
+  std::shared_ptr<RateLimiter> rate_limiter;
   std::shared_ptr<TeamIndex> team_index;
   phosg::JSON team_reward_defs_json;
 
@@ -278,6 +287,11 @@ struct ServerState : public std::enable_shared_from_this<ServerState> {
   std::string bb_patch_server_message;
 
   std::shared_ptr<PlayerFilesManager> player_files_manager;
+  // Shared by all timeouts that are frequently rescheduled (client idle and
+  // ping timeouts, proxy session timeouts, and IP stack simulator timers)
+  std::shared_ptr<TimerWheel> timer_wheel;
+  // Null if session capture is disabled
+  std::shared_ptr<SessionCaptureWriter> session_capture;
   std::unordered_map<Channel*, std::shared_ptr<Client>> channel_to_client;
   std::map<int64_t, std::shared_ptr<Lobby>> id_to_lobby;
   std::unordered_set<std::shared_ptr<Lobby>> lobbies_to_destroy;
@@ -430,6 +444,8 @@ struct ServerState : public std::enable_shared_from_this<ServerState> {
   void collect_network_addresses();
   void load_config_early();
   void load_config_late();
+  // Called by load_config_late; requires ep3_card_index to be loaded
+  void load_ep3_trap_cards();
   void load_bb_private_keys(bool from_non_event_thread);
   void load_bb_system_defaults(bool from_non_event_thread);
   void load_accounts(bool from_non_event_thread);
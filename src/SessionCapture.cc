@@ -0,0 +1,372 @@
+#include "SessionCapture.hh"
+
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+
+#include <phosg/Filesystem.hh>
+#include <phosg/Strings.hh>
+#include <phosg/Time.hh>
+
+#include "CommandFormats.hh"
+#include "Loggers.hh"
+#include "PSOProtocol.hh"
+
+using namespace std;
+
+void SessionCaptureRecord::print_as_log(FILE* stream) const {
+  // The replay parser splits these lines on spaces, so the timestamp must be
+  // exactly two tokens and the PID token must be present
+  time_t secs = this->timestamp_usecs / 1000000;
+  struct tm tm;
+  localtime_r(&secs, &tm);
+  char time_str[0x40];
+  strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &tm);
+
+  switch (this->type) {
+    case SessionCaptureRecordType::CONNECT:
+      fprintf(stream, "I 0 %s - [Server] Client connected: C-%" PRIX64 " on fd 0 via 0 (%s)\n",
+          time_str, this->channel_id, this->data.c_str());
+      break;
+    case SessionCaptureRecordType::DISCONNECT:
+      fprintf(stream, "I 0 %s - [Server] Client disconnected: C-%" PRIX64 "\n", time_str, this->channel_id);
+      break;
+    case SessionCaptureRecordType::RECEIVE:
+    case SessionCaptureRecordType::SEND: {
+      const char* direction_str = (this->type == SessionCaptureRecordType::RECEIVE) ? "Received from" : "Sending to";
+      if (this->version == Version::BB_V4) {
+        fprintf(stream, "I 0 %s - [Commands] %s C-%" PRIX64 " (version=BB command=%04hX flag=%08" PRIX32 ")\n",
+            time_str, direction_str, this->channel_id, this->command, this->flag);
+      } else {
+        fprintf(stream, "I 0 %s - [Commands] %s C-%" PRIX64 " (version=%s command=%02hX flag=%02" PRIX32 ")\n",
+            time_str, direction_str, this->channel_id, phosg::name_for_enum(this->version), this->command, this->flag);
+      }
+      phosg::print_data(stream, this->data.data(), this->data.size(), 0, nullptr,
+          phosg::PrintDataFlags::PRINT_ASCII | phosg::PrintDataFlags::DISABLE_COLOR | phosg::PrintDataFlags::OFFSET_16_BITS);
+      break;
+    }
+    default:
+      throw runtime_error("unknown session capture record type");
+  }
+}
+
+SessionCaptureWriter::SessionCaptureWriter(const string& filename, size_t max_buffered_bytes)
+    : filename(filename),
+      f(phosg::fopen_shared(filename, "wb")),
+      max_buffered_bytes(max_buffered_bytes),
+      next_channel_id(1),
+      num_dropped(0),
+      should_exit(false) {
+  write_session_capture_signature(this->f.get());
+  fflush(this->f.get());
+  this->th = thread(&SessionCaptureWriter::thread_fn, this);
+}
+
+SessionCaptureWriter::~SessionCaptureWriter() {
+  {
+    lock_guard g(this->lock);
+    this->should_exit = true;
+  }
+  this->cv.notify_one();
+  this->th.join();
+  if (this->num_dropped) {
+    command_data_log.warning("%zu session capture records were dropped because the writer could not keep up",
+        this->num_dropped);
+  }
+}
+
+uint64_t SessionCaptureWriter::allocate_channel_id() {
+  return this->next_channel_id++;
+}
+
+void SessionCaptureWriter::record_connect(uint64_t channel_id, Version version, const string& description) {
+  this->add_record(channel_id, SessionCaptureRecordType::CONNECT, version, 0, 0,
+      description.data(), description.size(), nullptr, 0);
+}
+
+void SessionCaptureWriter::record_disconnect(uint64_t channel_id, Version version) {
+  this->add_record(channel_id, SessionCaptureRecordType::DISCONNECT, version, 0, 0, nullptr, 0, nullptr, 0);
+}
+
+// Clears the passwords and access keys in client login commands. These are
+// the same fields that ReplaySession::check_for_password checks; the cleared
+// fields are empty, so captures can still be converted to replay tests.
+// Returns false if the command is not a login command.
+static bool redact_credentials(Version version, uint16_t command, string& data) {
+  size_t header_size = (version == Version::BB_V4) ? 8 : 4;
+  if (data.size() < header_size) {
+    return false;
+  }
+  void* cmd_data = data.data() + header_size;
+  size_t cmd_size = data.size() - header_size;
+
+  switch (version) {
+    case Version::PC_PATCH:
+    case Version::BB_PATCH:
+      if (command == 0x04) {
+        check_size_t<C_Login_Patch_04>(cmd_data, cmd_size).password.clear();
+        return true;
+      }
+      return false;
+
+    case Version::PC_NTE:
+    case Version::PC_V2:
+      if (command == 0x03) {
+        check_size_t<C_LegacyLogin_PC_V3_03>(cmd_data, cmd_size).access_key2.clear();
+      } else if (command == 0x04) {
+        check_size_t<C_LegacyLogin_PC_V3_04>(cmd_data, cmd_size).access_key.clear();
+      } else if (command == 0x9A) {
+        auto& cmd = check_size_t<C_Login_DC_PC_V3_9A>(cmd_data, cmd_size);
+        cmd.v1_access_key.clear();
+        cmd.access_key.clear();
+        cmd.access_key2.clear();
+      } else if (command == 0x9C) {
+        auto& cmd = check_size_t<C_Register_DC_PC_V3_9C>(cmd_data, cmd_size);
+        cmd.access_key.clear();
+        cmd.password.clear();
+      } else if (command == 0x9D) {
+        auto& cmd = check_size_t<C_Login_DC_PC_GC_9D>(cmd_data, cmd_size, sizeof(C_LoginExtended_PC_9D));
+        cmd.v1_access_key.clear();
+        cmd.access_key.clear();
+        cmd.access_key2.clear();
+      } else {
+        return false;
+      }
+      return true;
+
+    case Version::DC_NTE:
+    case Version::DC_11_2000:
+    case Version::DC_V1:
+    case Version::DC_V2:
+    case Version::GC_NTE:
+    case Version::GC_V3:
+    case Version::GC_EP3_NTE:
+    case Version::GC_EP3:
+    case Version::XB_V3:
+      if (command == 0x03) {
+        check_size_t<C_LegacyLogin_PC_V3_03>(cmd_data, cmd_size).access_key2.clear();
+      } else if (command == 0x04) {
+        check_size_t<C_LegacyLogin_PC_V3_04>(cmd_data, cmd_size).access_key.clear();
+      } else if (command == 0x90) {
+        check_size_t<C_LoginV1_DC_PC_V3_90>(cmd_data, cmd_size, 0xFFFF).access_key.clear();
+      } else if (command == 0x93) {
+        check_size_t<C_LoginV1_DC_93>(cmd_data, cmd_size, sizeof(C_LoginExtendedV1_DC_93)).access_key.clear();
+      } else if (command == 0x9A) {
+        auto& cmd = check_size_t<C_Login_DC_PC_V3_9A>(cmd_data, cmd_size);
+        cmd.v1_access_key.clear();
+        cmd.access_key.clear();
+        cmd.access_key2.clear();
+      } else if (command == 0x9C) {
+        auto& cmd = check_size_t<C_Register_DC_PC_V3_9C>(cmd_data, cmd_size);
+        cmd.access_key.clear();
+        cmd.password.clear();
+      } else if (command == 0x9D) {
+        auto& cmd = check_size_t<C_Login_DC_PC_GC_9D>(cmd_data, cmd_size, sizeof(C_LoginExtended_DC_GC_9D));
+        cmd.v1_access_key.clear();
+        cmd.access_key.clear();
+        cmd.access_key2.clear();
+      } else if (command == 0x9E) {
+        if (is_gc(version)) {
+          auto& cmd = check_size_t<C_Login_GC_9E>(cmd_data, cmd_size, sizeof(C_LoginExtended_GC_9E));
+          cmd.access_key.clear();
+          cmd.access_key2.clear();
+        } else { // XB
+          auto& cmd = check_size_t<C_Login_XB_9E>(cmd_data, cmd_size, sizeof(C_LoginExtended_XB_9E));
+          cmd.access_key.clear();
+          cmd.access_key2.clear();
+        }
+      } else if (command == 0xDB) {
+        auto& cmd = check_size_t<C_VerifyAccount_V3_DB>(cmd_data, cmd_size);
+        cmd.access_key.clear();
+        cmd.access_key2.clear();
+        cmd.password.clear();
+      } else {
+        return false;
+      }
+      return true;
+
+    case Version::BB_V4:
+      if (command == 0x04) {
+        check_size_t<C_LegacyLogin_BB_04>(cmd_data, cmd_size).password.clear();
+      } else if (command == 0x93) {
+        check_size_t<C_LoginBase_BB_93>(cmd_data, cmd_size, 0xFFFF).password.clear();
+      } else if (command == 0x9C) {
+        check_size_t<C_Register_BB_9C>(cmd_data, cmd_size).password.clear();
+      } else if (command == 0x9E) {
+        check_size_t<C_LoginExtended_BB_9E>(cmd_data, cmd_size).password.clear();
+      } else if (command == 0xDB) {
+        check_size_t<C_VerifyAccount_V3_DB>(cmd_data, cmd_size).password.clear();
+      } else {
+        return false;
+      }
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+void SessionCaptureWriter::record_command(
+    uint64_t channel_id,
+    bool is_send,
+    bool is_from_client,
+    Version version,
+    uint16_t command,
+    uint32_t flag,
+    const void* data1,
+    size_t size1,
+    const void* data2,
+    size_t size2) {
+  auto type = is_send ? SessionCaptureRecordType::SEND : SessionCaptureRecordType::RECEIVE;
+  if (is_from_client) {
+    string data(reinterpret_cast<const char*>(data1), size1);
+    if (size2) {
+      data.append(reinterpret_cast<const char*>(data2), size2);
+    }
+    bool redacted;
+    try {
+      redacted = redact_credentials(version, command, data);
+    } catch (const exception&) {
+      // The command has a login command's number but the wrong size; don't
+      // try to guess where the credentials are, and omit all of its data
+      size_t header_size = (version == Version::BB_V4) ? 8 : 4;
+      if (data.size() > header_size) {
+        memset(data.data() + header_size, 0, data.size() - header_size);
+      }
+      redacted = true;
+    }
+    if (redacted) {
+      this->add_record(channel_id, type, version, command, flag, data.data(), data.size(), nullptr, 0);
+      return;
+    }
+  }
+  this->add_record(channel_id, type, version, command, flag, data1, size1, data2, size2);
+}
+
+size_t SessionCaptureWriter::num_dropped_records() const {
+  lock_guard g(this->lock);
+  return this->num_dropped;
+}
+
+void SessionCaptureWriter::add_record(
+    uint64_t channel_id,
+    SessionCaptureRecordType type,
+    Version version,
+    uint16_t command,
+    uint32_t flag,
+    const void* data1,
+    size_t size1,
+    const void* data2,
+    size_t size2) {
+  SessionCaptureRecordHeader header;
+  header.timestamp_usecs = phosg::now();
+  header.channel_id = channel_id;
+  header.type = type;
+  header.version = static_cast<uint8_t>(version);
+  header.command = command;
+  header.flag = flag;
+  header.data_size = size1 + size2;
+
+  bool should_notify;
+  {
+    lock_guard g(this->lock);
+    size_t record_size = sizeof(header) + size1 + size2;
+    if (this->pending_data.size() + record_size > this->max_buffered_bytes) {
+      this->num_dropped++;
+      return;
+    }
+    size_t prev_size = this->pending_data.size();
+    this->pending_data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (size1) {
+      this->pending_data.append(reinterpret_cast<const char*>(data1), size1);
+    }
+    if (size2) {
+      this->pending_data.append(reinterpret_cast<const char*>(data2), size2);
+    }
+    // Only wake the writer thread when the buffer crosses the threshold, not
+    // for every record after that
+    should_notify = (prev_size < FLUSH_THRESHOLD_BYTES) && (this->pending_data.size() >= FLUSH_THRESHOLD_BYTES);
+  }
+  if (should_notify) {
+    this->cv.notify_one();
+  }
+}
+
+void SessionCaptureWriter::thread_fn() {
+  string data_to_write;
+  for (;;) {
+    bool exit_after_write;
+    {
+      unique_lock g(this->lock);
+      // Write at least once per second even if the threshold isn't reached,
+      // so the file is reasonably up to date if the server crashes
+      this->cv.wait_for(g, chrono::seconds(1), [&]() -> bool {
+        return this->should_exit || (this->pending_data.size() >= FLUSH_THRESHOLD_BYTES);
+      });
+      data_to_write.swap(this->pending_data);
+      exit_after_write = this->should_exit;
+    }
+
+    if (!data_to_write.empty()) {
+      try {
+        phosg::fwritex(this->f.get(), data_to_write);
+        fflush(this->f.get());
+      } catch (const exception& e) {
+        command_data_log.warning("Failed to write session capture data: %s", e.what());
+      }
+      data_to_write.clear();
+    }
+
+    if (exit_after_write) {
+      break;
+    }
+  }
+}
+
+SessionCaptureReader::SessionCaptureReader(FILE* f) : f(f) {
+  phosg::be_uint64_t signature;
+  if (fread(&signature, sizeof(signature), 1, this->f) != 1 || signature != SESSION_CAPTURE_SIGNATURE) {
+    throw runtime_error("input is not a session capture");
+  }
+}
+
+bool SessionCaptureReader::read(SessionCaptureRecord& rec) {
+  SessionCaptureRecordHeader header;
+  size_t bytes_read = fread(&header, 1, sizeof(header), this->f);
+  if (bytes_read == 0) {
+    return false;
+  }
+  if (bytes_read != sizeof(header)) {
+    throw runtime_error("session capture ends with an incomplete record header");
+  }
+
+  rec.timestamp_usecs = header.timestamp_usecs;
+  rec.channel_id = header.channel_id;
+  rec.type = header.type;
+  rec.version = static_cast<Version>(header.version);
+  rec.command = header.command;
+  rec.flag = header.flag;
+  rec.data.resize(header.data_size);
+  if (!rec.data.empty() && (fread(rec.data.data(), 1, rec.data.size(), this->f) != rec.data.size())) {
+    throw runtime_error("session capture ends with an incomplete record");
+  }
+  return true;
+}
+
+void write_session_capture_signature(FILE* f) {
+  phosg::be_uint64_t signature = SESSION_CAPTURE_SIGNATURE;
+  phosg::fwritex(f, &signature, sizeof(signature));
+}
+
+void write_session_capture_record(FILE* f, const SessionCaptureRecord& rec) {
+  SessionCaptureRecordHeader header;
+  header.timestamp_usecs = rec.timestamp_usecs;
+  header.channel_id = rec.channel_id;
+  header.type = rec.type;
+  header.version = static_cast<uint8_t>(rec.version);
+  header.command = rec.command;
+  header.flag = rec.flag;
+  header.data_size = rec.data.size();
+  phosg::fwritex(f, &header, sizeof(header));
+  phosg::fwritex(f, rec.data);
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "Types.hh"
+#include "Version.hh"
+
+// Session captures are a compact binary alternative to the command data log.
+// A capture file begins with SESSION_CAPTURE_SIGNATURE, followed by records
+// with no padding between them. Each record is a SessionCaptureRecordHeader
+// followed by data_size bytes of data. Command records contain the plaintext
+// of the command (including its header), exactly as it would appear in the
+// command data log; that is, after decryption for received commands and before
+// encryption for sent commands, without any implicit padding.
+
+constexpr uint64_t SESSION_CAPTURE_SIGNATURE = 0x6E73636170000001; // 'nscap' 00 00 01
+
+enum class SessionCaptureRecordType : uint8_t {
+  // data is a description of where the channel came from. For game server
+  // clients, this is the name of the listening socket as it appears in the
+  // "Client connected" log message (T-<port>-<version>-...).
+  CONNECT = 0,
+  DISCONNECT = 1, // No data
+  RECEIVE = 2, // data is the command (header + data) received on the channel
+  SEND = 3, // data is the command (header + data) sent on the channel
+};
+
+struct SessionCaptureRecordHeader {
+  le_uint64_t timestamp_usecs;
+  le_uint64_t channel_id;
+  SessionCaptureRecordType type;
+  uint8_t version; // Version enum value at the time of the record
+  le_uint16_t command; // Only used for RECEIVE and SEND
+  le_uint32_t flag; // Only used for RECEIVE and SEND
+  le_uint32_t data_size;
+} __packed_ws__(SessionCaptureRecordHeader, 0x1C);
+
+struct SessionCaptureRecord {
+  uint64_t timestamp_usecs = 0;
+  uint64_t channel_id = 0;
+  SessionCaptureRecordType type = SessionCaptureRecordType::CONNECT;
+  Version version = Version::UNKNOWN;
+  uint16_t command = 0;
+  uint32_t flag = 0;
+  std::string data;
+
+  // Writes this record to the given stream in the same format as the text
+  // command data log, so the output can be used as a replay test log.
+  void print_as_log(FILE* stream) const;
+};
+
+// SessionCaptureWriter writes capture records on a background thread, so the
+// cost on the calling thread is only a memcpy into a shared buffer. It is
+// thread-safe; one writer can be shared by the game server and the patch
+// servers' threads. If the writer thread can't keep up and the buffer grows
+// beyond max_buffered_bytes, new records are dropped (and counted) rather than
+// blocking the caller.
+class SessionCaptureWriter {
+public:
+  explicit SessionCaptureWriter(const std::string& filename, size_t max_buffered_bytes = 0x4000000);
+  SessionCaptureWriter(const SessionCaptureWriter&) = delete;
+  SessionCaptureWriter(SessionCaptureWriter&&) = delete;
+  SessionCaptureWriter& operator=(const SessionCaptureWriter&) = delete;
+  SessionCaptureWriter& operator=(SessionCaptureWriter&&) = delete;
+  ~SessionCaptureWriter(); // Writes all pending records before returning
+
+  inline const std::string& get_filename() const {
+    return this->filename;
+  }
+
+  uint64_t allocate_channel_id();
+
+  void record_connect(uint64_t channel_id, Version version, const std::string& description);
+  void record_disconnect(uint64_t channel_id, Version version);
+  // The command is given in two parts, since the header and data are
+  // separate buffers in Channel::recv. is_from_client should be true if the
+  // command was sent by a PSO client (that is, it was received from a client,
+  // or the proxy is sending it to a remote server); passwords and access keys
+  // in these commands are cleared before they're written.
+  void record_command(
+      uint64_t channel_id,
+      bool is_send,
+      bool is_from_client,
+      Version version,
+      uint16_t command,
+      uint32_t flag,
+      const void* data1,
+      size_t size1,
+      const void* data2 = nullptr,
+      size_t size2 = 0);
+
+  size_t num_dropped_records() const;
+
+private:
+  static constexpr size_t FLUSH_THRESHOLD_BYTES = 0x10000;
+
+  std::string filename;
+  std::shared_ptr<FILE> f; // Only used on the writer thread after construction
+  size_t max_buffered_bytes;
+  std::atomic<uint64_t> next_channel_id;
+
+  mutable std::mutex lock;
+  std::condition_variable cv;
+  std::string pending_data;
+  size_t num_dropped;
+  bool should_exit;
+  std::thread th;
+
+  void add_record(
+      uint64_t channel_id,
+      SessionCaptureRecordType type,
+      Version version,
+      uint16_t command,
+      uint32_t flag,
+      const void* data1,
+      size_t size1,
+      const void* data2,
+      size_t size2);
+  void thread_fn();
+};
+
+// Reads records from a capture file. Throws std::runtime_error if the file
+// isn't a capture or if a record is truncated.
+class SessionCaptureReader {
+public:
+  explicit SessionCaptureReader(FILE* f);
+  ~SessionCaptureReader() = default;
+
+  // Returns false at the end of the file
+  bool read(SessionCaptureRecord& rec);
+
+private:
+  FILE* f;
+};
+
+void write_session_capture_signature(FILE* f);
+void write_session_capture_record(FILE* f, const SessionCaptureRecord& rec);
@@ -869,7 +869,7 @@ ShellCommand c_start_tournament(
       auto tourn = args.s->ep3_tournament_index->get_tournament(name);
       if (tourn) {
         tourn->start();
-        args.s->ep3_tournament_index->save();
+        args.s->ep3_tournament_index->save_tournament(tourn);
         tourn->send_all_state_updates();
         send_ep3_text_message_printf(args.s, "$C7The tournament\n$C6%s$C7\nhas begun", tourn->get_name().c_str());
         return {"Tournament started"};
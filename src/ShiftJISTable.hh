@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Double-byte Shift-JIS characters have a lead byte in the range 81-9F or
+// E0-EA and a trail byte in the range 40-FC. (E0-EF and F0-FC are also valid
+// lead bytes in some variants of Shift-JIS, but no characters are defined
+// there in the standard encoding; Sega's nonstandard F040-F064 characters are
+// handled separately in Text.cc.)
+constexpr size_t SJIS_NUM_LEAD_BYTES = 0x2A;
+constexpr size_t SJIS_NUM_TRAIL_BYTES = 0xBD;
+
+extern const uint16_t SJIS_DOUBLE_BYTE_TO_UNICODE[SJIS_NUM_LEAD_BYTES][SJIS_NUM_TRAIL_BYTES];
+
+// Returns the row index in SJIS_DOUBLE_BYTE_TO_UNICODE for the given lead
+// byte, or -1 if it isn't a valid lead byte.
+inline int sjis_lead_byte_index(uint8_t lead) {
+  if (lead >= 0x81 && lead <= 0x9F) {
+    return lead - 0x81;
+  } else if (lead >= 0xE0 && lead <= 0xEA) {
+    return lead - 0xE0 + 0x1F;
+  }
+  return -1;
+}
@@ -5,139 +5,22 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <array>
 #include <phosg/Filesystem.hh>
 #include <phosg/Strings.hh>
 #include <vector>
 
-using namespace std;
-
-const iconv_t TextTranscoder::INVALID_IC = (iconv_t)(-1);
-const size_t TextTranscoder::FAILURE_RESULT = static_cast<size_t>(-1);
-
-TextTranscoder::TextTranscoder(const char* to, const char* from)
-    : ic(iconv_open(to, from)) {
-  if (ic == this->INVALID_IC) {
-    string error_str = phosg::string_for_error(errno);
-    throw runtime_error(phosg::string_printf("failed to initialize %s -> %s text converter: %s", from, to, error_str.c_str()));
-  }
-}
-
-TextTranscoder::~TextTranscoder() {
-  iconv_close(this->ic);
-}
-
-TextTranscoder::Result TextTranscoder::operator()(
-    void* dest, size_t dest_bytes, const void* src, size_t src_bytes, bool truncate_oversize_result) {
-  // Clear any conversion state left over from the previous call
-  iconv(this->ic, nullptr, nullptr, nullptr, nullptr);
-
-  void* orig_dest = dest;
-  const void* orig_src = src;
-  while (src_bytes > 0) {
-    size_t src_bytes_before = src_bytes;
-    size_t ret = iconv(
-        this->ic,
-        reinterpret_cast<char**>(const_cast<void**>(&src)),
-        &src_bytes,
-        reinterpret_cast<char**>(&dest),
-        &dest_bytes);
-
-    size_t bytes_read = reinterpret_cast<const char*>(src) - reinterpret_cast<const char*>(orig_src);
-    if (ret == this->FAILURE_RESULT) {
-      switch (errno) {
-        case EILSEQ: {
-          string custom_result = this->on_untranslatable(&src, &src_bytes);
-          if (custom_result.empty()) {
-            throw runtime_error(phosg::string_printf("untranslatable character at position 0x%zX", bytes_read));
-          } else if (custom_result.size() <= dest_bytes) {
-            memcpy(dest, custom_result.data(), custom_result.size());
-            dest = reinterpret_cast<char*>(dest) + custom_result.size();
-            dest_bytes -= custom_result.size();
-          } else if (!truncate_oversize_result) {
-            throw runtime_error("string does not fit in buffer");
-          }
-          break;
-        }
-        case EINVAL:
-          throw runtime_error(phosg::string_printf("incomplete multibyte sequence at position 0x%zX", bytes_read));
-        case E2BIG:
-          if (!truncate_oversize_result) {
-            throw runtime_error("string does not fit in buffer");
-          } else {
-            src_bytes = 0;
-            break;
-          }
-        default:
-          throw runtime_error("transcoding failed: " + phosg::string_for_error(errno));
-      }
-    } else if (src_bytes_before == src_bytes) {
-      throw runtime_error("could not transcode any characters");
-    }
-  }
-
-  size_t bytes_read = reinterpret_cast<const char*>(src) - reinterpret_cast<const char*>(orig_src);
-  size_t bytes_written = reinterpret_cast<char*>(dest) - reinterpret_cast<char*>(orig_dest);
-  return Result{
-      .bytes_read = bytes_read,
-      .bytes_written = bytes_written,
-  };
-}
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-string TextTranscoder::operator()(const void* src, size_t src_bytes) {
-  // Clear any conversion state left over from the previous call
-  iconv(this->ic, nullptr, nullptr, nullptr, nullptr);
-
-  const void* orig_src = src;
-  deque<string> blocks;
-  while (src_bytes > 0) {
-    // Assume 2x input size on average, but always allocate at least 8 bytes
-    string& block = blocks.emplace_back(max<size_t>((src_bytes << 1), 8), '\0');
-    char* dest = block.data();
-    size_t dest_size = block.size();
-    size_t src_bytes_before = src_bytes;
-    size_t ret = iconv(
-        this->ic,
-        reinterpret_cast<char**>(const_cast<void**>(&src)),
-        &src_bytes,
-        reinterpret_cast<char**>(&dest),
-        &dest_size);
-    block.resize(block.size() - dest_size);
-
-    size_t bytes_read = reinterpret_cast<const char*>(src) - reinterpret_cast<const char*>(orig_src);
-    if (ret == this->FAILURE_RESULT) {
-      switch (errno) {
-        case EILSEQ: {
-          string custom_result = this->on_untranslatable(&src, &src_bytes);
-          if (custom_result.empty()) {
-            throw runtime_error(phosg::string_printf("untranslatable character at position %zu", bytes_read));
-          }
-          blocks.emplace_back(std::move(custom_result));
-          break;
-        }
-        case EINVAL:
-          throw runtime_error(phosg::string_printf("incomplete multibyte sequence at position %zu", bytes_read));
-        case E2BIG:
-          break;
-        default:
-          throw runtime_error("transcoding failed: " + phosg::string_for_error(errno));
-      }
-    } else if (src_bytes_before == src_bytes) {
-      throw runtime_error("could not transcode any characters");
-    }
-  }
+#include "ShiftJISTable.hh"
 
-  return phosg::join(blocks, "");
-}
-
-string TextTranscoder::operator()(const string& data) {
-  return this->operator()(data.data(), data.size());
-}
-
-std::string TextTranscoder::on_untranslatable(const void**, size_t*) const {
-  return "";
-}
-
-TextTranscoderCustomSJISToUTF8::TextTranscoderCustomSJISToUTF8() : TextTranscoder("UTF-8", "SHIFT_JIS") {}
+using namespace std;
 
 std::string encode_utf8_char(uint32_t ch) {
   string ret;
@@ -197,83 +80,497 @@ uint32_t decode_utf8_char(const void** vdata, size_t* size) {
   }
 }
 
-std::string TextTranscoderCustomSJISToUTF8::on_untranslatable(const void** vsrc, size_t* size) const {
+// Character decoders and encoders for each supported encoding. These follow
+// the same rules as glibc's iconv converters for the same encodings, so that
+// text is converted the same way it was when we used iconv.
+
+static TextTranscoder::CharResult decode_utf8(uint32_t* ch, const uint8_t* src, size_t src_bytes, size_t* bytes_read) {
+  uint8_t first = src[0];
+  size_t size;
+  uint32_t min_value;
+  if (first < 0x80) {
+    *ch = first;
+    *bytes_read = 1;
+    return TextTranscoder::CharResult::OK;
+  } else if ((first & 0xE0) == 0xC0) {
+    size = 2;
+    min_value = 0x80;
+    *ch = first & 0x1F;
+  } else if ((first & 0xF0) == 0xE0) {
+    size = 3;
+    min_value = 0x800;
+    *ch = first & 0x0F;
+  } else if ((first & 0xF8) == 0xF0) {
+    size = 4;
+    min_value = 0x10000;
+    *ch = first & 0x07;
+  } else {
+    return TextTranscoder::CharResult::INVALID;
+  }
+
+  for (size_t z = 1; z < size; z++) {
+    if (z >= src_bytes) {
+      return TextTranscoder::CharResult::INCOMPLETE;
+    }
+    if ((src[z] & 0xC0) != 0x80) {
+      return TextTranscoder::CharResult::INVALID;
+    }
+    *ch = (*ch << 6) | (src[z] & 0x3F);
+  }
+  // Overlong encodings, surrogates, and values beyond the Unicode range are
+  // not valid UTF-8
+  if ((*ch < min_value) || (*ch >= 0xD800 && *ch < 0xE000) || (*ch >= 0x110000)) {
+    return TextTranscoder::CharResult::INVALID;
+  }
+  *bytes_read = size;
+  return TextTranscoder::CharResult::OK;
+}
+
+static TextTranscoder::CharResult encode_utf8(uint8_t* dest, size_t* bytes_written, uint32_t ch) {
+  if (ch < 0x80) {
+    dest[0] = ch;
+    *bytes_written = 1;
+  } else if (ch < 0x800) {
+    dest[0] = 0xC0 | (ch >> 6);
+    dest[1] = 0x80 | (ch & 0x3F);
+    *bytes_written = 2;
+  } else if (ch < 0x10000) {
+    dest[0] = 0xE0 | (ch >> 12);
+    dest[1] = 0x80 | ((ch >> 6) & 0x3F);
+    dest[2] = 0x80 | (ch & 0x3F);
+    *bytes_written = 3;
+  } else if (ch < 0x110000) {
+    dest[0] = 0xF0 | (ch >> 18);
+    dest[1] = 0x80 | ((ch >> 12) & 0x3F);
+    dest[2] = 0x80 | ((ch >> 6) & 0x3F);
+    dest[3] = 0x80 | (ch & 0x3F);
+    *bytes_written = 4;
+  } else {
+    return TextTranscoder::CharResult::INVALID;
+  }
+  return TextTranscoder::CharResult::OK;
+}
+
+static TextTranscoder::CharResult decode_ascii(uint32_t* ch, const uint8_t* src, size_t, size_t* bytes_read) {
+  if (src[0] >= 0x80) {
+    return TextTranscoder::CharResult::INVALID;
+  }
+  *ch = src[0];
+  *bytes_read = 1;
+  return TextTranscoder::CharResult::OK;
+}
+
+static TextTranscoder::CharResult encode_ascii(uint8_t* dest, size_t* bytes_written, uint32_t ch) {
+  if (ch >= 0x80) {
+    return TextTranscoder::CharResult::INVALID;
+  }
+  dest[0] = ch;
+  *bytes_written = 1;
+  return TextTranscoder::CharResult::OK;
+}
+
+static TextTranscoder::CharResult decode_8859(uint32_t* ch, const uint8_t* src, size_t, size_t* bytes_read) {
+  *ch = src[0];
+  *bytes_read = 1;
+  return TextTranscoder::CharResult::OK;
+}
+
+static TextTranscoder::CharResult encode_8859(uint8_t* dest, size_t* bytes_written, uint32_t ch) {
+  if (ch >= 0x100) {
+    return TextTranscoder::CharResult::INVALID;
+  }
+  dest[0] = ch;
+  *bytes_written = 1;
+  return TextTranscoder::CharResult::OK;
+}
+
+static TextTranscoder::CharResult decode_utf16le(uint32_t* ch, const uint8_t* src, size_t src_bytes, size_t* bytes_read) {
+  if (src_bytes < 2) {
+    return TextTranscoder::CharResult::INCOMPLETE;
+  }
+  uint16_t w1 = src[0] | (src[1] << 8);
+  if (w1 < 0xD800 || w1 >= 0xE000) {
+    *ch = w1;
+    *bytes_read = 2;
+    return TextTranscoder::CharResult::OK;
+  }
+  if (w1 >= 0xDC00) {
+    return TextTranscoder::CharResult::INVALID; // Unpaired low surrogate
+  }
+  if (src_bytes < 4) {
+    return TextTranscoder::CharResult::INCOMPLETE;
+  }
+  uint16_t w2 = src[2] | (src[3] << 8);
+  if (w2 < 0xDC00 || w2 >= 0xE000) {
+    return TextTranscoder::CharResult::INVALID; // Unpaired high surrogate
+  }
+  *ch = 0x10000 + (((w1 & 0x3FF) << 10) | (w2 & 0x3FF));
+  *bytes_read = 4;
+  return TextTranscoder::CharResult::OK;
+}
+
+static TextTranscoder::CharResult encode_utf16le(uint8_t* dest, size_t* bytes_written, uint32_t ch) {
+  if (ch < 0x10000) {
+    dest[0] = ch;
+    dest[1] = ch >> 8;
+    *bytes_written = 2;
+  } else if (ch < 0x110000) {
+    uint16_t w1 = 0xD800 | ((ch - 0x10000) >> 10);
+    uint16_t w2 = 0xDC00 | ((ch - 0x10000) & 0x3FF);
+    dest[0] = w1;
+    dest[1] = w1 >> 8;
+    dest[2] = w2;
+    dest[3] = w2 >> 8;
+    *bytes_written = 4;
+  } else {
+    return TextTranscoder::CharResult::INVALID;
+  }
+  return TextTranscoder::CharResult::OK;
+}
+
+static TextTranscoder::CharResult decode_standard_sjis(uint32_t* ch, const uint8_t* src, size_t src_bytes, size_t* bytes_read) {
+  uint8_t lead = src[0];
+  if (lead < 0x80) {
+    // Like JIS X 0201 (and glibc), 5C is the yen sign and 7E is an overline
+    *ch = (lead == 0x5C) ? 0x00A5 : (lead == 0x7E) ? 0x203E : lead;
+    *bytes_read = 1;
+    return TextTranscoder::CharResult::OK;
+  } else if (lead >= 0xA1 && lead <= 0xDF) { // Half-width katakana
+    *ch = 0xFF61 + (lead - 0xA1);
+    *bytes_read = 1;
+    return TextTranscoder::CharResult::OK;
+  } else if ((lead >= 0x81 && lead <= 0x9F) || (lead >= 0xE0 && lead <= 0xFC)) {
+    if (src_bytes < 2) {
+      return TextTranscoder::CharResult::INCOMPLETE;
+    }
+    int lead_index = sjis_lead_byte_index(lead);
+    uint8_t trail = src[1];
+    if (lead_index < 0 || trail < 0x40 || trail > 0xFC) {
+      return TextTranscoder::CharResult::INVALID;
+    }
+    uint16_t value = SJIS_DOUBLE_BYTE_TO_UNICODE[lead_index][trail - 0x40];
+    if (value == 0) {
+      return TextTranscoder::CharResult::INVALID;
+    }
+    *ch = value;
+    *bytes_read = 2;
+    return TextTranscoder::CharResult::OK;
+  } else {
+    return TextTranscoder::CharResult::INVALID;
+  }
+}
+
+static TextTranscoder::CharResult decode_sega_sjis(uint32_t* ch, const uint8_t* src, size_t src_bytes, size_t* bytes_read) {
+  auto ret = decode_standard_sjis(ch, src, src_bytes, bytes_read);
+  if ((ret != TextTranscoder::CharResult::INVALID) || (src_bytes < 2) || (src[0] != 0xF0)) {
+    return ret;
+  }
+
   // Sega implemented some nonstandard Shift-JIS characters on PSO GC (and
   // probably XB as well): the heart symbol, encoded as F040, and the PSO font,
-  // encoded as F041-F064. Understandably, libiconv doesn't know what to do
-  // with these because they're not actually part of Shift-JIS, so we have to
-  // handle them manually here. We convert them to actual UTF-8 symbols:
+  // encoded as F041-F064. We convert them to actual Unicode symbols:
   // F040 (heart symbol) -> U+2665 (heart suit symbol)
   // F041 (PSO font number 0) -> 24EA (circled digit zero)
   // F042-F04A (PSO font numbers 1-9) -> 2460-2468 (circled digits 1-9)
   // F04B-F064 (PSO font letters) -> 1D4D0-1D4E9 (script letters A-Z)
+  uint8_t trail = src[1];
+  if (trail == 0x40) {
+    *ch = 0x2665;
+  } else if (trail == 0x41) {
+    *ch = 0x24EA;
+  } else if (trail >= 0x42 && trail <= 0x4A) {
+    *ch = 0x2460 + (trail - 0x42);
+  } else if (trail >= 0x4B && trail <= 0x64) {
+    *ch = 0x1D4D0 + (trail - 0x4B);
+  } else {
+    return TextTranscoder::CharResult::INVALID;
+  }
+  *bytes_read = 2;
+  return TextTranscoder::CharResult::OK;
+}
+
+static const array<uint16_t, 0x10000>& unicode_to_sjis_table() {
+  // This is built from the decoding table the first time it's needed; static
+  // local initialization is thread-safe, and the table is never modified
+  // afterward. Zero means the character can't be encoded.
+  static const unique_ptr<const array<uint16_t, 0x10000>> table = []() -> unique_ptr<const array<uint16_t, 0x10000>> {
+    auto ret_p = make_unique<array<uint16_t, 0x10000>>();
+    auto& ret = *ret_p;
+    ret.fill(0);
+    for (size_t z = 0x01; z < 0x80; z++) {
+      ret[z] = z;
+    }
+    ret[0x00A5] = 0x5C;
+    ret[0x203E] = 0x7E;
+    for (size_t z = 0xA1; z <= 0xDF; z++) {
+      ret[0xFF61 + (z - 0xA1)] = z;
+    }
+    for (size_t lead = 0x81; lead <= 0xEA; lead++) {
+      int lead_index = sjis_lead_byte_index(lead);
+      if (lead_index < 0) {
+        continue;
+      }
+      for (size_t trail = 0x40; trail <= 0xFC; trail++) {
+        uint16_t value = SJIS_DOUBLE_BYTE_TO_UNICODE[lead_index][trail - 0x40];
+        if (value && !ret[value]) {
+          ret[value] = (lead << 8) | trail;
+        }
+      }
+    }
+    // glibc also accepts these characters, which don't round-trip
+    ret[0xFFE0] = 0x8191; // Fullwidth cent sign -> cent sign
+    ret[0xFFE1] = 0x8192; // Fullwidth pound sign -> pound sign
+    ret[0xFFE2] = 0x81CA; // Fullwidth not sign -> not sign
+    return ret_p;
+  }();
+  return *table;
+}
 
-  const uint8_t* src = reinterpret_cast<const uint8_t*>(*vsrc);
-  if ((*size < 2) || (src[0] != 0xF0)) {
-    return "";
+static TextTranscoder::CharResult encode_standard_sjis(uint8_t* dest, size_t* bytes_written, uint32_t ch) {
+  if (ch == 0) {
+    dest[0] = 0;
+    *bytes_written = 1;
+    return TextTranscoder::CharResult::OK;
   }
+  if (ch >= 0x10000) {
+    return TextTranscoder::CharResult::INVALID;
+  }
+  uint16_t value = unicode_to_sjis_table()[ch];
+  if (value == 0) {
+    return TextTranscoder::CharResult::INVALID;
+  } else if (value < 0x100) {
+    dest[0] = value;
+    *bytes_written = 1;
+  } else {
+    dest[0] = value >> 8;
+    dest[1] = value;
+    *bytes_written = 2;
+  }
+  return TextTranscoder::CharResult::OK;
+}
 
-  string ret;
-  if (src[1] < 0x40) {
-    return "";
-  } else if (src[1] == 0x40) { // F040 -> U+2665
-    ret = encode_utf8_char(0x2665);
-  } else if (src[1] == 0x41) { // F041 -> U+24EA
-    ret = encode_utf8_char(0x24EA);
-  } else if (src[1] <= 0x4A) { // F042-F04A -> U+2460-U+2468
-    ret = encode_utf8_char(0x2460 + (src[1] - 0x42));
-  } else if (src[1] <= 0x64) { // F04B-F064 -> U+1D4D0-U+1D4E9
-    ret = encode_utf8_char(0x1D4D0 + (src[1] - 0x4B));
+static TextTranscoder::CharResult encode_sega_sjis(uint8_t* dest, size_t* bytes_written, uint32_t ch) {
+  auto ret = encode_standard_sjis(dest, bytes_written, ch);
+  if (ret != TextTranscoder::CharResult::INVALID) {
+    return ret;
+  }
+  // See decode_sega_sjis for a description of these characters
+  dest[0] = 0xF0;
+  if (ch == 0x2665) {
+    dest[1] = 0x40;
+  } else if (ch == 0x24EA) {
+    dest[1] = 0x41;
+  } else if (ch >= 0x2460 && ch <= 0x2468) {
+    dest[1] = 0x42 + (ch - 0x2460);
+  } else if (ch >= 0x1D4D0 && ch <= 0x1D4E9) {
+    dest[1] = 0x4B + (ch - 0x1D4D0);
   } else {
-    return "";
+    return TextTranscoder::CharResult::INVALID;
   }
+  *bytes_written = 2;
+  return TextTranscoder::CharResult::OK;
+}
 
-  *vsrc = src + 2;
-  (*size) -= 2;
-  return ret;
+size_t TextTranscoder::convert_ascii_run(uint8_t* dest, size_t dest_bytes, const uint8_t* src, size_t src_bytes) const {
+  size_t count = 0;
+  switch (this->fast_path) {
+    case FastPath::NONE:
+      return 0;
+
+    case FastPath::ASCII_COPY:
+    case FastPath::ASCII_COPY_EXCEPT_5C_7E: {
+      bool except_5C_7E = (this->fast_path == FastPath::ASCII_COPY_EXCEPT_5C_7E);
+      size_t max_count = min<size_t>(src_bytes, dest_bytes);
+#ifdef __SSE2__
+      const __m128i v5C = _mm_set1_epi8(0x5C);
+      const __m128i v7E = _mm_set1_epi8(0x7E);
+      for (; count + 16 <= max_count; count += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + count));
+        int mask = _mm_movemask_epi8(v);
+        if (except_5C_7E) {
+          mask |= _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, v5C), _mm_cmpeq_epi8(v, v7E)));
+        }
+        if (mask) {
+          break;
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + count), v);
+      }
+#endif
+      for (; count < max_count; count++) {
+        uint8_t ch = src[count];
+        if ((ch & 0x80) || (except_5C_7E && (ch == 0x5C || ch == 0x7E))) {
+          break;
+        }
+        dest[count] = ch;
+      }
+      return count;
+    }
+
+    case FastPath::ASCII_TO_UTF16: {
+      size_t max_count = min<size_t>(src_bytes, dest_bytes / 2);
+#ifdef __SSE2__
+      const __m128i zero = _mm_setzero_si128();
+      for (; count + 16 <= max_count; count += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + count));
+        if (_mm_movemask_epi8(v)) {
+          break;
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + count * 2), _mm_unpacklo_epi8(v, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + count * 2 + 16), _mm_unpackhi_epi8(v, zero));
+      }
+#endif
+      for (; count < max_count; count++) {
+        uint8_t ch = src[count];
+        if (ch & 0x80) {
+          break;
+        }
+        dest[count * 2] = ch;
+        dest[count * 2 + 1] = 0;
+      }
+      return count;
+    }
+
+    case FastPath::UTF16_TO_ASCII: {
+      size_t max_count = min<size_t>(src_bytes / 2, dest_bytes);
+#ifdef __SSE2__
+      const __m128i high_mask = _mm_set1_epi16(static_cast<int16_t>(0xFF80));
+      const __m128i zero = _mm_setzero_si128();
+      for (; count + 8 <= max_count; count += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + count * 2));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, high_mask), zero)) != 0xFFFF) {
+          break;
+        }
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(dest + count), _mm_packus_epi16(v, v));
+      }
+#endif
+      for (; count < max_count; count++) {
+        if ((src[count * 2] & 0x80) || src[count * 2 + 1]) {
+          break;
+        }
+        dest[count] = src[count * 2];
+      }
+      return count;
+    }
+
+    default:
+      throw logic_error("invalid fast path");
+  }
+}
+
+static size_t fast_path_src_char_size(TextTranscoder::FastPath fast_path) {
+  return (fast_path == TextTranscoder::FastPath::UTF16_TO_ASCII) ? 2 : 1;
 }
 
-TextTranscoderUTF8ToCustomSJIS::TextTranscoderUTF8ToCustomSJIS() : TextTranscoder("SHIFT_JIS", "UTF-8") {}
+static size_t fast_path_dest_char_size(TextTranscoder::FastPath fast_path) {
+  return (fast_path == TextTranscoder::FastPath::ASCII_TO_UTF16) ? 2 : 1;
+}
 
-std::string TextTranscoderUTF8ToCustomSJIS::on_untranslatable(const void** src, size_t* size) const {
-  const void* orig_src = *src;
-  size_t orig_size = *size;
-  uint32_t ch;
-  try {
-    ch = decode_utf8_char(src, size);
-  } catch (const runtime_error&) {
-    return "";
+TextTranscoder::Result TextTranscoder::operator()(
+    void* vdest, size_t dest_bytes, const void* vsrc, size_t src_bytes, bool truncate_oversize_result) const {
+  uint8_t* dest = reinterpret_cast<uint8_t*>(vdest);
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(vsrc);
+  size_t src_offset = 0;
+  size_t dest_offset = 0;
+  size_t src_char_size = fast_path_src_char_size(this->fast_path);
+  size_t dest_char_size = fast_path_dest_char_size(this->fast_path);
+
+  while (src_offset < src_bytes) {
+    size_t count = this->convert_ascii_run(dest + dest_offset, dest_bytes - dest_offset, src + src_offset, src_bytes - src_offset);
+    src_offset += count * src_char_size;
+    dest_offset += count * dest_char_size;
+    if (src_offset >= src_bytes) {
+      break;
+    }
+
+    uint32_t ch = 0;
+    size_t bytes_read = 0;
+    switch (this->decode(&ch, src + src_offset, src_bytes - src_offset, &bytes_read)) {
+      case CharResult::OK:
+        break;
+      case CharResult::INVALID:
+        throw runtime_error(phosg::string_printf("untranslatable character at position 0x%zX", src_offset));
+      case CharResult::INCOMPLETE:
+        throw runtime_error(phosg::string_printf("incomplete multibyte sequence at position 0x%zX", src_offset));
+    }
+
+    uint8_t encoded[MAX_CHAR_BYTES];
+    size_t bytes_written = 0;
+    if (this->encode(encoded, &bytes_written, ch) != CharResult::OK) {
+      throw runtime_error(phosg::string_printf("untranslatable character at position 0x%zX", src_offset));
+    }
+    if (bytes_written > dest_bytes - dest_offset) {
+      if (!truncate_oversize_result) {
+        throw runtime_error("string does not fit in buffer");
+      }
+      break;
+    }
+    memcpy(dest + dest_offset, encoded, bytes_written);
+    src_offset += bytes_read;
+    dest_offset += bytes_written;
   }
 
-  if (ch == 0x2665) { // U+2665 -> F040
-    return "\xF0\x40";
-  } else if (ch == 0x24EA) { // U+24EA -> F041
-    return "\xF0\x41";
-  } else if (ch >= 0x2460 && ch <= 0x2468) { // U+2460-U+2468 -> F042-F04A
-    string ret("\xF0");
-    ret.push_back(0x42 + (ch - 0x2460));
-    return ret;
-  } else if (ch >= 0x1D4D0 && ch <= 0x1D4E9) { // U+1D4D0-U+1D4E9 -> F04B-F064
-    string ret("\xF0");
-    ret.push_back(0x4B + (ch - 0x1D4D0));
-    return ret;
-  } else {
-    *src = orig_src;
-    *size = orig_size;
-    return "";
+  return Result{
+      .bytes_read = src_offset,
+      .bytes_written = dest_offset,
+  };
+}
+
+string TextTranscoder::operator()(const void* vsrc, size_t src_bytes) const {
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(vsrc);
+  size_t src_char_size = fast_path_src_char_size(this->fast_path);
+  size_t dest_char_size = fast_path_dest_char_size(this->fast_path);
+
+  // The output is at most 3 times the size of the input for all supported
+  // encodings (the worst case is 2-byte Shift-JIS or UTF-16 characters that
+  // become 3-byte UTF-8 characters, or 1-byte 8859 characters that become
+  // 2-byte UTF-8 characters), so we allocate that much up front
+  string ret(src_bytes * 3 + MAX_CHAR_BYTES, '\0');
+  uint8_t* dest = reinterpret_cast<uint8_t*>(ret.data());
+  size_t src_offset = 0;
+  size_t dest_offset = 0;
+  while (src_offset < src_bytes) {
+    size_t count = this->convert_ascii_run(dest + dest_offset, ret.size() - dest_offset, src + src_offset, src_bytes - src_offset);
+    src_offset += count * src_char_size;
+    dest_offset += count * dest_char_size;
+    if (src_offset >= src_bytes) {
+      break;
+    }
+
+    uint32_t ch = 0;
+    size_t bytes_read = 0;
+    switch (this->decode(&ch, src + src_offset, src_bytes - src_offset, &bytes_read)) {
+      case CharResult::OK:
+        break;
+      case CharResult::INVALID:
+        throw runtime_error(phosg::string_printf("untranslatable character at position %zu", src_offset));
+      case CharResult::INCOMPLETE:
+        throw runtime_error(phosg::string_printf("incomplete multibyte sequence at position %zu", src_offset));
+    }
+    size_t bytes_written = 0;
+    if (this->encode(dest + dest_offset, &bytes_written, ch) != CharResult::OK) {
+      throw runtime_error(phosg::string_printf("untranslatable character at position %zu", src_offset));
+    }
+    src_offset += bytes_read;
+    dest_offset += bytes_written;
   }
+  ret.resize(dest_offset);
+  return ret;
+}
+
+string TextTranscoder::operator()(const string& data) const {
+  return this->operator()(data.data(), data.size());
 }
 
-TextTranscoder tt_8859_to_utf8("UTF-8", "ISO-8859-1");
-TextTranscoder tt_utf8_to_8859("ISO-8859-1", "UTF-8");
-TextTranscoder tt_standard_sjis_to_utf8("UTF-8", "SHIFT_JIS");
-TextTranscoder tt_utf8_to_standard_sjis("SHIFT_JIS", "UTF-8");
-TextTranscoderCustomSJISToUTF8 tt_sega_sjis_to_utf8;
-TextTranscoderUTF8ToCustomSJIS tt_utf8_to_sega_sjis;
-TextTranscoder tt_utf16_to_utf8("UTF-8", "UTF-16LE");
-TextTranscoder tt_utf8_to_utf16("UTF-16LE", "UTF-8");
-TextTranscoder tt_ascii_to_utf8("UTF-8", "ASCII");
-TextTranscoder tt_utf8_to_ascii("ASCII", "UTF-8");
+const TextTranscoder tt_8859_to_utf8(decode_8859, encode_utf8, TextTranscoder::FastPath::ASCII_COPY);
+const TextTranscoder tt_utf8_to_8859(decode_utf8, encode_8859, TextTranscoder::FastPath::ASCII_COPY);
+const TextTranscoder tt_standard_sjis_to_utf8(decode_standard_sjis, encode_utf8, TextTranscoder::FastPath::ASCII_COPY_EXCEPT_5C_7E);
+const TextTranscoder tt_utf8_to_standard_sjis(decode_utf8, encode_standard_sjis, TextTranscoder::FastPath::ASCII_COPY);
+const TextTranscoder tt_sega_sjis_to_utf8(decode_sega_sjis, encode_utf8, TextTranscoder::FastPath::ASCII_COPY_EXCEPT_5C_7E);
+const TextTranscoder tt_utf8_to_sega_sjis(decode_utf8, encode_sega_sjis, TextTranscoder::FastPath::ASCII_COPY);
+const TextTranscoder tt_utf16_to_utf8(decode_utf16le, encode_utf8, TextTranscoder::FastPath::UTF16_TO_ASCII);
+const TextTranscoder tt_utf8_to_utf16(decode_utf8, encode_utf16le, TextTranscoder::FastPath::ASCII_TO_UTF16);
+const TextTranscoder tt_ascii_to_utf8(decode_ascii, encode_utf8, TextTranscoder::FastPath::ASCII_COPY);
+const TextTranscoder tt_utf8_to_ascii(decode_utf8, encode_ascii, TextTranscoder::FastPath::ASCII_COPY);
 
 string tt_encode_marked_optional(const string& utf8, uint8_t default_language, bool is_utf16) {
   if (is_utf16) {
@@ -365,33 +662,83 @@ void replace_char_inplace(char* a, char f, char r) {
   }
 }
 
+// Returns the number of bytes at the beginning of src that aren't any of the
+// given marker bytes. The color functions below use this to find the next byte
+// they need to look at, and copy everything before it in one step; most text
+// has few or no markers, so this is much faster than checking each byte.
+template <char... Markers>
+static size_t count_unmarked_bytes(const char* src, size_t size) {
+  size_t count = 0;
+#ifdef __AVX2__
+  for (; count + 32 <= size; count += 32) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + count));
+    __m256i matches = _mm256_setzero_si256();
+    ((matches = _mm256_or_si256(matches, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(Markers)))), ...);
+    uint32_t mask = _mm256_movemask_epi8(matches);
+    if (mask) {
+      return count + __builtin_ctz(mask);
+    }
+  }
+#endif
+#ifdef __SSE2__
+  for (; count + 16 <= size; count += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + count));
+    __m128i matches = _mm_setzero_si128();
+    ((matches = _mm_or_si128(matches, _mm_cmpeq_epi8(v, _mm_set1_epi8(Markers)))), ...);
+    uint32_t mask = _mm_movemask_epi8(matches);
+    if (mask) {
+      return count + __builtin_ctz(mask);
+    }
+  }
+#endif
+  for (; count < size; count++) {
+    char ch = src[count];
+    if (((ch == Markers) || ...)) {
+      break;
+    }
+  }
+  return count;
+}
+
 size_t add_color_inplace(char* a, size_t max_chars) {
   char* d = a;
   char* orig_d = d;
 
-  for (size_t x = 0; (x < max_chars) && *a; x++) {
-    if (*a == '$') {
+  for (size_t x = 0; x < max_chars;) {
+    size_t run_size = count_unmarked_bytes<'$', '#', '%', '\0'>(a + x, max_chars - x);
+    if (run_size) {
+      if (d != a + x) {
+        memmove(d, a + x, run_size);
+      }
+      d += run_size;
+      x += run_size;
+      if (x >= max_chars) {
+        break;
+      }
+    }
+
+    char ch = a[x];
+    if (ch == '$') {
       *(d++) = '\t';
-    } else if (*a == '#') {
+    } else if (ch == '#') {
       *(d++) = '\n';
-    } else if (*a == '%') {
-      a++;
-      x++;
-      if (*a == 's') {
+    } else if (ch == '%') {
+      ch = a[++x];
+      if (ch == 's') {
         *(d++) = '$';
-      } else if (*a == '%') {
+      } else if (ch == '%') {
         *(d++) = '%';
-      } else if (*a == 'n') {
+      } else if (ch == 'n') {
         *(d++) = '#';
-      } else if (*a == '\0') {
+      } else if (ch == '\0') {
         break;
       } else {
-        *(d++) = *a;
+        *(d++) = ch;
       }
-    } else {
-      *(d++) = *a;
+    } else { // '\0'
+      break;
     }
-    a++;
+    x++;
   }
   *d = 0;
   // TODO: we should clear the chars after the null if the new string is shorter
@@ -405,86 +752,118 @@ void add_color_inplace(string& s) {
 }
 
 void add_color(phosg::StringWriter& w, const char* src, size_t max_input_chars) {
-  for (size_t x = 0; (x < max_input_chars) && *src; x++) {
-    if (*src == '$') {
+  for (size_t x = 0; x < max_input_chars;) {
+    size_t run_size = count_unmarked_bytes<'$', '#', '%', '\0'>(src + x, max_input_chars - x);
+    if (run_size) {
+      w.write(src + x, run_size);
+      x += run_size;
+      if (x >= max_input_chars) {
+        break;
+      }
+    }
+
+    char ch = src[x];
+    if (ch == '$') {
       w.put<char>('\t');
-    } else if (*src == '#') {
+    } else if (ch == '#') {
       w.put<char>('\n');
-    } else if (*src == '%') {
-      src++;
-      x++;
-      if (*src == 's') {
+    } else if (ch == '%') {
+      ch = src[++x];
+      if (ch == 's') {
         w.put<char>('$');
-      } else if (*src == '%') {
+      } else if (ch == '%') {
         w.put<char>('%');
-      } else if (*src == 'n') {
+      } else if (ch == 'n') {
         w.put<char>('#');
-      } else if (*src == '\0') {
+      } else if (ch == '\0') {
         break;
       } else {
-        w.put<char>(*src);
+        w.put<char>(ch);
       }
-    } else {
-      w.put<char>(*src);
+    } else { // '\0'
+      break;
     }
-    src++;
+    x++;
   }
 }
 
 string add_color(const string& s) {
   phosg::StringWriter w;
+  w.str().reserve(s.size());
   add_color(w, s.data(), s.size());
   return std::move(w.str());
 }
 
 void remove_color(phosg::StringWriter& w, const char* src, size_t max_input_chars) {
-  for (size_t x = 0; (x < max_input_chars) && *src; x++) {
-    if (*src == '$') {
+  for (size_t x = 0; x < max_input_chars;) {
+    size_t run_size = count_unmarked_bytes<'$', '%', '#', '\t', '\n', '\0'>(src + x, max_input_chars - x);
+    if (run_size) {
+      w.write(src + x, run_size);
+      x += run_size;
+      if (x >= max_input_chars) {
+        break;
+      }
+    }
+
+    char ch = src[x];
+    if (ch == '$') {
       w.put<char>('%');
       w.put<char>('s');
-    } else if (*src == '%') {
+    } else if (ch == '%') {
       w.put<char>('%');
       w.put<char>('%');
-    } else if (*src == '#') {
+    } else if (ch == '#') {
       w.put<char>('%');
       w.put<char>('n');
-    } else if (*src == '\t') {
+    } else if (ch == '\t') {
       w.put<char>('$');
-    } else if (*src == '\n') {
+    } else if (ch == '\n') {
       w.put<char>('#');
-    } else {
-      w.put<char>(*src);
+    } else { // '\0'
+      break;
     }
-    src++;
+    x++;
   }
   w.put<char>(0);
 }
 
 string remove_color(const string& s) {
   phosg::StringWriter w;
+  w.str().reserve(s.size() + 1);
   remove_color(w, s.data(), s.size());
   return std::move(w.str());
 }
 
 string strip_color(const string& s) {
   string ret;
-  for (size_t r = 0; r < s.size(); r++) {
-    if ((s[r] == '$' || s[r] == '\t') &&
-        (s[r + 1] == 'C') && (((s[r + 2] >= '0') && (s[r + 2] <= '9')) || (s[r + 2] == 'G') || (s[r + 2] == 'a'))) {
-      r += 2;
+  ret.reserve(s.size());
+  for (size_t r = 0; r < s.size();) {
+    size_t run_size = count_unmarked_bytes<'$', '\t'>(s.data() + r, s.size() - r);
+    ret.append(s.data() + r, run_size);
+    r += run_size;
+    if (r >= s.size()) {
+      break;
+    }
+    // s[s.size()] is always '\0', so these can't read out of bounds
+    if ((s[r + 1] == 'C') && (((s[r + 2] >= '0') && (s[r + 2] <= '9')) || (s[r + 2] == 'G') || (s[r + 2] == 'a'))) {
+      r += 3;
     } else {
       ret.push_back(s[r]);
+      r++;
     }
   }
   return ret;
 }
 
 string escape_player_name(const string& name) {
+  phosg::StringWriter w;
+  w.str().reserve(name.size() + 1);
   if (name.size() > 2 && name[0] == '\t' && name[1] != 'C') {
-    return remove_color(name.substr(2));
+    remove_color(w, name.data() + 2, name.size() - 2);
   } else {
-    return remove_color(name);
+    remove_color(w, name.data(), name.size());
   }
+  return std::move(w.str());
 }
 
 char marker_for_language_code(uint8_t language_code) {
@@ -1,6 +1,5 @@
 #pragma once
 
-#include <iconv.h>
 #include <inttypes.h>
 #include <stddef.h>
 #include <string.h>
@@ -27,60 +26,74 @@
 std::string encode_utf8_char(uint32_t ch);
 uint32_t decode_utf8_char(const void** data, size_t* size);
 
+// Text transcoders convert between UTF-8 and the encodings used by the game.
+// Each transcoder is a pair of table-driven functions (one that decodes a
+// character from the source encoding, and one that encodes it in the
+// destination encoding), plus an optional fast path for runs of ASCII
+// characters. Transcoders have no internal state, so they can be used from
+// any thread at the same time.
 class TextTranscoder {
 public:
-  TextTranscoder(const char* to, const char* from);
+  enum class CharResult {
+    OK = 0,
+    INVALID, // Source character is invalid or can't be represented
+    INCOMPLETE, // Source ends in the middle of a multibyte character
+  };
+  // Decodes one character from src (which is not empty) into *ch, and sets
+  // *bytes_read to the size of the source character.
+  using DecodeFn = CharResult (*)(uint32_t* ch, const uint8_t* src, size_t src_bytes, size_t* bytes_read);
+  // Encodes ch into dest, which has room for MAX_CHAR_BYTES bytes, and sets
+  // *bytes_written to the size of the encoded character.
+  using EncodeFn = CharResult (*)(uint8_t* dest, size_t* bytes_written, uint32_t ch);
+  static constexpr size_t MAX_CHAR_BYTES = 4;
+
+  enum class FastPath {
+    NONE = 0,
+    ASCII_COPY, // ASCII bytes are copied unchanged
+    ASCII_COPY_EXCEPT_5C_7E, // Same, except 5C and 7E (which Shift-JIS decodes differently)
+    ASCII_TO_UTF16, // ASCII bytes become the same UTF-16 code units
+    UTF16_TO_ASCII, // UTF-16 code units below 0x80 become ASCII bytes
+  };
+
+  constexpr TextTranscoder(DecodeFn decode, EncodeFn encode, FastPath fast_path)
+      : decode(decode),
+        encode(encode),
+        fast_path(fast_path) {}
   TextTranscoder(const TextTranscoder&) = delete;
   TextTranscoder(TextTranscoder&&) = delete;
   TextTranscoder& operator=(const TextTranscoder&) = delete;
   TextTranscoder& operator=(TextTranscoder&&) = delete;
-  virtual ~TextTranscoder();
+  ~TextTranscoder() = default;
 
   struct Result {
     size_t bytes_read;
     size_t bytes_written;
   };
-  Result operator()(void* dest, size_t dest_bytes, const void* src, size_t src_bytes, bool truncate_oversize_result);
+  Result operator()(void* dest, size_t dest_bytes, const void* src, size_t src_bytes, bool truncate_oversize_result) const;
 
-  std::string operator()(const void* src, size_t src_bytes);
-  std::string operator()(const std::string& data);
-
-protected:
-  virtual std::string on_untranslatable(const void** src, size_t* size) const;
-
-  static const iconv_t INVALID_IC;
-  static const size_t FAILURE_RESULT;
-  iconv_t ic;
-};
+  std::string operator()(const void* src, size_t src_bytes) const;
+  std::string operator()(const std::string& data) const;
 
-class TextTranscoderCustomSJISToUTF8 : public TextTranscoder {
-public:
-  TextTranscoderCustomSJISToUTF8();
-  virtual ~TextTranscoderCustomSJISToUTF8() = default;
-
-protected:
-  virtual std::string on_untranslatable(const void** src, size_t* size) const;
-};
-
-class TextTranscoderUTF8ToCustomSJIS : public TextTranscoder {
-public:
-  TextTranscoderUTF8ToCustomSJIS();
-  virtual ~TextTranscoderUTF8ToCustomSJIS() = default;
+private:
+  DecodeFn decode;
+  EncodeFn encode;
+  FastPath fast_path;
 
-protected:
-  virtual std::string on_untranslatable(const void** src, size_t* size) const;
+  // Converts as many ASCII characters as possible from the beginning of src
+  // using the fast path, and returns the number of characters converted
+  size_t convert_ascii_run(uint8_t* dest, size_t dest_bytes, const uint8_t* src, size_t src_bytes) const;
 };
 
-extern TextTranscoder tt_8859_to_utf8;
-extern TextTranscoder tt_utf8_to_8859;
-extern TextTranscoder tt_standard_sjis_to_utf8;
-extern TextTranscoder tt_utf8_to_standard_sjis;
-extern TextTranscoderCustomSJISToUTF8 tt_sega_sjis_to_utf8;
-extern TextTranscoderUTF8ToCustomSJIS tt_utf8_to_sega_sjis;
-extern TextTranscoder tt_utf16_to_utf8;
-extern TextTranscoder tt_utf8_to_utf16;
-extern TextTranscoder tt_ascii_to_utf8;
-extern TextTranscoder tt_utf8_to_ascii;
+extern const TextTranscoder tt_8859_to_utf8;
+extern const TextTranscoder tt_utf8_to_8859;
+extern const TextTranscoder tt_standard_sjis_to_utf8;
+extern const TextTranscoder tt_utf8_to_standard_sjis;
+extern const TextTranscoder tt_sega_sjis_to_utf8;
+extern const TextTranscoder tt_utf8_to_sega_sjis;
+extern const TextTranscoder tt_utf16_to_utf8;
+extern const TextTranscoder tt_utf8_to_utf16;
+extern const TextTranscoder tt_ascii_to_utf8;
+extern const TextTranscoder tt_utf8_to_ascii;
 
 std::string tt_encode_marked_optional(const std::string& utf8, uint8_t default_language, bool is_utf16);
 std::string tt_encode_marked(const std::string& utf8, uint8_t default_language, bool is_utf16);
@@ -0,0 +1,179 @@
+#include "TimerWheel.hh"
+
+#include <algorithm>
+#include <phosg/Time.hh>
+#include <stdexcept>
+
+using namespace std;
+
+TimerWheel::Timer::Timer(shared_ptr<TimerWheel> wheel, function<void()> callback)
+    : wheel(wheel),
+      callback(std::move(callback)),
+      expire_tick(0) {
+  if (!this->wheel) {
+    throw logic_error("timer created without a timer wheel");
+  }
+}
+
+TimerWheel::Timer::~Timer() {
+  this->cancel();
+}
+
+void TimerWheel::Timer::schedule(uint64_t delay_usecs) {
+  this->wheel->schedule(this, delay_usecs);
+}
+
+void TimerWheel::Timer::cancel() {
+  this->wheel->cancel(this);
+}
+
+TimerWheel::TimerWheel(shared_ptr<struct event_base> base, uint64_t tick_usecs)
+    : base(base),
+      tick_event(event_new(this->base.get(), -1, EV_TIMEOUT | EV_PERSIST, &TimerWheel::dispatch_on_tick, this), event_free),
+      tick_usecs(tick_usecs),
+      start_time(chrono::steady_clock::now()),
+      current_tick(0),
+      num_pending(0) {
+  if (this->tick_usecs == 0) {
+    throw invalid_argument("tick length must be nonzero");
+  }
+  for (auto& level : this->slots) {
+    for (auto& list : level) {
+      list.prev = &list;
+      list.next = &list;
+    }
+  }
+}
+
+uint64_t TimerWheel::now_tick() const {
+  auto elapsed = chrono::steady_clock::now() - this->start_time;
+  return chrono::duration_cast<chrono::microseconds>(elapsed).count() / this->tick_usecs;
+}
+
+void TimerWheel::unlink(ListNode* node) {
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  node->prev = nullptr;
+  node->next = nullptr;
+}
+
+void TimerWheel::link_before(ListNode* node, ListNode* list) {
+  node->prev = list->prev;
+  node->next = list;
+  list->prev->next = node;
+  list->prev = node;
+}
+
+void TimerWheel::splice_all(ListNode* dest_list, ListNode* src_list) {
+  if (src_list->next == src_list) {
+    dest_list->prev = dest_list;
+    dest_list->next = dest_list;
+  } else {
+    dest_list->next = src_list->next;
+    dest_list->prev = src_list->prev;
+    dest_list->next->prev = dest_list;
+    dest_list->prev->next = dest_list;
+    src_list->prev = src_list;
+    src_list->next = src_list;
+  }
+}
+
+void TimerWheel::schedule(Timer* t, uint64_t delay_usecs) {
+  if (t->is_pending()) {
+    this->unlink(t);
+  } else if (this->num_pending++ == 0) {
+    // The wheel was empty, so current_tick may be far behind the actual time;
+    // we can skip directly to the current time since there's nothing to fire
+    this->current_tick = max<uint64_t>(this->current_tick, this->now_tick());
+    if (!event_pending(this->tick_event.get(), EV_TIMEOUT, nullptr)) {
+      struct timeval tv = phosg::usecs_to_timeval(this->tick_usecs);
+      event_add(this->tick_event.get(), &tv);
+    }
+  }
+
+  // If the tick event is running late, current_tick may be behind the actual
+  // time; the delay should be relative to the actual time
+  uint64_t delay_ticks = max<uint64_t>((delay_usecs + this->tick_usecs - 1) / this->tick_usecs, 1);
+  t->expire_tick = max<uint64_t>(this->current_tick, this->now_tick()) + delay_ticks;
+  this->insert(t);
+}
+
+void TimerWheel::cancel(Timer* t) {
+  if (t->is_pending()) {
+    this->unlink(t);
+    this->num_pending--;
+    // If this was the last timer, the tick event is removed the next time it
+    // fires, so that cancelling and rescheduling a single timer repeatedly
+    // doesn't also add and remove the event repeatedly
+  }
+}
+
+void TimerWheel::insert(Timer* t) {
+  uint64_t delta = (t->expire_tick > this->current_tick) ? (t->expire_tick - this->current_tick) : 0;
+  size_t level = 0;
+  while ((level < NUM_LEVELS - 1) && (delta >= (1ULL << (LEVEL_BITS * (level + 1))))) {
+    level++;
+  }
+  // Timers beyond the range of the wheel go in the farthest slot of the
+  // highest level, and are re-inserted when that slot is cascaded
+  uint64_t slot_tick = (delta > MAX_DELTA_TICKS) ? (this->current_tick + MAX_DELTA_TICKS) : t->expire_tick;
+  size_t index = (slot_tick >> (LEVEL_BITS * level)) & (SLOTS_PER_LEVEL - 1);
+  this->link_before(t, &this->slots[level][index]);
+}
+
+void TimerWheel::cascade(size_t level, size_t index) {
+  // Move the list out of the slot first, since some timers may be re-inserted
+  // into the same slot
+  ListNode list;
+  this->splice_all(&list, &this->slots[level][index]);
+  while (list.next != &list) {
+    Timer* t = static_cast<Timer*>(list.next);
+    this->unlink(t);
+    this->insert(t);
+  }
+}
+
+void TimerWheel::advance_one_tick() {
+  this->current_tick++;
+
+  size_t index = this->current_tick & (SLOTS_PER_LEVEL - 1);
+  if (index == 0) {
+    for (size_t level = 1; level < NUM_LEVELS; level++) {
+      size_t level_index = (this->current_tick >> (LEVEL_BITS * level)) & (SLOTS_PER_LEVEL - 1);
+      this->cascade(level, level_index);
+      if (level_index != 0) {
+        break;
+      }
+    }
+  }
+
+  // Callbacks may schedule, cancel, or destroy any timer (including others in
+  // this slot, or the timer being called), so we remove each timer from the
+  // list and copy its callback before calling it
+  ListNode expiring;
+  this->splice_all(&expiring, &this->slots[0][index]);
+  while (expiring.next != &expiring) {
+    Timer* t = static_cast<Timer*>(expiring.next);
+    this->unlink(t);
+    this->num_pending--;
+    auto callback = t->callback;
+    callback();
+  }
+}
+
+void TimerWheel::dispatch_on_tick(evutil_socket_t, short, void* ctx) {
+  reinterpret_cast<TimerWheel*>(ctx)->on_tick();
+}
+
+void TimerWheel::on_tick() {
+  // A callback could destroy the last timer holding a reference to this wheel
+  auto self = this->shared_from_this();
+
+  uint64_t target_tick = this->now_tick();
+  while (this->num_pending && (this->current_tick < target_tick)) {
+    this->advance_one_tick();
+  }
+  if (!this->num_pending) {
+    event_del(this->tick_event.get());
+  }
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <event2/event.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <chrono>
+#include <functional>
+#include <memory>
+
+// TimerWheel is a hierarchical timer wheel driven by a single event on a
+// libevent base. It's intended for timeouts that are rescheduled or cancelled
+// much more often than they fire, like idle timeouts and retransmission
+// timers: scheduling, rescheduling, and cancelling a timer are constant-time
+// list operations that don't involve libevent at all. The tradeoff is
+// precision: a timer fires on the first tick after it expires, so it may be
+// late by up to one tick.
+//
+// The wheel has 4 levels of 64 slots each; level 0 has one slot per tick, and
+// each higher level has one slot per full rotation of the level below it.
+// Timers are moved to lower levels as their expiration time approaches. Timers
+// further in the future than the wheel can represent (2^24 ticks; about 46
+// hours at the default tick length) are placed in the last slot of the
+// highest level and re-placed each time it rotates.
+//
+// TimerWheel is not thread-safe; all timers must be scheduled and cancelled on
+// the base's event thread.
+class TimerWheel : public std::enable_shared_from_this<TimerWheel> {
+private:
+  struct ListNode {
+    ListNode* prev = nullptr;
+    ListNode* next = nullptr;
+  };
+
+public:
+  class Timer : private ListNode {
+  public:
+    Timer(std::shared_ptr<TimerWheel> wheel, std::function<void()> callback);
+    Timer(const Timer&) = delete;
+    Timer(Timer&&) = delete;
+    Timer& operator=(const Timer&) = delete;
+    Timer& operator=(Timer&&) = delete;
+    ~Timer();
+
+    // Schedules the timer to fire after the given delay. If the timer is
+    // already scheduled, its previous expiration time is replaced.
+    void schedule(uint64_t delay_usecs);
+    // Does nothing if the timer is not scheduled.
+    void cancel();
+
+    inline bool is_pending() const {
+      return this->next != nullptr;
+    }
+
+  private:
+    friend class TimerWheel;
+
+    std::shared_ptr<TimerWheel> wheel;
+    std::function<void()> callback;
+    uint64_t expire_tick;
+  };
+
+  explicit TimerWheel(std::shared_ptr<struct event_base> base, uint64_t tick_usecs = 10000);
+  TimerWheel(const TimerWheel&) = delete;
+  TimerWheel(TimerWheel&&) = delete;
+  TimerWheel& operator=(const TimerWheel&) = delete;
+  TimerWheel& operator=(TimerWheel&&) = delete;
+  ~TimerWheel() = default;
+
+  inline uint64_t get_tick_usecs() const {
+    return this->tick_usecs;
+  }
+  inline size_t num_pending_timers() const {
+    return this->num_pending;
+  }
+
+private:
+  static constexpr size_t LEVEL_BITS = 6;
+  static constexpr size_t SLOTS_PER_LEVEL = (1 << LEVEL_BITS);
+  static constexpr size_t NUM_LEVELS = 4;
+  static constexpr uint64_t MAX_DELTA_TICKS = (1ULL << (LEVEL_BITS * NUM_LEVELS)) - 1;
+
+  std::shared_ptr<struct event_base> base;
+  std::unique_ptr<struct event, void (*)(struct event*)> tick_event;
+  uint64_t tick_usecs;
+  std::chrono::steady_clock::time_point start_time;
+  uint64_t current_tick;
+  size_t num_pending;
+  std::array<std::array<ListNode, SLOTS_PER_LEVEL>, NUM_LEVELS> slots;
+
+  uint64_t now_tick() const;
+  static void unlink(ListNode* node);
+  static void link_before(ListNode* node, ListNode* list);
+  static void splice_all(ListNode* dest_list, ListNode* src_list);
+
+  void schedule(Timer* t, uint64_t delay_usecs);
+  void cancel(Timer* t);
+  void insert(Timer* t);
+  void cascade(size_t level, size_t index);
+  void advance_one_tick();
+
+  static void dispatch_on_tick(evutil_socket_t, short, void* ctx);
+  void on_tick();
+};
@@ -0,0 +1,12 @@
+#!/bin/sh
+
+set -e
+
+EXECUTABLE="$1"
+if [ -z "$EXECUTABLE" ]; then
+  EXECUTABLE="./newserv"
+fi
+
+echo "... check recovery from incomplete tournament journal entry"
+rm -f tests/ep3-tournament-journal-test.json tests/ep3-tournament-journal-test.json.journal
+$EXECUTABLE --config=tests/config.json ep3-tournament-journal-test tests/ep3-tournament-journal-test.json
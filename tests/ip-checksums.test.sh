@@ -0,0 +1,11 @@
+#!/bin/sh
+
+set -e
+
+EXECUTABLE="$1"
+if [ -z "$EXECUTABLE" ]; then
+  EXECUTABLE="./newserv"
+fi
+
+echo "... check IP checksums against reference implementation"
+$EXECUTABLE --config=tests/config.json ip-checksums-test